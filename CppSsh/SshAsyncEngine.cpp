@@ -0,0 +1,802 @@
+
+#include "SshAsyncEngine.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/stat.h>
+
+using steady_clock = chrono::steady_clock;
+
+// Longest a loop sleeps while operations are in flight, bounds how late an
+// operation timeout is noticed
+static constexpr int loopPollTimeoutMs = 100;
+// Amount of data moved for one operation before the loop turns to the next
+// session, so a bulk transfer can't starve the others
+static constexpr size_t stepChunkSize = 64 * 1024;
+
+enum
+{
+    stageConnectStart,
+    stageConnectHandshake,
+    stageConnectPassword,
+    stageConnectPublicKey
+};
+
+enum
+{
+    stageLocalFile,
+    stageOpen,
+    stageExec,
+    stageTransfer,
+    stageFinish
+};
+
+struct SshAsyncEngine::_Loop
+{
+    thread worker;
+    ssh_event event{NULL};
+    int wake[2]{-1, -1};
+    mutex queueMutex;
+    bool stopping{false};
+    vector<shared_ptr<SshAsyncSession>> scheduled;
+    vector<shared_ptr<SshAsyncSession>> sessions;
+};
+
+struct SshAsyncSession::_Operation
+{
+    enum Type
+    {
+        Connect,
+        Execute,
+        Push,
+        Pull,
+        Close
+    };
+
+    _Operation(Type type): type(type){};
+
+    Type type;
+    int stage{stageLocalFile};
+    // Taken when queued, counted from when the operation starts, as the ones
+    // queued before it on the session run first
+    chrono::milliseconds timeout{0};
+    steady_clock::time_point deadline;
+    bool progress{false};
+    string command;
+    string local;
+    string remote;
+    ssh_channel channel{NULL};
+    int fd{-1};
+    SshPooledBuffer chunk;
+    size_t chunkOffset{0};
+    size_t chunkLength{0};
+    bool localEof{false};
+    SshExecResult result;
+    promise<int> done;
+    promise<SshExecResult> executed;
+};
+
+SshAsyncEngine::SshAsyncEngine(size_t ioThreads)
+{
+    ioThreads = max<size_t>(ioThreads, 1);
+
+    for (size_t i = 0; i < ioThreads; i++)
+    {
+        unique_ptr<_Loop> loop = make_unique<_Loop>();
+
+        loop->event = ssh_event_new();
+        if (loop->event == NULL || pipe2(loop->wake, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            throw runtime_error("Error creating async event loop");
+        }
+        ssh_event_add_fd(loop->event, loop->wake[0], POLLIN, _OnWake, loop.get());
+
+        _loops.push_back(move(loop));
+    }
+
+    for (unique_ptr<_Loop>& loop : _loops)
+    {
+        loop->worker = thread(&SshAsyncEngine::_Run, this, ref(*loop));
+    }
+}
+
+SshAsyncEngine::~SshAsyncEngine()
+{
+    for (unique_ptr<_Loop>& loop : _loops)
+    {
+        {
+            lock_guard<mutex> lock(loop->queueMutex);
+            loop->stopping = true;
+        }
+        _Wake(*loop);
+    }
+
+    for (unique_ptr<_Loop>& loop : _loops)
+    {
+        loop->worker.join();
+        ssh_event_remove_fd(loop->event, loop->wake[0]);
+        ssh_event_free(loop->event);
+        close(loop->wake[0]);
+        close(loop->wake[1]);
+    }
+}
+
+shared_ptr<SshAsyncSession> SshAsyncEngine::CreateSession(const string& ip,
+                                                          const string& user,
+                                                          const string& password)
+{
+    lock_guard<mutex> lock(_mutex);
+    _Loop& loop = *_loops[_nextLoop++ % _loops.size()];
+
+    return shared_ptr<SshAsyncSession>(
+        new SshAsyncSession(*this, loop, ip, user, password, _connectOptions));
+}
+
+void SshAsyncEngine::SetConnectOptions(const SshConnectOptions& options)
+{
+    lock_guard<mutex> lock(_mutex);
+    _connectOptions = options;
+}
+
+void SshAsyncEngine::SetOperationTimeout(chrono::milliseconds timeout)
+{
+    lock_guard<mutex> lock(_mutex);
+    _operationTimeout = timeout;
+}
+
+size_t SshAsyncEngine::GetSessionCount()
+{
+    size_t count = 0;
+
+    for (unique_ptr<_Loop>& loop : _loops)
+    {
+        lock_guard<mutex> lock(loop->queueMutex);
+        count += loop->sessions.size();
+    }
+
+    return count;
+}
+
+int SshAsyncEngine::_OnWake(socket_t fd, int revents, void *userdata)
+{
+    char buffer[64];
+
+    (void) revents;
+    (void) userdata;
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+
+    return 0;
+}
+
+void SshAsyncEngine::_Wake(_Loop& loop)
+{
+    char c = 0;
+
+    // A full pipe already guarantees a wake up
+    (void) !write(loop.wake[1], &c, 1);
+}
+
+void SshAsyncEngine::_Run(_Loop& loop)
+{
+    vector<shared_ptr<SshAsyncSession>> active;
+    vector<char> buffer(stepChunkSize);
+
+    while (1)
+    {
+        {
+            lock_guard<mutex> lock(loop.queueMutex);
+
+            if (loop.stopping)
+            {
+                break;
+            }
+
+            for (shared_ptr<SshAsyncSession>& session : loop.scheduled)
+            {
+                move(session->_incoming.begin(), session->_incoming.end(),
+                     back_inserter(session->_operations));
+                session->_incoming.clear();
+                session->_scheduled = false;
+
+                if (session->_registered == false)
+                {
+                    loop.sessions.push_back(session);
+                    session->_registered = true;
+                }
+                if (session->_active == false)
+                {
+                    active.push_back(session);
+                    session->_active = true;
+                }
+            }
+            loop.scheduled.clear();
+        }
+
+        bool progress = false;
+
+        for (size_t i = 0; i < active.size();)
+        {
+            shared_ptr<SshAsyncSession> session = active[i];
+
+            progress |= session->_Step(buffer);
+            if (!session->_operations.empty())
+            {
+                i++;
+                continue;
+            }
+
+            session->_active = false;
+            active[i] = active.back();
+            active.pop_back();
+
+            if (session->_session == NULL)
+            {
+                lock_guard<mutex> lock(loop.queueMutex);
+                auto it = find(loop.sessions.begin(), loop.sessions.end(), session);
+
+                if (it != loop.sessions.end() && session->_incoming.empty())
+                {
+                    loop.sessions.erase(it);
+                    session->_registered = false;
+                }
+            }
+        }
+
+        // Sessions without operations stay in the event so keepalives and
+        // disconnects from the server are still processed
+        ssh_event_dopoll(loop.event, progress ? 0 :
+                         (active.empty() ? SSH_TIMEOUT_INFINITE : loopPollTimeoutMs));
+    }
+
+    lock_guard<mutex> lock(loop.queueMutex);
+
+    for (shared_ptr<SshAsyncSession>& session : loop.scheduled)
+    {
+        if (session->_registered == false)
+        {
+            loop.sessions.push_back(session);
+            session->_registered = true;
+        }
+    }
+
+    for (shared_ptr<SshAsyncSession>& session : loop.sessions)
+    {
+        move(session->_incoming.begin(), session->_incoming.end(),
+             back_inserter(session->_operations));
+        session->_incoming.clear();
+
+        for (unique_ptr<SshAsyncSession::_Operation>& operation : session->_operations)
+        {
+            session->_Complete(*operation, SSH_ERROR);
+        }
+        session->_operations.clear();
+        session->_Release();
+        session->_registered = false;
+    }
+    loop.sessions.clear();
+    loop.scheduled.clear();
+}
+
+SshAsyncSession::SshAsyncSession(SshAsyncEngine& engine, SshAsyncEngine::_Loop& loop,
+                                 const string& ip, const string& user,
+                                 const string& password, const SshConnectOptions& options):
+    _engine(engine), _loop(loop), _ip(ip), _user(user), _password(password),
+    _connectOptions(options)
+{
+}
+
+SshAsyncSession::~SshAsyncSession()
+{
+    _Release();
+}
+
+future<int> SshAsyncSession::ConnectAsync()
+{
+    unique_ptr<_Operation> operation = make_unique<_Operation>(_Operation::Connect);
+    future<int> result = operation->done.get_future();
+
+    _Enqueue(move(operation));
+
+    return result;
+}
+
+future<SshExecResult> SshAsyncSession::ExecuteAsync(const string& command)
+{
+    unique_ptr<_Operation> operation = make_unique<_Operation>(_Operation::Execute);
+    future<SshExecResult> result = operation->executed.get_future();
+
+    operation->command = command;
+    _Enqueue(move(operation));
+
+    return result;
+}
+
+future<int> SshAsyncSession::PushAsync(const string& source, const string& destination)
+{
+    unique_ptr<_Operation> operation = make_unique<_Operation>(_Operation::Push);
+    future<int> result = operation->done.get_future();
+
+    operation->local = source;
+    operation->remote = destination;
+    _Enqueue(move(operation));
+
+    return result;
+}
+
+future<int> SshAsyncSession::PullAsync(const string& source, const string& destination)
+{
+    unique_ptr<_Operation> operation = make_unique<_Operation>(_Operation::Pull);
+    future<int> result = operation->done.get_future();
+
+    operation->remote = source;
+    operation->local = destination;
+    operation->command = "cat " + SshShellQuote(source);
+    _Enqueue(move(operation));
+
+    return result;
+}
+
+future<int> SshAsyncSession::CloseAsync()
+{
+    unique_ptr<_Operation> operation = make_unique<_Operation>(_Operation::Close);
+    future<int> result = operation->done.get_future();
+
+    _Enqueue(move(operation));
+
+    return result;
+}
+
+void SshAsyncSession::_Enqueue(unique_ptr<_Operation> operation)
+{
+    {
+        lock_guard<mutex> lock(_engine._mutex);
+        operation->timeout = _engine._operationTimeout;
+    }
+
+    {
+        lock_guard<mutex> lock(_loop.queueMutex);
+
+        if (_loop.stopping)
+        {
+            _Complete(*operation, SSH_ERROR);
+            return;
+        }
+
+        _incoming.push_back(move(operation));
+        if (_scheduled == false)
+        {
+            _loop.scheduled.push_back(shared_from_this());
+            _scheduled = true;
+        }
+    }
+
+    _engine._Wake(_loop);
+}
+
+bool SshAsyncSession::_Step(vector<char>& buffer)
+{
+    bool progress = false;
+
+    while (!_operations.empty())
+    {
+        _Operation& operation = *_operations.front();
+        int res = SSH_ERROR;
+
+        operation.progress = false;
+        if (operation.deadline == steady_clock::time_point())
+        {
+            operation.deadline = steady_clock::now() + operation.timeout;
+        }
+
+        if (steady_clock::now() > operation.deadline)
+        {
+            SSH_LOG(Error, "Operation on %s timed out", _ip.c_str());
+        }
+        else if (operation.type == _Operation::Connect)
+        {
+            res = _StepConnect(operation);
+        }
+        else if (operation.type == _Operation::Close)
+        {
+            _Release();
+            res = SSH_OK;
+        }
+        else if (_session == NULL)
+        {
+            SSH_LOG(Error, "Session to %s is not connected", _ip.c_str());
+        }
+        else
+        {
+            res = _StepOpenLocalFile(operation);
+            if (res == SSH_OK)
+            {
+                res = _StepOpenChannel(operation);
+            }
+            if (res == SSH_OK && operation.stage == stageTransfer)
+            {
+                if (operation.type == _Operation::Push)
+                {
+                    res = _StepWrite(operation);
+                }
+                else
+                {
+                    res = _StepRead(operation, buffer);
+                }
+            }
+            if (res == SSH_OK)
+            {
+                res = _StepFinishChannel(operation);
+            }
+        }
+
+        progress |= operation.progress;
+        if (res == SSH_AGAIN)
+        {
+            break;
+        }
+
+        _Complete(operation, res);
+        _operations.pop_front();
+        progress = true;
+    }
+
+    return progress;
+}
+
+int SshAsyncSession::_StepConnect(_Operation& operation)
+{
+    int res;
+
+    if (operation.stage == stageConnectStart)
+    {
+        if (_session != NULL)
+        {
+            return SSH_OK;
+        }
+
+        _session = ssh_new();
+        if (_session == NULL)
+        {
+            return SSH_ERROR;
+        }
+
+        if ((!_user.empty() &&
+             ssh_options_set(_session, SSH_OPTIONS_USER, _user.c_str()) < 0) ||
+            ssh_options_set(_session, SSH_OPTIONS_HOST, _ip.c_str()) < 0 ||
+            SshApplyConnectOptions(_session, _connectOptions) != SSH_OK)
+        {
+            return SSH_ERROR;
+        }
+
+        ssh_set_blocking(_session, 0);
+        operation.stage = stageConnectHandshake;
+    }
+
+    if (operation.stage == stageConnectHandshake)
+    {
+        res = ssh_connect(_session);
+
+        // The socket only exists once the first connect call went out
+        if (_inEvent == false && ssh_get_fd(_session) >= 0)
+        {
+            ssh_event_add_session(_loop.event, _session);
+            _inEvent = true;
+        }
+
+        if (res == SSH_ERROR)
+        {
+            SSH_LOG(Error, "Connection to %s failed: %s", _ip.c_str(),
+                    ssh_get_error(_session));
+        }
+        if (res != SSH_OK)
+        {
+            return res;
+        }
+
+        res = ssh_session_is_known_server(_session);
+        if (res == SSH_KNOWN_HOSTS_CHANGED || res == SSH_KNOWN_HOSTS_OTHER ||
+            res == SSH_KNOWN_HOSTS_ERROR)
+        {
+            SSH_LOG(Error, "Host key of %s can't be trusted", _ip.c_str());
+            return SSH_ERROR;
+        }
+
+        operation.progress = true;
+        operation.stage = _password.empty() ? stageConnectPublicKey : stageConnectPassword;
+    }
+
+    if (operation.stage == stageConnectPassword)
+    {
+        res = ssh_userauth_password(_session, NULL, _password.c_str());
+        if (res == SSH_AUTH_AGAIN)
+        {
+            return SSH_AGAIN;
+        }
+        if (res == SSH_AUTH_SUCCESS)
+        {
+            return SSH_OK;
+        }
+        if (res == SSH_AUTH_ERROR)
+        {
+            SSH_LOG(Error, "Authentication to %s failed: %s", _ip.c_str(),
+                    ssh_get_error(_session));
+            return SSH_ERROR;
+        }
+
+        operation.stage = stageConnectPublicKey;
+    }
+
+    res = ssh_userauth_publickey_auto(_session, NULL, NULL);
+    if (res == SSH_AUTH_AGAIN)
+    {
+        return SSH_AGAIN;
+    }
+    if (res != SSH_AUTH_SUCCESS)
+    {
+        SSH_LOG(Error, "Authentication to %s failed", _ip.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshAsyncSession::_StepOpenLocalFile(_Operation& operation)
+{
+    struct stat st;
+
+    if (operation.stage != stageLocalFile)
+    {
+        return SSH_OK;
+    }
+
+    if (operation.type == _Operation::Push)
+    {
+        operation.fd = open(operation.local.c_str(), O_RDONLY | O_CLOEXEC);
+        if (operation.fd < 0 || fstat(operation.fd, &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            SSH_LOG(Error, "Can't read local file %s", operation.local.c_str());
+            return SSH_ERROR;
+        }
+
+        char mode[8];
+        snprintf(mode, sizeof(mode), "%04o", st.st_mode & 07777);
+
+        operation.command = "cat > " + SshShellQuote(operation.remote) +
+                            " && chmod " + mode + " " + SshShellQuote(operation.remote);
+        operation.chunk = SshBufferPool::Shared().Acquire(stepChunkSize);
+    }
+    else if (operation.type == _Operation::Pull)
+    {
+        operation.fd = open(operation.local.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (operation.fd < 0)
+        {
+            SSH_LOG(Error, "Can't create local file %s", operation.local.c_str());
+            return SSH_ERROR;
+        }
+    }
+
+    operation.stage = stageOpen;
+
+    return SSH_OK;
+}
+
+int SshAsyncSession::_StepOpenChannel(_Operation& operation)
+{
+    int res;
+
+    if (operation.stage == stageOpen)
+    {
+        if (operation.channel == NULL)
+        {
+            operation.channel = ssh_channel_new(_session);
+            if (operation.channel == NULL)
+            {
+                return SSH_ERROR;
+            }
+        }
+
+        res = ssh_channel_open_session(operation.channel);
+        if (res != SSH_OK)
+        {
+            return res;
+        }
+
+        operation.progress = true;
+        operation.stage = stageExec;
+    }
+
+    if (operation.stage == stageExec)
+    {
+        res = ssh_channel_request_exec(operation.channel, operation.command.c_str());
+        if (res != SSH_OK)
+        {
+            return res;
+        }
+
+        operation.progress = true;
+        operation.stage = stageTransfer;
+    }
+
+    return SSH_OK;
+}
+
+int SshAsyncSession::_StepRead(_Operation& operation, vector<char>& buffer)
+{
+    size_t total = 0;
+
+    while (total < stepChunkSize)
+    {
+        int nout = ssh_channel_read_nonblocking(operation.channel, buffer.data(),
+                                                buffer.size(), 0);
+        if (nout > 0)
+        {
+            if (operation.fd < 0)
+            {
+                operation.result.output.append(buffer.data(), nout);
+            }
+            else if (write(operation.fd, buffer.data(), nout) != nout)
+            {
+                SSH_LOG(Error, "Can't write local file %s", operation.local.c_str());
+                return SSH_ERROR;
+            }
+        }
+
+        int nerr = ssh_channel_read_nonblocking(operation.channel, buffer.data(),
+                                                buffer.size(), 1);
+        if (nerr > 0)
+        {
+            operation.result.errors.append(buffer.data(), nerr);
+        }
+
+        if ((nout < 0 && nout != SSH_EOF) || (nerr < 0 && nerr != SSH_EOF))
+        {
+            return SSH_ERROR;
+        }
+
+        if (nout <= 0 && nerr <= 0)
+        {
+            if (ssh_channel_is_eof(operation.channel))
+            {
+                operation.stage = stageFinish;
+                return SSH_OK;
+            }
+
+            return SSH_AGAIN;
+        }
+
+        total += max(nout, 0) + max(nerr, 0);
+        operation.progress = true;
+    }
+
+    return SSH_AGAIN;
+}
+
+int SshAsyncSession::_StepWrite(_Operation& operation)
+{
+    size_t total = 0;
+
+    while (total < stepChunkSize)
+    {
+        if (operation.chunkOffset == operation.chunkLength)
+        {
+            ssize_t nbytes = read(operation.fd, operation.chunk.Data(), stepChunkSize);
+            if (nbytes < 0)
+            {
+                SSH_LOG(Error, "Can't read local file %s", operation.local.c_str());
+                return SSH_ERROR;
+            }
+            if (nbytes == 0)
+            {
+                ssh_channel_send_eof(operation.channel);
+                operation.stage = stageFinish;
+                return SSH_OK;
+            }
+
+            operation.chunkOffset = 0;
+            operation.chunkLength = nbytes;
+        }
+
+        // Only hand libssh what the peer can take right now, anything more
+        // would be buffered in memory
+        uint32_t window = ssh_channel_window_size(operation.channel);
+        if (window == 0)
+        {
+            return SSH_AGAIN;
+        }
+
+        uint32_t length = min<size_t>(window, operation.chunkLength - operation.chunkOffset);
+        int nbytes = ssh_channel_write(operation.channel,
+                                       operation.chunk.Data() + operation.chunkOffset,
+                                       length);
+        if (nbytes < 0)
+        {
+            return SSH_ERROR;
+        }
+        if (nbytes == 0)
+        {
+            return SSH_AGAIN;
+        }
+
+        operation.chunkOffset += nbytes;
+        total += nbytes;
+        operation.progress = true;
+    }
+
+    return SSH_AGAIN;
+}
+
+int SshAsyncSession::_StepFinishChannel(_Operation& operation)
+{
+    int status;
+
+    // The exit status usually arrives right after EOF, the close tells that
+    // the server won't send one
+    status = ssh_channel_get_exit_status(operation.channel);
+    if (status == -1 && ssh_channel_is_closed(operation.channel) == 0)
+    {
+        return SSH_AGAIN;
+    }
+
+    operation.result.exitStatus = status;
+
+    if (operation.type != _Operation::Execute && status != 0)
+    {
+        SSH_LOG(Error, "Remote command failed on %s: %s", _ip.c_str(),
+                operation.result.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+void SshAsyncSession::_Complete(_Operation& operation, int res)
+{
+    if (operation.channel != NULL)
+    {
+        ssh_channel_close(operation.channel);
+        ssh_channel_free(operation.channel);
+        operation.channel = NULL;
+    }
+    if (operation.fd >= 0)
+    {
+        close(operation.fd);
+        operation.fd = -1;
+    }
+
+    if (operation.type == _Operation::Connect && res != SSH_OK)
+    {
+        _Release();
+    }
+
+    if (operation.type == _Operation::Execute)
+    {
+        operation.result.status = res;
+        operation.executed.set_value(move(operation.result));
+    }
+    else
+    {
+        operation.done.set_value(res);
+    }
+}
+
+void SshAsyncSession::_Release()
+{
+    if (_session == NULL)
+    {
+        return;
+    }
+
+    if (_inEvent)
+    {
+        ssh_event_remove_session(_loop.event, _session);
+        _inEvent = false;
+    }
+    ssh_disconnect(_session);
+    ssh_free(_session);
+    _session = NULL;
+}
@@ -0,0 +1,104 @@
+#ifndef __SSH_ASYNC_ENGINE_H__
+#define __SSH_ASYNC_ENGINE_H__
+
+#include "SshClient.h"
+
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+#include <thread>
+
+class SshAsyncSession;
+
+struct SshExecResult
+{
+    int status{SSH_ERROR};
+    int exitStatus{-1};
+    string output;
+    string errors;
+};
+
+// Drives many non-blocking sessions from a few I/O threads. Every session is
+// bound to one thread, which runs all libssh calls for it.
+class SshAsyncEngine
+{
+public:
+    explicit SshAsyncEngine(size_t ioThreads);
+    ~SshAsyncEngine();
+    SshAsyncEngine(const SshAsyncEngine&) = delete;
+    SshAsyncEngine& operator=(const SshAsyncEngine&) = delete;
+
+    shared_ptr<SshAsyncSession> CreateSession(const string& ip, const string& user,
+                                              const string& password);
+    void SetOperationTimeout(chrono::milliseconds timeout);
+    // Applies to the sessions created afterwards
+    void SetConnectOptions(const SshConnectOptions& options);
+    size_t GetSessionCount();
+
+private:
+    friend class SshAsyncSession;
+    struct _Loop;
+
+    void _Run(_Loop& loop);
+    static int _OnWake(socket_t fd, int revents, void *userdata);
+    void _Wake(_Loop& loop);
+
+private:
+    vector<unique_ptr<_Loop>> _loops;
+    size_t _nextLoop{0};
+    mutex _mutex;
+    chrono::milliseconds _operationTimeout{30000};
+    SshConnectOptions _connectOptions;
+};
+
+// Handle on one session of an SshAsyncEngine. Operations queued on a session
+// run one after the other in the order they were queued. The engine keeps a
+// connected session alive until CloseAsync completes or the engine is
+// destroyed. A session must not be used after its engine is destroyed.
+class SshAsyncSession : public enable_shared_from_this<SshAsyncSession>
+{
+public:
+    ~SshAsyncSession();
+    SshAsyncSession(const SshAsyncSession&) = delete;
+    SshAsyncSession& operator=(const SshAsyncSession&) = delete;
+
+    future<int> ConnectAsync();
+    future<SshExecResult> ExecuteAsync(const string& command);
+    future<int> PushAsync(const string& source, const string& destination);
+    future<int> PullAsync(const string& source, const string& destination);
+    future<int> CloseAsync();
+
+private:
+    friend class SshAsyncEngine;
+    struct _Operation;
+
+    SshAsyncSession(SshAsyncEngine& engine, SshAsyncEngine::_Loop& loop,
+                    const string& ip, const string& user, const string& password,
+                    const SshConnectOptions& options);
+    void _Enqueue(unique_ptr<_Operation> operation);
+    bool _Step(vector<char>& buffer);
+    int _StepConnect(_Operation& operation);
+    int _StepOpenLocalFile(_Operation& operation);
+    int _StepOpenChannel(_Operation& operation);
+    int _StepRead(_Operation& operation, vector<char>& buffer);
+    int _StepWrite(_Operation& operation);
+    int _StepFinishChannel(_Operation& operation);
+    void _Complete(_Operation& operation, int res);
+    void _Release();
+
+private:
+    SshAsyncEngine& _engine;
+    SshAsyncEngine::_Loop& _loop;
+    string _ip, _user, _password;
+    SshConnectOptions _connectOptions;
+    ssh_session _session{NULL};
+    bool _inEvent{false};
+    bool _scheduled{false};
+    bool _active{false};
+    bool _registered{false};
+    deque<unique_ptr<_Operation>> _incoming;
+    deque<unique_ptr<_Operation>> _operations;
+};
+
+#endif // __SSH_ASYNC_ENGINE_H__
@@ -0,0 +1,411 @@
+#include "SshBroadcast.h"
+#include "SshScheduler.h"
+
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+
+// Started by the login shell of every host. It reads the relay script from
+// the stream up to the #end line and runs it under sh with the rest of the
+// stream as input.
+static const char bootstrap[] =
+    "s=; while IFS= read -r l && [ \"$l\" != \"#end\" ]; do s=\"$s$l\n"
+    "\"; done; export s; exec sh -c \"$s\"";
+
+// After the script the stream holds the destination, the relay command, the
+// file size and the plan of the subtree up to #plan, then the file. Plan
+// lines are "depth host port user@address" in preorder with this host first.
+// Every subtree gets a fifo that tee fills along with the local copy, and a
+// relay that sends the script, the subtree's plan and the fifo to its first
+// host. SIGPIPE is ignored so a relay that dies doesn't stop the others.
+static const char relayScript[] = R"SH(boot='s=; while IFS= read -r l && [ "$l" != "#end" ]; do s="$s$l
+"; done; export s; exec sh -c "$s"'
+d=$(mktemp -d) || exit 1
+trap 'rm -rf "$d"' EXIT
+trap '' PIPE
+IFS= read -r dest
+IFS= read -r relay
+IFS= read -r size
+while IFS= read -r l && [ "$l" != "#plan" ]; do printf '%s\n' "$l"; done > "$d/plan"
+set -- $(sed -n 1p "$d/plan")
+self=$2
+awk -v d="$d" 'NR > 1 { if ($1 == 1) n++; $1 = $1 - 1; print > (d "/plan" n) }' "$d/plan"
+outs=
+for p in "$d"/plan[0-9]*; do
+    [ -e "$p" ] || break
+    k=${p##*plan}
+    mkfifo "$d/f$k" || continue
+    set -- $(sed -n 1p "$p")
+    { printf '%s\n' "$s#end" "$dest" "$relay" "$size"; cat "$p"; echo '#plan'; cat "$d/f$k"; } |
+        $relay -p "$3" "$4" "$boot" || echo "cppssh-broadcast $2 relay-failed" &
+    outs="$outs $d/f$k"
+done
+mkdir -p "$(dirname "$dest")" 2>/dev/null
+tee "$dest.cppssh-part" $outs > /dev/null
+if [ "$(wc -c 2>/dev/null < "$dest.cppssh-part" | tr -d ' ')" = "$size" ] && mv -f "$dest.cppssh-part" "$dest"; then
+    echo "cppssh-broadcast $self ok"
+else
+    rm -f "$dest.cppssh-part"
+    echo "cppssh-broadcast $self failed"
+fi
+wait
+)SH";
+
+static const char statusPrefix[] = "cppssh-broadcast ";
+
+// Feeds one tree from the shared mapping and follows the reports of its hosts
+class SshBroadcast::_Stream : public SshInputSource, public SshOutputSink
+{
+public:
+    _Stream(SshBroadcast& broadcast, SshClient& client, const string& header):
+            _broadcast(broadcast), _client(client), _header(header){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        size_t length;
+
+        if (_position < _header.size())
+        {
+            length = min(size, _header.size() - _position);
+            memcpy(buffer, _header.data() + _position, length);
+            _position += length;
+            return length;
+        }
+
+        uint64_t offset = _position - _header.size();
+
+        length = min<uint64_t>(size, _broadcast._size - offset);
+        if (length > 0)
+        {
+            SshTransferScheduler::Shared().Acquire(_client._ip,
+                                                   _client._transferOptions.priority, length);
+            memcpy(buffer, _broadcast._data + offset, length);
+            _position += length;
+            _sent += length;
+        }
+
+        return length;
+    };
+
+    void OnStdout(string_view data) override
+    {
+        size_t end;
+
+        _line.append(data);
+        while ((end = _line.find('\n')) != string::npos)
+        {
+            _Report(_line.substr(0, end));
+            _line.erase(0, end + 1);
+        }
+    };
+
+    void OnStderr(string_view data) override
+    {
+        // The first lines say why a relay failed, the rest is seldom useful
+        if (errors.size() < 4096)
+        {
+            errors.append(data.substr(0, 4096 - errors.size()));
+        }
+    };
+
+    uint64_t Sent() const { return _sent; };
+
+    string errors;
+
+private:
+    void _Report(const string& line)
+    {
+        if (line.compare(0, sizeof(statusPrefix) - 1, statusPrefix) != 0)
+        {
+            return;
+        }
+
+        char *end;
+        const char *start = line.c_str() + sizeof(statusPrefix) - 1;
+        unsigned long host = strtoul(start, &end, 10);
+
+        if (end == start || *end != ' ' || host >= _broadcast._hosts.size())
+        {
+            return;
+        }
+
+        if (strcmp(end + 1, "ok") == 0)
+        {
+            _broadcast._SetState(host, SshBroadcastState::Done);
+        }
+        else
+        {
+            SSH_LOG(Warning, "Broadcast to %s: %s", _broadcast._clients[host]->_ip.c_str(),
+                    end + 1);
+            _broadcast._SetState(host, SshBroadcastState::Failed);
+        }
+    };
+
+private:
+    SshBroadcast& _broadcast;
+    SshClient& _client;
+    const string& _header;
+    uint64_t _position{0};
+    uint64_t _sent{0};
+    string _line;
+};
+
+void SshBroadcast::SetOptions(const SshBroadcastOptions& options)
+{
+    _options = options;
+}
+
+void SshBroadcast::SetProgressCallback(ProgressCallback callback)
+{
+    _callback = move(callback);
+}
+
+vector<SshBroadcastHost> SshBroadcast::GetHosts()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _hosts;
+}
+
+SshTransferStats SshBroadcast::GetLastTransferStats()
+{
+    return _stats;
+}
+
+int SshBroadcast::Broadcast(const string& source, const string& destination,
+                            const vector<SshClient*>& hosts)
+{
+    auto start = chrono::steady_clock::now();
+    size_t firstTier = max<size_t>(_options.firstTier, 1);
+    size_t fanOut = max<size_t>(_options.fanOut, 1);
+    vector<size_t> roots;
+    struct stat status;
+    atomic<uint64_t> sent{0};
+    vector<thread> workers;
+    size_t delivered = 0;
+    int fd;
+
+    _stats = SshTransferStats();
+    _clients = hosts;
+    _hosts.assign(hosts.size(), SshBroadcastHost());
+    _children.assign(hosts.size(), vector<size_t>());
+    if (hosts.empty())
+    {
+        return SSH_OK;
+    }
+
+    if (destination.empty() || destination.find('\n') != string::npos ||
+        _options.relayCommand.find('\n') != string::npos)
+    {
+        SSH_LOG(Error, "Can't broadcast to %s", destination.c_str());
+        return SSH_ERROR;
+    }
+
+    fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &status) != 0 || S_ISREG(status.st_mode) == false)
+    {
+        SSH_LOG(Error, "Can't read %s", source.c_str());
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return SSH_ERROR;
+    }
+
+    _size = status.st_size;
+    _data = nullptr;
+    if (_size > 0)
+    {
+        void *data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data == MAP_FAILED)
+        {
+            SSH_LOG(Error, "Can't map %s: %s", source.c_str(), strerror(errno));
+            close(fd);
+            return SSH_ERROR;
+        }
+        _data = (const char *) data;
+        madvise(data, _size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Breadth first, so every level is full before the next one starts and
+    // the depth stays logarithmic in the number of hosts
+    for (size_t host = 0, next = 0; host < hosts.size(); host++)
+    {
+        if (host < firstTier)
+        {
+            roots.push_back(host);
+            continue;
+        }
+        while (_children[next].size() == fanOut)
+        {
+            next++;
+        }
+        _children[next].push_back(host);
+        _hosts[host].parent = next;
+    }
+
+    string header = string(relayScript) + "#end\n" + destination + "\n" +
+                    _options.relayCommand + "\n" + to_string(_size) + "\n";
+
+    for (size_t root : roots)
+    {
+        workers.emplace_back([this, root, &header, &sent]()
+        {
+            sent += _Send(root, header + _Plan(root, 0) + "#plan\n");
+        });
+    }
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+    workers.clear();
+
+    // The subtrees below a failed relay never saw the stream
+    vector<size_t> missed;
+
+    for (size_t host = 0; host < hosts.size(); host++)
+    {
+        if (_hosts[host].state != SshBroadcastState::Done)
+        {
+            missed.push_back(host);
+        }
+    }
+
+    if (missed.empty() == false && _options.reroute)
+    {
+        atomic<size_t> index{0};
+
+        SSH_LOG(Warning, "Relays missed %zu of %zu hosts, sending to them directly",
+                missed.size(), hosts.size());
+        for (size_t host : missed)
+        {
+            lock_guard<mutex> lock(_mutex);
+
+            _children[host].clear();
+            _hosts[host].parent = -1;
+            _hosts[host].rerouted = true;
+        }
+        for (size_t i = 0; i < min(firstTier, missed.size()); i++)
+        {
+            workers.emplace_back([this, &missed, &index, &header, &sent]()
+            {
+                size_t next;
+
+                while ((next = index++) < missed.size())
+                {
+                    sent += _Send(missed[next], header + _Plan(missed[next], 0) + "#plan\n");
+                }
+            });
+        }
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    if (_data != nullptr)
+    {
+        munmap((void *) _data, _size);
+        _data = nullptr;
+    }
+
+    for (size_t host = 0; host < hosts.size(); host++)
+    {
+        if (_hosts[host].state == SshBroadcastState::Done)
+        {
+            delivered++;
+        }
+        else
+        {
+            _SetState(host, SshBroadcastState::Failed);
+        }
+    }
+
+    _stats.bytes = sent;
+    _stats.files = delivered;
+    _stats.elapsed = chrono::steady_clock::now() - start;
+
+    if (delivered != hosts.size())
+    {
+        SSH_LOG(Error, "Broadcast of %s reached %zu of %zu hosts", source.c_str(),
+                delivered, hosts.size());
+        return SSH_ERROR;
+    }
+
+    SSH_LOG(Info, "Broadcast %s to %zu hosts, sending %.1f copies from here",
+            source.c_str(), hosts.size(), _size > 0 ? (double) sent / _size : 0.0);
+
+    return SSH_OK;
+}
+
+string SshBroadcast::_Plan(size_t host, size_t depth)
+{
+    SshClient& client = *_clients[host];
+    string plan = to_string(depth) + " " + to_string(host) + " " +
+                  to_string(client._connectOptions.port) + " " +
+                  client._user + "@" + client._ip + "\n";
+
+    for (size_t child : _children[host])
+    {
+        plan += _Plan(child, depth + 1);
+    }
+
+    return plan;
+}
+
+int SshBroadcast::_Send(size_t root, const string& header)
+{
+    SshClient& client = *_clients[root];
+    _Stream stream(*this, client, header);
+    SshScheduledTransfer scheduled(client._transferOptions.priority);
+    int exitStatus = -1;
+
+    _SetSubtreeState(root, SshBroadcastState::Sending);
+
+    if (client.Execute(bootstrap, stream, stream, &exitStatus) != SSH_OK)
+    {
+        SSH_LOG(Error, "Can't stream the broadcast to %s", client._ip.c_str());
+    }
+    else if (stream.errors.empty() == false)
+    {
+        SSH_LOG(Warning, "Broadcast through %s: %s", client._ip.c_str(),
+                stream.errors.c_str());
+    }
+
+    return stream.Sent();
+}
+
+void SshBroadcast::_SetState(size_t host, SshBroadcastState state)
+{
+    SshBroadcastHost status;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        if (_hosts[host].state == state)
+        {
+            return;
+        }
+        _hosts[host].state = state;
+        status = _hosts[host];
+    }
+
+    if (_callback)
+    {
+        _callback(host, status);
+    }
+}
+
+void SshBroadcast::_SetSubtreeState(size_t host, SshBroadcastState state)
+{
+    _SetState(host, state);
+    for (size_t child : _children[host])
+    {
+        _SetSubtreeState(child, state);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef __SSH_BROADCAST_H__
+#define __SSH_BROADCAST_H__
+
+#include "SshClient.h"
+
+#include <functional>
+
+struct SshBroadcastOptions
+{
+    // Hosts the stream is sent to from here, the others get it from them
+    size_t firstTier{4};
+    // Hosts each relay passes the stream on to, 1 makes chains
+    size_t fanOut{2};
+    // How a relay logs in to the next host, followed by -p port, user@host
+    // and the command. The hosts have to be able to log in to each other
+    // without a prompt.
+    string relayCommand{"ssh -o BatchMode=yes -o StrictHostKeyChecking=accept-new"};
+    // Sends the file from here to the hosts the relays didn't reach
+    bool reroute{true};
+};
+
+enum class SshBroadcastState
+{
+    Pending,
+    Sending,
+    Done,
+    Failed
+};
+
+struct SshBroadcastHost
+{
+    SshBroadcastState state{SshBroadcastState::Pending};
+    // Index of the host it gets the stream from, -1 for this process
+    int parent{-1};
+    // Sent from here after its relay didn't deliver
+    bool rerouted{false};
+};
+
+// Copies one local file to many hosts without sending it from here to each
+// of them. The file is mapped once and streamed to the first tier of hosts,
+// which write it and pass it on at the same time to the next hosts of a
+// tree, so the time grows with its depth rather than with the number of
+// hosts. Every host reports its copy on the stream back up the tree; those
+// that don't are sent the file from here once the tree is done.
+class SshBroadcast
+{
+public:
+    // Called from the sending threads whenever a host changes state
+    using ProgressCallback = function<void(size_t host, const SshBroadcastHost& status)>;
+
+    void SetOptions(const SshBroadcastOptions& options);
+    void SetProgressCallback(ProgressCallback callback);
+    // Copies source to destination on every host. The clients must be
+    // connected and stay unused until it returns.
+    int Broadcast(const string& source, const string& destination,
+                  const vector<SshClient*>& hosts);
+    // States of the hosts of the last broadcast, in the order they were given
+    vector<SshBroadcastHost> GetHosts();
+    // Bytes sent from here, and the hosts that got the file
+    SshTransferStats GetLastTransferStats();
+
+private:
+    class _Stream;
+
+    string _Plan(size_t host, size_t depth);
+    int _Send(size_t root, const string& header);
+    void _SetState(size_t host, SshBroadcastState state);
+    void _SetSubtreeState(size_t host, SshBroadcastState state);
+
+private:
+    SshBroadcastOptions _options;
+    ProgressCallback _callback;
+    mutex _mutex;
+    vector<SshClient*> _clients;
+    vector<SshBroadcastHost> _hosts;
+    vector<vector<size_t>> _children;
+    const char *_data{nullptr};
+    uint64_t _size{0};
+    SshTransferStats _stats;
+};
+
+#endif // __SSH_BROADCAST_H__
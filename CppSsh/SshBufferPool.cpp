@@ -0,0 +1,148 @@
+#include "SshBufferPool.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
+// Alignment of every pooled buffer, enough for O_DIRECT
+static constexpr size_t bufferAlignment = 4096;
+// Returned buffers a size class keeps, in bytes and at the least in number
+static constexpr size_t maxCachedBytesPerClass = 64 * 1024 * 1024;
+static constexpr size_t minCachedPerClass = 4;
+
+SshPooledBuffer& SshPooledBuffer::operator=(SshPooledBuffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        Release();
+        _pool = other._pool;
+        _data = other._data;
+        _size = other._size;
+        other._pool = nullptr;
+        other._data = nullptr;
+        other._size = 0;
+    }
+
+    return *this;
+}
+
+void SshPooledBuffer::Release()
+{
+    if (_data)
+    {
+        _pool->_Release(_data, _size);
+        _data = nullptr;
+        _size = 0;
+    }
+}
+
+SshBufferPool& SshBufferPool::Shared()
+{
+    // Never destroyed, buffers may come back from static destructors
+    static SshBufferPool* pool = new SshBufferPool();
+
+    return *pool;
+}
+
+SshBufferPool::~SshBufferPool()
+{
+    Trim();
+}
+
+SshPooledBuffer SshBufferPool::Acquire(size_t size)
+{
+    size_t index = 0;
+    char* data = nullptr;
+
+    while (index < _classes && (size_t(1) << (_minClassShift + index)) < size)
+    {
+        index++;
+    }
+
+    if (index == _classes)
+    {
+        size = (size + bufferAlignment - 1) / bufferAlignment * bufferAlignment;
+        _allocations++;
+
+        return SshPooledBuffer(this, (char*) aligned_alloc(bufferAlignment, size), size);
+    }
+
+    size = size_t(1) << (_minClassShift + index);
+
+    {
+        lock_guard<mutex> lock(_free[index].lock);
+
+        if (_free[index].free.empty() == false)
+        {
+            data = _free[index].free.back();
+            _free[index].free.pop_back();
+        }
+    }
+
+    if (data)
+    {
+        _reuses++;
+        _cachedBytes -= size;
+    }
+    else
+    {
+        _allocations++;
+        data = (char*) aligned_alloc(bufferAlignment, size);
+    }
+
+    return SshPooledBuffer(this, data, size);
+}
+
+void SshBufferPool::_Release(char* data, size_t size)
+{
+    size_t index = 0;
+
+    while (index < _classes && (size_t(1) << (_minClassShift + index)) != size)
+    {
+        index++;
+    }
+
+    if (index < _classes)
+    {
+        size_t limit = max(minCachedPerClass, maxCachedBytesPerClass / size);
+        lock_guard<mutex> lock(_free[index].lock);
+
+        if (_free[index].free.size() < limit)
+        {
+            _free[index].free.push_back(data);
+            _cachedBytes += size;
+            return;
+        }
+    }
+
+    free(data);
+}
+
+SshBufferPoolStats SshBufferPool::GetStats()
+{
+    SshBufferPoolStats stats;
+
+    stats.allocations = _allocations.load(memory_order_relaxed);
+    stats.reuses = _reuses.load(memory_order_relaxed);
+    stats.cachedBytes = _cachedBytes.load(memory_order_relaxed);
+
+    return stats;
+}
+
+void SshBufferPool::Trim()
+{
+    for (size_t index = 0; index < _classes; index++)
+    {
+        vector<char*> buffers;
+
+        {
+            lock_guard<mutex> lock(_free[index].lock);
+            buffers.swap(_free[index].free);
+        }
+
+        for (char* data : buffers)
+        {
+            free(data);
+        }
+        _cachedBytes -= buffers.size() * (size_t(1) << (_minClassShift + index));
+    }
+}
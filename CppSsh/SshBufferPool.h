@@ -0,0 +1,89 @@
+#ifndef __SSH_BUFFER_POOL_H__
+#define __SSH_BUFFER_POOL_H__
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+class SshBufferPool;
+
+// Buffer borrowed from an SshBufferPool, given back when destroyed
+class SshPooledBuffer
+{
+public:
+    SshPooledBuffer() = default;
+    SshPooledBuffer(SshPooledBuffer&& other) noexcept { *this = move(other); };
+    SshPooledBuffer& operator=(SshPooledBuffer&& other) noexcept;
+    SshPooledBuffer(const SshPooledBuffer&) = delete;
+    SshPooledBuffer& operator=(const SshPooledBuffer&) = delete;
+    ~SshPooledBuffer() { Release(); };
+
+    char* Data() const { return _data; };
+    // At least what was asked for, the whole size class
+    size_t Size() const { return _size; };
+    void Release();
+
+private:
+    friend class SshBufferPool;
+
+    SshPooledBuffer(SshBufferPool* pool, char* data, size_t size):
+                    _pool(pool), _data(data), _size(size){};
+
+    SshBufferPool* _pool{nullptr};
+    char* _data{nullptr};
+    size_t _size{0};
+};
+
+struct SshBufferPoolStats
+{
+    // Buffers that had to be allocated, and those served from the pool
+    uint64_t allocations{0};
+    uint64_t reuses{0};
+    uint64_t cachedBytes{0};
+};
+
+// Buffers in power of two size classes from 4 KiB to 16 MiB, aligned for
+// O_DIRECT, that the transfer and exec paths take instead of allocating their
+// own. A size class keeps up to 64 MiB of returned buffers, and at least
+// four of them. Larger requests are allocated and freed every time.
+class SshBufferPool
+{
+public:
+    static SshBufferPool& Shared();
+
+    SshBufferPool() = default;
+    ~SshBufferPool();
+    SshBufferPool(const SshBufferPool&) = delete;
+    SshBufferPool& operator=(const SshBufferPool&) = delete;
+
+    SshPooledBuffer Acquire(size_t size);
+    SshBufferPoolStats GetStats();
+    // Frees every buffer the pool holds
+    void Trim();
+
+private:
+    friend class SshPooledBuffer;
+
+    static constexpr size_t _minClassShift = 12;
+    static constexpr size_t _classes = 13;
+
+    struct _Class
+    {
+        mutex lock;
+        vector<char*> free;
+    };
+
+    void _Release(char* data, size_t size);
+
+private:
+    _Class _free[_classes];
+    atomic<uint64_t> _allocations{0};
+    atomic<uint64_t> _reuses{0};
+    atomic<uint64_t> _cachedBytes{0};
+};
+
+#endif // __SSH_BUFFER_POOL_H__
@@ -0,0 +1,253 @@
+#include "SshCaptureBuffer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Tail mode lets this much more than the tail pile up before moving the
+// tail back over the dropped bytes, so each byte is moved about once
+static constexpr uint64_t minCompactSlack = 64 * 1024;
+static constexpr size_t compactChunkSize = 1024 * 1024;
+
+SshCaptureBuffer::~SshCaptureBuffer()
+{
+    Clear();
+}
+
+int SshCaptureBuffer::Append(string_view data)
+{
+    _Unmap();
+    _size += data.size();
+
+    if (_options.head == 0 && _options.tail == 0)
+    {
+        _Store(data.data(), data.size());
+        return _error == 0 ? SSH_OK : SSH_ERROR;
+    }
+
+    size_t head = min<uint64_t>(data.size(), _options.head - _headKept);
+
+    _Store(data.data(), head);
+    _headKept += head;
+    data.remove_prefix(head);
+
+    if (_options.tail == 0)
+    {
+        _dropped += data.size();
+    }
+    else
+    {
+        _Store(data.data(), data.size());
+        if (_stored - _headKept > _options.tail + max(_options.tail, minCompactSlack))
+        {
+            _Compact();
+        }
+    }
+
+    return _error == 0 ? SSH_OK : SSH_ERROR;
+}
+
+string_view SshCaptureBuffer::View()
+{
+    if (_options.tail > 0 && _stored - _headKept > _options.tail)
+    {
+        _Unmap();
+        _Compact();
+    }
+
+    if (_fd < 0)
+    {
+        return string_view(_memory);
+    }
+    if (_map == nullptr && _stored > 0)
+    {
+        void *map = mmap(NULL, _stored, PROT_READ, MAP_SHARED, _fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            SSH_LOG(Error, "Can't map the captured output: %s", strerror(errno));
+            return string_view();
+        }
+        _map = map;
+        _mapLength = _stored;
+    }
+
+    return string_view((const char *) _map, _mapLength);
+}
+
+uint64_t SshCaptureBuffer::Dropped() const
+{
+    uint64_t body = _stored - _headKept;
+
+    if (_options.tail > 0 && body > _options.tail)
+    {
+        return _dropped + body - _options.tail;
+    }
+
+    return _dropped;
+}
+
+void SshCaptureBuffer::Clear()
+{
+    _Unmap();
+    if (_fd >= 0)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+    string().swap(_memory);
+    _stored = 0;
+    _headKept = 0;
+    _size = 0;
+    _dropped = 0;
+    _error = 0;
+}
+
+void SshCaptureBuffer::_Store(const char *data, size_t length)
+{
+    if (length == 0 || _error != 0)
+    {
+        return;
+    }
+
+    if (_fd < 0 && _memory.size() + length > _options.memoryLimit && _Spill() == false)
+    {
+        return;
+    }
+
+    if (_fd >= 0)
+    {
+        if (_WriteFile(data, length, _stored) == false)
+        {
+            return;
+        }
+    }
+    else
+    {
+        // Grown by hand, doubling past the limit would overshoot it
+        if (_memory.size() + length > _memory.capacity())
+        {
+            _memory.reserve(min(max(_memory.capacity() * 2, _memory.size() + length),
+                                _options.memoryLimit));
+        }
+        _memory.append(data, length);
+    }
+    _stored += length;
+}
+
+bool SshCaptureBuffer::_Spill()
+{
+    const char *environment = getenv("TMPDIR");
+    string directory = _options.directory;
+
+    if (directory.empty())
+    {
+        directory = environment && *environment ? environment : "/tmp";
+    }
+
+    string path = directory + "/cppssh-capture-XXXXXX";
+
+    _fd = mkostemp(&path[0], O_CLOEXEC);
+    if (_fd < 0)
+    {
+        _error = errno;
+        SSH_LOG(Error, "Can't create a temporary file in %s: %s", directory.c_str(),
+                strerror(_error));
+        return false;
+    }
+    // Gone from the directory right away, the space is freed with the
+    // descriptor even if the process dies
+    unlink(path.c_str());
+
+    // What is in memory stays the output when the file can't take it
+    if (_WriteFile(_memory.data(), _memory.size(), 0) == false)
+    {
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+    string().swap(_memory);
+
+    return true;
+}
+
+bool SshCaptureBuffer::_WriteFile(const char *data, size_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t written = pwrite(_fd, data, length, offset);
+
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            _error = written < 0 ? errno : ENOSPC;
+            SSH_LOG(Error, "Can't write the captured output: %s", strerror(_error));
+            return false;
+        }
+        data += written;
+        offset += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+void SshCaptureBuffer::_Compact()
+{
+    uint64_t drop = _stored - _headKept - _options.tail;
+
+    if (_fd < 0)
+    {
+        _memory.erase(_headKept, drop);
+    }
+    else
+    {
+        SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(compactChunkSize);
+        uint64_t moved = 0;
+
+        // Front to back, the tail only ever moves down
+        while (moved < _options.tail && _error == 0)
+        {
+            size_t length = min<uint64_t>(buffer.Size(), _options.tail - moved);
+            ssize_t nbytes = pread(_fd, buffer.Data(), length, _headKept + drop + moved);
+
+            if (nbytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nbytes <= 0)
+            {
+                _error = nbytes < 0 ? errno : EIO;
+                SSH_LOG(Error, "Can't read the captured output: %s", strerror(_error));
+                break;
+            }
+
+            if (_WriteFile(buffer.Data(), nbytes, _headKept + moved) == false)
+            {
+                break;
+            }
+            moved += nbytes;
+        }
+        if (_error == 0 && ftruncate(_fd, _headKept + _options.tail) != 0)
+        {
+            _error = errno;
+            SSH_LOG(Error, "Can't truncate the captured output: %s", strerror(_error));
+        }
+    }
+
+    _stored -= drop;
+    _dropped += drop;
+}
+
+void SshCaptureBuffer::_Unmap()
+{
+    if (_map != nullptr)
+    {
+        munmap(_map, _mapLength);
+        _map = nullptr;
+        _mapLength = 0;
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef __SSH_CAPTURE_BUFFER_H__
+#define __SSH_CAPTURE_BUFFER_H__
+
+#include "SshClient.h"
+
+struct SshCaptureOptions
+{
+    // Output kept in memory, the rest of it goes to a temporary file
+    size_t memoryLimit{8 * 1024 * 1024};
+    // Where the temporary file is created, $TMPDIR or /tmp when empty
+    string directory;
+    // Keep only the first head and the last tail bytes and drop what is
+    // between them. With both 0 everything is kept.
+    uint64_t head{0};
+    uint64_t tail{0};
+};
+
+// Output of a command with a ceiling on the memory it takes. Past
+// memoryLimit the output moves to an unlinked temporary file, which View
+// maps, so the caller sees one contiguous block either way.
+class SshCaptureBuffer
+{
+public:
+    SshCaptureBuffer(const SshCaptureOptions& options = SshCaptureOptions()):
+                     _options(options){};
+    ~SshCaptureBuffer();
+    SshCaptureBuffer(const SshCaptureBuffer&) = delete;
+    SshCaptureBuffer& operator=(const SshCaptureBuffer&) = delete;
+
+    // Fails once the temporary file can't be created or written, the output
+    // after that is counted but not kept
+    int Append(string_view data);
+    // What was kept, the head followed by the tail. Valid until the next
+    // Append or Clear.
+    string_view View();
+    // Bytes appended, kept or not
+    uint64_t Size() const { return _size; };
+    // Bytes dropped between the head and the tail
+    uint64_t Dropped() const;
+    bool Spilled() const { return _fd >= 0; };
+    // errno of the failed spill, 0 while everything went well
+    int Error() const { return _error; };
+    void Clear();
+
+private:
+    void _Store(const char *data, size_t length);
+    bool _Spill();
+    bool _WriteFile(const char *data, size_t length, uint64_t offset);
+    void _Compact();
+    void _Unmap();
+
+private:
+    SshCaptureOptions _options;
+    string _memory;
+    int _fd{-1};
+    // Bytes in memory or in the file, and the part of them that is the head
+    uint64_t _stored{0};
+    uint64_t _headKept{0};
+    uint64_t _size{0};
+    uint64_t _dropped{0};
+    void *_map{nullptr};
+    size_t _mapLength{0};
+    int _error{0};
+};
+
+// Captures stdout and stderr of a command in two buffers of the same options
+class SshCaptureBufferSink : public SshOutputSink
+{
+public:
+    SshCaptureBufferSink(const SshCaptureOptions& options = SshCaptureOptions()):
+                         output(options), errors(options){};
+    void OnStdout(string_view data) override { output.Append(data); };
+    void OnStderr(string_view data) override { errors.Append(data); };
+
+    SshCaptureBuffer output;
+    SshCaptureBuffer errors;
+};
+
+#endif // __SSH_CAPTURE_BUFFER_H__
@@ -0,0 +1,156 @@
+#include "SshCheckpoint.h"
+#include "SshHash.h"
+
+#include <filesystem>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+static const char checkpointMagic[] = "cppssh-checkpoint 1";
+
+string SshDefaultCheckpointDirectory()
+{
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+
+    if (state && state[0] == '/')
+    {
+        return string(state) + "/cppssh-checkpoints";
+    }
+    if (home && home[0] == '/')
+    {
+        return string(home) + "/.local/state/cppssh-checkpoints";
+    }
+
+    return "/tmp/cppssh-checkpoints-" + to_string(getuid());
+}
+
+string SshCheckpointPath(const string& directory, const string& scope, bool push,
+                         const string& source, const string& destination)
+{
+    string base = directory.empty() ? SshDefaultCheckpointDirectory() : directory;
+    string key = scope + "\n" + (push ? "push" : "pull") + "\n" + source + "\n" + destination;
+    SshSha256 hash;
+
+    hash.Update(key.data(), key.size());
+
+    return base + "/" + hash.HexDigest().substr(0, 32);
+}
+
+int SshLoadCheckpoint(const string& path, SshTransferCheckpoint& checkpoint)
+{
+    FILE *file = fopen(path.c_str(), "re");
+    char line[8192];
+    string magic;
+
+    if (file == NULL)
+    {
+        return SSH_ERROR;
+    }
+
+    checkpoint = SshTransferCheckpoint();
+
+    // One "key value" pair per line, paths run to the end of theirs
+    while (fgets(line, sizeof(line), file))
+    {
+        string text(line);
+        size_t space;
+
+        if (text.empty() == false && text.back() == '\n')
+        {
+            text.pop_back();
+        }
+        if (magic.empty())
+        {
+            magic = text;
+            continue;
+        }
+
+        space = text.find(' ');
+        if (space == string::npos)
+        {
+            continue;
+        }
+
+        string key = text.substr(0, space);
+        string value = text.substr(space + 1);
+
+        if (key == "push") { checkpoint.push = value == "1"; }
+        else if (key == "size") { checkpoint.size = strtoull(value.c_str(), NULL, 10); }
+        else if (key == "mtime") { checkpoint.mtime = strtoll(value.c_str(), NULL, 10); }
+        else if (key == "offset") { checkpoint.offset = strtoull(value.c_str(), NULL, 10); }
+        else if (key == "sha256") { checkpoint.prefixHash = value; }
+        else if (key == "source") { checkpoint.source = value; }
+        else if (key == "destination") { checkpoint.destination = value; }
+    }
+    fclose(file);
+
+    if (magic != checkpointMagic)
+    {
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshSaveCheckpoint(const string& path, const SshTransferCheckpoint& checkpoint)
+{
+    string temporary = path + ".tmp";
+    ostringstream text;
+    error_code ec;
+    int fd;
+
+    // Paths with a newline can't be stored, their transfers aren't resumable
+    if (checkpoint.source.find('\n') != string::npos ||
+        checkpoint.destination.find('\n') != string::npos)
+    {
+        return SSH_ERROR;
+    }
+
+    if (fs::create_directories(fs::path(path).parent_path(), ec))
+    {
+        chmod(fs::path(path).parent_path().c_str(), 0700);
+    }
+
+    text << checkpointMagic << "\n"
+         << "push " << (checkpoint.push ? 1 : 0) << "\n"
+         << "size " << checkpoint.size << "\n"
+         << "mtime " << checkpoint.mtime << "\n"
+         << "offset " << checkpoint.offset << "\n"
+         << "sha256 " << checkpoint.prefixHash << "\n"
+         << "source " << checkpoint.source << "\n"
+         << "destination " << checkpoint.destination << "\n";
+
+    fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        SSH_LOG(Warning, "Can't save checkpoint %s: %s", path.c_str(), strerror(errno));
+        return SSH_ERROR;
+    }
+
+    string data = text.str();
+    if (SshWriteAll(fd, data.data(), data.size()) != SSH_OK || fsync(fd) < 0)
+    {
+        SSH_LOG(Warning, "Can't save checkpoint %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        unlink(temporary.c_str());
+        return SSH_ERROR;
+    }
+    close(fd);
+
+    if (rename(temporary.c_str(), path.c_str()) < 0)
+    {
+        SSH_LOG(Warning, "Can't save checkpoint %s: %s", path.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+void SshRemoveCheckpoint(const string& path)
+{
+    unlink(path.c_str());
+}
@@ -0,0 +1,33 @@
+#ifndef __SSH_CHECKPOINT_H__
+#define __SSH_CHECKPOINT_H__
+
+#include "SshClient.h"
+
+// Progress of one file transfer, saved locally while it runs so that a later
+// attempt can continue where it stopped instead of starting over
+struct SshTransferCheckpoint
+{
+    bool push{false};
+    string source;
+    string destination;
+    // Size and modification time of the source when the transfer started,
+    // a source that changed since then is sent again from the start
+    uint64_t size{0};
+    int64_t mtime{0};
+    // Bytes known to be at the destination, and their SHA-256
+    uint64_t offset{0};
+    string prefixHash;
+};
+
+// $XDG_STATE_HOME/cppssh-checkpoints, or ~/.local/state/cppssh-checkpoints
+string SshDefaultCheckpointDirectory();
+// File in directory that holds the checkpoint of a transfer. scope tells
+// apart the same paths on different hosts.
+string SshCheckpointPath(const string& directory, const string& scope, bool push,
+                         const string& source, const string& destination);
+int SshLoadCheckpoint(const string& path, SshTransferCheckpoint& checkpoint);
+// Replaces the file atomically, so an interrupted save keeps the last one
+int SshSaveCheckpoint(const string& path, const SshTransferCheckpoint& checkpoint);
+void SshRemoveCheckpoint(const string& path);
+
+#endif // __SSH_CHECKPOINT_H__
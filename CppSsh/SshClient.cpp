@@ -1,17 +1,133 @@
 
 #include "SshClient.h"
+#include "SshCaptureBuffer.h"
+#include "SshControlMaster.h"
+#include "SshFilePipeline.h"
+#include "SshHash.h"
+#include "SshSftpTransfer.h"
+#include "SshShell.h"
+#include "SshSync.h"
+#include "SshTarTransfer.h"
+
+#include <libssh/callbacks.h>
 
 #include <sys/stat.h>
 #include <filesystem>
 #include <fcntl.h>
-#include <fstream>
 #include <iostream>
+#include <poll.h>
 
 namespace fs = std::filesystem;
 
+// Upper bound for how long a reader waits on the socket before draining again
+static constexpr int channelPollTimeoutMs = 10;
+// Buffer and offset alignment accepted by O_DIRECT on common filesystems
+static constexpr size_t directIoAlignment = 4096;
+// Connections a batch opens to the control master at the same time
+static constexpr size_t controlBatchWorkers = 16;
+// How long a keepalive waits for its reply without a timeout of the client
+static constexpr chrono::milliseconds keepaliveReplyTimeout{10000};
+
+string SshShellQuote(const string& value)
+{
+    string quoted = "'";
+
+    for (char c : value)
+    {
+        if (c == '\'')
+        {
+            quoted += "'\\''";
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    quoted += "'";
+
+    return quoted;
+}
+
+int SshWriteAll(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t nbytes = write(fd, buffer, length);
+        if (nbytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return SSH_ERROR;
+        }
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    return SSH_OK;
+}
+
+int SshApplyConnectOptions(ssh_session session, const SshConnectOptions& options)
+{
+    if (ssh_options_set(session, SSH_OPTIONS_PORT, &options.port) < 0)
+    {
+        return SSH_ERROR;
+    }
+
+    if (!options.identityFile.empty() &&
+        ssh_options_set(session, SSH_OPTIONS_ADD_IDENTITY, options.identityFile.c_str()) < 0)
+    {
+        return SSH_ERROR;
+    }
+
+    if (!options.knownHostsFile.empty() &&
+        ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, options.knownHostsFile.c_str()) < 0)
+    {
+        return SSH_ERROR;
+    }
+
+    return SshApplyCryptoOptions(session, options.crypto);
+}
+
+// Notes when the server banner arrived, the end of the Connect phase
+static void onConnectStatus(void *userdata, float status)
+{
+    chrono::steady_clock::time_point *bannerTime =
+        (chrono::steady_clock::time_point *) userdata;
+
+    if (status >= 0.4f && *bannerTime == chrono::steady_clock::time_point())
+    {
+        *bannerTime = chrono::steady_clock::now();
+    }
+}
+
+// Set once ssh_connect returns, the connect callbacks live on its stack
+static ssh_callbacks noCallbacks()
+{
+    static struct ssh_callbacks_struct callbacks = []()
+    {
+        struct ssh_callbacks_struct empty = {};
+
+        ssh_callbacks_init(&empty);
+        return empty;
+    }();
+
+    return &callbacks;
+}
+
 static void error(ssh_session session)
 {
-    printf("Authentication failed: %s\n", ssh_get_error(session));
+    SSH_LOG(Error, "Authentication failed: %s", ssh_get_error(session));
+}
+
+// Ends a session that _Connect gives up on, on every path
+static ssh_session dropSession(ssh_session session)
+{
+    ssh_disconnect(session);
+    ssh_free(session);
+
+    return NULL;
 }
 
 vector<string> split(const string& str, const string& delimiter)
@@ -33,368 +149,1586 @@ vector<string> split(const string& str, const string& delimiter)
 
 int SshClient::Connect()
 {
-    _session = _Connect(_ip.c_str(), _user.c_str(), _password.c_str(), 0);
-    if (_session == NULL)
-    {
-        return SSH_ERROR;
-    }
+    int res = SSH_OK;
 
-    _channel = ssh_channel_new(_session);
-    if (_channel == NULL)
+    // A reconnect starts from nothing, the shell and SFTP channel of the
+    // previous session would otherwise outlive it
+    Close();
+
+    if (!_controlPath.empty())
     {
-        ssh_disconnect(_session);
+        bool reachable;
 
-        return SSH_ERROR;
+        res = _ControlClient().Connect(&reachable);
+        if (reachable)
+        {
+            _controlled = res == SSH_OK;
+            return res;
+        }
+        res = SSH_OK;
     }
 
-    int res = ssh_channel_open_session(_channel);
-    if (res < 0)
+    // Whatever an earlier session moved is accounted before the counters
+    // start over
+    _FlushCounters();
+
     {
-        ssh_channel_close(_channel);
-        ssh_disconnect(_session);
+        lock_guard<mutex> lock(_sessionMutex);
 
-        return SSH_ERROR;
+        _session = _Connect(_ip.c_str(), _user.c_str(), _password.c_str(), 0);
+        if (_session == NULL)
+        {
+            res = SSH_ERROR;
+        }
     }
 
-    return SSH_OK;
+    _FlushCounters();
+
+    return res;
 };
 
-int SshClient::Push(string source, string destination)
+void SshClient::SetMetrics(SshMetrics* metrics)
 {
-    return _CopyToRemote(_session, source, destination);
+    _metrics.store(metrics, memory_order_relaxed);
 }
 
-int SshClient::Pull(string source, string destination)
+SshSessionCounters SshClient::GetSessionCounters()
 {
-    return _CopyFromRemote(_session, source, destination);
+    lock_guard<mutex> lock(_sessionMutex);
+    SshSessionCounters counters;
+
+    counters.bytesIn = _counters.in_bytes;
+    counters.bytesOut = _counters.out_bytes;
+    counters.packetsIn = _counters.in_packets;
+    counters.packetsOut = _counters.out_packets;
+
+    return counters;
 }
 
-int SshClient::_CreateRemoteFilesTree(ssh_session& session, ssh_scp& scp,
-                                      string source, string destination)
+void SshClient::_FlushCounters()
 {
-    int res = SSH_OK;
+    SshMetrics* metrics = _metrics.load(memory_order_relaxed);
+
+    if (metrics == nullptr)
+    {
+        return;
+    }
+
+    lock_guard<mutex> lock(_sessionMutex);
+
+    metrics->AddBytes(_counters.in_bytes - _reportedIn, _counters.out_bytes - _reportedOut);
+    _reportedIn = _counters.in_bytes;
+    _reportedOut = _counters.out_bytes;
+}
+
+void SshClient::SetConnectOptions(const SshConnectOptions& options)
+{
+    lock_guard<mutex> lock(_sessionMutex);
+
+    _connectOptions = options;
+}
+
+void SshClient::SetControlPath(const string& path)
+{
+    lock_guard<mutex> lock(_sessionMutex);
+
+    _controlPath = path;
+}
+
+SshControlClient SshClient::_ControlClient()
+{
+    lock_guard<mutex> lock(_sessionMutex);
+
+    return SshControlClient(_controlPath,
+                            SshControlTarget{_ip, _user, _password, _autoverifyhost,
+                                             _connectOptions});
+}
+
+SshClient::~SshClient()
+{
+    Close();
+}
+
+int SshClient::Push(const string& source, const string& destination)
+{
+    return Push(source, destination, SshTransferProtocol::Scp);
+}
+
+int SshClient::Pull(const string& source, const string& destination)
+{
+    return Pull(source, destination, SshTransferProtocol::Scp);
+}
+
+int SshClient::Push(const string& source, const string& destination,
+                    SshTransferProtocol protocol)
+{
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Push, _ip);
+    bool verify;
+    int res;
+
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        verify = _transferOptions.verify;
+    }
+
+    if (_controlled)
+    {
+        SshTransferOptions options;
+        SshTransferStats stats;
+
+        {
+            lock_guard<mutex> lock(_sessionMutex);
+            options = _transferOptions;
+        }
+
+        res = _ControlClient().Transfer(true, source, destination, protocol, options, &stats);
+
+        lock_guard<mutex> lock(_sessionMutex);
+        _transferStats = stats;
+    }
+    else if (protocol == SshTransferProtocol::Sftp)
+    {
+        res = _SftpTransfer(source, destination, true);
+    }
+    else if (protocol == SshTransferProtocol::Tar)
+    {
+        res = _TarTransfer(source, destination, true);
+    }
+    else
+    {
+        lock_guard<mutex> transfer(_transferMutex);
+        lock_guard<mutex> lock(_sessionMutex);
+        SshScheduledTransfer scheduled(_transferOptions.priority);
+        _transferDeadline = _Deadline();
+        if (_transferOptions.resume)
+        {
+            SSH_LOG(Warning, "scp can't resume, sending all of %s", source.c_str());
+        }
+        res = _CopyToRemote(_session, source, destination);
+    }
+
+    res = _Verify(res, protocol, verify);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
+
+    return res;
+}
+
+int SshClient::Pull(const string& source, const string& destination,
+                    SshTransferProtocol protocol)
+{
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Pull, _ip);
+    bool verify;
+    int res;
+
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        verify = _transferOptions.verify;
+    }
 
-    if (fs::is_directory(source) == false)
+    if (_controlled)
     {
-        printf("INFO - Uploading file %s, permissions 0\n",source.c_str());
-        ifstream input(source, std::ios::binary);
-        constexpr size_t bufferSize = 1024 * 1024;
-        unique_ptr<char[]> buffer(new char[bufferSize]);
+        SshTransferOptions options;
+        SshTransferStats stats;
+
+        {
+            lock_guard<mutex> lock(_sessionMutex);
+            options = _transferOptions;
+        }
+
+        res = _ControlClient().Transfer(false, source, destination, protocol, options, &stats);
 
-        while (!input.eof())
+        lock_guard<mutex> lock(_sessionMutex);
+        _transferStats = stats;
+    }
+    else if (protocol == SshTransferProtocol::Sftp)
+    {
+        res = _SftpTransfer(source, destination, false);
+    }
+    else if (protocol == SshTransferProtocol::Tar)
+    {
+        res = _TarTransfer(source, destination, false);
+    }
+    else
+    {
+        lock_guard<mutex> transfer(_transferMutex);
+        lock_guard<mutex> lock(_sessionMutex);
+        SshScheduledTransfer scheduled(_transferOptions.priority);
+        _transferDeadline = _Deadline();
+        if (_transferOptions.resume)
         {
-            input.read(buffer.get(), bufferSize);
-            _CreateRemoteFile(session, scp, destination, buffer.get(),
-                              strlen(buffer.get()));
+            SSH_LOG(Warning, "scp can't resume, receiving all of %s", source.c_str());
         }
+        res = _CopyFromRemote(_session, source, destination);
+    }
+
+    res = _Verify(res, protocol, verify);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
+
+    return res;
+}
+
+int SshClient::_SftpTransfer(const string& source, const string& destination, bool push)
+{
+    lock_guard<mutex> transfer(_transferMutex);
+    lock_guard<mutex> lock(_sessionMutex);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int res;
+
+    if (_Sftp() == NULL)
+    {
+        return SSH_ERROR;
+    }
+
+    SshScheduledTransfer scheduled(_transferOptions.priority);
+    _transferStats = SshTransferStats();
+    _sftp->SetVerifier(_transferOptions.verify ? &_verifier : NULL);
+    _sftp->SetDeadline(_Deadline());
+
+    if (push)
+    {
+        res = _sftp->Push(source, destination, _transferOptions, _transferStats);
+    }
+    else
+    {
+        res = _sftp->Pull(source, destination, _transferOptions, _transferStats);
+    }
+    _sftp->SetVerifier(NULL);
+    _sftp->SetDeadline(chrono::steady_clock::time_point::max());
+
+    _transferStats.elapsed = chrono::steady_clock::now() - start;
+    SSH_LOG(Info, "%s %llu bytes in %llu files, %.1f MB/s",
+            push ? "Uploaded" : "Downloaded",
+            (unsigned long long) _transferStats.bytes,
+            (unsigned long long) _transferStats.files,
+            _transferStats.BytesPerSecond() / (1024 * 1024));
+
+    return res;
+}
+
+int SshClient::_TarTransfer(const string& source, const string& destination, bool push)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SshTransferStats stats;
+    SshTransferOptions options;
+    SshTarTransfer tar(*this);
+    int res;
+
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        options = _transferOptions;
+    }
+
+    if (options.resume)
+    {
+        SSH_LOG(Warning, "Tar mode can't resume, copying all of %s", source.c_str());
+    }
+
+    SshScheduledTransfer scheduled(options.priority);
+
+    // The stream runs through Execute, which takes the session lock for each
+    // channel operation on its own
+    if (push)
+    {
+        res = tar.Push(source, destination, options, stats);
+    }
+    else
+    {
+        res = tar.Pull(source, destination, options, stats);
+    }
+
+    stats.elapsed = chrono::steady_clock::now() - start;
+    SSH_LOG(Info, "%s %llu archive bytes, %.1f MB/s",
+            push ? "Uploaded" : "Downloaded",
+            (unsigned long long) stats.bytes,
+            stats.BytesPerSecond() / (1024 * 1024));
+
+    lock_guard<mutex> lock(_sessionMutex);
+    _transferStats = stats;
 
-        return 0;
+    return res;
+}
+
+SshSftpTransfer* SshClient::_Sftp()
+{
+    if (_session == NULL)
+    {
+        return NULL;
+    }
+
+    // One SFTP channel per client, opened on first use and kept for the
+    // transfers that follow
+    if (_sftp == nullptr)
+    {
+        _sftp = make_shared<SshSftpTransfer>(_session, _ip, _user + "@" + _ip + ":" +
+                                             to_string(_connectOptions.port),
+                                             &_sessionMutex);
+    }
+
+    if (_sftp->Init() != SSH_OK)
+    {
+        return NULL;
+    }
+
+    return _sftp.get();
+}
+
+// Called without the session lock, the remote hashes go through Execute
+int SshClient::_Verify(int res, SshTransferProtocol protocol, bool verify)
+{
+    if (_controlled || verify == false)
+    {
+        return res;
     }
 
-    printf("INFO - Uploading directory %s, permissions 0\n", source.c_str());
-    fs::current_path(source);
+    if (protocol == SshTransferProtocol::Tar)
+    {
+        SSH_LOG(Warning, "Tar transfers aren't verified");
+        return res;
+    }
 
-    res = _CreateRemoteFolder(session, scp, destination);
     if (res != SSH_OK)
     {
-        fprintf(stderr, "Error to create folder: %s\n",
-                ssh_get_error(session));
-        ssh_scp_free(scp);
+        _verifier.Clear();
+        return res;
+    }
+
+    return _verifier.Check(*this);
+}
+
+int SshClient::_CreateRemoteFilesTree(ssh_session& session, ssh_scp& scp,
+                                      const string& source, const string& remote)
+{
+    error_code ec;
+    int res = SSH_OK;
+    int mode;
+
+    if (fs::is_directory(source, ec) == false)
+    {
+        return _CreateRemoteFile(session, scp, source, remote);
+    }
+
+    mode = (int) fs::status(source, ec).permissions() & 07777;
+    SSH_LOG(Debug, "Uploading directory %s, permissions 0%o", source.c_str(), mode);
 
+    res = _CreateRemoteFolder(session, scp, fs::path(remote).filename().string(), mode);
+    if (res != SSH_OK)
+    {
         return res;
     }
 
-    try
+    for (fs::directory_iterator entry(source, ec), end; entry != end && !ec;
+         entry.increment(ec))
+    {
+        res = _CreateRemoteFilesTree(session, scp, entry->path().string(),
+                                     remote + "/" + entry->path().filename().string());
+        if (res != SSH_OK)
+        {
+            return res;
+        }
+    }
+
+    if (ec)
+    {
+        SSH_LOG(Error, "Error reading directory %s: %s", source.c_str(),
+                ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    return ssh_scp_leave_directory(scp);
+}
+
+int SshClient::_CopyToRemote(ssh_session& session, const string& source,
+                             const string& destination)
+{
+    fs::path remote(destination);
+    string location = ".";
+    string name;
+    ssh_scp scp;
+    int res;
+
+    // scp places everything inside its location, so open it on the parent
+    // and create the last component under the requested name
+    if (remote.has_filename())
     {
-        for (fs::directory_iterator s("."), end; s != end; ++s)
+        name = remote.filename().string();
+        if (remote.has_parent_path())
         {
-            _CreateRemoteFilesTree(session, scp, s->path().filename(),
-                                   destination + "/" + s->path().filename().c_str());
+            location = remote.parent_path().string();
         }
     }
-    catch(const std::exception& e)
+    else
+    {
+        name = fs::path(source).filename().string();
+        location = destination;
+    }
+
+    scp = ssh_scp_new(session, SSH_SCP_WRITE | SSH_SCP_RECURSIVE, location.c_str());
+    if (scp == NULL)
+    {
+        SSH_LOG(Error, "Error allocating scp session: %s",
+                ssh_get_error(session));
+        return SSH_ERROR;
+    }
+
+    res = ssh_scp_init(scp);
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Error initializing scp session: %s",
+                ssh_get_error(session));
+        ssh_scp_free(scp);
+        return res;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    _transferStats = SshTransferStats();
+
+    res = _CreateRemoteFilesTree(session, scp, source, location + "/" + name);
+
+    _transferStats.elapsed = chrono::steady_clock::now() - start;
+    SSH_LOG(Info, "Uploaded %llu bytes in %llu files, %.1f MB/s",
+            (unsigned long long) _transferStats.bytes,
+            (unsigned long long) _transferStats.files,
+            _transferStats.BytesPerSecond() / (1024 * 1024));
+
+    ssh_scp_close(scp);
+    ssh_scp_free(scp);
+
+    return res;
+}
+
+int SshClient::_CopyFromRemote(ssh_session& session, const string& source,
+                               const string& destination)
+{
+    ssh_scp scp;
+    int res;
+
+    scp = ssh_scp_new(session, SSH_SCP_READ | SSH_SCP_RECURSIVE, source.c_str());
+    if (scp == NULL)
+    {
+        SSH_LOG(Error, "Error allocating scp session: %s",
+                ssh_get_error(session));
+        return SSH_ERROR;
+    }
+
+    res = ssh_scp_init(scp);
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Error initializing scp session: %s",
+                ssh_get_error(session));
+        ssh_scp_free(scp);
+        return res;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    _transferStats = SshTransferStats();
+
+    res = _CreateLocalFilesTree(session, scp, source, destination);
+
+    _transferStats.elapsed = chrono::steady_clock::now() - start;
+    SSH_LOG(Info, "Downloaded %llu bytes in %llu files, %.1f MB/s",
+            (unsigned long long) _transferStats.bytes,
+            (unsigned long long) _transferStats.files,
+            _transferStats.BytesPerSecond() / (1024 * 1024));
+
+    ssh_scp_close(scp);
+    ssh_scp_free(scp);
+
+    return res;
+}
+
+int SshClient::_CreateLocalFile(ssh_session& session, ssh_scp& scp, const string& path,
+                                const string& remote, uint64_t size, int mode)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    bool direct = _transferOptions.directIo;
+    bool verify = _transferOptions.verify;
+    uint64_t remaining = size;
+    uint32_t crc = 0;
+    int fd;
+    int res = SSH_OK;
+
+    fd = open(path.c_str(), flags | (direct ? O_DIRECT : 0), mode);
+    if (fd < 0 && direct)
+    {
+        // Not every filesystem supports O_DIRECT, fall back to buffered writes
+        fd = open(path.c_str(), flags, mode);
+    }
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Can't create local file %s: %s", path.c_str(),
+                strerror(errno));
+        ssh_scp_deny_request(scp, strerror(errno));
+        return SSH_ERROR;
+    }
+
+    if (_transferOptions.preallocate && size > 0)
+    {
+        posix_fallocate(fd, 0, size);
+    }
+
+    ssh_scp_accept_request(scp);
+
+    {
+        // Filled chunks are written behind the reads of the next ones
+        SshFileWriter writer(fd, 0, size, _transferOptions.bufferSize,
+                             _transferOptions.pipelineDepth, _transferOptions.dropPageCache);
+        SshFileChunk chunk;
+
+        while (res == SSH_OK && remaining > 0)
+        {
+            size_t filled = 0;
+
+            if (writer.Next(chunk) == false)
+            {
+                SSH_LOG(Error, "Can't write local file %s: %s", path.c_str(),
+                        strerror(writer.Error()));
+                res = SSH_ERROR;
+                break;
+            }
+
+            chunk.length = min<uint64_t>(remaining, chunk.length);
+            while (filled < chunk.length)
+            {
+                if (chrono::steady_clock::now() > _transferDeadline)
+                {
+                    SSH_LOG(Error, "Timed out receiving %s", remote.c_str());
+                    res = SSH_ERROR;
+                    break;
+                }
+
+                int nbytes = ssh_scp_read(scp, chunk.data + filled, chunk.length - filled);
+                // 0 means the file ended early or the channel closed, asking
+                // again would only get 0 again
+                if (nbytes <= 0)
+                {
+                    SSH_LOG(Error, "Error receiving file data: %s",
+                            nbytes == 0 ? "file ended early" : ssh_get_error(session));
+                    res = SSH_ERROR;
+                    break;
+                }
+                // Charged once it arrived, the next read waits if it overdrew
+                SshTransferScheduler::Shared().Acquire(_ip, _transferOptions.priority, nbytes,
+                                                       &_sessionMutex);
+
+                filled += nbytes;
+                _transferStats.bytes += nbytes;
+            }
+
+            if (res == SSH_OK)
+            {
+                if (verify)
+                {
+                    crc = SshCrc32(chunk.data, filled, crc);
+                }
+                writer.Write(chunk);
+                remaining -= filled;
+            }
+        }
+
+        if (res == SSH_OK && writer.Flush() != SSH_OK)
+        {
+            SSH_LOG(Error, "Can't write local file %s: %s", path.c_str(),
+                    strerror(writer.Error()));
+            res = SSH_ERROR;
+        }
+    }
+
+    if (close(fd) < 0 && res == SSH_OK)
+    {
+        SSH_LOG(Error, "Can't write local file %s: %s", path.c_str(),
+                strerror(errno));
+        res = SSH_ERROR;
+    }
+
+    if (res == SSH_OK)
+    {
+        _transferStats.files++;
+        if (verify)
+        {
+            _verifier.Add(remote, path, crc);
+        }
+    }
+
+    return res;
+}
+
+int SshClient::_CreateLocalFilesTree(ssh_session& session, ssh_scp& scp,
+                                     const string& source, const string& destination)
+{
+    vector<fs::path> directories;
+    // Remote counterpart of each directory entered, for verification
+    vector<string> remoteDirectories;
+    fs::path current(destination);
+    string rename;
+    error_code ec;
+    uint64_t size;
+    int res, mode;
+
+    // Like scp, an existing directory receives the source inside it, any
+    // other destination names the copy itself
+    if (fs::is_directory(current, ec) == false)
+    {
+        rename = current.filename().string();
+        current = current.parent_path();
+        if (current.empty())
+        {
+            current = ".";
+        }
+    }
+
+    do
+    {
+        res = ssh_scp_pull_request(scp);
+
+        switch(res)
+        {
+        case SSH_SCP_REQUEST_NEWFILE:
+        {
+            string filename = ssh_scp_request_get_filename(scp);
+            size = ssh_scp_request_get_size64(scp);
+            mode = ssh_scp_request_get_permissions(scp);
+            SSH_LOG(Debug, "Receiving file %s, size %llu, permissions 0%o",
+                    filename.c_str(), (unsigned long long) size, mode);
+
+            string remote = directories.empty() ? source :
+                            remoteDirectories.back() + "/" + filename;
+
+            if (directories.empty() && !rename.empty())
+            {
+                filename = rename;
+            }
+
+            res = _CreateLocalFile(session, scp, (current / filename).string(), remote,
+                                   size, mode);
+            if (res != SSH_OK)
+            {
+                return res;
+            }
+
+            break;
+        }
+        case SSH_SCP_REQUEST_NEWDIR:
+        {
+            string filename = ssh_scp_request_get_filename(scp);
+            mode = ssh_scp_request_get_permissions(scp);
+
+            SSH_LOG(Debug, "Downloading directory %s, permissions 0%o",
+                    filename.c_str(), mode);
+
+            remoteDirectories.push_back(directories.empty() ? source :
+                                        remoteDirectories.back() + "/" + filename);
+
+            if (directories.empty() && !rename.empty())
+            {
+                filename = rename;
+            }
+
+            directories.push_back(current);
+            current /= filename;
+
+            if (mkdir(current.c_str(), mode) < 0 && errno != EEXIST)
+            {
+                SSH_LOG(Error, "Can't create local directory %s: %s",
+                        current.c_str(), strerror(errno));
+                ssh_scp_deny_request(scp, strerror(errno));
+                return SSH_ERROR;
+            }
+
+            ssh_scp_accept_request(scp);
+
+            break;
+        }
+        case SSH_SCP_REQUEST_WARNING:
+            SSH_LOG(Warning, "%s",ssh_scp_request_get_warning(scp));
+            break;
+
+        case SSH_SCP_REQUEST_ENDDIR:
+            if (!directories.empty())
+            {
+                current = directories.back();
+                directories.pop_back();
+                remoteDirectories.pop_back();
+            }
+
+            break;
+
+        case SSH_SCP_REQUEST_EOF:
+            return SSH_OK;
+
+        case SSH_ERROR:
+            SSH_LOG(Error, "Error: %s", ssh_get_error(session));
+
+            return SSH_ERROR;
+        }
+    } while(1);
+
+    return SSH_OK;
+}
+
+int SshClient::_CreateRemoteFolder(ssh_session& session, ssh_scp& scp, const string& name,
+                                   int mode)
+{
+    int res;
+
+    res = ssh_scp_push_directory(scp, name.c_str(), mode);
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Can't create remote directory: %s",
+                ssh_get_error(session));
+        return res;
+    }
+
+    return SSH_OK;
+}
+
+int SshClient::_CreateRemoteFile(ssh_session& session, ssh_scp& scp,
+                                 const string& source, const string& remote)
+{
+    string name = fs::path(remote).filename().string();
+    bool verify = _transferOptions.verify;
+    struct stat st;
+    uint64_t remaining;
+    uint32_t crc = 0;
+    int fd, res;
+
+    fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        SSH_LOG(Error, "Can't open local file %s: %s", source.c_str(),
+                strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return SSH_ERROR;
+    }
+
+    SSH_LOG(Debug, "Uploading file %s, size %llu, permissions 0%o", source.c_str(),
+            (unsigned long long) st.st_size, st.st_mode & 07777);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // The size goes out once in the header, the content follows as one stream
+    res = ssh_scp_push_file64(scp, name.c_str(), st.st_size, st.st_mode & 07777);
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Can't open remote file: %s",
+                ssh_get_error(session));
+        close(fd);
+        return res;
+    }
+
+    remaining = st.st_size;
+    {
+        // The next chunks are read while this one goes out
+        SshFileReader reader(fd, 0, st.st_size, _transferOptions.bufferSize,
+                             _transferOptions.pipelineDepth);
+        SshFileChunk chunk;
+
+        while (res == SSH_OK && remaining > 0)
+        {
+            if (chrono::steady_clock::now() > _transferDeadline)
+            {
+                SSH_LOG(Error, "Timed out sending %s", source.c_str());
+                res = SSH_ERROR;
+                break;
+            }
+            if (reader.Next(chunk) == false)
+            {
+                // The remote side expects exactly the announced size, a file
+                // that shrinks while being sent can't be completed
+                SSH_LOG(Error, "Can't read local file %s: %s", source.c_str(),
+                        reader.Error() ? strerror(reader.Error()) : "file truncated");
+                res = SSH_ERROR;
+                break;
+            }
+
+            SshTransferScheduler::Shared().Acquire(_ip, _transferOptions.priority,
+                                                   chunk.length, &_sessionMutex);
+            if (verify)
+            {
+                crc = SshCrc32(chunk.data, chunk.length, crc);
+            }
+            res = ssh_scp_write(scp, chunk.data, chunk.length);
+            reader.Done(chunk);
+            if (res != SSH_OK)
+            {
+                SSH_LOG(Error, "Can't write to remote file: %s",
+                        ssh_get_error(session));
+                break;
+            }
+
+            remaining -= chunk.length;
+            _transferStats.bytes += chunk.length;
+        }
+    }
+
+    close(fd);
+    if (res == SSH_OK)
+    {
+        _transferStats.files++;
+        if (verify)
+        {
+            _verifier.Add(remote, source, crc);
+        }
+    }
+
+    return res;
+}
+
+ssh_channel SshClient::_OpenChannel(const string& command)
+{
+    lock_guard<mutex> lock(_sessionMutex);
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::ChannelOpen, _ip);
+    ssh_channel channel;
+    int res;
+
+    if (_session == NULL)
+    {
+        return NULL;
+    }
+
+    channel = ssh_channel_new(_session);
+    if (channel == NULL)
+    {
+        return NULL;
+    }
+
+    res = ssh_channel_open_session(channel);
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Error opening channel: %s", ssh_get_error(_session));
+        ssh_channel_free(channel);
+
+        return NULL;
+    }
+
+    res = ssh_channel_request_exec(channel, command.c_str());
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Error executing command: %s", ssh_get_error(_session));
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+
+        return NULL;
+    }
+
+    timer.Finish(true);
+
+    return channel;
+}
+
+void SshClient::_CloseChannel(ssh_channel channel)
+{
+    lock_guard<mutex> lock(_sessionMutex);
+
+    ssh_channel_send_eof(channel);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+}
+
+int SshClient::_DrainChannel(ssh_channel channel, SshOutputSink& sink)
+{
+    // The sink only ever sees views into the pooled buffer
+    uint32_t size = _readBufferSize;
+    SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(size);
+    int nout, nerr;
+
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        nout = ssh_channel_read_nonblocking(channel, buffer.Data(), size, 0);
+    }
+    if (nout > 0)
+    {
+        sink.OnStdout(string_view(buffer.Data(), nout));
+    }
+
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        nerr = ssh_channel_read_nonblocking(channel, buffer.Data(), size, 1);
+    }
+    if (nerr > 0)
+    {
+        sink.OnStderr(string_view(buffer.Data(), nerr));
+    }
+
+    if ((nout < 0 && nout != SSH_EOF) || (nerr < 0 && nerr != SSH_EOF))
+    {
+        SSH_LOG(Error, "Error reading channel: %s", ssh_get_error(_session));
+        return SSH_ERROR;
+    }
+
+    return max(nout, 0) + max(nerr, 0);
+}
+
+void SshClient::_WaitSession()
+{
+    struct pollfd pfd = {-1, POLLIN, 0};
+
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        if (_session != NULL)
+        {
+            pfd.fd = ssh_get_fd(_session);
+        }
+    }
+
+    // The lock is released while waiting so other threads keep driving their
+    // channels. Data another thread pulled off the socket in the meantime is
+    // picked up by the next drain, at most one poll timeout later
+    poll(&pfd, 1, channelPollTimeoutMs);
+}
+
+int SshClient::_WriteChannel(ssh_channel channel, SshInputSource& input,
+                             SshOutputSink& sink, chrono::steady_clock::time_point deadline)
+{
+    size_t size = _readBufferSize;
+    SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(size);
+    ssize_t length;
+    int res;
+
+    while ((length = input.Read(buffer.Data(), size)) > 0)
+    {
+        const char *data = buffer.Data();
+
+        while (length > 0)
+        {
+            int nbytes = 0;
+
+            if (chrono::steady_clock::now() > deadline)
+            {
+                SSH_LOG(Error, "Command on %s timed out", _ip.c_str());
+                return SSH_ERROR;
+            }
+
+            {
+                lock_guard<mutex> lock(_sessionMutex);
+
+                // Only send what the remote window takes, a blocking write
+                // could wait forever on a command stalled on its own output
+                uint32_t window = ssh_channel_window_size(channel);
+                if (window > 0)
+                {
+                    nbytes = ssh_channel_write(channel, data,
+                                               min<size_t>(window, length));
+                }
+                if (nbytes < 0)
+                {
+                    SSH_LOG(Error, "Error writing channel: %s",
+                            ssh_get_error(_session));
+                    return SSH_ERROR;
+                }
+            }
+            data += nbytes;
+            length -= nbytes;
+
+            res = _DrainChannel(channel, sink);
+            if (res < 0)
+            {
+                return SSH_ERROR;
+            }
+
+            if (nbytes == 0 && res == 0)
+            {
+                {
+                    lock_guard<mutex> lock(_sessionMutex);
+
+                    if (ssh_channel_is_eof(channel) || ssh_channel_is_closed(channel))
+                    {
+                        SSH_LOG(Error, "Error writing channel: remote end closed its input");
+                        return SSH_ERROR;
+                    }
+                }
+
+                _WaitSession();
+            }
+        }
+    }
+
+    if (length < 0)
+    {
+        SSH_LOG(Error, "Error reading command input");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshClient::_ReadChannel(ssh_channel channel, SshOutputSink& sink,
+                            int* exitStatus, chrono::steady_clock::time_point deadline)
+{
+    int res;
+
+    do
+    {
+        if (chrono::steady_clock::now() > deadline)
+        {
+            SSH_LOG(Error, "Command on %s timed out", _ip.c_str());
+            return SSH_ERROR;
+        }
+
+        res = _DrainChannel(channel, sink);
+        if (res < 0)
+        {
+            return SSH_ERROR;
+        }
+        if (res > 0)
+        {
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(_sessionMutex);
+
+            if (ssh_channel_is_eof(channel))
+            {
+                break;
+            }
+        }
+
+        _WaitSession();
+    } while (1);
+
+    if (exitStatus)
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        *exitStatus = ssh_channel_get_exit_status(channel);
+    }
+
+    return SSH_OK;
+}
+
+int SshClient::Execute(const string& command, SshOutputSink& sink, int* exitStatus)
+{
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Execute, _ip);
+    ssh_channel channel;
+    int res;
+
+    if (_controlled)
+    {
+        res = _ControlClient().Execute(command, NULL, sink, exitStatus);
+        timer.Finish(res == SSH_OK);
+
+        return res;
+    }
+
+    chrono::steady_clock::time_point deadline = _Deadline();
+
+    channel = _OpenChannel(command);
+    if (channel == NULL)
+    {
+        return SSH_ERROR;
+    }
+
+    res = _ReadChannel(channel, sink, exitStatus, deadline);
+
+    _CloseChannel(channel);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
+
+    return res;
+}
+
+int SshClient::Execute(const string& command, SshInputSource& input,
+                       SshOutputSink& sink, int* exitStatus)
+{
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Execute, _ip);
+    ssh_channel channel;
+    int res;
+
+    if (_controlled)
+    {
+        res = _ControlClient().Execute(command, &input, sink, exitStatus);
+        timer.Finish(res == SSH_OK);
+
+        return res;
+    }
+
+    chrono::steady_clock::time_point deadline = _Deadline();
+
+    channel = _OpenChannel(command);
+    if (channel == NULL)
+    {
+        return SSH_ERROR;
+    }
+
+    res = _WriteChannel(channel, input, sink, deadline);
+    if (res == SSH_OK)
+    {
+        lock_guard<mutex> lock(_sessionMutex);
+        res = ssh_channel_send_eof(channel);
+    }
+    if (res == SSH_OK)
+    {
+        res = _ReadChannel(channel, sink, exitStatus, deadline);
+    }
+
+    _CloseChannel(channel);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
+
+    return res;
+}
+
+int SshClient::ExecuteBatch(const vector<string>& commands, vector<SshCommandResult>* results)
+{
+    vector<SshCommandResult> discarded;
+    vector<SshCommandResult>& batch = results ? *results : discarded;
+
+    // The control master has no shell to keep, the script takes one channel
+    if (_controlled)
+    {
+        return SshShell::ExecuteScript(*this, commands, batch);
+    }
+
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Execute, _ip);
+    shared_ptr<SshShell> shell = _Shell();
+    int res = SSH_ERROR;
+
+    if (shell)
     {
-        std::cerr << e.what() << '\n';
+        res = shell->ExecuteBatch(commands, batch);
     }
 
-    ssh_scp_leave_directory(scp);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
 
-    fs::current_path("../");
-
-    return 0;
+    return res;
 }
 
-int SshClient::_CopyToRemote(ssh_session& session, string source, string destination)
+shared_ptr<SshShell> SshClient::_Shell()
 {
-    ssh_scp scp;
-    int res;
+    shared_ptr<SshShell> shell;
 
-    scp = ssh_scp_new(session, SSH_SCP_WRITE | SSH_SCP_RECURSIVE, ".");
-    if (scp == NULL)
     {
-        fprintf(stderr, "Error allocating scp session: %s\n",
-                ssh_get_error(session));
-        return SSH_ERROR;
+        lock_guard<mutex> lock(_sessionMutex);
+
+        if (_shell == nullptr)
+        {
+            _shell = make_shared<SshShell>(*this);
+        }
+        shell = _shell;
     }
 
-    res = ssh_scp_init(scp);
-    if (res != SSH_OK)
+    if (shell->Open() != SSH_OK)
     {
-        fprintf(stderr, "Error initializing scp session: %s\n",
-                ssh_get_error(session));
-        ssh_scp_free(scp);
-        return res;
+        return nullptr;
     }
 
-    _CreateRemoteFilesTree(session, scp, source, destination);
+    return shell;
+}
 
-    ssh_scp_close(scp);
-    ssh_scp_free(scp);
+void SshClient::SetReadBufferSize(size_t size)
+{
+    _readBufferSize = min<size_t>(max<size_t>(size, 1), UINT32_MAX);
+}
 
-    return SSH_OK;
+void SshClient::SetTimeout(chrono::milliseconds timeout)
+{
+    _timeoutMs = timeout.count();
 }
 
-int SshClient::_CopyFromRemote(ssh_session& session, string source,
-                               string destination)
+chrono::steady_clock::time_point SshClient::_Deadline()
 {
-    ssh_scp scp;
-    int res;
+    chrono::milliseconds timeout(_timeoutMs.load());
 
-    scp = ssh_scp_new(session, SSH_SCP_READ | SSH_SCP_RECURSIVE, source.c_str());
-    if (scp == NULL)
+    if (timeout <= chrono::milliseconds(0))
     {
-        fprintf(stderr, "Error allocating scp session: %s\n",
-                ssh_get_error(session));
-        return SSH_ERROR;
+        return chrono::steady_clock::time_point::max();
     }
 
-    res = ssh_scp_init(scp);
-    if (res != SSH_OK)
+    return chrono::steady_clock::now() + timeout;
+}
+
+int SshClient::Execute(const string& command, string* received, bool verbosity)
+{
+    class StringSink : public SshOutputSink
     {
-        fprintf(stderr, "Error initializing scp session: %s\n",
-                ssh_get_error(session));
-        ssh_scp_free(scp);
-        return res;
-    }
+    public:
+        StringSink(string* received, bool verbosity):
+                   _received(received), _verbosity(verbosity){};
+        void OnStdout(string_view data) override
+        {
+            if (_verbosity)
+            {
+                cout.write(data.data(), data.size());
+            }
+            if (_received)
+            {
+                (*_received).append(data);
+            }
+        }
+        void OnStderr(string_view data) override
+        {
+            if (_verbosity)
+            {
+                cerr.write(data.data(), data.size());
+            }
+        }
+    private:
+        string* _received;
+        bool _verbosity;
+    };
 
-    _CreateLocalFilesTree(session, scp, destination);
+    StringSink sink(received, verbosity);
+    int res;
 
-    ssh_scp_close(scp);
-    ssh_scp_free(scp);
+    res = Execute(command, sink, NULL);
+    if (verbosity)
+    {
+        cout.flush();
+    }
 
-    return SSH_OK;
-}
+    return res;
+};
 
-int SshClient::_CreateLocalFilesTree(ssh_session& session, ssh_scp& scp,
-                                     string destination)
+int SshClient::Execute(const vector<string>& commands, vector<string>* received)
 {
-    char *filename, *buffer;
-    int res, size, mode;
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Execute, _ip);
+    vector<ssh_channel> channels(commands.size(), NULL);
+    vector<ssh_channel> finished;
+    char buffer[4096];
+    size_t pending = 0;
+    int res = SSH_OK;
 
-    fs::current_path(destination);
+    if (received)
+    {
+        (*received).assign(commands.size(), "");
+    }
 
-    do
+    // Each command gets its own connection to the control master
+    if (_controlled)
     {
-        res = ssh_scp_pull_request(scp);
+        SshControlClient control = _ControlClient();
+        vector<SshCaptureSink> sinks(commands.size());
+        vector<int> results(commands.size(), SSH_OK);
+        size_t workers = min(controlBatchWorkers, commands.size());
+        atomic<size_t> next{0};
+        vector<thread> threads;
+
+        for (size_t i = 0; i < workers; i++)
+        {
+            threads.emplace_back([&]()
+            {
+                size_t index;
 
-        switch(res)
+                while ((index = next++) < commands.size())
+                {
+                    results[index] = control.Execute(commands[index], NULL,
+                                                     sinks[index], NULL);
+                }
+            });
+        }
+        for (thread& worker : threads)
         {
-        case SSH_SCP_REQUEST_NEWFILE:
+            worker.join();
+        }
+        for (size_t i = 0; i < commands.size(); i++)
         {
-            size = ssh_scp_request_get_size(scp);
-            filename = strdup(ssh_scp_request_get_filename(scp));
-            mode = ssh_scp_request_get_permissions(scp);
-            printf("INFO - Receiving file %s, size %d, permissions 0%o\n",
-                   filename, size, mode);
+            if (results[i] != SSH_OK)
+            {
+                res = SSH_ERROR;
+            }
+            if (received)
+            {
+                (*received)[i] = move(sinks[i].output);
+            }
+        }
+        timer.Finish(res == SSH_OK);
+
+        return res;
+    }
 
-            ofstream localfile;
-            localfile.open(destination);
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        channels[i] = _OpenChannel(commands[i]);
+        if (channels[i] == NULL)
+        {
+            res = SSH_ERROR;
+            continue;
+        }
+        pending++;
+    }
 
-            int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC);
-            free(filename);
+    while (pending > 0)
+    {
+        bool progress = false;
 
-            buffer = (char*) malloc(size);
-            if (buffer == NULL)
-            {
-                fprintf(stderr, "Memory allocation error\n");
-                localfile.close();
-                close(fd); // todo decide what is the best approach to save file
-                return SSH_ERROR;
-            }
+        {
+            lock_guard<mutex> lock(_sessionMutex);
 
-            ssh_scp_accept_request(scp);
-            res = ssh_scp_read(scp, buffer, size);
-            if (res == SSH_ERROR)
+            for (size_t i = 0; i < channels.size(); i++)
             {
-                fprintf(stderr, "Error receiving file data: %s\n",
-                        ssh_get_error(session));
-                free(buffer);
-                localfile.close();
-                close(fd); // todo decide what is the best approach to save file
-                return res;
+                if (channels[i] == NULL)
+                {
+                    continue;
+                }
+
+                int nbytes = ssh_channel_read_nonblocking(channels[i], buffer,
+                                                          sizeof(buffer), 0);
+                if (nbytes > 0 && received)
+                {
+                    (*received)[i].append(buffer, nbytes);
+                }
+
+                // stderr isn't returned, but left unread it fills the channel
+                // window and the command stops
+                int nerr = ssh_channel_read_nonblocking(channels[i], buffer,
+                                                        sizeof(buffer), 1);
+                if (nerr < 0 && nerr != SSH_EOF)
+                {
+                    nbytes = nerr;
+                }
+
+                if (nbytes > 0 || nerr > 0)
+                {
+                    progress = true;
+                }
+                else if (nbytes < 0 || ssh_channel_is_eof(channels[i]))
+                {
+                    if (nbytes < 0 && nbytes != SSH_EOF)
+                    {
+                        res = SSH_ERROR;
+                    }
+                    finished.push_back(channels[i]);
+                    channels[i] = NULL;
+                    pending--;
+                    progress = true;
+                }
             }
 
-            localfile << buffer;
-        
-            write(fd, buffer, size);
-            localfile.close();
-            close(fd); // todo decide what is the best approach to save file
-            free(buffer);
+        }
 
-            break;
+        if (progress == false)
+        {
+            _WaitSession();
         }
-        case SSH_SCP_REQUEST_NEWDIR:
-            filename = strdup(ssh_scp_request_get_filename(scp));
-            mode = ssh_scp_request_get_permissions(scp);
 
-            printf("INFO - Downloading directory %s, permissions 0%o\n",filename, mode);
+        for (ssh_channel channel : finished)
+        {
+            _CloseChannel(channel);
+        }
+        finished.clear();
+    }
 
-            fs::create_directory(filename);
-            fs::current_path(filename);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
 
-            free(filename);
-            ssh_scp_accept_request(scp);
+    return res;
+}
 
-            break;
+int SshClient::Execute(const string& command, bool verbosity)
+{ 
+    return Execute(command, NULL, verbosity);
+}
 
-        case SSH_SCP_REQUEST_WARNING:
-            fprintf(stderr, "Warning: %s\n",ssh_scp_request_get_warning(scp));
-            break;
+int SshClient::Execute(const string& command, string* received)
+{
+    return Execute(command, received, false);
+}
 
-        case SSH_SCP_REQUEST_ENDDIR:
-            fs::current_path("..");
+int SshClient::Execute(const string& command, SshCaptureBuffer* received)
+{
+    class BufferSink : public SshOutputSink
+    {
+    public:
+        BufferSink(SshCaptureBuffer* received): _received(received){};
+        void OnStdout(string_view data) override
+        {
+            _received->Append(data);
+        }
+        void OnStderr(string_view) override {}
+    private:
+        SshCaptureBuffer* _received;
+    };
 
-            break;
+    BufferSink sink(received);
+    int res;
 
-        case SSH_SCP_REQUEST_EOF:
-            fprintf(stderr, "Unexpected request: %s\n",
-                    ssh_get_error(session));
+    res = Execute(command, sink, NULL);
+    if (res == SSH_OK && received->Error() != 0)
+    {
+        SSH_LOG(Error, "Can't keep the output of %s: %s", command.c_str(),
+                strerror(received->Error()));
+        res = SSH_ERROR;
+    }
 
-            return SSH_OK;
+    return res;
+}
+    
+double SshTransferStats::BytesPerSecond() const
+{
+    return elapsed.count() > 0 ? bytes / elapsed.count() : 0.0;
+}
 
-        case SSH_ERROR:
-            fprintf(stderr, "Error: %s\n", ssh_get_error(session));
+void SshClient::SetTransferOptions(const SshTransferOptions& options)
+{
+    lock_guard<mutex> lock(_sessionMutex);
 
-            return SSH_ERROR;
-        }
-    } while(1);
+    _transferOptions = options;
+    // Whole multiples of the alignment keep every full buffer valid for O_DIRECT
+    _transferOptions.bufferSize = max<size_t>(_transferOptions.bufferSize, directIoAlignment);
+    _transferOptions.bufferSize += directIoAlignment - 1;
+    _transferOptions.bufferSize -= _transferOptions.bufferSize % directIoAlignment;
+}
 
-    return SSH_OK;
+SshTransferStats SshClient::GetLastTransferStats()
+{
+    lock_guard<mutex> lock(_sessionMutex);
+
+    return _transferStats;
+}
+
+uint64_t SshSyncReport::BytesSaved() const
+{
+    return bytesTotal > bytesSent ? bytesTotal - bytesSent : 0;
 }
 
-int SshClient::_CreateRemoteFolder(ssh_session& session, ssh_scp& scp, string name)
+int SshClient::Sync(const string& source, const string& destination)
 {
+    SshTransferOptions options;
+    SshSyncReport report;
+    SshSync sync(*this);
     int res;
 
-    res = ssh_scp_push_directory(scp, name.c_str(), S_IRWXU);
-    if (res != SSH_OK)
     {
-        fprintf(stderr, "Can't create remote directory: %s\n",
-                ssh_get_error(session));
-        return res;
+        lock_guard<mutex> lock(_sessionMutex);
+        options = _transferOptions;
     }
 
-    return SSH_OK;
+    SshPhaseTimer timer(_metrics.load(memory_order_relaxed), SshPhase::Sync, _ip);
+    res = sync.Sync(source, destination, options, report);
+    timer.Finish(res == SSH_OK);
+    _FlushCounters();
+
+    SSH_LOG(Info, "Synced %llu files (%llu unchanged, %llu patched, %llu copied), "
+            "sent %llu of %llu bytes, about %.1f s saved",
+            (unsigned long long) report.files, (unsigned long long) report.filesUnchanged,
+            (unsigned long long) report.filesDelta, (unsigned long long) report.filesCopied,
+            (unsigned long long) report.bytesSent, (unsigned long long) report.bytesTotal,
+            report.timeSaved.count());
+
+    lock_guard<mutex> lock(_sessionMutex);
+    _syncReport = report;
+
+    return res;
 }
 
-int SshClient::_CreateRemoteFile(ssh_session& session, ssh_scp& scp,
-                                 string destination, const char *buffer,
-                                 size_t length)
+SshSyncReport SshClient::GetLastSyncReport()
 {
-    int res;
+    lock_guard<mutex> lock(_sessionMutex);
 
+    return _syncReport;
+}
 
-    res = ssh_scp_push_file(scp, destination.c_str(), length, S_IRWXU);
-    if (res != SSH_OK)
+void SshClient::Close()
+{
+    // Waits for a transfer that gave up the session lock to finish with it
+    lock_guard<mutex> transfer(_transferMutex);
+    shared_ptr<SshShell> shell;
+
+    _FlushCounters();
+    _controlled = false;
+
+    // Its channel goes before the session does
     {
-        fprintf(stderr, "Can't open remote file: %s\n",
-                ssh_get_error(session));
-        return res;
+        lock_guard<mutex> lock(_sessionMutex);
+        shell.swap(_shell);
     }
-
-    res = ssh_scp_write(scp, buffer, length);
-    if (res != SSH_OK)
+    if (shell)
     {
-        fprintf(stderr, "Can't write to remote file: %s\n",
-                ssh_get_error(session));
-        return res;
+        shell->Close();
     }
 
-  return SSH_OK;
+    lock_guard<mutex> lock(_sessionMutex);
+
+    _sftp.reset();
+
+    if (_session)
+    {
+        ssh_disconnect(_session);
+        ssh_free(_session);
+        _session = NULL;
+    }
 }
 
-int SshClient::Execute(string command, string* received, bool verbosity)
+int SshClient::SendKeepalive()
 {
-    char buffer[256] = {};
-    string receive = "";
-    size_t nbytes;
+    if (_controlled)
+    {
+        bool reachable;
+
+        return _ControlClient().Connect(&reachable);
+    }
+
+    lock_guard<mutex> lock(_sessionMutex);
     int res;
 
-    res = ssh_channel_request_exec(_channel, command.c_str());
-    if (res < 0)
+    if (_session == NULL)
     {
-        ssh_channel_close(_channel);
-        ssh_disconnect(_session);
+        return SSH_ERROR;
+    }
 
+    // Opening a channel needs an answer from the server, unlike an ignore
+    // message, so a connection that silently went away fails here
+    ssh_channel channel = ssh_channel_new(_session);
+    if (channel == NULL)
+    {
         return SSH_ERROR;
     }
 
-    nbytes = ssh_channel_read(_channel, buffer, sizeof(buffer), 0);
-    while (nbytes > 0)
+    chrono::milliseconds timeout(_timeoutMs.load());
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+        (timeout > chrono::milliseconds(0) ? timeout : keepaliveReplyTimeout);
+
+    ssh_set_blocking(_session, 0);
+    while ((res = ssh_channel_open_session(channel)) == SSH_AGAIN)
     {
-        try
-        {
-            string line(buffer, nbytes);
-            if (verbosity == true)
-            {
-                cout << line << endl;
-            }
-            if (received)
-            {
-                (*received).append(line);
-            }
-        }
-        catch (const std::exception& e)
+        auto remaining = chrono::duration_cast<chrono::milliseconds>(
+                             deadline - chrono::steady_clock::now());
+        struct pollfd socket = {ssh_get_fd(_session), POLLIN, 0};
+
+        if (remaining.count() <= 0)
         {
+            res = SSH_ERROR;
             break;
         }
-
-        nbytes = ssh_channel_read(_channel, buffer, sizeof(buffer), 0);
+        poll(&socket, 1, remaining.count());
     }
+    ssh_set_blocking(_session, 1);
 
-    if (nbytes < 0)
+    if (res == SSH_OK)
     {
-        ssh_channel_close(_channel);
-        ssh_channel_free(_channel);
+        ssh_channel_close(channel);
+    }
+    ssh_channel_free(channel);
 
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Warning, "Keepalive to %s got no reply", _ip.c_str());
         return SSH_ERROR;
     }
 
     return SSH_OK;
-};
-
-int SshClient::Execute(string command, bool verbosity)
-{ 
-    return Execute(command, NULL, verbosity);
 }
 
-int SshClient::Execute(string command, string* received)
-{
-    return Execute(command, received, false);
-}
-    
-void SshClient::Close()
+bool SshClient::IsConnected()
 {
-    if (_channel)
+    if (_controlled)
     {
-        ssh_channel_send_eof(_channel);
-        ssh_channel_close(_channel);
-        ssh_channel_free(_channel);
+        return true;
     }
-    if (_session)
+
+    lock_guard<mutex> lock(_sessionMutex);
+
+    if (_session == NULL || ssh_is_connected(_session) == 0)
     {
-        ssh_disconnect(_session);
+        return false;
     }
+
+    return (ssh_get_status(_session) & (SSH_CLOSED | SSH_CLOSED_ERROR)) == 0;
 }
 
 ssh_session SshClient::_Connect(const char *host, const char *user,
@@ -403,47 +1737,107 @@ ssh_session SshClient::_Connect(const char *host, const char *user,
     int auth = 0;
     int res;
 
+    SshMetrics* metrics = _metrics.load(memory_order_relaxed);
+    chrono::steady_clock::time_point bannerTime;
+    struct ssh_callbacks_struct callbacks = {};
+
     _session = ssh_new();
     if (_session == NULL)
     {
         return NULL;
     }
 
+    // Counted on the socket for the whole life of the session
+    _counters = ssh_counter_struct{};
+    _reportedIn = 0;
+    _reportedOut = 0;
+    ssh_set_counters(_session, &_counters, NULL);
+
     if (user != NULL)
     {
         res = ssh_options_set(_session, SSH_OPTIONS_USER, user);
         if (res < 0)
         {
-            ssh_disconnect(_session);
-
-            return NULL;
+            return dropSession(_session);
         }
     }
 
     res = ssh_options_set(_session, SSH_OPTIONS_HOST, host);
     if (res < 0)
     {
-        return NULL;
+        return dropSession(_session);
+    }
+
+    res = SshApplyConnectOptions(_session, _connectOptions);
+    if (res < 0)
+    {
+        return dropSession(_session);
     }
 
     ssh_options_set(_session, SSH_OPTIONS_LOG_VERBOSITY, &verbosity);
 
+    int64_t timeoutMs = _timeoutMs;
+    if (timeoutMs > 0)
+    {
+        long seconds = timeoutMs / 1000;
+        long microseconds = (timeoutMs % 1000) * 1000;
+
+        ssh_options_set(_session, SSH_OPTIONS_TIMEOUT, &seconds);
+        ssh_options_set(_session, SSH_OPTIONS_TIMEOUT_USEC, &microseconds);
+    }
+
+    // libssh reports the server banner as 40% of the connection, which
+    // splits the TCP connect from the key exchange
+    if (metrics)
+    {
+        callbacks.userdata = &bannerTime;
+        callbacks.connect_status_function = onConnectStatus;
+        ssh_callbacks_init(&callbacks);
+        ssh_set_callbacks(_session, &callbacks);
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     res = ssh_connect(_session);
-    if (res != 0)
+
+    if (metrics)
     {
-        printf("Connection failed : %s\n",ssh_get_error(_session));
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        bool banner = bannerTime != chrono::steady_clock::time_point();
 
-        ssh_disconnect(_session);
+        ssh_set_callbacks(_session, noCallbacks());
+        metrics->Record(SshPhase::Connect, (banner ? bannerTime : end) - start,
+                        banner || res == 0, _ip);
+        if (banner)
+        {
+            metrics->Record(SshPhase::KeyExchange, end - bannerTime, res == 0, _ip);
+        }
+    }
 
-        return NULL;
+    if (res != 0)
+    {
+        SSH_LOG(Error, "Connection failed : %s",ssh_get_error(_session));
+
+        return dropSession(_session);
     }
 
+    SshPhaseTimer knownHost(metrics, SshPhase::KnownHost, _ip);
     res = _VerifyKnownhost(_session);
+    knownHost.Finish(res >= 0);
     if (res < 0)
     {
-        ssh_disconnect(_session);
+        return dropSession(_session);
+    }
 
-        return NULL;
+    SshPhaseTimer authentication(metrics, SshPhase::Auth, _ip);
+
+    if (!_connectOptions.identityFile.empty())
+    {
+        res = ssh_userauth_publickey_auto(_session, NULL, NULL);
+        if (res == SSH_AUTH_SUCCESS)
+        {
+            authentication.Finish(true);
+            return _session;
+        }
     }
 
     if (password)
@@ -453,7 +1847,7 @@ ssh_session SshClient::_Connect(const char *host, const char *user,
         {
             error(_session);
 
-            return NULL;
+            return dropSession(_session);
         }
         else if (res == SSH_AUTH_SUCCESS)
         {
@@ -466,6 +1860,7 @@ ssh_session SshClient::_Connect(const char *host, const char *user,
                 free(banner);
             }
 
+            authentication.Finish(true);
             return _session;
         }
     }
@@ -473,20 +1868,19 @@ ssh_session SshClient::_Connect(const char *host, const char *user,
     auth = _AuthenticateConsole(_session);
     if (auth == SSH_AUTH_SUCCESS)
     {
+        authentication.Finish(true);
         return _session;
     }
     else if(auth == SSH_AUTH_DENIED)
     {
-        printf("Authentication failed\n");
+        SSH_LOG(Error, "Authentication failed");
     }
     else
     {
-        printf("Error while authenticating : %s\n", ssh_get_error(_session));
+        SSH_LOG(Error, "Error while authenticating : %s", ssh_get_error(_session));
     }
 
-    ssh_disconnect(_session);
-
-    return NULL;
+    return dropSession(_session);
 }
 
 int SshClient::_AuthenticateKbdint(ssh_session& session, const char *password)
@@ -3,52 +3,297 @@
 #define __SSH_CLIENT_H__
 
 #include <libssh/libssh.h>
+#include "SshCrypto.h"
+#include "SshBufferPool.h"
+#include "SshLog.h"
+#include "SshMetrics.h"
+#include "SshScheduler.h"
+#include "SshVerify.h"
+#include <chrono>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <errno.h>
 #include <iostream>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 using namespace std;
 
+// Quotes a value so a POSIX shell on the remote end reads it as one word
+string SshShellQuote(const string& value);
+// Writes the whole buffer to fd, retrying interrupted and short writes
+int SshWriteAll(int fd, const char *buffer, size_t length);
+
+class SshOutputSink
+{
+public:
+    virtual ~SshOutputSink() = default;
+    virtual void OnStdout(string_view data) = 0;
+    virtual void OnStderr(string_view data) = 0;
+};
+
+// Keeps the whole output of a command in memory
+class SshCaptureSink : public SshOutputSink
+{
+public:
+    void OnStdout(string_view data) override { output.append(data); };
+    void OnStderr(string_view data) override { errors.append(data); };
+
+    string output;
+    string errors;
+};
+
+// Feeds the standard input of a remote command. Read returns the number of
+// bytes placed in buffer, 0 once the input is exhausted or -1 on error.
+class SshInputSource
+{
+public:
+    virtual ~SshInputSource() = default;
+    virtual ssize_t Read(char *buffer, size_t size) = 0;
+    // Called from another thread when the command ended before the input
+    // ran out. A source whose Read can wait on something else makes it
+    // return then, Execute through a control master waits for that.
+    virtual void Cancel() {};
+};
+
+class SshCaptureBuffer;
+class SshSftpTransfer;
+class SshShell;
+class SshControlClient;
+
+struct SshConnectOptions
+{
+    int port{22};
+    // Private key tried before the password, as well as the default keys
+    // and the agent
+    string identityFile;
+    // Known hosts file used instead of ~/.ssh/known_hosts
+    string knownHostsFile;
+    SshCryptoOptions crypto;
+};
+
+// Applies the connect options to a session that isn't connected yet
+int SshApplyConnectOptions(ssh_session session, const SshConnectOptions& options);
+
+enum class SshTransferProtocol
+{
+    Scp,
+    Sftp,
+    Tar
+};
+
+enum class SshCompression
+{
+    None,
+    Gzip,
+    Zstd
+};
+
+struct SshTransferOptions
+{
+    size_t bufferSize{1024 * 1024};
+    // Size of one SFTP read or write request, capped by the server limits
+    size_t sftpRequestSize{256 * 1024};
+    // Number of SFTP requests kept in flight per file
+    size_t sftpQueueDepth{32};
+    // Reserve the full size of pulled files before writing them
+    bool preallocate{true};
+    // Write pulled files with O_DIRECT, bypassing the page cache
+    bool directIo{false};
+    // Flush pulled data as it is written and drop it from the page cache
+    bool dropPageCache{false};
+    // Compression of the stream in Tar mode, both ends need tar support for it
+    SshCompression compression{SshCompression::None};
+    // Block size used by Sync to match changed files, 0 picks one from the size
+    size_t syncBlockSize{0};
+    // Changed files smaller than this are sent whole by Sync
+    uint64_t syncDeltaMinSize{1024 * 1024};
+    // Compare content hashes even when size and modification time match
+    bool syncChecksum{false};
+    // Continue SFTP file transfers that an earlier attempt left unfinished
+    // from the last checkpoint instead of from the start
+    bool resume{false};
+    // Where checkpoints are kept, empty for SshDefaultCheckpointDirectory()
+    string checkpointDirectory;
+    // Bytes transferred between two checkpoints
+    uint64_t checkpointInterval{64 * 1024 * 1024};
+    // Class of the transfer in SshTransferScheduler::Shared()
+    SshTransferPriority priority{SshTransferPriority::Normal};
+    // Chunks of a local file read ahead of the channel on Push and written
+    // behind it on Pull, 0 does the local I/O inline
+    size_t pipelineDepth{4};
+    // After scp and SFTP transfers, compare a CRC-32 of each file taken as
+    // it streamed with one the remote host computes on its copy
+    bool verify{false};
+};
+
+struct SshCommandResult
+{
+    string output;
+    string errors;
+    int exitStatus{-1};
+};
+
+struct SshTransferStats
+{
+    uint64_t bytes{0};
+    uint64_t files{0};
+    chrono::duration<double> elapsed{0};
+
+    double BytesPerSecond() const;
+};
+
+// Traffic of one session as counted on its socket
+struct SshSessionCounters
+{
+    uint64_t bytesIn{0};
+    uint64_t bytesOut{0};
+    uint64_t packetsIn{0};
+    uint64_t packetsOut{0};
+};
+
+struct SshSyncReport
+{
+    uint64_t files{0};
+    uint64_t filesUnchanged{0};
+    uint64_t filesDelta{0};
+    uint64_t filesCopied{0};
+    // Size of the local files against what actually went over the wire
+    uint64_t bytesTotal{0};
+    uint64_t bytesSent{0};
+    chrono::duration<double> elapsed{0};
+    // Estimated from the measured throughput of the bytes that were sent
+    chrono::duration<double> timeSaved{0};
+
+    uint64_t BytesSaved() const;
+};
+
 class SshClient
 {
 public:
     SshClient() = delete;
-    SshClient(string ip, string user, string password):
+    SshClient(const string& ip, const string& user, const string& password):
               _ip(ip), _user(user), _password(password){};
-    SshClient(string ip, string user, string password, bool autoverifyhost):
+    SshClient(const string& ip, const string& user, const string& password,
+              bool autoverifyhost):
               _ip(ip), _user(user), _password(password), _autoverifyhost(autoverifyhost){};
+    ~SshClient();
+    // Closes the session of an earlier Connect first
     int Connect();
-    int Execute(string command, bool verbosity);
-    int Execute(string command, string* received);
-    int Execute(string command, string* received, bool verbosity);
-    int Push(string source, string destination);
-    int Pull(string source, string destination);
+    void SetConnectOptions(const SshConnectOptions& options);
+    // Runs Connect and later operations through the control master listening
+    // on path, connecting directly when there is none
+    void SetControlPath(const string& path);
+    // Records every phase and operation of this client in metrics, which
+    // must outlive it. Null, the default, turns recording off.
+    void SetMetrics(SshMetrics* metrics);
+    SshSessionCounters GetSessionCounters();
+    int Execute(const string& command, bool verbosity);
+    int Execute(const string& command, string* received);
+    int Execute(const string& command, string* received, bool verbosity);
+    // Appends stdout to received, which bounds the memory it takes. Fails
+    // when received couldn't keep it.
+    int Execute(const string& command, SshCaptureBuffer* received);
+    int Execute(const vector<string>& commands, vector<string>* received);
+    int Execute(const string& command, SshOutputSink& sink, int* exitStatus);
+    int Execute(const string& command, SshInputSource& input, SshOutputSink& sink,
+                int* exitStatus);
+    // Runs the commands in order on a remote shell kept open between
+    // batches, paying one round trip for the whole batch
+    int ExecuteBatch(const vector<string>& commands, vector<SshCommandResult>* results);
+    void SetReadBufferSize(size_t size);
+    // Gives up on Execute, ExecuteBatch, Push and Pull calls that run longer
+    // than timeout and, from the next Connect on, when the server doesn't
+    // answer for that long while connecting or transferring. 0, the default,
+    // waits as long as it takes.
+    void SetTimeout(chrono::milliseconds timeout);
+    // Checks that the server still answers with a channel open round trip,
+    // waiting up to the timeout of the client or 10 seconds
+    int SendKeepalive();
+    bool IsConnected();
+    int Push(const string& source, const string& destination);
+    int Pull(const string& source, const string& destination);
+    int Push(const string& source, const string& destination, SshTransferProtocol protocol);
+    int Pull(const string& source, const string& destination, SshTransferProtocol protocol);
+    void SetTransferOptions(const SshTransferOptions& options);
+    SshTransferStats GetLastTransferStats();
+    int Sync(const string& source, const string& destination);
+    SshSyncReport GetLastSyncReport();
     void Close();
 
 private:
+    friend class SshBroadcast;
+    friend class SshDirectoryTransfer;
+    friend class SshShell;
+    friend class SshTarTransfer;
+    friend class SshTunnel;
+
     int _AuthenticateConsole(ssh_session& session);
     int _AuthenticateKbdint(ssh_session& session, const char *password);
     int _VerifyKnownhost(ssh_session& session);
     ssh_session _Connect(const char *hostname, const char *user,
                          const char *password, int verbosity);
-    int _CopyToRemote(ssh_session& session, string source, string destination);
-    int _CopyFromRemote(ssh_session& session, string source, string destination);
-    int _CreateRemoteFolder(ssh_session& session, ssh_scp& scp, string name);
-    int _CreateRemoteFile(ssh_session& session, ssh_scp& scp, string destination,
-                          const char *buffer, size_t length);
+    int _CopyToRemote(ssh_session& session, const string& source, const string& destination);
+    int _CopyFromRemote(ssh_session& session, const string& source, const string& destination);
+    int _CreateRemoteFolder(ssh_session& session, ssh_scp& scp, const string& name,
+                            int mode);
+    int _CreateRemoteFile(ssh_session& session, ssh_scp& scp, const string& source,
+                          const string& remote);
     int _CreateRemoteFilesTree(ssh_session& session, ssh_scp& scp,
-                               string source, string destination);
+                               const string& source, const string& remote);
+    int _CreateLocalFile(ssh_session& session, ssh_scp& scp, const string& path,
+                         const string& remote, uint64_t size, int mode);
     int _CreateLocalFilesTree(ssh_session& session, ssh_scp& scp,
-                              string destination);
+                              const string& source, const string& destination);
+    int _SftpTransfer(const string& source, const string& destination, bool push);
+    int _TarTransfer(const string& source, const string& destination, bool push);
+    int _Verify(int res, SshTransferProtocol protocol, bool verify);
+    SshSftpTransfer* _Sftp();
+    shared_ptr<SshShell> _Shell();
+    ssh_channel _OpenChannel(const string& command);
+    void _CloseChannel(ssh_channel channel);
+    int _DrainChannel(ssh_channel channel, SshOutputSink& sink);
+    void _WaitSession();
+    int _WriteChannel(ssh_channel channel, SshInputSource& input, SshOutputSink& sink,
+                      chrono::steady_clock::time_point deadline =
+                          chrono::steady_clock::time_point::max());
+    int _ReadChannel(ssh_channel channel, SshOutputSink& sink, int* exitStatus,
+                     chrono::steady_clock::time_point deadline =
+                         chrono::steady_clock::time_point::max());
+    chrono::steady_clock::time_point _Deadline();
+    void _FlushCounters();
+    SshControlClient _ControlClient();
 private:
     string _ip, _user, _password;
     bool _autoverifyhost{true};
-    ssh_session _session;
-    ssh_channel _channel;
+    SshConnectOptions _connectOptions;
+    string _controlPath;
+    atomic<bool> _controlled{false};
+    // Set from any thread while others run commands
+    atomic<size_t> _readBufferSize{64 * 1024};
+    atomic<int64_t> _timeoutMs{0};
+    // End of the scp transfer in progress, under _sessionMutex
+    chrono::steady_clock::time_point _transferDeadline{chrono::steady_clock::time_point::max()};
+    SshTransferOptions _transferOptions;
+    SshTransferStats _transferStats;
+    SshSyncReport _syncReport;
+    SshTransferVerifier _verifier;
+    shared_ptr<SshSftpTransfer> _sftp;
+    shared_ptr<SshShell> _shell;
+    ssh_session _session{NULL};
+    mutex _sessionMutex;
+    // Held for a whole scp or SFTP transfer, which gives up _sessionMutex
+    // while the rate limit holds it back. Taken before _sessionMutex.
+    mutex _transferMutex;
+    atomic<SshMetrics*> _metrics{nullptr};
+    struct ssh_counter_struct _counters{};
+    uint64_t _reportedIn{0};
+    uint64_t _reportedOut{0};
 };
 
 #endif // __SSH_CLIENT_H__
\ No newline at end of file
@@ -0,0 +1,876 @@
+#include "SshControlMaster.h"
+
+#include <fcntl.h>
+#include <filesystem>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace fs = std::filesystem;
+
+// Frame: one type byte, a big endian 32 bit length, then the payload, which
+// is a sequence of fields each with its own 32 bit length
+static constexpr char frameConnect = 'C';
+static constexpr char frameExecute = 'E';
+static constexpr char framePush = 'P';
+static constexpr char framePull = 'L';
+static constexpr char frameInput = 'I';
+static constexpr char frameAbort = 'A';
+static constexpr char frameStdout = 'O';
+static constexpr char frameStderr = 'R';
+static constexpr char frameStatus = 'S';
+
+static constexpr uint32_t maxFrameSize = 16 * 1024 * 1024;
+static constexpr size_t inputChunkSize = 64 * 1024;
+// How often the master looks for idle sessions
+static constexpr int idleCheckIntervalMs = 1000;
+
+class FrameWriter
+{
+public:
+    FrameWriter& Add(string_view value)
+    {
+        uint32_t length = value.size();
+        char header[4] = {(char) (length >> 24), (char) (length >> 16),
+                          (char) (length >> 8), (char) length};
+
+        data.append(header, sizeof(header));
+        data.append(value);
+
+        return *this;
+    };
+
+    FrameWriter& Add(int64_t value) { return Add(to_string(value)); };
+
+    string data;
+};
+
+class FrameReader
+{
+public:
+    FrameReader(string_view data): _data(data){};
+
+    bool Next(string& value)
+    {
+        if (_data.size() < 4)
+        {
+            return false;
+        }
+
+        const unsigned char* header = (const unsigned char*) _data.data();
+        uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                          (uint32_t(header[2]) << 8) | header[3];
+
+        if (_data.size() - 4 < length)
+        {
+            return false;
+        }
+        value.assign(_data.substr(4, length));
+        _data.remove_prefix(4 + length);
+
+        return true;
+    };
+
+    bool Next(int64_t& value)
+    {
+        string text;
+
+        if (Next(text) == false || text.empty())
+        {
+            return false;
+        }
+        value = strtoll(text.c_str(), NULL, 10);
+
+        return true;
+    };
+
+private:
+    string_view _data;
+};
+
+// Socket writes don't raise SIGPIPE when the other end went away
+static int sendAll(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t nbytes = send(fd, buffer, length, MSG_NOSIGNAL);
+        if (nbytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return SSH_ERROR;
+        }
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    return SSH_OK;
+}
+
+static int recvAll(int fd, char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t nbytes = recv(fd, buffer, length, 0);
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            return SSH_ERROR;
+        }
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    return SSH_OK;
+}
+
+static int writeFrame(int fd, char type, string_view payload)
+{
+    uint32_t length = payload.size();
+    char header[5] = {type, (char) (length >> 24), (char) (length >> 16),
+                      (char) (length >> 8), (char) length};
+
+    if (sendAll(fd, header, sizeof(header)) != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    return sendAll(fd, payload.data(), payload.size());
+}
+
+static int readFrame(int fd, char* type, string& payload)
+{
+    unsigned char header[5];
+    uint32_t length;
+
+    if (recvAll(fd, (char *) header, sizeof(header)) != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    *type = (char) header[0];
+    length = (uint32_t(header[1]) << 24) | (uint32_t(header[2]) << 16) |
+             (uint32_t(header[3]) << 8) | header[4];
+    if (length > maxFrameSize)
+    {
+        return SSH_ERROR;
+    }
+
+    payload.resize(length);
+
+    return recvAll(fd, &payload[0], length);
+}
+
+static void encodeTarget(FrameWriter& frame, const SshControlTarget& target)
+{
+    const SshCryptoOptions& crypto = target.connect.crypto;
+
+    frame.Add(target.ip).Add(target.user).Add(target.password)
+         .Add((int64_t) target.autoverifyhost)
+         .Add((int64_t) target.connect.port)
+         .Add(target.connect.identityFile).Add(target.connect.knownHostsFile)
+         .Add(crypto.ciphers).Add(crypto.hmacs).Add(crypto.keyExchange)
+         .Add(crypto.hostKeys).Add(crypto.compression)
+         .Add((int64_t) crypto.compressionLevel);
+}
+
+static bool decodeTarget(FrameReader& frame, SshControlTarget& target)
+{
+    SshCryptoOptions& crypto = target.connect.crypto;
+    int64_t autoverifyhost, port, compressionLevel;
+
+    if (!(frame.Next(target.ip) && frame.Next(target.user) && frame.Next(target.password) &&
+          frame.Next(autoverifyhost) && frame.Next(port) &&
+          frame.Next(target.connect.identityFile) && frame.Next(target.connect.knownHostsFile) &&
+          frame.Next(crypto.ciphers) && frame.Next(crypto.hmacs) &&
+          frame.Next(crypto.keyExchange) && frame.Next(crypto.hostKeys) &&
+          frame.Next(crypto.compression) && frame.Next(compressionLevel)))
+    {
+        return false;
+    }
+
+    target.autoverifyhost = autoverifyhost != 0;
+    target.connect.port = (int) port;
+    crypto.compressionLevel = (int) compressionLevel;
+
+    return true;
+}
+
+static void encodeOptions(FrameWriter& frame, const SshTransferOptions& options)
+{
+    frame.Add((int64_t) options.bufferSize).Add((int64_t) options.sftpRequestSize)
+         .Add((int64_t) options.sftpQueueDepth).Add((int64_t) options.preallocate)
+         .Add((int64_t) options.directIo).Add((int64_t) options.dropPageCache)
+         .Add((int64_t) options.compression).Add((int64_t) options.syncBlockSize)
+         .Add((int64_t) options.syncDeltaMinSize).Add((int64_t) options.syncChecksum)
+         .Add((int64_t) options.resume).Add((int64_t) options.checkpointInterval)
+         .Add((int64_t) options.priority).Add((int64_t) options.pipelineDepth)
+         .Add((int64_t) options.verify).Add(options.checkpointDirectory);
+}
+
+static bool decodeOptions(FrameReader& frame, SshTransferOptions& options)
+{
+    int64_t values[15];
+
+    for (int64_t& value : values)
+    {
+        if (frame.Next(value) == false)
+        {
+            return false;
+        }
+    }
+
+    options.bufferSize = values[0];
+    options.sftpRequestSize = values[1];
+    options.sftpQueueDepth = values[2];
+    options.preallocate = values[3] != 0;
+    options.directIo = values[4] != 0;
+    options.dropPageCache = values[5] != 0;
+    options.compression = (SshCompression) values[6];
+    options.syncBlockSize = values[7];
+    options.syncDeltaMinSize = values[8];
+    options.syncChecksum = values[9] != 0;
+    options.resume = values[10] != 0;
+    options.checkpointInterval = values[11];
+    options.priority = (SshTransferPriority) values[12];
+    options.pipelineDepth = values[13];
+    options.verify = values[14] != 0;
+
+    return frame.Next(options.checkpointDirectory);
+}
+
+static string encodeStatus(int res, int exitStatus, const SshTransferStats& stats)
+{
+    FrameWriter frame;
+
+    frame.Add((int64_t) res).Add((int64_t) exitStatus)
+         .Add((int64_t) stats.bytes).Add((int64_t) stats.files)
+         .Add((int64_t) chrono::duration_cast<chrono::nanoseconds>(stats.elapsed).count());
+
+    return frame.data;
+}
+
+// Reads a status frame, passing output frames that come before it to sink
+static int readStatus(int fd, SshOutputSink* sink, int* exitStatus, SshTransferStats* stats)
+{
+    string payload;
+    char type;
+
+    while (readFrame(fd, &type, payload) == SSH_OK)
+    {
+        if (type == frameStdout && sink)
+        {
+            sink->OnStdout(payload);
+        }
+        else if (type == frameStderr && sink)
+        {
+            sink->OnStderr(payload);
+        }
+        else if (type == frameStatus)
+        {
+            FrameReader frame(payload);
+            int64_t res, status, bytes, files, elapsed;
+
+            if (!(frame.Next(res) && frame.Next(status) && frame.Next(bytes) &&
+                  frame.Next(files) && frame.Next(elapsed)))
+            {
+                break;
+            }
+            if (exitStatus)
+            {
+                *exitStatus = (int) status;
+            }
+            if (stats)
+            {
+                stats->bytes = bytes;
+                stats->files = files;
+                stats->elapsed = chrono::nanoseconds(elapsed);
+            }
+
+            return (int) res;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    SSH_LOG(Error, "Control master connection lost");
+
+    return SSH_ERROR;
+}
+
+string SshDefaultControlPath()
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime && runtime[0] == '/')
+    {
+        return string(runtime) + "/cppssh-control";
+    }
+
+    return "/tmp/cppssh-control-" + to_string(getuid());
+}
+
+int SshControlClient::_Open()
+{
+    struct sockaddr_un address = {};
+    int fd;
+
+    if (_path.size() >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, _path.c_str(), _path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+    {
+        int error = errno;
+
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    // Credentials only go to a master run by the same user
+    struct ucred peer = {};
+    socklen_t length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 || peer.uid != getuid())
+    {
+        SSH_LOG(Warning, "Ignoring %s, it belongs to uid %d", _path.c_str(), (int) peer.uid);
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+
+    return fd;
+}
+
+int SshControlClient::Connect(bool* reachable)
+{
+    FrameWriter request;
+    int fd;
+    int res;
+
+    fd = _Open();
+    *reachable = fd >= 0;
+    if (fd < 0)
+    {
+        SSH_LOG(Debug, "No control master at %s: %s", _path.c_str(), strerror(errno));
+        return SSH_ERROR;
+    }
+
+    encodeTarget(request, _target);
+    res = writeFrame(fd, frameConnect, request.data);
+    if (res == SSH_OK)
+    {
+        res = readStatus(fd, NULL, NULL, NULL);
+    }
+    close(fd);
+
+    return res;
+}
+
+int SshControlClient::Execute(const string& command, SshInputSource* input,
+                              SshOutputSink& sink, int* exitStatus)
+{
+    FrameWriter request;
+    thread writer;
+    atomic<bool> stopped{false};
+    atomic<bool> finished{false};
+    int fd;
+    int res;
+
+    fd = _Open();
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Can't reach the control master at %s: %s", _path.c_str(),
+                strerror(errno));
+        return SSH_ERROR;
+    }
+
+    encodeTarget(request, _target);
+    request.Add(command).Add((int64_t) (input != NULL));
+    if (writeFrame(fd, frameExecute, request.data) != SSH_OK)
+    {
+        close(fd);
+        return SSH_ERROR;
+    }
+
+    // Input goes out from its own thread, so output keeps being read while
+    // the master waits for room in the remote window
+    if (input)
+    {
+        writer = thread([fd, input, &stopped, &finished]()
+        {
+            SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(inputChunkSize);
+
+            // Once the command ended the input isn't read any further
+            while (stopped == false)
+            {
+                ssize_t length = input->Read(buffer.Data(), inputChunkSize);
+
+                if (length < 0)
+                {
+                    writeFrame(fd, frameAbort, string_view());
+                    break;
+                }
+                if (writeFrame(fd, frameInput, string_view(buffer.Data(), length)) != SSH_OK ||
+                    length == 0)
+                {
+                    break;
+                }
+            }
+            finished = true;
+        });
+    }
+
+    res = readStatus(fd, &sink, exitStatus, NULL);
+
+    // A writer still waiting in Read is told to give up, the input stays the
+    // caller's and isn't touched after this returns
+    stopped = true;
+    shutdown(fd, SHUT_RDWR);
+    if (writer.joinable())
+    {
+        if (finished == false)
+        {
+            input->Cancel();
+        }
+        writer.join();
+    }
+    close(fd);
+
+    return res;
+}
+
+int SshControlClient::Transfer(bool push, const string& source, const string& destination,
+                               SshTransferProtocol protocol, const SshTransferOptions& options,
+                               SshTransferStats* stats)
+{
+    FrameWriter request;
+    error_code ec;
+    int fd;
+    int res;
+
+    fd = _Open();
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Can't reach the control master at %s: %s", _path.c_str(),
+                strerror(errno));
+        return SSH_ERROR;
+    }
+
+    // The master runs in another directory, local paths go out absolute
+    encodeTarget(request, _target);
+    request.Add(push ? fs::absolute(source, ec).string() : source)
+           .Add(push ? destination : fs::absolute(destination, ec).string())
+           .Add((int64_t) protocol);
+    encodeOptions(request, options);
+
+    res = writeFrame(fd, push ? framePush : framePull, request.data);
+    if (res == SSH_OK)
+    {
+        res = readStatus(fd, NULL, NULL, stats);
+    }
+    close(fd);
+
+    return res;
+}
+
+// Output of a command running in the master, sent back as frames
+class FrameSink : public SshOutputSink
+{
+public:
+    FrameSink(int fd): _fd(fd){};
+
+    void OnStdout(string_view data) override { _Write(frameStdout, data); };
+    void OnStderr(string_view data) override { _Write(frameStderr, data); };
+
+private:
+    void _Write(char type, string_view data)
+    {
+        // A caller that went away doesn't stop the command, its output is
+        // dropped
+        while (_failed == false && data.empty() == false)
+        {
+            string_view chunk = data.substr(0, maxFrameSize);
+
+            _failed = writeFrame(_fd, type, chunk) != SSH_OK;
+            data.remove_prefix(chunk.size());
+        }
+    };
+
+private:
+    int _fd;
+    bool _failed{false};
+};
+
+// Command input received from the caller as frames
+class FrameSource : public SshInputSource
+{
+public:
+    FrameSource(int fd): _fd(fd){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        while (_offset == _pending.size())
+        {
+            char type;
+
+            if (_eof)
+            {
+                return 0;
+            }
+            if (readFrame(_fd, &type, _pending) != SSH_OK || type != frameInput)
+            {
+                return -1;
+            }
+            _offset = 0;
+            _eof = _pending.empty();
+        }
+
+        size = min(size, _pending.size() - _offset);
+        memcpy(buffer, _pending.data() + _offset, size);
+        _offset += size;
+
+        return size;
+    };
+
+private:
+    int _fd;
+    string _pending;
+    size_t _offset{0};
+    bool _eof{false};
+};
+
+SshControlMaster::~SshControlMaster()
+{
+    Stop();
+}
+
+int SshControlMaster::Start()
+{
+    struct sockaddr_un address = {};
+
+    if (_path.size() >= sizeof(address.sun_path))
+    {
+        SSH_LOG(Error, "Control socket path too long: %s", _path.c_str());
+        return SSH_ERROR;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, _path.c_str(), _path.size());
+
+    // A socket left behind by a master that died is replaced, a live one isn't
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0)
+    {
+        int res = connect(probe, (struct sockaddr *) &address, sizeof(address));
+        int error = errno;
+
+        close(probe);
+        if (res == 0)
+        {
+            SSH_LOG(Error, "A control master already listens on %s", _path.c_str());
+            return SSH_ERROR;
+        }
+        if (error == ECONNREFUSED)
+        {
+            unlink(_path.c_str());
+        }
+    }
+
+    _listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listenFd < 0)
+    {
+        SSH_LOG(Error, "Can't create the control socket: %s", strerror(errno));
+        return SSH_ERROR;
+    }
+
+    if (bind(_listenFd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        chmod(_path.c_str(), 0600) < 0 || listen(_listenFd, SOMAXCONN) < 0)
+    {
+        SSH_LOG(Error, "Can't listen on %s: %s", _path.c_str(), strerror(errno));
+        Stop();
+        return SSH_ERROR;
+    }
+
+    if (pipe2(_wakeFds, O_CLOEXEC) < 0)
+    {
+        SSH_LOG(Error, "Can't create a pipe: %s", strerror(errno));
+        Stop();
+        return SSH_ERROR;
+    }
+
+    _acceptor = thread(&SshControlMaster::_Accept, this);
+
+    return SSH_OK;
+}
+
+void SshControlMaster::Stop()
+{
+    map<string, shared_ptr<_Session>> sessions;
+
+    if (_acceptor.joinable())
+    {
+        char wake = 0;
+
+        SshWriteAll(_wakeFds[1], &wake, 1);
+        _acceptor.join();
+        unlink(_path.c_str());
+    }
+
+    if (_listenFd >= 0)
+    {
+        close(_listenFd);
+        _listenFd = -1;
+    }
+
+    for (int& fd : _wakeFds)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    {
+        unique_lock<mutex> lock(_mutex);
+
+        // Callers are cut off, running operations still finish first
+        for (int fd : _connections)
+        {
+            shutdown(fd, SHUT_RDWR);
+        }
+        _finished.wait(lock, [this]() { return _connections.empty(); });
+        sessions.swap(_sessions);
+    }
+}
+
+size_t SshControlMaster::SessionCount()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _sessions.size();
+}
+
+void SshControlMaster::_Accept()
+{
+    while (true)
+    {
+        struct pollfd fds[2] = {{_listenFd, POLLIN, 0}, {_wakeFds[0], POLLIN, 0}};
+
+        if (poll(fds, 2, idleCheckIntervalMs) < 0 && errno != EINTR)
+        {
+            SSH_LOG(Error, "Control master poll failed: %s", strerror(errno));
+            break;
+        }
+
+        _CloseIdle();
+
+        if (fds[1].revents)
+        {
+            break;
+        }
+        if ((fds[0].revents & POLLIN) == 0)
+        {
+            continue;
+        }
+
+        int fd = accept4(_listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        // Sessions are only lent to processes of the same user
+        struct ucred peer = {};
+        socklen_t length = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 ||
+            peer.uid != getuid())
+        {
+            SSH_LOG(Warning, "Refused a control connection from uid %d", (int) peer.uid);
+            close(fd);
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(_mutex);
+            _connections.insert(fd);
+        }
+        thread(&SshControlMaster::_Serve, this, fd).detach();
+    }
+}
+
+void SshControlMaster::_Serve(int fd)
+{
+    shared_ptr<_Session> session;
+    SshControlTarget target;
+    SshTransferStats stats;
+    string payload;
+    int exitStatus = -1;
+    int res = SSH_ERROR;
+    char type;
+
+    if (readFrame(fd, &type, payload) == SSH_OK)
+    {
+        FrameReader request(payload);
+        FrameWriter key;
+
+        if (decodeTarget(request, target))
+        {
+            encodeTarget(key, target);
+            session = _Acquire(key.data, target);
+        }
+
+        if (session == nullptr)
+        {
+            res = SSH_ERROR;
+        }
+        else if (type == frameConnect)
+        {
+            res = SSH_OK;
+        }
+        else if (type == frameExecute)
+        {
+            FrameSink sink(fd);
+            FrameSource source(fd);
+            string command;
+            int64_t input;
+
+            if (request.Next(command) && request.Next(input))
+            {
+                res = input ? session->client.Execute(command, source, sink, &exitStatus)
+                            : session->client.Execute(command, sink, &exitStatus);
+            }
+        }
+        else if (type == framePush || type == framePull)
+        {
+            SshTransferOptions options;
+            string source, destination;
+            int64_t protocol;
+
+            if (request.Next(source) && request.Next(destination) &&
+                request.Next(protocol) && decodeOptions(request, options))
+            {
+                lock_guard<mutex> lock(session->transferMutex);
+
+                session->client.SetTransferOptions(options);
+                res = type == framePush
+                      ? session->client.Push(source, destination, (SshTransferProtocol) protocol)
+                      : session->client.Pull(source, destination, (SshTransferProtocol) protocol);
+                stats = session->client.GetLastTransferStats();
+            }
+        }
+
+        writeFrame(fd, frameStatus, encodeStatus(res, exitStatus, stats));
+    }
+
+    if (session)
+    {
+        // A session that broke is replaced for the next caller
+        bool broken = res != SSH_OK && session->client.IsConnected() == false;
+        lock_guard<mutex> lock(_mutex);
+        map<string, shared_ptr<_Session>>::iterator it;
+
+        session->lastUsed = chrono::steady_clock::now();
+        for (it = _sessions.begin(); broken && it != _sessions.end(); it++)
+        {
+            if (it->second == session)
+            {
+                _sessions.erase(it);
+                break;
+            }
+        }
+    }
+    session.reset();
+
+    // Closed under the lock, so Stop never shuts down a reused descriptor
+    lock_guard<mutex> lock(_mutex);
+    _connections.erase(fd);
+    close(fd);
+    _finished.notify_all();
+}
+
+shared_ptr<SshControlMaster::_Session> SshControlMaster::_Acquire(const string& key,
+                                                                  const SshControlTarget& target)
+{
+    shared_ptr<_Session> session;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        shared_ptr<_Session>& slot = _sessions[key];
+
+        if (slot == nullptr)
+        {
+            slot = make_shared<_Session>(target);
+            slot->client.SetConnectOptions(target.connect);
+        }
+        slot->lastUsed = chrono::steady_clock::now();
+        session = slot;
+    }
+
+    // The first caller connects, the others wait for it
+    lock_guard<mutex> lock(session->connectMutex);
+
+    if (session->connected == false)
+    {
+        if (session->client.Connect() != SSH_OK)
+        {
+            lock_guard<mutex> lock(_mutex);
+            map<string, shared_ptr<_Session>>::iterator it = _sessions.find(key);
+
+            if (it != _sessions.end() && it->second == session)
+            {
+                _sessions.erase(it);
+            }
+            return nullptr;
+        }
+        session->connected = true;
+    }
+
+    return session;
+}
+
+void SshControlMaster::_CloseIdle()
+{
+    vector<shared_ptr<_Session>> idle;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        map<string, shared_ptr<_Session>>::iterator it = _sessions.begin();
+
+        while (it != _sessions.end())
+        {
+            if (it->second.use_count() == 1 && now - it->second->lastUsed > _idleTimeout)
+            {
+                idle.push_back(it->second);
+                it = _sessions.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+    }
+
+    // Disconnected here, outside the lock
+    idle.clear();
+}
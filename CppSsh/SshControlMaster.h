@@ -0,0 +1,101 @@
+#ifndef __SSH_CONTROL_MASTER_H__
+#define __SSH_CONTROL_MASTER_H__
+
+#include "SshClient.h"
+
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <thread>
+
+// Everything a control master needs to open the same session as a client
+struct SshControlTarget
+{
+    string ip;
+    string user;
+    string password;
+    bool autoverifyhost{true};
+    SshConnectOptions connect;
+};
+
+// $XDG_RUNTIME_DIR/cppssh-control, or /tmp/cppssh-control-UID without it
+string SshDefaultControlPath();
+
+// Client end of the control protocol. Every operation is one connection to
+// the master's socket: a request frame naming the target, output and input
+// frames while it runs, and a status frame at the end. Local paths are read
+// and written by the master, which runs on the same host as the caller.
+class SshControlClient
+{
+public:
+    SshControlClient(const string& path, const SshControlTarget& target):
+                     _path(path), _target(target){};
+
+    // Has the master open or reuse the session. reachable is false when no
+    // master listens on the path, so the caller can connect directly.
+    int Connect(bool* reachable);
+    int Execute(const string& command, SshInputSource* input, SshOutputSink& sink,
+                int* exitStatus);
+    int Transfer(bool push, const string& source, const string& destination,
+                 SshTransferProtocol protocol, const SshTransferOptions& options,
+                 SshTransferStats* stats);
+
+private:
+    int _Open();
+
+private:
+    string _path;
+    SshControlTarget _target;
+};
+
+// Owns authenticated sessions on behalf of other processes and serves them on
+// a Unix socket only its own user may use. Sessions are keyed by the whole
+// target, shared by concurrent callers, and closed after idleTimeout without
+// use. Commands run concurrently on a shared session, transfers on one
+// session take turns.
+class SshControlMaster
+{
+public:
+    SshControlMaster(const string& path, chrono::seconds idleTimeout):
+                     _path(path), _idleTimeout(idleTimeout){};
+    ~SshControlMaster();
+    SshControlMaster(const SshControlMaster&) = delete;
+    SshControlMaster& operator=(const SshControlMaster&) = delete;
+
+    // Binds the socket and serves it from a background thread
+    int Start();
+    void Stop();
+    size_t SessionCount();
+
+private:
+    struct _Session
+    {
+        _Session(const SshControlTarget& target):
+                 client(target.ip, target.user, target.password, target.autoverifyhost){};
+
+        SshClient client;
+        mutex connectMutex;
+        mutex transferMutex;
+        bool connected{false};
+        chrono::steady_clock::time_point lastUsed;
+    };
+
+    void _Accept();
+    void _Serve(int fd);
+    shared_ptr<_Session> _Acquire(const string& key, const SshControlTarget& target);
+    void _CloseIdle();
+
+private:
+    string _path;
+    chrono::seconds _idleTimeout;
+    int _listenFd{-1};
+    int _wakeFds[2]{-1, -1};
+    thread _acceptor;
+
+    mutex _mutex;
+    condition_variable _finished;
+    map<string, shared_ptr<_Session>> _sessions;
+    set<int> _connections;
+};
+
+#endif // __SSH_CONTROL_MASTER_H__
@@ -0,0 +1,184 @@
+#include "SshCrypto.h"
+#include "SshClient.h"
+
+#include <algorithm>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+static const char* aesFirst = "aes128-gcm@openssh.com,aes256-gcm@openssh.com,"
+                              "chacha20-poly1305@openssh.com,aes128-ctr,aes256-ctr";
+static const char* chachaFirst = "chacha20-poly1305@openssh.com,aes128-gcm@openssh.com,"
+                                 "aes256-gcm@openssh.com,aes128-ctr,aes256-ctr";
+
+// Candidates for calibration, the ctr modes pay for a separate MAC
+static const char* calibrationCiphers[] =
+{
+    "aes128-gcm@openssh.com",
+    "aes256-gcm@openssh.com",
+    "chacha20-poly1305@openssh.com",
+    "aes128-ctr",
+    "aes256-ctr"
+};
+
+// Endless zeros, up to a byte budget
+class ZeroSource : public SshInputSource
+{
+public:
+    ZeroSource(size_t bytes): _left(bytes){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        size = min(size, _left);
+        memset(buffer, 0, size);
+        _left -= size;
+
+        return size;
+    };
+
+private:
+    size_t _left;
+};
+
+int SshApplyCryptoOptions(ssh_session session, const SshCryptoOptions& options)
+{
+    string ciphers = options.ciphers == "auto" ? SshHardwareCiphers() : options.ciphers;
+
+    if (!ciphers.empty() &&
+        (ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, ciphers.c_str()) < 0 ||
+         ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, ciphers.c_str()) < 0))
+    {
+        SSH_LOG(Error, "Unsupported ciphers: %s", ciphers.c_str());
+        return SSH_ERROR;
+    }
+
+    if (!options.hmacs.empty() &&
+        (ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, options.hmacs.c_str()) < 0 ||
+         ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, options.hmacs.c_str()) < 0))
+    {
+        SSH_LOG(Error, "Unsupported MACs: %s", options.hmacs.c_str());
+        return SSH_ERROR;
+    }
+
+    if (!options.keyExchange.empty() &&
+        ssh_options_set(session, SSH_OPTIONS_KEY_EXCHANGE, options.keyExchange.c_str()) < 0)
+    {
+        SSH_LOG(Error, "Unsupported key exchange methods: %s", options.keyExchange.c_str());
+        return SSH_ERROR;
+    }
+
+    if (!options.hostKeys.empty() &&
+        ssh_options_set(session, SSH_OPTIONS_HOSTKEYS, options.hostKeys.c_str()) < 0)
+    {
+        SSH_LOG(Error, "Unsupported host key types: %s", options.hostKeys.c_str());
+        return SSH_ERROR;
+    }
+
+    if (!options.compression.empty() &&
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION, options.compression.c_str()) < 0)
+    {
+        SSH_LOG(Error, "Unsupported compression: %s", options.compression.c_str());
+        return SSH_ERROR;
+    }
+
+    if (options.compressionLevel > 0 &&
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION_LEVEL, &options.compressionLevel) < 0)
+    {
+        SSH_LOG(Error, "Invalid compression level %d", options.compressionLevel);
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+bool SshHardwareAes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#elif defined(__aarch64__) && defined(__APPLE__)
+    // Every Apple silicon CPU has the ARMv8 crypto extensions
+    return true;
+#else
+    return false;
+#endif
+}
+
+string SshHardwareCiphers()
+{
+    return SshHardwareAes() ? aesFirst : chachaFirst;
+}
+
+int SshCalibrateCiphers(const string& ip, const string& user, const string& password,
+                        SshConnectOptions& options, vector<SshCipherResult>* results,
+                        size_t bytes)
+{
+    vector<SshCipherResult> measured;
+
+    for (const char* cipher : calibrationCiphers)
+    {
+        SshConnectOptions candidate = options;
+        SshClient client(ip, user, password);
+        SshCaptureSink sink;
+        ZeroSource zeros(bytes);
+        int status = -1;
+
+        candidate.crypto.ciphers = cipher;
+        candidate.crypto.compression = "no";
+        client.SetConnectOptions(candidate);
+        if (client.Connect() != SSH_OK)
+        {
+            SSH_LOG(Info, "Cipher %s isn't available", cipher);
+            continue;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int res = client.Execute("cat > /dev/null", zeros, sink, &status);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        client.Close();
+        if (res != SSH_OK || status != 0)
+        {
+            SSH_LOG(Warning, "Calibration of %s failed", cipher);
+            continue;
+        }
+
+        measured.push_back(SshCipherResult{cipher, bytes / max(elapsed.count(), 1e-9)});
+        SSH_LOG(Info, "Cipher %s: %.1f MB/s", cipher,
+                measured.back().bytesPerSecond / (1024 * 1024));
+    }
+
+    if (measured.empty())
+    {
+        SSH_LOG(Error, "No cipher could be calibrated against %s", ip.c_str());
+        return SSH_ERROR;
+    }
+
+    stable_sort(measured.begin(), measured.end(),
+                [](const SshCipherResult& a, const SshCipherResult& b)
+                {
+                    return a.bytesPerSecond > b.bytesPerSecond;
+                });
+
+    options.crypto.ciphers.clear();
+    for (const SshCipherResult& result : measured)
+    {
+        if (!options.crypto.ciphers.empty())
+        {
+            options.crypto.ciphers += ",";
+        }
+        options.crypto.ciphers += result.cipher;
+    }
+
+    if (results)
+    {
+        *results = measured;
+    }
+
+    return SSH_OK;
+}
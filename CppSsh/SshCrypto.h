@@ -0,0 +1,54 @@
+#ifndef __SSH_CRYPTO_H__
+#define __SSH_CRYPTO_H__
+
+#include <libssh/libssh.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Algorithm preferences sent in the key exchange. Lists are comma separated,
+// most preferred first, in OpenSSH naming. Empty keeps the libssh defaults.
+struct SshCryptoOptions
+{
+    // "auto" orders the ciphers for the local CPU, see SshHardwareCiphers
+    string ciphers;
+    string hmacs;
+    string keyExchange;
+    string hostKeys;
+    // "yes", "no" or a list such as "zlib@openssh.com,none"
+    string compression;
+    // 1 to 9, 0 keeps the default
+    int compressionLevel{0};
+};
+
+// Applies the preferences to a session that isn't connected yet
+int SshApplyCryptoOptions(ssh_session session, const SshCryptoOptions& options);
+
+// True when the CPU has AES and carry-less multiply instructions, which make
+// AES-GCM faster than chacha20-poly1305
+bool SshHardwareAes();
+
+// Cipher list with AES-GCM first on CPUs with AES instructions and
+// chacha20-poly1305 first on the others
+string SshHardwareCiphers();
+
+struct SshCipherResult
+{
+    string cipher;
+    double bytesPerSecond{0};
+};
+
+struct SshConnectOptions;
+
+// Measures the throughput of each cipher by streaming bytes into
+// "cat > /dev/null" on a fresh session to the host, and stores the ciphers
+// that worked in options.crypto.ciphers, fastest first. Against a local sshd
+// this measures the local crypto, against the real peer the pair of them.
+// Compression is turned off for the measurement.
+int SshCalibrateCiphers(const string& ip, const string& user, const string& password,
+                        SshConnectOptions& options, vector<SshCipherResult>* results,
+                        size_t bytes = 64 * 1024 * 1024);
+
+#endif // __SSH_CRYPTO_H__
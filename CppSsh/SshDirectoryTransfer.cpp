@@ -0,0 +1,483 @@
+
+#include "SshDirectoryTransfer.h"
+#include "SshSftpTransfer.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// Longest remote command line built when creating directories in batches
+static constexpr size_t maxCommandLength = 64 * 1024;
+
+SshDirectoryTransfer::SshDirectoryTransfer(const string& ip, const string& user,
+                                           const string& password, size_t streams):
+    _ip(ip), _user(user), _password(password), _streams(max<size_t>(streams, 1))
+{
+}
+
+SshDirectoryTransfer::~SshDirectoryTransfer()
+{
+    Close();
+}
+
+int SshDirectoryTransfer::Push(const string& source, const string& destination)
+{
+    vector<SshManifestEntry> manifest;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int res;
+
+    SshScheduledTransfer scheduled(_options.priority);
+    _stats = SshTransferStats();
+
+    if (_Connect() != SSH_OK ||
+        _BuildLocalManifest(source, manifest) != SSH_OK ||
+        _CreateRemoteDirectories(destination, manifest, false) != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    res = _Run(manifest, [&](SshClient& client, const SshManifestEntry& entry,
+                             SshTransferStats& stats)
+    {
+        lock_guard<mutex> transfer(client._transferMutex);
+        lock_guard<mutex> lock(client._sessionMutex);
+        SshSftpTransfer* sftp = client._Sftp();
+
+        if (sftp == NULL)
+        {
+            return SSH_ERROR;
+        }
+
+        return sftp->PushFile((fs::path(source) / entry.path).string(),
+                              destination + "/" + entry.path, _options, stats);
+    });
+
+    // Modes go on last so read-only directories don't block their own content
+    if (_CreateRemoteDirectories(destination, manifest, true) != SSH_OK)
+    {
+        res = SSH_ERROR;
+    }
+
+    _stats.elapsed = chrono::steady_clock::now() - start;
+    SSH_LOG(Info, "Uploaded %llu bytes in %llu files over %zu streams, %.1f MB/s",
+            (unsigned long long) _stats.bytes, (unsigned long long) _stats.files,
+            _clients.size(), _stats.BytesPerSecond() / (1024 * 1024));
+
+    return res;
+}
+
+int SshDirectoryTransfer::Pull(const string& source, const string& destination)
+{
+    vector<SshManifestEntry> manifest;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int res;
+
+    SshScheduledTransfer scheduled(_options.priority);
+    _stats = SshTransferStats();
+
+    if (_Connect() != SSH_OK ||
+        _BuildRemoteManifest(source, manifest) != SSH_OK ||
+        _CreateLocalDirectories(destination, manifest, false) != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    res = _Run(manifest, [&](SshClient& client, const SshManifestEntry& entry,
+                             SshTransferStats& stats)
+    {
+        lock_guard<mutex> transfer(client._transferMutex);
+        lock_guard<mutex> lock(client._sessionMutex);
+        SshSftpTransfer* sftp = client._Sftp();
+
+        if (sftp == NULL)
+        {
+            return SSH_ERROR;
+        }
+
+        return sftp->PullFile(source + "/" + entry.path,
+                              (fs::path(destination) / entry.path).string(),
+                              entry.size, entry.mode, _options, stats);
+    });
+
+    if (_CreateLocalDirectories(destination, manifest, true) != SSH_OK)
+    {
+        res = SSH_ERROR;
+    }
+
+    _stats.elapsed = chrono::steady_clock::now() - start;
+    SSH_LOG(Info, "Downloaded %llu bytes in %llu files over %zu streams, %.1f MB/s",
+            (unsigned long long) _stats.bytes, (unsigned long long) _stats.files,
+            _clients.size(), _stats.BytesPerSecond() / (1024 * 1024));
+
+    return res;
+}
+
+void SshDirectoryTransfer::SetTransferOptions(const SshTransferOptions& options)
+{
+    _options = options;
+}
+
+void SshDirectoryTransfer::SetConnectOptions(const SshConnectOptions& options)
+{
+    _connectOptions = options;
+}
+
+SshTransferStats SshDirectoryTransfer::GetLastTransferStats()
+{
+    return _stats;
+}
+
+void SshDirectoryTransfer::Close()
+{
+    _clients.clear();
+}
+
+int SshDirectoryTransfer::_Connect()
+{
+    vector<thread> workers;
+    vector<int> results(_streams, SSH_OK);
+
+    if (_clients.size() == _streams &&
+        all_of(_clients.begin(), _clients.end(),
+               [](unique_ptr<SshClient>& client) { return client->IsConnected(); }))
+    {
+        return SSH_OK;
+    }
+
+    _clients.clear();
+    for (size_t i = 0; i < _streams; i++)
+    {
+        _clients.push_back(make_unique<SshClient>(_ip, _user, _password));
+        _clients.back()->SetConnectOptions(_connectOptions);
+    }
+
+    // Each stream is its own session so encryption runs on as many threads
+    // as there are streams
+    for (size_t i = 0; i < _streams; i++)
+    {
+        workers.emplace_back([this, &results, i]() { results[i] = _clients[i]->Connect(); });
+    }
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    if (find(results.begin(), results.end(), SSH_ERROR) != results.end())
+    {
+        SSH_LOG(Error, "Error connecting %zu streams to %s", _streams, _ip.c_str());
+        _clients.clear();
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshDirectoryTransfer::_BuildLocalManifest(const string& source,
+                                              vector<SshManifestEntry>& manifest)
+{
+    error_code ec;
+
+    if (fs::is_directory(source, ec) == false)
+    {
+        SSH_LOG(Error, "Not a local directory: %s", source.c_str());
+        return SSH_ERROR;
+    }
+
+    for (fs::recursive_directory_iterator entry(source, ec), end; entry != end && !ec;
+         entry.increment(ec))
+    {
+        SshManifestEntry item;
+        fs::file_status status = entry->status(ec);
+
+        item.path = entry->path().lexically_relative(source).string();
+        item.mode = (int) status.permissions() & 07777;
+        item.directory = fs::is_directory(status);
+
+        if (item.directory == false)
+        {
+            if (fs::is_regular_file(status) == false)
+            {
+                continue;
+            }
+            item.size = entry->file_size(ec);
+        }
+
+        manifest.push_back(item);
+    }
+
+    if (ec)
+    {
+        SSH_LOG(Error, "Error reading directory %s: %s", source.c_str(),
+                ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshDirectoryTransfer::_BuildRemoteManifest(const string& source,
+                                               vector<SshManifestEntry>& manifest)
+{
+    SshCaptureSink sink;
+    int exitStatus = -1;
+    size_t begin = 0;
+    int res;
+
+    // One round trip lists the whole tree, NUL separated so any file name
+    // survives
+    res = _clients[0]->Execute("cd " + SshShellQuote(source) +
+                               " && find . -mindepth 1"
+                               " \\( -type d -printf 'd %m %s %P\\0' \\) -o"
+                               " \\( -type f -printf 'f %m %s %P\\0' \\)",
+                               sink, &exitStatus);
+    if (res != SSH_OK || exitStatus != 0)
+    {
+        SSH_LOG(Error, "Can't list remote directory %s: %s", source.c_str(),
+                sink.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    while (begin < sink.output.size())
+    {
+        size_t end = sink.output.find('\0', begin);
+        if (end == string::npos)
+        {
+            end = sink.output.size();
+        }
+
+        string record = sink.output.substr(begin, end - begin);
+        size_t modeEnd = record.find(' ', 2);
+        size_t sizeEnd = modeEnd == string::npos ? string::npos : record.find(' ', modeEnd + 1);
+
+        begin = end + 1;
+        if (record.size() < 2 || sizeEnd == string::npos)
+        {
+            continue;
+        }
+
+        SshManifestEntry item;
+        item.directory = record[0] == 'd';
+        item.mode = stoi(record.substr(2, modeEnd - 2), nullptr, 8);
+        item.size = stoull(record.substr(modeEnd + 1, sizeEnd - modeEnd - 1));
+        item.path = record.substr(sizeEnd + 1);
+        manifest.push_back(item);
+    }
+
+    return SSH_OK;
+}
+
+int SshDirectoryTransfer::_CreateRemoteDirectories(const string& destination,
+                                                   const vector<SshManifestEntry>& manifest,
+                                                   bool modes)
+{
+    map<int, vector<const SshManifestEntry*>> batches;
+    vector<string> commands;
+    string root = "cd " + SshShellQuote(destination) + " && ";
+
+    if (modes == false)
+    {
+        commands.push_back("mkdir -p -- " + SshShellQuote(destination));
+    }
+
+    for (const SshManifestEntry& entry : manifest)
+    {
+        if (entry.directory)
+        {
+            batches[modes ? entry.mode : 0].push_back(&entry);
+        }
+    }
+
+    for (auto& batch : batches)
+    {
+        char mode[8];
+        string prefix;
+
+        snprintf(mode, sizeof(mode), "%04o", batch.first);
+        prefix = root + (modes ? string("chmod ") + mode : string("mkdir -p")) + " --";
+
+        string command = prefix;
+        for (const SshManifestEntry* entry : batch.second)
+        {
+            if (command.size() > maxCommandLength)
+            {
+                commands.push_back(command);
+                command = prefix;
+            }
+            command += " " + SshShellQuote(entry->path);
+        }
+        commands.push_back(command);
+    }
+
+    for (const string& command : commands)
+    {
+        SshCaptureSink sink;
+        int exitStatus = -1;
+
+        if (_clients[0]->Execute(command, sink, &exitStatus) != SSH_OK || exitStatus != 0)
+        {
+            SSH_LOG(Error, "Can't create remote directories in %s: %s",
+                    destination.c_str(), sink.errors.c_str());
+            return SSH_ERROR;
+        }
+    }
+
+    return SSH_OK;
+}
+
+int SshDirectoryTransfer::_CreateLocalDirectories(const string& destination,
+                                                  const vector<SshManifestEntry>& manifest,
+                                                  bool modes)
+{
+    error_code ec;
+
+    fs::create_directories(destination, ec);
+
+    for (const SshManifestEntry& entry : manifest)
+    {
+        if (entry.directory == false || ec)
+        {
+            continue;
+        }
+
+        fs::path path = fs::path(destination) / entry.path;
+        if (modes)
+        {
+            fs::permissions(path, (fs::perms) entry.mode, ec);
+        }
+        else
+        {
+            fs::create_directories(path, ec);
+        }
+    }
+
+    if (ec)
+    {
+        SSH_LOG(Error, "Can't create local directories in %s: %s",
+                destination.c_str(), ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshDirectoryTransfer::_Run(const vector<SshManifestEntry>& manifest,
+                               const _CopyFunction& copy)
+{
+    vector<const SshManifestEntry*> files;
+    vector<SshTransferStats> stats(_clients.size());
+    vector<thread> workers;
+    atomic<size_t> failures{0};
+
+    for (const SshManifestEntry& entry : manifest)
+    {
+        if (entry.directory == false)
+        {
+            files.push_back(&entry);
+        }
+    }
+
+    // Largest first, so the big files start early and don't end up as the
+    // last ones running on a single stream
+    sort(files.begin(), files.end(),
+         [](const SshManifestEntry* a, const SshManifestEntry* b) { return a->size > b->size; });
+
+    _queues.clear();
+    for (size_t i = 0; i < _clients.size(); i++)
+    {
+        _queues.push_back(make_unique<_Queue>());
+    }
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        _Queue& queue = *_queues[i % _queues.size()];
+
+        queue.files.push_back(files[i]);
+        queue.bytes += files[i]->size;
+    }
+
+    for (size_t i = 0; i < _clients.size(); i++)
+    {
+        workers.emplace_back([this, i, &copy, &stats, &failures]()
+        {
+            const SshManifestEntry* entry;
+
+            while ((entry = _NextFile(i)) != NULL)
+            {
+                if (copy(*_clients[i], *entry, stats[i]) != SSH_OK)
+                {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    for (SshTransferStats& stream : stats)
+    {
+        _stats.bytes += stream.bytes;
+        _stats.files += stream.files;
+    }
+
+    if (failures > 0)
+    {
+        SSH_LOG(Error, "%zu of %zu files failed to transfer", failures.load(),
+                files.size());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+const SshManifestEntry* SshDirectoryTransfer::_NextFile(size_t stream)
+{
+    _Queue* victim = _queues[stream].get();
+
+    // Own queue first, otherwise steal from the one with the most bytes left
+    if (victim->bytes == 0)
+    {
+        for (unique_ptr<_Queue>& queue : _queues)
+        {
+            if (queue->bytes > victim->bytes)
+            {
+                victim = queue.get();
+            }
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(victim->lock);
+
+        if (!victim->files.empty())
+        {
+            const SshManifestEntry* entry = victim->files.front();
+
+            victim->files.pop_front();
+            victim->bytes -= entry->size;
+
+            return entry;
+        }
+    }
+
+    // Empty files carry no bytes, sweep every queue before giving up
+    for (unique_ptr<_Queue>& queue : _queues)
+    {
+        lock_guard<mutex> lock(queue->lock);
+
+        if (!queue->files.empty())
+        {
+            const SshManifestEntry* entry = queue->files.front();
+
+            queue->files.pop_front();
+            queue->bytes -= entry->size;
+
+            return entry;
+        }
+    }
+
+    return NULL;
+}
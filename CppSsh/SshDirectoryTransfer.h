@@ -0,0 +1,73 @@
+#ifndef __SSH_DIRECTORY_TRANSFER_H__
+#define __SSH_DIRECTORY_TRANSFER_H__
+
+#include "SshClient.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+struct SshManifestEntry
+{
+    string path;
+    uint64_t size{0};
+    int mode{0};
+    bool directory{false};
+    // Modification time in seconds and hex SHA-256, only filled in by SshSync
+    int64_t mtime{0};
+    string hash;
+};
+
+// Copies a directory tree over several sessions to the same host at once.
+// The tree is listed up front, its files are sorted largest first and spread
+// over one queue per stream; a stream that runs dry takes the largest file
+// left in the fullest queue. Paths are always absolute or relative to the
+// given roots, the process working directory is never changed.
+class SshDirectoryTransfer
+{
+public:
+    SshDirectoryTransfer(const string& ip, const string& user,
+                         const string& password, size_t streams);
+    ~SshDirectoryTransfer();
+
+    int Push(const string& source, const string& destination);
+    int Pull(const string& source, const string& destination);
+    void SetTransferOptions(const SshTransferOptions& options);
+    // Takes effect on the next connection of the streams
+    void SetConnectOptions(const SshConnectOptions& options);
+    SshTransferStats GetLastTransferStats();
+    void Close();
+
+private:
+    using _CopyFunction = function<int(SshClient& client, const SshManifestEntry& entry,
+                                       SshTransferStats& stats)>;
+
+    struct _Queue
+    {
+        mutex lock;
+        deque<const SshManifestEntry*> files;
+        atomic<uint64_t> bytes{0};
+    };
+
+    int _Connect();
+    int _BuildLocalManifest(const string& source, vector<SshManifestEntry>& manifest);
+    int _BuildRemoteManifest(const string& source, vector<SshManifestEntry>& manifest);
+    int _CreateRemoteDirectories(const string& destination,
+                                 const vector<SshManifestEntry>& manifest, bool modes);
+    int _CreateLocalDirectories(const string& destination,
+                                const vector<SshManifestEntry>& manifest, bool modes);
+    int _Run(const vector<SshManifestEntry>& manifest, const _CopyFunction& copy);
+    const SshManifestEntry* _NextFile(size_t stream);
+
+private:
+    string _ip, _user, _password;
+    size_t _streams;
+    SshTransferOptions _options;
+    SshConnectOptions _connectOptions;
+    SshTransferStats _stats;
+    vector<unique_ptr<SshClient>> _clients;
+    vector<unique_ptr<_Queue>> _queues;
+};
+
+#endif // __SSH_DIRECTORY_TRANSFER_H__
@@ -0,0 +1,217 @@
+#include "SshFanOut.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+static chrono::duration<double> percentile(const vector<chrono::duration<double>>& sorted,
+                                           double fraction)
+{
+    if (sorted.empty())
+    {
+        return chrono::duration<double>(0);
+    }
+
+    size_t rank = (size_t) ceil(fraction * sorted.size());
+
+    return sorted[min(max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+void SshFanOut::SetOptions(const SshFanOutOptions& options)
+{
+    _options = options;
+}
+
+void SshFanOut::SetResultCallback(ResultCallback callback)
+{
+    _callback = move(callback);
+}
+
+int SshFanOut::Execute(const string& command)
+{
+    return _Run([&command](SshClient& client, SshFanOutResult& result)
+    {
+        SshCaptureSink sink;
+
+        result.status = client.Execute(command, sink, &result.exitStatus);
+        result.output = move(sink.output);
+        result.errors = move(sink.errors);
+    });
+}
+
+int SshFanOut::Push(const string& source, const string& destination)
+{
+    return _Run([&](SshClient& client, SshFanOutResult& result)
+    {
+        result.status = client.Push(source, destination);
+        result.exitStatus = result.status == SSH_OK ? 0 : -1;
+    });
+}
+
+int SshFanOut::Pull(const string& source, const string& destination)
+{
+    error_code ec;
+
+    fs::create_directories(destination, ec);
+    if (ec)
+    {
+        SSH_LOG(Error, "Can't create %s: %s", destination.c_str(), ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    return _Run([&](SshClient& client, SshFanOutResult& result)
+    {
+        const string& ip = _hosts[result.host].ip;
+
+        result.status = client.Pull(source, (fs::path(destination) / ip).string());
+        result.exitStatus = result.status == SSH_OK ? 0 : -1;
+    });
+}
+
+int SshFanOut::_Run(const _Operation& operation)
+{
+    auto start = chrono::steady_clock::now();
+    size_t workers = min(max<size_t>(_options.concurrency, 1), _hosts.size());
+    atomic<size_t> next{0};
+    vector<thread> threads;
+    size_t failed = 0;
+
+    _results.assign(_hosts.size(), SshFanOutResult());
+    for (size_t i = 0; i < workers; i++)
+    {
+        threads.emplace_back([this, &next, &operation]()
+        {
+            size_t index;
+
+            while ((index = next++) < _hosts.size())
+            {
+                _RunHost(index, operation);
+            }
+        });
+    }
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+    _elapsed = chrono::steady_clock::now() - start;
+
+    for (const SshFanOutResult& result : _results)
+    {
+        if (result.Succeeded() == false)
+        {
+            failed++;
+        }
+    }
+
+    if (failed > 0)
+    {
+        SSH_LOG(Error, "Failed on %zu of %zu hosts", failed, _hosts.size());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+void SshFanOut::_RunHost(size_t index, const _Operation& operation)
+{
+    const SshFanOutHost& host = _hosts[index];
+    SshFanOutResult result;
+    SshConnectOptions connect = _options.connect;
+    SshClient client(host.ip, host.user, host.password);
+    auto start = chrono::steady_clock::now();
+
+    if (host.port != 0)
+    {
+        connect.port = host.port;
+    }
+
+    result.host = index;
+    client.SetConnectOptions(connect);
+    client.SetTransferOptions(_options.transfer);
+    client.SetTimeout(_options.timeout);
+
+    if (client.Connect() != SSH_OK)
+    {
+        result.errors = "Can't connect";
+    }
+    else
+    {
+        // The operation gets what the connection left of the host's time
+        auto remaining = _options.timeout - chrono::duration_cast<chrono::milliseconds>(
+                             chrono::steady_clock::now() - start);
+
+        if (_options.timeout.count() > 0 && remaining.count() <= 0)
+        {
+            result.errors = "Timed out";
+        }
+        else
+        {
+            client.SetTimeout(_options.timeout.count() > 0 ? remaining
+                                                           : chrono::milliseconds(0));
+            operation(client, result);
+        }
+    }
+    client.Close();
+
+    result.elapsed = chrono::steady_clock::now() - start;
+    result.timedOut = result.Succeeded() == false && _options.timeout.count() > 0 &&
+                      result.elapsed >= _options.timeout;
+    if (result.timedOut && result.errors.empty())
+    {
+        result.errors = "Timed out";
+    }
+
+    lock_guard<mutex> lock(_mutex);
+
+    _results[index] = move(result);
+    if (_callback)
+    {
+        _callback(host, _results[index]);
+    }
+}
+
+SshFanOutSummary SshFanOut::GetSummary(size_t slowest) const
+{
+    SshFanOutSummary summary;
+    vector<chrono::duration<double>> latencies;
+    vector<size_t> order;
+
+    summary.hosts = _results.size();
+    summary.elapsed = _elapsed;
+    for (const SshFanOutResult& result : _results)
+    {
+        if (result.Succeeded())
+        {
+            summary.succeeded++;
+        }
+        else
+        {
+            summary.failed++;
+        }
+        if (result.timedOut)
+        {
+            summary.timedOut++;
+        }
+        latencies.push_back(result.elapsed);
+        order.push_back(result.host);
+    }
+
+    sort(latencies.begin(), latencies.end());
+    summary.p50 = percentile(latencies, 0.50);
+    summary.p90 = percentile(latencies, 0.90);
+    summary.p99 = percentile(latencies, 0.99);
+    summary.max = latencies.empty() ? chrono::duration<double>(0) : latencies.back();
+
+    sort(order.begin(), order.end(), [this](size_t a, size_t b)
+    {
+        return _results[a].elapsed > _results[b].elapsed;
+    });
+    order.resize(min(slowest, order.size()));
+    summary.slowest = move(order);
+
+    return summary;
+}
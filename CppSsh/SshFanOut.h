@@ -0,0 +1,99 @@
+#ifndef __SSH_FAN_OUT_H__
+#define __SSH_FAN_OUT_H__
+
+#include "SshClient.h"
+
+#include <functional>
+
+struct SshFanOutHost
+{
+    string ip;
+    string user;
+    string password;
+    // 0 for the port of the connect options
+    int port{0};
+};
+
+struct SshFanOutOptions
+{
+    // Hosts worked on at once
+    size_t concurrency{32};
+    // Limit for connecting to a host and running the operation there, 0 for
+    // none
+    chrono::milliseconds timeout{0};
+    SshConnectOptions connect;
+    SshTransferOptions transfer;
+};
+
+struct SshFanOutResult
+{
+    // Index in the host list
+    size_t host{0};
+    // SSH_OK when the operation ran, see exitStatus for commands
+    int status{SSH_ERROR};
+    // Exit status of the command, 0 for a transfer that worked
+    int exitStatus{-1};
+    bool timedOut{false};
+    string output;
+    string errors;
+    // From the start of Connect to the end of the operation
+    chrono::duration<double> elapsed{0};
+
+    bool Succeeded() const { return status == SSH_OK && exitStatus == 0; };
+};
+
+struct SshFanOutSummary
+{
+    size_t hosts{0};
+    size_t succeeded{0};
+    size_t failed{0};
+    size_t timedOut{0};
+    // Host latencies, nearest rank percentiles
+    chrono::duration<double> p50{0};
+    chrono::duration<double> p90{0};
+    chrono::duration<double> p99{0};
+    chrono::duration<double> max{0};
+    chrono::duration<double> elapsed{0};
+    // Indexes of the slowest hosts, slowest first
+    vector<size_t> slowest;
+};
+
+// Runs the same command or transfer on many hosts, with a session of its own
+// for each and at most concurrency of them at a time. Results are handed to
+// the callback as hosts finish, in whatever order that is.
+class SshFanOut
+{
+public:
+    // Called once per host, never by two threads at the same time
+    using ResultCallback = function<void(const SshFanOutHost& host,
+                                         const SshFanOutResult& result)>;
+
+    SshFanOut(const vector<SshFanOutHost>& hosts): _hosts(hosts){};
+
+    void SetOptions(const SshFanOutOptions& options);
+    void SetResultCallback(ResultCallback callback);
+    // Each of them fails unless the operation succeeded on every host
+    int Execute(const string& command);
+    int Push(const string& source, const string& destination);
+    // Copies source of every host into destination/<ip>
+    int Pull(const string& source, const string& destination);
+    // Results of the last run in the order of the hosts
+    const vector<SshFanOutResult>& GetResults() const { return _results; };
+    SshFanOutSummary GetSummary(size_t slowest = 10) const;
+
+private:
+    using _Operation = function<void(SshClient& client, SshFanOutResult& result)>;
+
+    int _Run(const _Operation& operation);
+    void _RunHost(size_t index, const _Operation& operation);
+
+private:
+    vector<SshFanOutHost> _hosts;
+    SshFanOutOptions _options;
+    ResultCallback _callback;
+    mutex _mutex;
+    vector<SshFanOutResult> _results;
+    chrono::duration<double> _elapsed{0};
+};
+
+#endif // __SSH_FAN_OUT_H__
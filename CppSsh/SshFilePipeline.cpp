@@ -0,0 +1,592 @@
+#include "SshFilePipeline.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <libssh/libssh.h>
+#include <unistd.h>
+
+static constexpr size_t directIoAlignment = 4096;
+
+// Fills the rest of a chunk, false with error set on failure or end of file
+static bool readFully(int fd, char *buffer, uint64_t offset, size_t length, size_t& filled,
+                      int& error)
+{
+    while (filled < length)
+    {
+        ssize_t nbytes = pread(fd, buffer + filled, length - filled, offset + filled);
+
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            error = nbytes < 0 ? errno : 0;
+            return false;
+        }
+        filled += nbytes;
+    }
+
+    return true;
+}
+
+SshFileReader::SshFileReader(int fd, uint64_t offset, uint64_t length, size_t chunkSize,
+                             size_t depth):
+                             _fd(fd), _offset(offset), _end(offset + length),
+                             _chunkSize(max<size_t>(chunkSize, 1))
+{
+    _chunks = (length + _chunkSize - 1) / _chunkSize;
+    if (depth > 0 && _chunks > 1)
+    {
+        _backend = SshFileBackend::Thread;
+    }
+
+    // The chunk being sent and the ones read ahead of it
+    _slots.resize(_backend == SshFileBackend::Inline ? 1 : min<uint64_t>(depth + 1, _chunks));
+    for (_Slot& slot : _slots)
+    {
+        slot.buffer = SshBufferPool::Shared().Acquire(_chunkSize);
+    }
+
+    if (_backend == SshFileBackend::Inline)
+    {
+        return;
+    }
+
+#ifdef CPPSSH_HAVE_LIBURING
+    if (io_uring_queue_init(_slots.size(), &_ring, 0) == 0)
+    {
+        _backend = SshFileBackend::Uring;
+        for (_Slot& slot : _slots)
+        {
+            _Prepare(slot, _issued++);
+            _Submit(slot);
+        }
+        return;
+    }
+#endif
+
+    _thread = thread(&SshFileReader::_Run, this);
+}
+
+SshFileReader::~SshFileReader()
+{
+    if (_backend == SshFileBackend::Thread)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _changed.notify_all();
+        _thread.join();
+    }
+
+#ifdef CPPSSH_HAVE_LIBURING
+    if (_backend == SshFileBackend::Uring)
+    {
+        // The kernel still writes into the buffers of reads in flight
+        _stopping = true;
+        while (_inFlight > 0)
+        {
+            _Reap();
+        }
+        io_uring_queue_exit(&_ring);
+    }
+#endif
+}
+
+void SshFileReader::_Prepare(_Slot& slot, uint64_t chunk)
+{
+    slot.offset = _offset + chunk * _chunkSize;
+    slot.length = min<uint64_t>(_chunkSize, _end - slot.offset);
+    slot.filled = 0;
+    slot.state = _State::Busy;
+}
+
+void SshFileReader::_Run()
+{
+    unique_lock<mutex> lock(_mutex);
+
+    while (_stopping == false && _failed == false && _issued < _chunks)
+    {
+        _Slot& slot = _slots[_issued % _slots.size()];
+        int error = 0;
+
+        if (slot.state != _State::Free)
+        {
+            _changed.wait(lock);
+            continue;
+        }
+
+        _Prepare(slot, _issued++);
+        lock.unlock();
+        bool ok = readFully(_fd, slot.buffer.Data(), slot.offset, slot.length, slot.filled,
+                            error);
+        lock.lock();
+
+        if (ok)
+        {
+            slot.state = _State::Ready;
+        }
+        else
+        {
+            _error = error;
+            _failed = true;
+        }
+        _changed.notify_all();
+    }
+}
+
+#ifdef CPPSSH_HAVE_LIBURING
+void SshFileReader::_Submit(_Slot& slot)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+
+    // The ring has an entry per slot, so one is always free
+    io_uring_prep_read(sqe, _fd, slot.buffer.Data() + slot.filled, slot.length - slot.filled,
+                       slot.offset + slot.filled);
+    io_uring_sqe_set_data(sqe, &slot);
+    io_uring_submit(&_ring);
+    _inFlight++;
+}
+
+void SshFileReader::_Reap()
+{
+    struct io_uring_cqe *cqe;
+    int res = io_uring_wait_cqe(&_ring, &cqe);
+
+    if (res < 0)
+    {
+        // Only an interrupted wait gets here, the completion is still coming
+        return;
+    }
+
+    _Slot& slot = *(_Slot*) io_uring_cqe_get_data(cqe);
+    res = cqe->res;
+    io_uring_cqe_seen(&_ring, cqe);
+    _inFlight--;
+
+    if (_stopping)
+    {
+        return;
+    }
+    if (res <= 0)
+    {
+        _error = res < 0 ? -res : 0;
+        _failed = true;
+        return;
+    }
+
+    slot.filled += res;
+    if (slot.filled < slot.length)
+    {
+        _Submit(slot);
+        return;
+    }
+    slot.state = _State::Ready;
+}
+#endif
+
+bool SshFileReader::Next(SshFileChunk& chunk)
+{
+    if (_next >= _chunks)
+    {
+        return false;
+    }
+
+    _Slot& slot = _slots[_next % _slots.size()];
+
+    switch (_backend)
+    {
+    case SshFileBackend::Inline:
+        _Prepare(slot, _next);
+        if (readFully(_fd, slot.buffer.Data(), slot.offset, slot.length, slot.filled,
+                      _error) == false)
+        {
+            return false;
+        }
+        break;
+
+    case SshFileBackend::Thread:
+    {
+        unique_lock<mutex> lock(_mutex);
+
+        _changed.wait(lock, [&]{ return slot.state == _State::Ready || _failed; });
+        if (slot.state != _State::Ready)
+        {
+            return false;
+        }
+        slot.state = _State::Out;
+        break;
+    }
+
+    case SshFileBackend::Uring:
+#ifdef CPPSSH_HAVE_LIBURING
+        while (slot.state == _State::Busy && _failed == false)
+        {
+            _Reap();
+        }
+#endif
+        if (slot.state != _State::Ready)
+        {
+            return false;
+        }
+        break;
+    }
+
+    if (_backend != SshFileBackend::Thread)
+    {
+        slot.state = _State::Out;
+    }
+    chunk.data = slot.buffer.Data();
+    chunk.length = slot.length;
+    chunk.slot = _next % _slots.size();
+    _next++;
+
+    return true;
+}
+
+void SshFileReader::Done(const SshFileChunk& chunk)
+{
+    _Slot& slot = _slots[chunk.slot];
+
+    if (_backend == SshFileBackend::Thread)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            slot.state = _State::Free;
+        }
+        _changed.notify_all();
+        return;
+    }
+
+    slot.state = _State::Free;
+
+#ifdef CPPSSH_HAVE_LIBURING
+    if (_backend == SshFileBackend::Uring && _failed == false && _issued < _chunks &&
+        &_slots[_issued % _slots.size()] == &slot)
+    {
+        _Prepare(slot, _issued++);
+        _Submit(slot);
+    }
+#endif
+}
+
+SshFileWriter::SshFileWriter(int fd, uint64_t offset, uint64_t length, size_t chunkSize,
+                             size_t depth, bool dropPageCache):
+                             _fd(fd), _chunkSize(max<size_t>(chunkSize, 1)),
+                             _dropPageCache(dropPageCache), _nextOffset(offset),
+                             _writeback(offset), _flushed(offset)
+{
+    uint64_t chunks = (length + _chunkSize - 1) / _chunkSize;
+    int flags = fcntl(fd, F_GETFL);
+
+    _direct = flags >= 0 && (flags & O_DIRECT) != 0;
+    if (depth > 0 && chunks > 1)
+    {
+        _backend = SshFileBackend::Thread;
+    }
+
+    // The chunk being received and the ones written behind it
+    _slots.resize(_backend == SshFileBackend::Inline ? 1 : min<uint64_t>(depth + 1, chunks));
+    for (_Slot& slot : _slots)
+    {
+        slot.buffer = SshBufferPool::Shared().Acquire(_chunkSize);
+    }
+
+    if (_backend == SshFileBackend::Inline)
+    {
+        return;
+    }
+
+#ifdef CPPSSH_HAVE_LIBURING
+    if (io_uring_queue_init(_slots.size(), &_ring, 0) == 0)
+    {
+        _backend = SshFileBackend::Uring;
+        return;
+    }
+#endif
+
+    _thread = thread(&SshFileWriter::_Run, this);
+}
+
+SshFileWriter::~SshFileWriter()
+{
+    if (_backend == SshFileBackend::Thread)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _changed.notify_all();
+        _thread.join();
+    }
+
+#ifdef CPPSSH_HAVE_LIBURING
+    if (_backend == SshFileBackend::Uring)
+    {
+        while (_inFlight > 0)
+        {
+            _Reap();
+        }
+        io_uring_queue_exit(&_ring);
+    }
+#endif
+}
+
+bool SshFileWriter::_WriteSlot(_Slot& slot)
+{
+    while (slot.done < slot.length)
+    {
+        ssize_t nbytes = pwrite(_fd, slot.buffer.Data() + slot.done, slot.length - slot.done,
+                                slot.offset + slot.done);
+
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            lock_guard<mutex> lock(_mutex);
+            _error = nbytes < 0 ? errno : EIO;
+            _failed = true;
+            return false;
+        }
+        slot.done += nbytes;
+    }
+
+    return true;
+}
+
+// Everything before end is written. Starts its writeback and drops what was
+// started before, which has had the time of a chunk to reach the disk.
+void SshFileWriter::_Written(uint64_t end)
+{
+    if (_dropPageCache == false || end <= _writeback)
+    {
+        return;
+    }
+
+    if (_writeback > _flushed)
+    {
+        sync_file_range(_fd, _flushed, _writeback - _flushed,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(_fd, _flushed, _writeback - _flushed, POSIX_FADV_DONTNEED);
+        _flushed = _writeback;
+    }
+
+    sync_file_range(_fd, _writeback, end - _writeback, SYNC_FILE_RANGE_WRITE);
+    _writeback = end;
+}
+
+void SshFileWriter::_Run()
+{
+    unique_lock<mutex> lock(_mutex);
+
+    while (_failed == false)
+    {
+        _Slot& slot = _slots[_written % _slots.size()];
+
+        if (_written < _queued && slot.state == _State::Queued)
+        {
+            lock.unlock();
+            bool ok = _WriteSlot(slot);
+            if (ok)
+            {
+                _Written(slot.offset + slot.length);
+            }
+            lock.lock();
+
+            if (ok)
+            {
+                slot.state = _State::Free;
+                _written++;
+            }
+            _changed.notify_all();
+            continue;
+        }
+
+        if (_stopping)
+        {
+            break;
+        }
+        _changed.wait(lock);
+    }
+}
+
+#ifdef CPPSSH_HAVE_LIBURING
+void SshFileWriter::_Submit(_Slot& slot)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+
+    io_uring_prep_write(sqe, _fd, slot.buffer.Data() + slot.done, slot.length - slot.done,
+                        slot.offset + slot.done);
+    io_uring_sqe_set_data(sqe, &slot);
+    io_uring_submit(&_ring);
+    _inFlight++;
+}
+
+void SshFileWriter::_Reap()
+{
+    struct io_uring_cqe *cqe;
+    int res = io_uring_wait_cqe(&_ring, &cqe);
+
+    if (res < 0)
+    {
+        return;
+    }
+
+    _Slot& slot = *(_Slot*) io_uring_cqe_get_data(cqe);
+    res = cqe->res;
+    io_uring_cqe_seen(&_ring, cqe);
+    _inFlight--;
+
+    if (res <= 0)
+    {
+        _error = res < 0 ? -res : EIO;
+        _failed = true;
+        slot.state = _State::Free;
+        return;
+    }
+
+    slot.done += res;
+    if (slot.done < slot.length)
+    {
+        _Submit(slot);
+        return;
+    }
+    slot.state = _State::Free;
+    _written++;
+
+    // Completions come in any order, only the part with no write left in
+    // flight before it counts as written
+    uint64_t end = _nextOffset;
+    for (const _Slot& other : _slots)
+    {
+        if (other.state == _State::Busy)
+        {
+            end = min(end, other.offset);
+        }
+    }
+    _Written(end);
+}
+#endif
+
+bool SshFileWriter::Next(SshFileChunk& chunk)
+{
+    size_t index = _queued % _slots.size();
+    _Slot& slot = _slots[index];
+
+    if (_backend == SshFileBackend::Thread)
+    {
+        unique_lock<mutex> lock(_mutex);
+
+        _changed.wait(lock, [&]{ return slot.state == _State::Free || _failed; });
+        if (_failed)
+        {
+            return false;
+        }
+        slot.state = _State::Out;
+    }
+    else
+    {
+#ifdef CPPSSH_HAVE_LIBURING
+        while (_backend == SshFileBackend::Uring && slot.state == _State::Busy &&
+               _failed == false)
+        {
+            _Reap();
+        }
+#endif
+        if (_failed)
+        {
+            return false;
+        }
+        slot.state = _State::Out;
+    }
+    chunk.data = slot.buffer.Data();
+    chunk.length = _chunkSize;
+    chunk.slot = index;
+
+    return true;
+}
+
+void SshFileWriter::Write(const SshFileChunk& chunk)
+{
+    _Slot& slot = _slots[chunk.slot];
+
+    // Only the tail of a file can be unaligned, it goes through the page
+    // cache. Writes before it are aligned, so they don't mind the change.
+    if (_direct && chunk.length % directIoAlignment != 0)
+    {
+        fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT);
+        _direct = false;
+    }
+
+    slot.offset = _nextOffset;
+    slot.length = chunk.length;
+    slot.done = 0;
+    _nextOffset += chunk.length;
+
+    switch (_backend)
+    {
+    case SshFileBackend::Inline:
+        _queued++;
+        if (_WriteSlot(slot))
+        {
+            _Written(_nextOffset);
+            _written++;
+        }
+        slot.state = _State::Free;
+        break;
+
+    case SshFileBackend::Thread:
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        slot.state = _State::Queued;
+        _queued++;
+        _changed.notify_all();
+        break;
+    }
+
+    case SshFileBackend::Uring:
+#ifdef CPPSSH_HAVE_LIBURING
+        slot.state = _State::Busy;
+        _queued++;
+        _Submit(slot);
+#endif
+        break;
+    }
+}
+
+int SshFileWriter::Flush()
+{
+    if (_backend == SshFileBackend::Thread)
+    {
+        unique_lock<mutex> lock(_mutex);
+
+        _changed.wait(lock, [&]{ return _written == _queued || _failed; });
+    }
+#ifdef CPPSSH_HAVE_LIBURING
+    while (_backend == SshFileBackend::Uring && _inFlight > 0)
+    {
+        _Reap();
+    }
+#endif
+
+    if (_failed)
+    {
+        return SSH_ERROR;
+    }
+
+    if (_dropPageCache && _nextOffset > _flushed)
+    {
+        fdatasync(_fd);
+        posix_fadvise(_fd, _flushed, _nextOffset - _flushed, POSIX_FADV_DONTNEED);
+        _writeback = _flushed = _nextOffset;
+    }
+
+    return SSH_OK;
+}
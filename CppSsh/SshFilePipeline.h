@@ -0,0 +1,180 @@
+#ifndef __SSH_FILE_PIPELINE_H__
+#define __SSH_FILE_PIPELINE_H__
+
+#include "SshBufferPool.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#ifdef CPPSSH_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+// Part of a local file on its way between the disk and a channel. data is a
+// buffer of the pipeline, valid until the chunk is handed back.
+struct SshFileChunk
+{
+    char *data{nullptr};
+    size_t length{0};
+    size_t slot{0};
+};
+
+// How the pipelines reach the disk: io_uring when the library is built with
+// liburing and the kernel allows it, a thread of their own otherwise, and
+// inline for a depth of 0 or a file of a single chunk
+enum class SshFileBackend
+{
+    Inline,
+    Thread,
+    Uring
+};
+
+// Reads a range of a local file up to depth chunks ahead of the one being
+// sent, so the disk and the channel work at the same time. Chunks come out
+// in file order, one at a time, in buffers that the reads fill directly.
+class SshFileReader
+{
+public:
+    SshFileReader(int fd, uint64_t offset, uint64_t length, size_t chunkSize, size_t depth);
+    ~SshFileReader();
+    SshFileReader(const SshFileReader&) = delete;
+    SshFileReader& operator=(const SshFileReader&) = delete;
+
+    // Waits for the next chunk. Fails past the end of the range, on a read
+    // error and when the file ends before the range does.
+    bool Next(SshFileChunk& chunk);
+    // Gives the buffer back to be filled with a later chunk
+    void Done(const SshFileChunk& chunk);
+    // errno of the failed read, 0 for a file shorter than the range
+    int Error() const { return _error; };
+    SshFileBackend Backend() const { return _backend; };
+
+private:
+    enum class _State
+    {
+        Free,
+        Busy,
+        Ready,
+        Out
+    };
+
+    struct _Slot
+    {
+        SshPooledBuffer buffer;
+        uint64_t offset{0};
+        size_t length{0};
+        size_t filled{0};
+        _State state{_State::Free};
+    };
+
+    void _Prepare(_Slot& slot, uint64_t chunk);
+    void _Run();
+#ifdef CPPSSH_HAVE_LIBURING
+    void _Submit(_Slot& slot);
+    void _Reap();
+#endif
+
+private:
+    int _fd;
+    uint64_t _offset;
+    uint64_t _end;
+    size_t _chunkSize;
+    uint64_t _chunks;
+    SshFileBackend _backend{SshFileBackend::Inline};
+    vector<_Slot> _slots;
+    // Chunks handed to the caller, and those whose read was started
+    uint64_t _next{0};
+    uint64_t _issued{0};
+    int _error{0};
+    bool _failed{false};
+    bool _stopping{false};
+    mutex _mutex;
+    condition_variable _changed;
+    thread _thread;
+#ifdef CPPSSH_HAVE_LIBURING
+    struct io_uring _ring;
+    size_t _inFlight{0};
+#endif
+};
+
+// Writes a local file from offset on, up to depth chunks behind the one
+// being received. The caller fills the buffers Next gives out and queues
+// them back with Write, the data isn't copied on the way to the disk. Files
+// opened with O_DIRECT get their unaligned tail through the page cache, and
+// with dropPageCache written data is flushed and evicted as it goes.
+class SshFileWriter
+{
+public:
+    SshFileWriter(int fd, uint64_t offset, uint64_t length, size_t chunkSize, size_t depth,
+                  bool dropPageCache);
+    // Waits for the queued writes, Flush reports whether they worked
+    ~SshFileWriter();
+    SshFileWriter(const SshFileWriter&) = delete;
+    SshFileWriter& operator=(const SshFileWriter&) = delete;
+
+    // Waits for a free buffer of chunkSize bytes. Fails once a write failed.
+    bool Next(SshFileChunk& chunk);
+    // Queues chunk.length bytes of a buffer from Next after the earlier ones
+    void Write(const SshFileChunk& chunk);
+    // Waits until everything queued is written
+    int Flush();
+    int Error() const { return _error; };
+    SshFileBackend Backend() const { return _backend; };
+
+private:
+    enum class _State
+    {
+        Free,
+        Out,
+        Queued,
+        Busy
+    };
+
+    struct _Slot
+    {
+        SshPooledBuffer buffer;
+        uint64_t offset{0};
+        size_t length{0};
+        size_t done{0};
+        _State state{_State::Free};
+    };
+
+    bool _WriteSlot(_Slot& slot);
+    void _Written(uint64_t end);
+    void _Run();
+#ifdef CPPSSH_HAVE_LIBURING
+    void _Submit(_Slot& slot);
+    void _Reap();
+#endif
+
+private:
+    int _fd;
+    size_t _chunkSize;
+    bool _direct;
+    bool _dropPageCache;
+    SshFileBackend _backend{SshFileBackend::Inline};
+    vector<_Slot> _slots;
+    // Chunks queued by the caller, and those written out
+    uint64_t _queued{0};
+    uint64_t _written{0};
+    // Where the next queued chunk goes, and how far writeback was started
+    // and the page cache dropped
+    uint64_t _nextOffset;
+    uint64_t _writeback;
+    uint64_t _flushed;
+    int _error{0};
+    bool _failed{false};
+    bool _stopping{false};
+    mutex _mutex;
+    condition_variable _changed;
+    thread _thread;
+#ifdef CPPSSH_HAVE_LIBURING
+    struct io_uring _ring;
+    size_t _inFlight{0};
+#endif
+};
+
+#endif // __SSH_FILE_PIPELINE_H__
@@ -0,0 +1,491 @@
+#include "SshHash.h"
+#include "SshBufferPool.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+static const uint32_t sha256Rounds[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotateRight(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+SshSha256::SshSha256()
+{
+    Reset();
+}
+
+void SshSha256::Reset()
+{
+    static const uint32_t initial[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(_state, initial, sizeof(_state));
+    _blockLength = 0;
+    _length = 0;
+}
+
+void SshSha256::_Compress(const uint8_t *block)
+{
+    uint32_t w[64];
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | (uint32_t) block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + sha256Rounds[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    _state[0] += a;
+    _state[1] += b;
+    _state[2] += c;
+    _state[3] += d;
+    _state[4] += e;
+    _state[5] += f;
+    _state[6] += g;
+    _state[7] += h;
+}
+
+void SshSha256::Update(const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+
+    _length += length;
+
+    if (_blockLength > 0)
+    {
+        size_t count = min(length, sizeof(_block) - _blockLength);
+
+        memcpy(_block + _blockLength, bytes, count);
+        _blockLength += count;
+        bytes += count;
+        length -= count;
+
+        if (_blockLength < sizeof(_block))
+        {
+            return;
+        }
+        _Compress(_block);
+        _blockLength = 0;
+    }
+
+    while (length >= sizeof(_block))
+    {
+        _Compress(bytes);
+        bytes += sizeof(_block);
+        length -= sizeof(_block);
+    }
+
+    memcpy(_block, bytes, length);
+    _blockLength = length;
+}
+
+string SshSha256::HexDigest()
+{
+    static const char hex[] = "0123456789abcdef";
+    uint64_t bits = _length * 8;
+    uint8_t padding[72] = {0x80};
+    size_t paddingLength = (_blockLength < 56 ? 56 : 120) - _blockLength;
+    string digest;
+
+    for (int i = 0; i < 8; i++)
+    {
+        padding[paddingLength + i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    Update(padding, paddingLength + 8);
+
+    for (uint32_t word : _state)
+    {
+        for (int shift = 28; shift >= 0; shift -= 4)
+        {
+            digest += hex[(word >> shift) & 0xf];
+        }
+    }
+
+    return digest;
+}
+
+string SshSha256File(const string& path)
+{
+    SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(1024 * 1024);
+    SshSha256 hash;
+    ssize_t nbytes;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return "";
+    }
+
+    while ((nbytes = read(fd, buffer.Data(), buffer.Size())) != 0)
+    {
+        if (nbytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return "";
+        }
+        hash.Update(buffer.Data(), nbytes);
+    }
+
+    close(fd);
+
+    return hash.HexDigest();
+}
+
+// Reflected CRC-32 polynomial of zlib and gzip
+static constexpr uint32_t crc32Polynomial = 0xedb88320;
+
+struct Crc32Tables
+{
+    uint32_t table[8][256];
+
+    Crc32Tables()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = crc & 1 ? (crc >> 1) ^ crc32Polynomial : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+
+        // table[k] advances a byte through k more zero bytes
+        for (int k = 1; k < 8; k++)
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static const Crc32Tables& crc32Tables()
+{
+    static const Crc32Tables tables;
+
+    return tables;
+}
+
+// Works on the inverted state, like the other kernels
+static uint32_t crc32Table(const uint8_t *data, size_t length, uint32_t crc)
+{
+    const uint32_t (*table)[256] = crc32Tables().table;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8)
+    {
+        uint32_t low, high;
+
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+              table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+#endif
+
+    while (length-- > 0)
+    {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Folds 64 bytes at a time into four 128 bit lanes, then Barrett reduces
+// them to 32 bits, after Gopal et al., "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction". length is a multiple of 16 and
+// at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32PclmulBlocks(const uint8_t *data, size_t length, uint32_t crc)
+{
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    data += 64;
+    length -= 64;
+
+    while (length >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i*) (data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i*) (data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i*) (data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i*) (data + 0x30)));
+        data += 64;
+        length -= 64;
+    }
+
+    // Four lanes into one
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+    for (__m128i next : {x2, x3, x4})
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+    }
+
+    while (length >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*) data)), x5);
+        data += 16;
+        length -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(const uint8_t *data, size_t length, uint32_t crc)
+{
+    if (length >= 64)
+    {
+        size_t blocks = length & ~(size_t) 15;
+
+        crc = crc32PclmulBlocks(data, blocks, crc);
+        data += blocks;
+        length -= blocks;
+    }
+
+    return crc32Table(data, length, crc);
+}
+#endif
+
+#if defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32Arm(const uint8_t *data, size_t length, uint32_t crc)
+{
+    while (length >= 32)
+    {
+        uint64_t words[4];
+
+        memcpy(words, data, sizeof(words));
+        crc = __crc32d(crc, words[0]);
+        crc = __crc32d(crc, words[1]);
+        crc = __crc32d(crc, words[2]);
+        crc = __crc32d(crc, words[3]);
+        data += 32;
+        length -= 32;
+    }
+
+    while (length >= 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32d(crc, word);
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0)
+    {
+        crc = __crc32b(crc, *data++);
+    }
+
+    return crc;
+}
+#endif
+
+bool SshCrc32Supported(SshCrc32Kernel kernel)
+{
+    switch (kernel)
+    {
+    case SshCrc32Kernel::Pclmul:
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+        return false;
+#endif
+
+    case SshCrc32Kernel::Arm:
+#if defined(__aarch64__)
+        return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+        return false;
+#endif
+
+    case SshCrc32Kernel::Table:
+        return true;
+    }
+
+    return false;
+}
+
+const char* SshCrc32KernelName(SshCrc32Kernel kernel)
+{
+    switch (kernel)
+    {
+    case SshCrc32Kernel::Pclmul:
+        return "pclmul";
+    case SshCrc32Kernel::Arm:
+        return "arm";
+    case SshCrc32Kernel::Table:
+        return "table";
+    }
+
+    return "unknown";
+}
+
+uint32_t SshCrc32(SshCrc32Kernel kernel, const void *data, size_t length, uint32_t crc)
+{
+    const uint8_t *bytes = (const uint8_t*) data;
+
+    crc = ~crc;
+    switch (kernel)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SshCrc32Kernel::Pclmul:
+        crc = crc32Pclmul(bytes, length, crc);
+        break;
+#endif
+#if defined(__aarch64__)
+    case SshCrc32Kernel::Arm:
+        crc = crc32Arm(bytes, length, crc);
+        break;
+#endif
+    default:
+        crc = crc32Table(bytes, length, crc);
+        break;
+    }
+
+    return ~crc;
+}
+
+uint32_t SshCrc32(const void *data, size_t length, uint32_t crc)
+{
+    static const SshCrc32Kernel best =
+        SshCrc32Supported(SshCrc32Kernel::Pclmul) ? SshCrc32Kernel::Pclmul :
+        SshCrc32Supported(SshCrc32Kernel::Arm) ? SshCrc32Kernel::Arm : SshCrc32Kernel::Table;
+
+    return SshCrc32(best, data, length, crc);
+}
+
+bool SshCrc32File(int fd, uint64_t length, uint32_t& crc)
+{
+    SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(1024 * 1024);
+    uint64_t offset = 0;
+
+    crc = 0;
+    while (offset < length)
+    {
+        ssize_t nbytes = pread(fd, buffer.Data(), min<uint64_t>(buffer.Size(), length - offset),
+                               offset);
+
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            return false;
+        }
+        crc = SshCrc32(buffer.Data(), nbytes, crc);
+        offset += nbytes;
+    }
+
+    return true;
+}
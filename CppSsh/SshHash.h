@@ -0,0 +1,55 @@
+#ifndef __SSH_HASH_H__
+#define __SSH_HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+using namespace std;
+
+// SHA-256, giving the same digests as sha256sum on the remote host
+class SshSha256
+{
+public:
+    SshSha256();
+    void Update(const void *data, size_t length);
+    // Hex digest of everything passed to Update; the object must be reset
+    // before it is used again
+    string HexDigest();
+    void Reset();
+
+private:
+    void _Compress(const uint8_t *block);
+
+private:
+    uint32_t _state[8];
+    uint8_t _block[64];
+    size_t _blockLength;
+    uint64_t _length;
+};
+
+// Hex SHA-256 digest of a local file, empty if it can't be read
+string SshSha256File(const string& path);
+
+// Implementations of CRC-32, fastest first
+enum class SshCrc32Kernel
+{
+    // Folding with carry-less multiplication, x86 with PCLMULQDQ and SSE4.1
+    Pclmul,
+    // CRC32 instructions of ARMv8
+    Arm,
+    // Slicing-by-8 tables, available everywhere
+    Table
+};
+
+// CRC-32 as computed by zlib, gzip and Python's zlib.crc32. Start from 0 and
+// pass the previous result to continue. The first overload picks the fastest
+// kernel the CPU supports.
+uint32_t SshCrc32(const void *data, size_t length, uint32_t crc = 0);
+uint32_t SshCrc32(SshCrc32Kernel kernel, const void *data, size_t length, uint32_t crc = 0);
+bool SshCrc32Supported(SshCrc32Kernel kernel);
+const char* SshCrc32KernelName(SshCrc32Kernel kernel);
+// CRC-32 of the first length bytes of fd, false if they can't be read
+bool SshCrc32File(int fd, uint64_t length, uint32_t& crc);
+
+#endif // __SSH_HASH_H__
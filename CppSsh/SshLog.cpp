@@ -0,0 +1,153 @@
+#include "SshLog.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+atomic<int> sshLogLevel{(int) SshLogLevel::Info};
+
+static shared_ptr<SshLogSink> defaultSink = make_shared<SshStdioLogSink>();
+static shared_ptr<SshLogSink> currentSink = defaultSink;
+
+void SshStdioLogSink::Write(SshLogLevel level, string_view message)
+{
+    switch (level)
+    {
+    case SshLogLevel::Debug:
+        printf("DEBUG - %.*s\n", (int) message.size(), message.data());
+        break;
+    case SshLogLevel::Info:
+        printf("INFO - %.*s\n", (int) message.size(), message.data());
+        break;
+    default:
+        fprintf(stderr, "%.*s\n", (int) message.size(), message.data());
+        break;
+    }
+}
+
+SshAsyncLogSink::SshAsyncLogSink(shared_ptr<SshLogSink> target, size_t capacity):
+    _target(target), _ring(capacity > 0 ? capacity : 1)
+{
+    _thread = thread(&SshAsyncLogSink::_Run, this);
+}
+
+SshAsyncLogSink::~SshAsyncLogSink()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        _stop = true;
+    }
+    _queued.notify_one();
+    _thread.join();
+}
+
+void SshAsyncLogSink::Write(SshLogLevel level, string_view message)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        if (_count == _ring.size())
+        {
+            _dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+
+        // Slots keep their buffers, so a warm ring doesn't allocate
+        _Entry& entry = _ring[(_head + _count) % _ring.size()];
+        entry.level = level;
+        entry.message.assign(message.data(), message.size());
+        _count++;
+    }
+    _queued.notify_one();
+}
+
+void SshAsyncLogSink::Flush()
+{
+    unique_lock<mutex> lock(_mutex);
+
+    _drained.wait(lock, [this]() { return _count == 0 && _writing == false; });
+}
+
+void SshAsyncLogSink::_Run()
+{
+    string message;
+    SshLogLevel level;
+
+    unique_lock<mutex> lock(_mutex);
+    while (true)
+    {
+        _queued.wait(lock, [this]() { return _count > 0 || _stop; });
+        if (_count == 0)
+        {
+            break;
+        }
+
+        // Swapped rather than copied, the slot gets the previous buffer back
+        level = _ring[_head].level;
+        swap(message, _ring[_head].message);
+        _head = (_head + 1) % _ring.size();
+        _count--;
+        _writing = true;
+
+        uint64_t dropped = _dropped.load(memory_order_relaxed);
+
+        lock.unlock();
+        if (dropped != _reportedDropped)
+        {
+            char notice[64];
+
+            snprintf(notice, sizeof(notice), "%llu log messages dropped",
+                     (unsigned long long) (dropped - _reportedDropped));
+            _target->Write(SshLogLevel::Warning, notice);
+            _reportedDropped = dropped;
+        }
+        _target->Write(level, message);
+        lock.lock();
+
+        _writing = false;
+        if (_count == 0)
+        {
+            _drained.notify_all();
+        }
+    }
+}
+
+void SshSetLogSink(shared_ptr<SshLogSink> sink)
+{
+    atomic_store(&currentSink, sink ? sink : defaultSink);
+}
+
+void SshSetLogLevel(SshLogLevel level)
+{
+    sshLogLevel.store((int) level, memory_order_relaxed);
+}
+
+void SshLogWrite(SshLogLevel level, const char *format, ...)
+{
+    char buffer[512];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return;
+    }
+
+    shared_ptr<SshLogSink> sink = atomic_load(&currentSink);
+
+    if ((size_t) length < sizeof(buffer))
+    {
+        sink->Write(level, string_view(buffer, length));
+        return;
+    }
+
+    string message(length, '\0');
+
+    va_start(args, format);
+    vsnprintf(&message[0], length + 1, format, args);
+    va_end(args);
+    sink->Write(level, message);
+}
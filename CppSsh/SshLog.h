@@ -0,0 +1,113 @@
+#ifndef __SSH_LOG_H__
+#define __SSH_LOG_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum class SshLogLevel
+{
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off
+};
+
+// Messages below this level are compiled out, e.g. -DCPPSSH_MIN_LOG_LEVEL=2
+// keeps warnings and errors only
+#ifndef CPPSSH_MIN_LOG_LEVEL
+#define CPPSSH_MIN_LOG_LEVEL 0
+#endif
+
+// Receives every message that passes both level checks, already formatted
+// and without a trailing newline. Write may be called from any thread.
+class SshLogSink
+{
+public:
+    virtual ~SshLogSink() = default;
+    virtual void Write(SshLogLevel level, string_view message) = 0;
+};
+
+// Default sink: debug and info on stdout prefixed with their level,
+// warnings and errors on stderr
+class SshStdioLogSink : public SshLogSink
+{
+public:
+    void Write(SshLogLevel level, string_view message) override;
+};
+
+// Queues messages in a fixed size ring and writes them to the target sink
+// from a background thread, so the calling thread never waits on log I/O.
+// Messages arriving while the ring is full are dropped and counted.
+class SshAsyncLogSink : public SshLogSink
+{
+public:
+    SshAsyncLogSink(shared_ptr<SshLogSink> target, size_t capacity = 4096);
+    ~SshAsyncLogSink();
+    SshAsyncLogSink(const SshAsyncLogSink&) = delete;
+    SshAsyncLogSink& operator=(const SshAsyncLogSink&) = delete;
+
+    void Write(SshLogLevel level, string_view message) override;
+    // Waits until every queued message has reached the target
+    void Flush();
+    uint64_t Dropped() const { return _dropped.load(memory_order_relaxed); };
+
+private:
+    struct _Entry
+    {
+        SshLogLevel level;
+        string message;
+    };
+
+    void _Run();
+
+private:
+    shared_ptr<SshLogSink> _target;
+    vector<_Entry> _ring;
+    size_t _head{0};
+    size_t _count{0};
+    bool _writing{false};
+    bool _stop{false};
+    atomic<uint64_t> _dropped{0};
+    uint64_t _reportedDropped{0};
+    mutex _mutex;
+    condition_variable _queued;
+    condition_variable _drained;
+    thread _thread;
+};
+
+// Replaces the sink for the whole library, a null sink restores the default
+void SshSetLogSink(shared_ptr<SshLogSink> sink);
+void SshSetLogLevel(SshLogLevel level);
+
+extern atomic<int> sshLogLevel;
+
+inline bool SshLogEnabled(SshLogLevel level)
+{
+    return (int) level >= sshLogLevel.load(memory_order_relaxed);
+}
+
+void SshLogWrite(SshLogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Arguments are only evaluated and formatted when the level is enabled
+#define SSH_LOG(level, ...)                                                  \
+    do                                                                       \
+    {                                                                        \
+        if ((int) SshLogLevel::level >= CPPSSH_MIN_LOG_LEVEL &&              \
+            SshLogEnabled(SshLogLevel::level))                               \
+        {                                                                    \
+            SshLogWrite(SshLogLevel::level, __VA_ARGS__);                    \
+        }                                                                    \
+    } while (0)
+
+#endif // __SSH_LOG_H__
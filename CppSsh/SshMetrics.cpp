@@ -0,0 +1,143 @@
+#include "SshMetrics.h"
+
+#include <stdio.h>
+
+static const char* phaseNames[(size_t) SshPhase::Count] =
+{
+    "connect",
+    "key_exchange",
+    "known_host",
+    "auth",
+    "channel_open",
+    "execute",
+    "push",
+    "pull",
+    "sync"
+};
+
+const char* SshPhaseName(SshPhase phase)
+{
+    return phase < SshPhase::Count ? phaseNames[(size_t) phase] : "unknown";
+}
+
+void SshMetrics::Record(SshPhase phase, chrono::nanoseconds elapsed, bool ok,
+                        string_view host)
+{
+    _Phase& stats = _phases[(size_t) phase];
+    uint64_t micros = elapsed.count() > 0 ? elapsed.count() / 1000 : 0;
+    size_t bucket = 0;
+
+    // Smallest i with micros <= 2^i
+    while (bucket < SshPhaseSnapshot::buckets && (uint64_t(1) << bucket) < micros)
+    {
+        bucket++;
+    }
+
+    stats.count.fetch_add(1, memory_order_relaxed);
+    stats.totalNs.fetch_add(elapsed.count(), memory_order_relaxed);
+    stats.histogram[bucket].fetch_add(1, memory_order_relaxed);
+    if (ok == false)
+    {
+        stats.errors.fetch_add(1, memory_order_relaxed);
+    }
+
+    if (_observed.load(memory_order_acquire))
+    {
+        lock_guard<mutex> lock(_observerMutex);
+
+        if (_observer)
+        {
+            _observer(SshMetricEvent{phase, elapsed, ok, host});
+        }
+    }
+}
+
+void SshMetrics::AddBytes(uint64_t bytesIn, uint64_t bytesOut)
+{
+    _bytesIn.fetch_add(bytesIn, memory_order_relaxed);
+    _bytesOut.fetch_add(bytesOut, memory_order_relaxed);
+}
+
+void SshMetrics::SetObserver(function<void(const SshMetricEvent&)> observer)
+{
+    lock_guard<mutex> lock(_observerMutex);
+
+    _observer = observer;
+    _observed.store((bool) _observer, memory_order_release);
+}
+
+SshMetricsSnapshot SshMetrics::Snapshot() const
+{
+    SshMetricsSnapshot snapshot;
+
+    for (size_t i = 0; i < (size_t) SshPhase::Count; i++)
+    {
+        const _Phase& stats = _phases[i];
+        SshPhaseSnapshot& phase = snapshot.phases[i];
+
+        phase.count = stats.count.load(memory_order_relaxed);
+        phase.errors = stats.errors.load(memory_order_relaxed);
+        phase.total = chrono::nanoseconds(stats.totalNs.load(memory_order_relaxed));
+        for (size_t bucket = 0; bucket <= SshPhaseSnapshot::buckets; bucket++)
+        {
+            phase.histogram[bucket] = stats.histogram[bucket].load(memory_order_relaxed);
+        }
+    }
+    snapshot.bytesIn = _bytesIn.load(memory_order_relaxed);
+    snapshot.bytesOut = _bytesOut.load(memory_order_relaxed);
+
+    return snapshot;
+}
+
+string SshMetrics::PrometheusText() const
+{
+    SshMetricsSnapshot snapshot = Snapshot();
+    string text;
+    char line[256];
+
+    text += "# HELP cppssh_phase_seconds Duration of SSH client operations by phase.\n"
+            "# TYPE cppssh_phase_seconds histogram\n";
+    for (size_t i = 0; i < (size_t) SshPhase::Count; i++)
+    {
+        const SshPhaseSnapshot& phase = snapshot.phases[i];
+        uint64_t cumulative = 0;
+
+        for (size_t bucket = 0; bucket < SshPhaseSnapshot::buckets; bucket++)
+        {
+            cumulative += phase.histogram[bucket];
+            snprintf(line, sizeof(line), "cppssh_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                     phaseNames[i], (double) (uint64_t(1) << bucket) / 1e6,
+                     (unsigned long long) cumulative);
+            text += line;
+        }
+        snprintf(line, sizeof(line),
+                 "cppssh_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+                 "cppssh_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                 "cppssh_phase_seconds_count{phase=\"%s\"} %llu\n",
+                 phaseNames[i], (unsigned long long) phase.count,
+                 phaseNames[i], chrono::duration<double>(phase.total).count(),
+                 phaseNames[i], (unsigned long long) phase.count);
+        text += line;
+    }
+
+    text += "# HELP cppssh_phase_errors_total Failed SSH client operations by phase.\n"
+            "# TYPE cppssh_phase_errors_total counter\n";
+    for (size_t i = 0; i < (size_t) SshPhase::Count; i++)
+    {
+        snprintf(line, sizeof(line), "cppssh_phase_errors_total{phase=\"%s\"} %llu\n",
+                 phaseNames[i], (unsigned long long) snapshot.phases[i].errors);
+        text += line;
+    }
+
+    snprintf(line, sizeof(line),
+             "# HELP cppssh_received_bytes_total Bytes received from SSH servers.\n"
+             "# TYPE cppssh_received_bytes_total counter\n"
+             "cppssh_received_bytes_total %llu\n"
+             "# HELP cppssh_sent_bytes_total Bytes sent to SSH servers.\n"
+             "# TYPE cppssh_sent_bytes_total counter\n"
+             "cppssh_sent_bytes_total %llu\n",
+             (unsigned long long) snapshot.bytesIn, (unsigned long long) snapshot.bytesOut);
+    text += line;
+
+    return text;
+}
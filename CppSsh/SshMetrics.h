@@ -0,0 +1,130 @@
+#ifndef __SSH_METRICS_H__
+#define __SSH_METRICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+enum class SshPhase
+{
+    // TCP connect and the exchange of version banners
+    Connect,
+    // Key exchange, up to the end of ssh_connect
+    KeyExchange,
+    KnownHost,
+    Auth,
+    ChannelOpen,
+    Execute,
+    Push,
+    Pull,
+    Sync,
+    Count
+};
+
+const char* SshPhaseName(SshPhase phase);
+
+// Finished operation as seen by an SshMetrics observer
+struct SshMetricEvent
+{
+    SshPhase phase;
+    chrono::nanoseconds elapsed;
+    bool ok;
+    string_view host;
+};
+
+struct SshPhaseSnapshot
+{
+    // Upper bound of bucket i is 2^i microseconds, the last bucket takes
+    // everything above
+    static constexpr size_t buckets = 28;
+
+    uint64_t count{0};
+    uint64_t errors{0};
+    chrono::nanoseconds total{0};
+    uint64_t histogram[buckets + 1]{};
+};
+
+struct SshMetricsSnapshot
+{
+    SshPhaseSnapshot phases[(size_t) SshPhase::Count];
+    // Bytes on the wire, SSH framing and encryption included
+    uint64_t bytesIn{0};
+    uint64_t bytesOut{0};
+};
+
+// Counters and latency histograms shared by any number of clients. Clients
+// hold a plain pointer to it and skip all of this when the pointer is null,
+// which keeps the disabled path to one branch per operation. Recording only
+// uses relaxed atomics.
+class SshMetrics
+{
+public:
+    SshMetrics() = default;
+    SshMetrics(const SshMetrics&) = delete;
+    SshMetrics& operator=(const SshMetrics&) = delete;
+
+    void Record(SshPhase phase, chrono::nanoseconds elapsed, bool ok, string_view host);
+    void AddBytes(uint64_t bytesIn, uint64_t bytesOut);
+    // Called for every recorded operation, from the thread that ran it
+    void SetObserver(function<void(const SshMetricEvent&)> observer);
+    SshMetricsSnapshot Snapshot() const;
+    // Snapshot in the Prometheus text exposition format
+    string PrometheusText() const;
+
+private:
+    struct _Phase
+    {
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> errors{0};
+        atomic<uint64_t> totalNs{0};
+        atomic<uint64_t> histogram[SshPhaseSnapshot::buckets + 1]{};
+    };
+
+    _Phase _phases[(size_t) SshPhase::Count];
+    atomic<uint64_t> _bytesIn{0};
+    atomic<uint64_t> _bytesOut{0};
+    atomic<bool> _observed{false};
+    mutex _observerMutex;
+    function<void(const SshMetricEvent&)> _observer;
+};
+
+// Times one phase and records it when finished. A timer destroyed without
+// Finish records a failure. Nothing is read or recorded without metrics.
+class SshPhaseTimer
+{
+public:
+    SshPhaseTimer(SshMetrics* metrics, SshPhase phase, string_view host):
+        _metrics(metrics), _phase(phase), _host(host)
+    {
+        if (_metrics)
+        {
+            _start = chrono::steady_clock::now();
+        }
+    };
+    ~SshPhaseTimer() { Finish(false); };
+    SshPhaseTimer(const SshPhaseTimer&) = delete;
+    SshPhaseTimer& operator=(const SshPhaseTimer&) = delete;
+
+    void Finish(bool ok)
+    {
+        if (_metrics)
+        {
+            _metrics->Record(_phase, chrono::steady_clock::now() - _start, ok, _host);
+            _metrics = nullptr;
+        }
+    };
+
+private:
+    SshMetrics* _metrics;
+    SshPhase _phase;
+    string_view _host;
+    chrono::steady_clock::time_point _start;
+};
+
+#endif // __SSH_METRICS_H__
@@ -0,0 +1,261 @@
+#include "SshScheduler.h"
+
+#include <algorithm>
+
+// Share of a limited rate each class gets while all of them wait
+static const double classWeights[sshTransferPriorities] = {16, 4, 1};
+// Smallest burst of a bucket, so chunks don't wait for every few tokens
+static constexpr double minBurst = 64 * 1024;
+// Longest a waiting chunk sleeps before it looks at the buckets again, in
+// case the limits changed
+static constexpr chrono::milliseconds maxWait(100);
+
+double SshPriorityStats::BytesPerSecond() const
+{
+    return busy.count() > 0 ? bytes / busy.count() : 0;
+}
+
+void SshTransferScheduler::_Bucket::Refill(chrono::steady_clock::time_point now)
+{
+    if (rate <= 0)
+    {
+        return;
+    }
+
+    tokens = min(burst, tokens + rate * chrono::duration<double>(now - refilled).count());
+    refilled = now;
+}
+
+chrono::steady_clock::time_point
+SshTransferScheduler::_Bucket::Ready(chrono::steady_clock::time_point now) const
+{
+    if (rate <= 0 || tokens > 0)
+    {
+        return now;
+    }
+
+    return now + chrono::duration_cast<chrono::steady_clock::duration>(
+                 chrono::duration<double>((1 - tokens) / rate));
+}
+
+SshTransferScheduler& SshTransferScheduler::Shared()
+{
+    static SshTransferScheduler scheduler;
+
+    return scheduler;
+}
+
+void SshTransferScheduler::_SetRate(_Bucket& bucket, uint64_t bytesPerSecond, uint64_t burst)
+{
+    bucket.rate = bytesPerSecond;
+    bucket.burst = burst > 0 ? burst : max(bytesPerSecond / 10.0, minBurst);
+    bucket.tokens = bucket.burst;
+    bucket.refilled = chrono::steady_clock::now();
+}
+
+void SshTransferScheduler::SetGlobalRate(uint64_t bytesPerSecond, uint64_t burst)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    _SetRate(_global, bytesPerSecond, burst);
+    _granted.notify_all();
+}
+
+void SshTransferScheduler::SetHostRate(const string& host, uint64_t bytesPerSecond,
+                                       uint64_t burst)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    // Waiting chunks point at the bucket, so it stays even without a limit
+    _SetRate(_hosts[host], bytesPerSecond, burst);
+    _granted.notify_all();
+}
+
+void SshTransferScheduler::Acquire(const string& host, SshTransferPriority priority,
+                                   uint64_t bytes, mutex* held)
+{
+    unique_lock<mutex> lock(_mutex);
+    _Class& current = _classes[(size_t) priority];
+    map<string, _Bucket>::iterator bucket = _hosts.find(host);
+    _Waiter waiter{bucket != _hosts.end() && bucket->second.rate > 0 ? &bucket->second : NULL,
+                   bytes};
+
+    current.stats.bytes += bytes;
+    if (_global.rate <= 0 && waiter.host == NULL)
+    {
+        return;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool released = false;
+
+    current.waiting.push_back(&waiter);
+    while (true)
+    {
+        chrono::steady_clock::time_point wake = _Dispatch();
+
+        if (waiter.granted)
+        {
+            break;
+        }
+        if (held && released == false)
+        {
+            held->unlock();
+            released = true;
+        }
+        _granted.wait_until(lock, wake);
+    }
+
+    current.stats.waited += chrono::steady_clock::now() - start;
+
+    // Taken back without the scheduler lock, which is always taken second
+    if (released)
+    {
+        lock.unlock();
+        held->lock();
+    }
+}
+
+// Grants waiting chunks while the buckets allow, the one with the earliest
+// virtual start first. Returns when the next one could go.
+chrono::steady_clock::time_point SshTransferScheduler::_Dispatch()
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    chrono::steady_clock::time_point wake = now + maxWait;
+    bool granted = false;
+
+    _global.Refill(now);
+
+    while (true)
+    {
+        if (_global.rate > 0 && _global.tokens <= 0)
+        {
+            wake = min(wake, _global.Ready(now));
+            break;
+        }
+
+        _Class *best = NULL;
+        deque<_Waiter*>::iterator bestWaiter;
+        double bestStart = 0;
+        size_t bestIndex = 0;
+
+        for (size_t i = 0; i < sshTransferPriorities; i++)
+        {
+            _Class& candidate = _classes[i];
+
+            // The first chunk of the class whose host has room, others
+            // behind it to the same host keep their order
+            for (deque<_Waiter*>::iterator it = candidate.waiting.begin();
+                 it != candidate.waiting.end(); ++it)
+            {
+                _Bucket *host = (*it)->host;
+
+                if (host)
+                {
+                    host->Refill(now);
+                    if (host->rate > 0 && host->tokens <= 0)
+                    {
+                        wake = min(wake, host->Ready(now));
+                        continue;
+                    }
+                }
+
+                double start = max(_virtualTime, candidate.finish);
+                if (best == NULL || start < bestStart)
+                {
+                    best = &candidate;
+                    bestWaiter = it;
+                    bestStart = start;
+                    bestIndex = i;
+                }
+                break;
+            }
+        }
+
+        if (best == NULL)
+        {
+            break;
+        }
+
+        _Waiter& waiter = **bestWaiter;
+
+        best->waiting.erase(bestWaiter);
+        if (_global.rate > 0)
+        {
+            _global.tokens -= waiter.bytes;
+        }
+        if (waiter.host && waiter.host->rate > 0)
+        {
+            waiter.host->tokens -= waiter.bytes;
+        }
+        _virtualTime = bestStart;
+        best->finish = bestStart + waiter.bytes / classWeights[bestIndex];
+        waiter.granted = true;
+        granted = true;
+    }
+
+    if (granted)
+    {
+        _granted.notify_all();
+    }
+
+    return wake;
+}
+
+void SshTransferScheduler::BeginTransfer(SshTransferPriority priority)
+{
+    lock_guard<mutex> lock(_mutex);
+    _Class& current = _classes[(size_t) priority];
+
+    if (current.stats.active == 0)
+    {
+        current.activeSince = chrono::steady_clock::now();
+    }
+    current.stats.active++;
+    current.stats.transfers++;
+}
+
+void SshTransferScheduler::EndTransfer(SshTransferPriority priority)
+{
+    lock_guard<mutex> lock(_mutex);
+    _Class& current = _classes[(size_t) priority];
+
+    current.stats.active--;
+    if (current.stats.active == 0)
+    {
+        current.stats.busy += chrono::steady_clock::now() - current.activeSince;
+    }
+}
+
+SshSchedulerStats SshTransferScheduler::GetStats()
+{
+    lock_guard<mutex> lock(_mutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    SshSchedulerStats stats;
+
+    for (size_t i = 0; i < sshTransferPriorities; i++)
+    {
+        stats.classes[i] = _classes[i].stats;
+        if (_classes[i].stats.active > 0)
+        {
+            stats.classes[i].busy += now - _classes[i].activeSince;
+        }
+    }
+
+    return stats;
+}
+
+void SshTransferScheduler::ResetStats()
+{
+    lock_guard<mutex> lock(_mutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+    for (_Class& current : _classes)
+    {
+        uint64_t active = current.stats.active;
+
+        current.stats = SshPriorityStats();
+        current.stats.active = active;
+        current.activeSince = now;
+    }
+}
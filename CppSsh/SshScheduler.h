@@ -0,0 +1,132 @@
+#ifndef __SSH_SCHEDULER_H__
+#define __SSH_SCHEDULER_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+enum class SshTransferPriority
+{
+    // Small transfers someone waits for, such as configuration pushes
+    Interactive,
+    Normal,
+    // Large transfers that only need to finish eventually
+    Bulk
+};
+
+static constexpr size_t sshTransferPriorities = 3;
+
+struct SshPriorityStats
+{
+    uint64_t transfers{0};
+    uint64_t active{0};
+    uint64_t bytes{0};
+    // Time with at least one transfer of the class running, and the time its
+    // transfers spent waiting for their share of a rate limit
+    chrono::duration<double> busy{0};
+    chrono::duration<double> waited{0};
+
+    // Achieved rate while the class had transfers running
+    double BytesPerSecond() const;
+};
+
+struct SshSchedulerStats
+{
+    // Indexed by SshTransferPriority
+    SshPriorityStats classes[sshTransferPriorities];
+};
+
+// Shares bandwidth between all the transfers of the process. A global limit
+// and one limit per host are token buckets that transfers draw from chunk by
+// chunk. While a limit holds transfers back, waiting chunks are served by
+// start-time fair queuing between the priority classes, which get 16, 4 and
+// 1 parts of the rate, and first come first served within a class, so
+// transfers of one class take turns. Without a limit nothing waits and the
+// bytes are only counted.
+class SshTransferScheduler
+{
+public:
+    static SshTransferScheduler& Shared();
+
+    SshTransferScheduler() = default;
+    SshTransferScheduler(const SshTransferScheduler&) = delete;
+    SshTransferScheduler& operator=(const SshTransferScheduler&) = delete;
+
+    // 0 removes the limit. burst is the most a bucket saves up while idle,
+    // 0 for a tenth of a second of the rate.
+    void SetGlobalRate(uint64_t bytesPerSecond, uint64_t burst = 0);
+    void SetHostRate(const string& host, uint64_t bytesPerSecond, uint64_t burst = 0);
+    // Blocks until bytes may go to or come from host. A chunk larger than
+    // the burst is let through once the buckets aren't empty, and the
+    // following ones wait until it is paid off. A caller holding held, such
+    // as the lock of its session, gives it up while it waits.
+    void Acquire(const string& host, SshTransferPriority priority, uint64_t bytes,
+                 mutex* held = NULL);
+    void BeginTransfer(SshTransferPriority priority);
+    void EndTransfer(SshTransferPriority priority);
+    SshSchedulerStats GetStats();
+    void ResetStats();
+
+private:
+    struct _Bucket
+    {
+        double rate{0};
+        double burst{0};
+        double tokens{0};
+        chrono::steady_clock::time_point refilled;
+
+        void Refill(chrono::steady_clock::time_point now);
+        chrono::steady_clock::time_point Ready(chrono::steady_clock::time_point now) const;
+    };
+
+    struct _Waiter
+    {
+        _Bucket *host;
+        uint64_t bytes;
+        bool granted{false};
+    };
+
+    struct _Class
+    {
+        deque<_Waiter*> waiting;
+        // Virtual time at which the class's last granted chunk is finished
+        double finish{0};
+        SshPriorityStats stats;
+        chrono::steady_clock::time_point activeSince;
+    };
+
+    static void _SetRate(_Bucket& bucket, uint64_t bytesPerSecond, uint64_t burst);
+    chrono::steady_clock::time_point _Dispatch();
+
+private:
+    mutex _mutex;
+    condition_variable _granted;
+    _Bucket _global;
+    map<string, _Bucket> _hosts;
+    _Class _classes[sshTransferPriorities];
+    double _virtualTime{0};
+};
+
+// Counts a transfer as running in its class for as long as it lives
+class SshScheduledTransfer
+{
+public:
+    SshScheduledTransfer(SshTransferPriority priority): _priority(priority)
+    {
+        SshTransferScheduler::Shared().BeginTransfer(priority);
+    };
+    ~SshScheduledTransfer() { SshTransferScheduler::Shared().EndTransfer(_priority); };
+    SshScheduledTransfer(const SshScheduledTransfer&) = delete;
+    SshScheduledTransfer& operator=(const SshScheduledTransfer&) = delete;
+
+private:
+    SshTransferPriority _priority;
+};
+
+#endif // __SSH_SCHEDULER_H__
@@ -0,0 +1,410 @@
+
+#include "SshSessionPool.h"
+
+using steady_clock = chrono::steady_clock;
+
+// Every field of the options, so sessions that differ in any of them never
+// share a key
+static string optionsKey(const SshConnectOptions& options)
+{
+    const SshCryptoOptions& crypto = options.crypto;
+
+    return to_string(options.port) + '\0' + options.identityFile + '\0' +
+           options.knownHostsFile + '\0' + crypto.ciphers + '\0' + crypto.hmacs + '\0' +
+           crypto.keyExchange + '\0' + crypto.hostKeys + '\0' + crypto.compression + '\0' +
+           to_string(crypto.compressionLevel);
+}
+
+double SshSessionPoolStats::HitRate() const
+{
+    uint64_t total = hits + misses;
+
+    return total ? (double) hits / total : 0.0;
+}
+
+SshSessionLease::SshSessionLease(SshSessionLease&& other) noexcept:
+    _pool(other._pool), _key(move(other._key)), _host(move(other._host)),
+    _client(move(other._client)), _reusable(other._reusable)
+{
+    other._pool = nullptr;
+}
+
+SshSessionLease& SshSessionLease::operator=(SshSessionLease&& other) noexcept
+{
+    if (this != &other)
+    {
+        Release();
+        _pool = other._pool;
+        _key = move(other._key);
+        _host = move(other._host);
+        _client = move(other._client);
+        _reusable = other._reusable;
+        other._pool = nullptr;
+    }
+
+    return *this;
+}
+
+SshSessionLease::~SshSessionLease()
+{
+    Release();
+}
+
+void SshSessionLease::Release()
+{
+    if (_pool && _client)
+    {
+        _pool->_Release(_key, _host, move(_client), _reusable);
+    }
+    _pool = nullptr;
+}
+
+SshSessionPool::SshSessionPool(size_t maxSessionsPerHost,
+                               chrono::seconds idleTimeout,
+                               chrono::seconds keepaliveInterval):
+    _maxSessionsPerHost(max<size_t>(maxSessionsPerHost, 1)),
+    _idleTimeout(idleTimeout), _keepaliveInterval(keepaliveInterval)
+{
+    _maintenance = thread(&SshSessionPool::_Maintain, this);
+}
+
+SshSessionPool::~SshSessionPool()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wakeMaintenance.notify_all();
+    _maintenance.join();
+
+    Clear();
+}
+
+SshSessionLease SshSessionPool::Acquire(const string& ip, const string& user,
+                                        const string& password)
+{
+    return Acquire(ip, user, password, chrono::milliseconds::max());
+}
+
+SshSessionLease SshSessionPool::Acquire(const string& ip, const string& user,
+                                        const string& password,
+                                        chrono::milliseconds timeout)
+{
+    vector<unique_ptr<SshClient>> evicted;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point deadline = steady_clock::time_point::max();
+    bool waited = false;
+
+    if (timeout != chrono::milliseconds::max())
+    {
+        deadline = start + timeout;
+    }
+
+    unique_lock<mutex> lock(_mutex);
+    SshConnectOptions options = _connectOptions;
+    // The password is part of the key so sessions authenticated with other
+    // credentials are never handed out
+    string key = ip + '\0' + user + '\0' + password + '\0' + optionsKey(options);
+
+    while (1)
+    {
+        deque<_IdleSession>& idle = _idle[key];
+
+        while (!idle.empty())
+        {
+            // Most recently used first, it is the least likely to be stale
+            unique_ptr<SshClient> client = move(idle.back().client);
+            idle.pop_back();
+
+            if (client->IsConnected() == false)
+            {
+                _openPerHost[ip]--;
+                _stats.evictions++;
+                evicted.push_back(move(client));
+                continue;
+            }
+
+            _stats.hits++;
+            _stats.leasedSessions++;
+            if (waited)
+            {
+                _RecordWait(start);
+            }
+            lock.unlock();
+
+            return SshSessionLease(this, key, ip, move(client));
+        }
+
+        if (_openPerHost[ip] < _maxSessionsPerHost ||
+            _EvictIdleOfHost(ip, evicted))
+        {
+            break;
+        }
+
+        waited = true;
+        if (_available.wait_until(lock, deadline) == cv_status::timeout)
+        {
+            _stats.timeouts++;
+            _RecordWait(start);
+
+            return SshSessionLease();
+        }
+    }
+
+    _openPerHost[ip]++;
+    _stats.misses++;
+    _stats.leasedSessions++;
+    if (waited)
+    {
+        _RecordWait(start);
+    }
+    lock.unlock();
+
+    evicted.clear();
+
+    unique_ptr<SshClient> client = make_unique<SshClient>(ip, user, password);
+    client->SetConnectOptions(options);
+    if (client->Connect() != SSH_OK)
+    {
+        lock.lock();
+        _openPerHost[ip]--;
+        _stats.leasedSessions--;
+        _stats.connectFailures++;
+        lock.unlock();
+        _available.notify_all();
+
+        return SshSessionLease();
+    }
+
+    return SshSessionLease(this, key, ip, move(client));
+}
+
+void SshSessionPool::SetConnectOptions(const SshConnectOptions& options)
+{
+    lock_guard<mutex> lock(_mutex);
+    _connectOptions = options;
+}
+
+SshSessionPoolStats SshSessionPool::GetStats()
+{
+    lock_guard<mutex> lock(_mutex);
+    SshSessionPoolStats stats = _stats;
+
+    stats.idleSessions = 0;
+    for (auto& idle : _idle)
+    {
+        stats.idleSessions += idle.second.size();
+    }
+
+    return stats;
+}
+
+void SshSessionPool::Clear()
+{
+    vector<unique_ptr<SshClient>> evicted;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        for (auto& idle : _idle)
+        {
+            for (_IdleSession& session : idle.second)
+            {
+                _openPerHost[session.host]--;
+                evicted.push_back(move(session.client));
+            }
+        }
+        _idle.clear();
+    }
+    _available.notify_all();
+
+    for (unique_ptr<SshClient>& client : evicted)
+    {
+        client->Close();
+    }
+}
+
+void SshSessionPool::_Release(const string& key, const string& host,
+                              unique_ptr<SshClient> client, bool reusable)
+{
+    if (reusable)
+    {
+        reusable = client->IsConnected();
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        _stats.leasedSessions--;
+        if (reusable && !_stopping)
+        {
+            steady_clock::time_point now = steady_clock::now();
+
+            _idle[key].push_back({move(client), host, now, now});
+        }
+        else
+        {
+            _openPerHost[host]--;
+            _stats.evictions++;
+        }
+    }
+    _available.notify_all();
+
+    if (client)
+    {
+        client->Close();
+    }
+}
+
+bool SshSessionPool::_EvictIdleOfHost(const string& host,
+                                      vector<unique_ptr<SshClient>>& evicted)
+{
+    deque<_IdleSession>* oldest = nullptr;
+
+    // Make room for a new key on a host at its cap by dropping the session
+    // that has been idle the longest for any other key of that host
+    for (auto& idle : _idle)
+    {
+        if (idle.second.empty() || idle.second.front().host != host)
+        {
+            continue;
+        }
+        if (oldest == nullptr ||
+            idle.second.front().idleSince < oldest->front().idleSince)
+        {
+            oldest = &idle.second;
+        }
+    }
+
+    if (oldest == nullptr)
+    {
+        return false;
+    }
+
+    evicted.push_back(move(oldest->front().client));
+    oldest->pop_front();
+    _openPerHost[host]--;
+    _stats.evictions++;
+
+    return true;
+}
+
+void SshSessionPool::_RecordWait(steady_clock::time_point start)
+{
+    chrono::microseconds wait =
+        chrono::duration_cast<chrono::microseconds>(steady_clock::now() - start);
+
+    _stats.waits++;
+    _stats.totalWaitTime += wait;
+    _stats.maxWaitTime = max(_stats.maxWaitTime, wait);
+}
+
+void SshSessionPool::_Maintain()
+{
+    chrono::seconds period = min(_idleTimeout, _keepaliveInterval) / 2;
+    unique_lock<mutex> lock(_mutex);
+
+    period = max(period, chrono::seconds(1));
+
+    while (!_stopping)
+    {
+        _wakeMaintenance.wait_for(lock, period);
+        if (_stopping)
+        {
+            break;
+        }
+
+        steady_clock::time_point now = steady_clock::now();
+        vector<unique_ptr<SshClient>> evicted;
+        vector<pair<string, _IdleSession>> probe;
+
+        for (auto& idle : _idle)
+        {
+            deque<_IdleSession>& sessions = idle.second;
+
+            for (auto it = sessions.begin(); it != sessions.end();)
+            {
+                if (now - it->idleSince >= _idleTimeout)
+                {
+                    _openPerHost[it->host]--;
+                    _stats.evictions++;
+                    evicted.push_back(move(it->client));
+                    it = sessions.erase(it);
+                }
+                else if (now - it->lastKeepalive >= _keepaliveInterval)
+                {
+                    probe.emplace_back(idle.first, move(*it));
+                    it = sessions.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        if (evicted.empty() && probe.empty())
+        {
+            continue;
+        }
+
+        // Keepalives and disconnects go over the network, never hold the
+        // pool lock for them
+        lock.unlock();
+
+        for (unique_ptr<SshClient>& client : evicted)
+        {
+            client->Close();
+        }
+        evicted.clear();
+
+        for (auto& session : probe)
+        {
+            if (session.second.client->SendKeepalive() != SSH_OK)
+            {
+                session.second.client->Close();
+                session.second.client.reset();
+            }
+            session.second.lastKeepalive = steady_clock::now();
+        }
+
+        lock.lock();
+
+        for (auto& session : probe)
+        {
+            if (session.second.client && !_stopping)
+            {
+                deque<_IdleSession>& sessions = _idle[session.first];
+
+                // Keep the deque ordered by idle time
+                auto it = sessions.begin();
+                while (it != sessions.end() &&
+                       it->idleSince <= session.second.idleSince)
+                {
+                    ++it;
+                }
+                sessions.insert(it, move(session.second));
+            }
+            else
+            {
+                _openPerHost[session.second.host]--;
+                _stats.evictions++;
+                if (session.second.client)
+                {
+                    evicted.push_back(move(session.second.client));
+                }
+            }
+        }
+        _available.notify_all();
+
+        if (!evicted.empty())
+        {
+            lock.unlock();
+            for (unique_ptr<SshClient>& client : evicted)
+            {
+                client->Close();
+            }
+            lock.lock();
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef __SSH_SESSION_POOL_H__
+#define __SSH_SESSION_POOL_H__
+
+#include "SshClient.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+
+class SshSessionPool;
+
+struct SshSessionPoolStats
+{
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t waits{0};
+    uint64_t timeouts{0};
+    uint64_t evictions{0};
+    uint64_t connectFailures{0};
+    chrono::microseconds totalWaitTime{0};
+    chrono::microseconds maxWaitTime{0};
+    size_t idleSessions{0};
+    size_t leasedSessions{0};
+
+    double HitRate() const;
+};
+
+// Owns a pooled session while it is in use and hands it back to the pool
+// when destroyed. A lease must not outlive the pool it came from.
+class SshSessionLease
+{
+public:
+    SshSessionLease() = default;
+    SshSessionLease(SshSessionLease&& other) noexcept;
+    SshSessionLease& operator=(SshSessionLease&& other) noexcept;
+    ~SshSessionLease();
+
+    SshClient* operator->() const { return _client.get(); };
+    SshClient& operator*() const { return *_client; };
+    explicit operator bool() const { return _client != nullptr; };
+    void Invalidate() { _reusable = false; };
+    void Release();
+
+private:
+    friend class SshSessionPool;
+    SshSessionLease(SshSessionPool* pool, const string& key, const string& host,
+                    unique_ptr<SshClient> client):
+                    _pool(pool), _key(key), _host(host), _client(move(client)){};
+
+    SshSessionPool* _pool{nullptr};
+    string _key, _host;
+    unique_ptr<SshClient> _client;
+    bool _reusable{true};
+};
+
+class SshSessionPool
+{
+public:
+    SshSessionPool(size_t maxSessionsPerHost, chrono::seconds idleTimeout,
+                   chrono::seconds keepaliveInterval);
+    ~SshSessionPool();
+    SshSessionPool(const SshSessionPool&) = delete;
+    SshSessionPool& operator=(const SshSessionPool&) = delete;
+
+    SshSessionLease Acquire(const string& ip, const string& user,
+                            const string& password);
+    SshSessionLease Acquire(const string& ip, const string& user,
+                            const string& password, chrono::milliseconds timeout);
+    // Applies to the sessions acquired afterwards. Sessions connected with
+    // other options are never handed out for them.
+    void SetConnectOptions(const SshConnectOptions& options);
+    SshSessionPoolStats GetStats();
+    void Clear();
+
+private:
+    friend class SshSessionLease;
+
+    struct _IdleSession
+    {
+        unique_ptr<SshClient> client;
+        string host;
+        chrono::steady_clock::time_point idleSince;
+        chrono::steady_clock::time_point lastKeepalive;
+    };
+
+    void _Release(const string& key, const string& host,
+                  unique_ptr<SshClient> client, bool reusable);
+    bool _EvictIdleOfHost(const string& host,
+                          vector<unique_ptr<SshClient>>& evicted);
+    void _RecordWait(chrono::steady_clock::time_point start);
+    void _Maintain();
+
+private:
+    size_t _maxSessionsPerHost;
+    chrono::seconds _idleTimeout;
+    chrono::seconds _keepaliveInterval;
+
+    mutex _mutex;
+    condition_variable _available;
+    condition_variable _wakeMaintenance;
+    map<string, deque<_IdleSession>> _idle;
+    map<string, size_t> _openPerHost;
+    SshSessionPoolStats _stats;
+    SshConnectOptions _connectOptions;
+    bool _stopping{false};
+    thread _maintenance;
+};
+
+#endif // __SSH_SESSION_POOL_H__
@@ -0,0 +1,760 @@
+
+#include "SshSftpTransfer.h"
+#include "SshFilePipeline.h"
+
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+SshSftpTransfer::~SshSftpTransfer()
+{
+    if (_sftp)
+    {
+        sftp_free(_sftp);
+    }
+}
+
+int SshSftpTransfer::Init()
+{
+    sftp_limits_t limits;
+    int res;
+
+    if (_sftp)
+    {
+        return SSH_OK;
+    }
+
+    _sftp = sftp_new(_session);
+    if (_sftp == NULL)
+    {
+        SSH_LOG(Error, "Error allocating sftp session: %s",
+                ssh_get_error(_session));
+        return SSH_ERROR;
+    }
+
+    res = sftp_init(_sftp);
+    if (res != SSH_OK)
+    {
+        SSH_LOG(Error, "Error initializing sftp session: %d",
+                sftp_get_error(_sftp));
+        sftp_free(_sftp);
+        _sftp = NULL;
+        return SSH_ERROR;
+    }
+
+    // Requests above the server limits are silently truncated, which would
+    // turn every request into a short read or write
+    limits = sftp_limits(_sftp);
+    if (limits)
+    {
+        _maxReadLength = limits->max_read_length;
+        _maxWriteLength = limits->max_write_length;
+        sftp_limits_free(limits);
+    }
+
+    return SSH_OK;
+}
+
+int SshSftpTransfer::Push(const string& source, const string& destination,
+                          const SshTransferOptions& options, SshTransferStats& stats)
+{
+    string target = destination;
+
+    if (Init() != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    if (_IsRemoteDirectory(destination))
+    {
+        target = destination + "/" + fs::path(source).filename().string();
+    }
+
+    return _PushTree(source, target, options, stats);
+}
+
+int SshSftpTransfer::Pull(const string& source, const string& destination,
+                          const SshTransferOptions& options, SshTransferStats& stats)
+{
+    string target = destination;
+    error_code ec;
+
+    if (Init() != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    if (fs::is_directory(destination, ec))
+    {
+        target = (fs::path(destination) / fs::path(source).filename()).string();
+    }
+
+    return _PullTree(source, target, options, stats);
+}
+
+int SshSftpTransfer::_PushTree(const string& source, const string& destination,
+                               const SshTransferOptions& options,
+                               SshTransferStats& stats)
+{
+    error_code ec;
+    int mode;
+    int res;
+
+    if (fs::is_directory(source, ec) == false)
+    {
+        return PushFile(source, destination, options, stats);
+    }
+
+    mode = (int) fs::status(source, ec).permissions() & 07777;
+    SSH_LOG(Debug, "Uploading directory %s, permissions 0%o", source.c_str(), mode);
+
+    res = sftp_mkdir(_sftp, destination.c_str(), mode);
+    if (res != SSH_OK && _IsRemoteDirectory(destination) == false)
+    {
+        SSH_LOG(Error, "Can't create remote directory %s: %s",
+                destination.c_str(), ssh_get_error(_session));
+        return SSH_ERROR;
+    }
+
+    for (fs::directory_iterator entry(source, ec), end; entry != end && !ec;
+         entry.increment(ec))
+    {
+        res = _PushTree(entry->path().string(),
+                        destination + "/" + entry->path().filename().string(),
+                        options, stats);
+        if (res != SSH_OK)
+        {
+            return res;
+        }
+    }
+
+    if (ec)
+    {
+        SSH_LOG(Error, "Error reading directory %s: %s", source.c_str(),
+                ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshSftpTransfer::PushFile(const string& source, const string& destination,
+                              const SshTransferOptions& options,
+                              SshTransferStats& stats)
+{
+    size_t requestSize = _RequestSize(options, true);
+    size_t queueDepth = max<size_t>(options.sftpQueueDepth, 1);
+    uint64_t interval = max<uint64_t>(options.checkpointInterval, requestSize);
+    deque<sftp_aio> pending;
+    SshTransferCheckpoint checkpoint;
+    string checkpointPath;
+    SshSha256 hash;
+    struct stat st;
+    sftp_file file;
+    uint64_t sent = 0;
+    uint64_t saved = 0;
+    uint32_t crc = 0;
+    int res = SSH_OK;
+    int fd;
+
+    fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        SSH_LOG(Error, "Can't open local file %s: %s", source.c_str(),
+                strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return SSH_ERROR;
+    }
+
+    SSH_LOG(Debug, "Uploading file %s, size %llu, permissions 0%o", source.c_str(),
+            (unsigned long long) st.st_size, st.st_mode & 07777);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (options.resume)
+    {
+        checkpoint.push = true;
+        checkpoint.source = fs::absolute(source).string();
+        checkpoint.destination = destination;
+        checkpoint.size = st.st_size;
+        checkpoint.mtime = st.st_mtime;
+        checkpointPath = SshCheckpointPath(options.checkpointDirectory, _scope, true,
+                                           checkpoint.source, destination);
+        sent = saved = _Resume(checkpointPath, checkpoint, fd, hash);
+    }
+
+    // A resumed file keeps the prefix that is already there
+    file = sftp_open(_sftp, destination.c_str(),
+                     sent > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (file == NULL)
+    {
+        SSH_LOG(Error, "Can't open remote file %s: %s", destination.c_str(),
+                ssh_get_error(_session));
+        close(fd);
+        return SSH_ERROR;
+    }
+
+    if (sent > 0 && sftp_seek64(file, sent) < 0)
+    {
+        SSH_LOG(Error, "Can't resume %s at %llu", source.c_str(), (unsigned long long) sent);
+        res = SSH_ERROR;
+    }
+
+    // A resumed file's CRC starts with the prefix sent before
+    if (_verifier && sent > 0 && SshCrc32File(fd, sent, crc) == false)
+    {
+        SSH_LOG(Error, "Can't read local file %s: %s", source.c_str(), strerror(errno));
+        res = SSH_ERROR;
+    }
+
+    {
+        // The data of a write request is copied into the outgoing packet, so a
+        // chunk goes back to the reader as soon as its request is queued
+        SshFileReader reader(fd, sent, st.st_size - min<uint64_t>(sent, st.st_size), requestSize,
+                             options.pipelineDepth);
+        SshFileChunk chunk;
+
+        while (res == SSH_OK && (sent < (uint64_t) st.st_size || !pending.empty()))
+        {
+            if (chrono::steady_clock::now() > _deadline)
+            {
+                SSH_LOG(Error, "Timed out sending %s", source.c_str());
+                res = SSH_ERROR;
+                break;
+            }
+
+            while (pending.size() < queueDepth && sent < (uint64_t) st.st_size &&
+                   (checkpointPath.empty() || sent - saved < interval))
+            {
+                sftp_aio aio;
+
+                if (reader.Next(chunk) == false)
+                {
+                    SSH_LOG(Error, "Can't read local file %s: %s", source.c_str(),
+                            reader.Error() ? strerror(reader.Error()) : "file truncated");
+                    res = SSH_ERROR;
+                    break;
+                }
+
+                SshTransferScheduler::Shared().Acquire(_host, options.priority, chunk.length,
+                                                       _sessionMutex);
+                if (sftp_aio_begin_write(file, chunk.data, chunk.length, &aio) !=
+                    (ssize_t) chunk.length)
+                {
+                    SSH_LOG(Error, "Can't write to remote file: %s",
+                            ssh_get_error(_session));
+                    reader.Done(chunk);
+                    res = SSH_ERROR;
+                    break;
+                }
+
+                if (checkpointPath.empty() == false)
+                {
+                    hash.Update(chunk.data, chunk.length);
+                }
+                if (_verifier)
+                {
+                    crc = SshCrc32(chunk.data, chunk.length, crc);
+                }
+                reader.Done(chunk);
+                pending.push_back(aio);
+                sent += chunk.length;
+            }
+
+            if (pending.empty())
+            {
+                if (res != SSH_OK || checkpointPath.empty() || sent == saved)
+                {
+                    break;
+                }
+
+                // Every write so far is acknowledged, so the hash covers exactly
+                // what the server has
+                SshSha256 prefix = hash;
+                checkpoint.offset = sent;
+                checkpoint.prefixHash = prefix.HexDigest();
+                SshSaveCheckpoint(checkpointPath, checkpoint);
+                saved = sent;
+                continue;
+            }
+
+            sftp_aio aio = pending.front();
+            pending.pop_front();
+
+            ssize_t nbytes = sftp_aio_wait_write(&aio);
+            if (nbytes < 0)
+            {
+                SSH_LOG(Error, "Can't write to remote file: %s",
+                        ssh_get_error(_session));
+                res = SSH_ERROR;
+            }
+            else
+            {
+                stats.bytes += nbytes;
+            }
+        }
+    }
+
+    // Replies of requests still in flight are dropped with their handles
+    for (sftp_aio aio : pending)
+    {
+        sftp_aio_free(aio);
+    }
+
+    close(fd);
+    if (sftp_close(file) != SSH_OK && res == SSH_OK)
+    {
+        SSH_LOG(Error, "Can't close remote file %s: %s", destination.c_str(),
+                ssh_get_error(_session));
+        res = SSH_ERROR;
+    }
+
+    if (res == SSH_OK)
+    {
+        stats.files++;
+        if (checkpointPath.empty() == false)
+        {
+            SshRemoveCheckpoint(checkpointPath);
+        }
+        if (_verifier)
+        {
+            _verifier->Add(destination, source, crc);
+        }
+    }
+
+    return res;
+}
+
+int SshSftpTransfer::_PullTree(const string& source, const string& destination,
+                               const SshTransferOptions& options,
+                               SshTransferStats& stats)
+{
+    sftp_attributes attributes;
+    sftp_dir dir;
+    int mode;
+    int res = SSH_OK;
+
+    attributes = sftp_stat(_sftp, source.c_str());
+    if (attributes == NULL)
+    {
+        SSH_LOG(Error, "Can't stat remote file %s: %s", source.c_str(),
+                ssh_get_error(_session));
+        return SSH_ERROR;
+    }
+
+    mode = attributes->permissions & 07777;
+    if (attributes->type != SSH_FILEXFER_TYPE_DIRECTORY)
+    {
+        uint64_t size = attributes->size;
+
+        sftp_attributes_free(attributes);
+
+        return PullFile(source, destination, size, mode, options, stats);
+    }
+    sftp_attributes_free(attributes);
+
+    SSH_LOG(Debug, "Downloading directory %s, permissions 0%o", source.c_str(), mode);
+
+    if (mkdir(destination.c_str(), mode) < 0 && errno != EEXIST)
+    {
+        SSH_LOG(Error, "Can't create local directory %s: %s",
+                destination.c_str(), strerror(errno));
+        return SSH_ERROR;
+    }
+
+    dir = sftp_opendir(_sftp, source.c_str());
+    if (dir == NULL)
+    {
+        SSH_LOG(Error, "Can't open remote directory %s: %s", source.c_str(),
+                ssh_get_error(_session));
+        return SSH_ERROR;
+    }
+
+    while (res == SSH_OK && (attributes = sftp_readdir(_sftp, dir)) != NULL)
+    {
+        string name = attributes->name;
+        uint8_t type = attributes->type;
+        uint64_t size = attributes->size;
+
+        mode = attributes->permissions & 07777;
+        sftp_attributes_free(attributes);
+
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+
+        if (type == SSH_FILEXFER_TYPE_DIRECTORY)
+        {
+            res = _PullTree(source + "/" + name, destination + "/" + name,
+                            options, stats);
+        }
+        else if (type == SSH_FILEXFER_TYPE_REGULAR)
+        {
+            res = PullFile(source + "/" + name, destination + "/" + name,
+                            size, mode, options, stats);
+        }
+    }
+
+    if (res == SSH_OK && sftp_dir_eof(dir) == 0)
+    {
+        SSH_LOG(Error, "Can't read remote directory %s: %s", source.c_str(),
+                ssh_get_error(_session));
+        res = SSH_ERROR;
+    }
+
+    sftp_closedir(dir);
+
+    return res;
+}
+
+int SshSftpTransfer::PullFile(const string& source, const string& destination,
+                              uint64_t size, int mode,
+                              const SshTransferOptions& options,
+                              SshTransferStats& stats)
+{
+    size_t requestSize = _RequestSize(options, false);
+    size_t queueDepth = max<size_t>(options.sftpQueueDepth, 1);
+    uint64_t interval = max<uint64_t>(options.checkpointInterval, requestSize);
+    deque<pair<sftp_aio, size_t>> pending;
+    SshTransferCheckpoint checkpoint;
+    string checkpointPath;
+    SshSha256 hash;
+    uint64_t requested = 0;
+    uint64_t received = 0;
+    uint64_t saved = 0;
+    uint32_t crc = 0;
+    sftp_file file;
+    int res = SSH_OK;
+    int fd;
+
+    SSH_LOG(Debug, "Receiving file %s, size %llu, permissions 0%o", source.c_str(),
+            (unsigned long long) size, mode);
+
+    file = sftp_open(_sftp, source.c_str(), O_RDONLY, 0);
+    if (file == NULL)
+    {
+        SSH_LOG(Error, "Can't open remote file %s: %s", source.c_str(),
+                ssh_get_error(_session));
+        return SSH_ERROR;
+    }
+
+    // A partial file from an earlier attempt is only cut once its prefix is
+    // checked
+    fd = open(destination.c_str(),
+              O_RDWR | O_CREAT | O_CLOEXEC | (options.resume ? 0 : O_TRUNC), mode);
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Can't create local file %s: %s", destination.c_str(),
+                strerror(errno));
+        sftp_close(file);
+        return SSH_ERROR;
+    }
+
+    if (options.resume)
+    {
+        sftp_attributes attributes = sftp_stat(_sftp, source.c_str());
+
+        checkpoint.source = source;
+        checkpoint.destination = fs::absolute(destination).string();
+        checkpoint.size = size;
+        checkpoint.mtime = attributes ? attributes->mtime : 0;
+        sftp_attributes_free(attributes);
+        checkpointPath = SshCheckpointPath(options.checkpointDirectory, _scope, false,
+                                           source, checkpoint.destination);
+        requested = received = saved = _Resume(checkpointPath, checkpoint, fd, hash);
+
+        if (ftruncate(fd, received) < 0 ||
+            (received > 0 && sftp_seek64(file, received) < 0))
+        {
+            SSH_LOG(Error, "Can't resume %s at %llu", source.c_str(),
+                    (unsigned long long) received);
+            res = SSH_ERROR;
+        }
+    }
+
+    // A resumed file's CRC starts with the prefix received before
+    if (_verifier && received > 0 && SshCrc32File(fd, received, crc) == false)
+    {
+        SSH_LOG(Error, "Can't read local file %s: %s", destination.c_str(), strerror(errno));
+        res = SSH_ERROR;
+    }
+
+    if (options.preallocate && size > 0)
+    {
+        posix_fallocate(fd, 0, size);
+    }
+
+    {
+        // Replies land straight in the writer's buffers, which go to the disk
+        // while the next replies arrive
+        SshFileWriter writer(fd, received, size - min(received, size), requestSize,
+                             options.pipelineDepth, options.dropPageCache);
+        SshFileChunk chunk;
+
+        while (res == SSH_OK && (requested < size || !pending.empty()))
+        {
+            if (chrono::steady_clock::now() > _deadline)
+            {
+                SSH_LOG(Error, "Timed out receiving %s", source.c_str());
+                res = SSH_ERROR;
+                break;
+            }
+
+            while (pending.size() < queueDepth && requested < size)
+            {
+                size_t length = min<uint64_t>(requestSize, size - requested);
+                sftp_aio aio;
+
+                SshTransferScheduler::Shared().Acquire(_host, options.priority, length,
+                                                       _sessionMutex);
+                if (sftp_aio_begin_read(file, length, &aio) != (ssize_t) length)
+                {
+                    SSH_LOG(Error, "Can't read remote file: %s",
+                            ssh_get_error(_session));
+                    res = SSH_ERROR;
+                    break;
+                }
+
+                pending.emplace_back(aio, length);
+                requested += length;
+            }
+
+            if (pending.empty())
+            {
+                break;
+            }
+
+            if (writer.Next(chunk) == false)
+            {
+                SSH_LOG(Error, "Can't write local file %s: %s", destination.c_str(),
+                        strerror(writer.Error()));
+                res = SSH_ERROR;
+                break;
+            }
+
+            sftp_aio aio = pending.front().first;
+            size_t length = pending.front().second;
+            pending.pop_front();
+
+            // Replies come back in request order, so each one lands right
+            // after the previous one in the local file
+            ssize_t nbytes = sftp_aio_wait_read(&aio, chunk.data, chunk.length);
+            if (nbytes < 0 || (size_t) nbytes != length)
+            {
+                SSH_LOG(Error, "Can't read remote file %s: %s", source.c_str(),
+                        nbytes < 0 ? ssh_get_error(_session) : "short read");
+                res = SSH_ERROR;
+                break;
+            }
+
+            if (checkpointPath.empty() == false)
+            {
+                hash.Update(chunk.data, nbytes);
+            }
+            if (_verifier)
+            {
+                crc = SshCrc32(chunk.data, nbytes, crc);
+            }
+            chunk.length = nbytes;
+            writer.Write(chunk);
+            received += nbytes;
+            stats.bytes += nbytes;
+
+            // A checkpoint only counts what is on the disk
+            if (checkpointPath.empty() == false && received - saved >= interval &&
+                received < size && writer.Flush() == SSH_OK)
+            {
+                SshSha256 prefix = hash;
+                checkpoint.offset = received;
+                checkpoint.prefixHash = prefix.HexDigest();
+                SshSaveCheckpoint(checkpointPath, checkpoint);
+                saved = received;
+            }
+        }
+
+        if (writer.Flush() != SSH_OK)
+        {
+            if (res == SSH_OK)
+            {
+                SSH_LOG(Error, "Can't write local file %s: %s", destination.c_str(),
+                        strerror(writer.Error()));
+                res = SSH_ERROR;
+            }
+            // Not all of it reached the file, only the last checkpoint holds
+            received = saved;
+        }
+    }
+
+    for (auto& request : pending)
+    {
+        sftp_aio_free(request.first);
+    }
+
+    sftp_close(file);
+    if (close(fd) < 0 && res == SSH_OK)
+    {
+        SSH_LOG(Error, "Can't write local file %s: %s", destination.c_str(),
+                strerror(errno));
+        res = SSH_ERROR;
+    }
+
+    if (checkpointPath.empty() == false)
+    {
+        // What arrived before a failure is kept for the next attempt
+        if (res == SSH_OK && received == size)
+        {
+            SshRemoveCheckpoint(checkpointPath);
+        }
+        else if (received > saved)
+        {
+            SshSha256 prefix = hash;
+            checkpoint.offset = received;
+            checkpoint.prefixHash = prefix.HexDigest();
+            SshSaveCheckpoint(checkpointPath, checkpoint);
+        }
+    }
+
+    if (res == SSH_OK && received == size)
+    {
+        stats.files++;
+        if (_verifier)
+        {
+            _verifier->Add(source, destination, crc);
+        }
+    }
+
+    return res;
+}
+
+bool SshSftpTransfer::_IsRemoteDirectory(const string& path)
+{
+    sftp_attributes attributes;
+    bool directory;
+
+    attributes = sftp_stat(_sftp, path.c_str());
+    if (attributes == NULL)
+    {
+        return false;
+    }
+
+    directory = attributes->type == SSH_FILEXFER_TYPE_DIRECTORY;
+    sftp_attributes_free(attributes);
+
+    return directory;
+}
+
+size_t SshSftpTransfer::_RequestSize(const SshTransferOptions& options, bool write)
+{
+    uint64_t limit = write ? _maxWriteLength : _maxReadLength;
+    size_t requestSize = max<size_t>(options.sftpRequestSize, 1024);
+
+    if (limit > 0)
+    {
+        requestSize = min<uint64_t>(requestSize, limit);
+    }
+
+    return requestSize;
+}
+
+uint64_t SshSftpTransfer::_Resume(const string& path, SshTransferCheckpoint& checkpoint,
+                                  int fd, SshSha256& hash)
+{
+    SshTransferCheckpoint saved;
+    SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(1024 * 1024);
+    const string& name = checkpoint.push ? checkpoint.source : checkpoint.destination;
+    uint64_t hashed = 0;
+
+    if (SshLoadCheckpoint(path, saved) != SSH_OK)
+    {
+        return 0;
+    }
+
+    if (saved.push != checkpoint.push || saved.source != checkpoint.source ||
+        saved.destination != checkpoint.destination || saved.size != checkpoint.size ||
+        saved.mtime != checkpoint.mtime || saved.offset == 0 || saved.offset > saved.size)
+    {
+        SSH_LOG(Info, "Source of %s changed since the last attempt, starting over",
+                name.c_str());
+        return 0;
+    }
+
+    // The local prefix is the source when pushing and the partial file when
+    // pulling. Hashing it also brings hash up to the resume offset.
+    while (hashed < saved.offset)
+    {
+        ssize_t nbytes = pread(fd, buffer.Data(),
+                               min<uint64_t>(buffer.Size(), saved.offset - hashed), hashed);
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            break;
+        }
+        hash.Update(buffer.Data(), nbytes);
+        hashed += nbytes;
+    }
+
+    SshSha256 prefix = hash;
+    if (hashed != saved.offset || prefix.HexDigest() != saved.prefixHash ||
+        (checkpoint.push &&
+         _RemotePrefixHash(checkpoint.destination, saved.offset) != saved.prefixHash))
+    {
+        SSH_LOG(Info, "Partial copy of %s doesn't match its checkpoint, starting over",
+                name.c_str());
+        hash.Reset();
+        return 0;
+    }
+
+    SSH_LOG(Info, "Resuming %s at %llu of %llu bytes", name.c_str(),
+            (unsigned long long) saved.offset, (unsigned long long) saved.size);
+    checkpoint.offset = saved.offset;
+    checkpoint.prefixHash = saved.prefixHash;
+
+    return saved.offset;
+}
+
+// SHA-256 of the first length bytes of a remote file, computed there so the
+// prefix doesn't cross the network again. Empty when it can't be run.
+string SshSftpTransfer::_RemotePrefixHash(const string& path, uint64_t length)
+{
+    string command = "head -c " + to_string(length) + " < " + SshShellQuote(path) +
+                     " | sha256sum";
+    ssh_channel channel = ssh_channel_new(_session);
+    string output;
+    char buffer[256];
+    int nbytes;
+
+    if (channel == NULL)
+    {
+        return "";
+    }
+
+    if (ssh_channel_open_session(channel) != SSH_OK ||
+        ssh_channel_request_exec(channel, command.c_str()) != SSH_OK)
+    {
+        SSH_LOG(Warning, "Can't hash remote file %s: %s", path.c_str(),
+                ssh_get_error(_session));
+        ssh_channel_free(channel);
+        return "";
+    }
+
+    while ((nbytes = ssh_channel_read(channel, buffer, sizeof(buffer), 0)) > 0)
+    {
+        output.append(buffer, nbytes);
+    }
+
+    ssh_channel_send_eof(channel);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+
+    return output.substr(0, output.find(' '));
+}
@@ -0,0 +1,68 @@
+#ifndef __SSH_SFTP_TRANSFER_H__
+#define __SSH_SFTP_TRANSFER_H__
+
+#include "SshCheckpoint.h"
+#include "SshClient.h"
+#include "SshHash.h"
+
+#include <libssh/sftp.h>
+
+// Copies files and directory trees over an SFTP channel. File contents are
+// moved with asynchronous requests so up to sftpQueueDepth of them are in
+// flight at once, which keeps high latency links busy. With the resume option
+// each file's progress is checkpointed, and a later attempt continues from
+// the last checkpoint once the prefix hashes on both ends still match it.
+class SshSftpTransfer
+{
+public:
+    // host is the one rate limits are set for in SshTransferScheduler, scope
+    // names the session in checkpoints, such as user@host:port. The callers
+    // of the transfers hold sessionMutex, which is given up while the rate
+    // limit holds a chunk back.
+    SshSftpTransfer(ssh_session session, const string& host = "", const string& scope = "",
+                    mutex* sessionMutex = NULL):
+                    _session(session), _host(host), _scope(scope),
+                    _sessionMutex(sessionMutex){};
+    ~SshSftpTransfer();
+    SshSftpTransfer(const SshSftpTransfer&) = delete;
+    SshSftpTransfer& operator=(const SshSftpTransfer&) = delete;
+
+    int Init();
+    int Push(const string& source, const string& destination,
+             const SshTransferOptions& options, SshTransferStats& stats);
+    int Pull(const string& source, const string& destination,
+             const SshTransferOptions& options, SshTransferStats& stats);
+    int PushFile(const string& source, const string& destination,
+                 const SshTransferOptions& options, SshTransferStats& stats);
+    int PullFile(const string& source, const string& destination,
+                 uint64_t size, int mode, const SshTransferOptions& options,
+                 SshTransferStats& stats);
+    // Files completed from now on are added to verifier, NULL stops it
+    void SetVerifier(SshTransferVerifier* verifier) { _verifier = verifier; };
+    // File transfers fail once it passed, time_point::max() for none
+    void SetDeadline(chrono::steady_clock::time_point deadline) { _deadline = deadline; };
+
+private:
+    int _PushTree(const string& source, const string& destination,
+                  const SshTransferOptions& options, SshTransferStats& stats);
+    int _PullTree(const string& source, const string& destination,
+                  const SshTransferOptions& options, SshTransferStats& stats);
+    bool _IsRemoteDirectory(const string& path);
+    size_t _RequestSize(const SshTransferOptions& options, bool write);
+    uint64_t _Resume(const string& path, SshTransferCheckpoint& checkpoint, int fd,
+                     SshSha256& hash);
+    string _RemotePrefixHash(const string& path, uint64_t length);
+
+private:
+    ssh_session _session;
+    string _host;
+    string _scope;
+    mutex* _sessionMutex;
+    sftp_session _sftp{NULL};
+    uint64_t _maxReadLength{0};
+    uint64_t _maxWriteLength{0};
+    SshTransferVerifier* _verifier{NULL};
+    chrono::steady_clock::time_point _deadline{chrono::steady_clock::time_point::max()};
+};
+
+#endif // __SSH_SFTP_TRANSFER_H__
@@ -0,0 +1,273 @@
+#include "SshShell.h"
+
+#include <random>
+
+// Marker prefix that can't turn up in command output by accident
+static string newToken()
+{
+    random_device random;
+    char token[40];
+
+    snprintf(token, sizeof(token), "__cppssh_%08x%08x%08x", random(), random(), random());
+
+    return token;
+}
+
+// Commands as one script. Each is quoted whole for eval, so a syntax error or
+// an exit only ends its own subshell. The marker line starts with a newline
+// of its own, which is removed again with it.
+static string buildScript(const vector<string>& commands, const string& token)
+{
+    string script;
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        string marker = token + "_" + to_string(i);
+
+        script += "( eval " + SshShellQuote(commands[i]) + " ) </dev/null; "
+                  "printf '\\n%s %d\\n' " + marker + " $?; "
+                  "printf '\\n%s\\n' " + marker + " >&2\n";
+    }
+
+    return script;
+}
+
+class ScriptSource : public SshInputSource
+{
+public:
+    ScriptSource(const string& script): _script(script){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        size = min(size, _script.size() - _offset);
+        memcpy(buffer, _script.data() + _offset, size);
+        _offset += size;
+
+        return size;
+    };
+
+private:
+    const string& _script;
+    size_t _offset{0};
+};
+
+// Splits the output of a batch at the markers into per-command results
+class BatchParser : public SshOutputSink
+{
+public:
+    BatchParser(const string& token, size_t commands, vector<SshCommandResult>& results):
+                _token(token), _commands(commands), _results(results)
+    {
+        _results.clear();
+        _results.reserve(commands);
+    };
+
+    void OnStdout(string_view data) override
+    {
+        _stdout.append(data);
+        while (_stdoutDone < _commands && _NextStdout())
+        {
+        }
+    };
+
+    void OnStderr(string_view data) override
+    {
+        _stderr.append(data);
+        while (_stderrDone < _commands && _NextStderr())
+        {
+        }
+    };
+
+    bool Done() const { return _stdoutDone == _commands && _stderrDone == _commands; };
+
+private:
+    SshCommandResult& _Result(size_t index)
+    {
+        if (_results.size() <= index)
+        {
+            _results.resize(index + 1);
+        }
+
+        return _results[index];
+    };
+
+    // Finds "\n<marker><terminator>" in data, starting where the last
+    // search couldn't have matched yet
+    size_t _Find(const string& data, size_t& scanned, const string& needle)
+    {
+        size_t from = scanned > needle.size() ? scanned - needle.size() : 0;
+        size_t position = data.find(needle, from);
+
+        scanned = position == string::npos ? data.size() : 0;
+
+        return position;
+    };
+
+    bool _NextStdout()
+    {
+        string needle = "\n" + _token + "_" + to_string(_stdoutDone) + " ";
+        size_t position = _Find(_stdout, _stdoutScanned, needle);
+        if (position == string::npos)
+        {
+            return false;
+        }
+
+        size_t end = _stdout.find('\n', position + needle.size());
+        if (end == string::npos)
+        {
+            // Status not complete yet, this spot is searched again
+            _stdoutScanned = position;
+            return false;
+        }
+
+        SshCommandResult& result = _Result(_stdoutDone);
+        result.output.assign(_stdout, 0, position);
+        result.exitStatus = atoi(_stdout.c_str() + position + needle.size());
+        _stdout.erase(0, end + 1);
+        _stdoutDone++;
+
+        return true;
+    };
+
+    bool _NextStderr()
+    {
+        string needle = "\n" + _token + "_" + to_string(_stderrDone) + "\n";
+        size_t position = _Find(_stderr, _stderrScanned, needle);
+        if (position == string::npos)
+        {
+            return false;
+        }
+
+        _Result(_stderrDone).errors.assign(_stderr, 0, position);
+        _stderr.erase(0, position + needle.size());
+        _stderrDone++;
+
+        return true;
+    };
+
+private:
+    string _token;
+    size_t _commands;
+    vector<SshCommandResult>& _results;
+    string _stdout, _stderr;
+    size_t _stdoutScanned{0}, _stderrScanned{0};
+    size_t _stdoutDone{0}, _stderrDone{0};
+};
+
+SshShell::~SshShell()
+{
+    Close();
+}
+
+int SshShell::Open()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_channel == NULL)
+    {
+        _channel = _client._OpenChannel("sh");
+    }
+
+    return _channel ? SSH_OK : SSH_ERROR;
+}
+
+bool SshShell::IsOpen()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _channel != NULL;
+}
+
+void SshShell::Close()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_channel)
+    {
+        _client._CloseChannel(_channel);
+        _channel = NULL;
+    }
+}
+
+int SshShell::ExecuteBatch(const vector<string>& commands, vector<SshCommandResult>& results)
+{
+    lock_guard<mutex> lock(_mutex);
+    string token = newToken();
+    string script = buildScript(commands, token);
+    ScriptSource source(script);
+    BatchParser parser(token, commands.size(), results);
+    chrono::steady_clock::time_point deadline = _client._Deadline();
+    int res;
+
+    if (_channel == NULL)
+    {
+        return SSH_ERROR;
+    }
+
+    // Output is parsed while the script is still going out
+    res = _client._WriteChannel(_channel, source, parser, deadline);
+
+    while (res == SSH_OK && parser.Done() == false)
+    {
+        if (chrono::steady_clock::now() > deadline)
+        {
+            SSH_LOG(Error, "Batch of %zu commands timed out", commands.size());
+            res = SSH_ERROR;
+            break;
+        }
+
+        int nbytes = _client._DrainChannel(_channel, parser);
+        if (nbytes < 0)
+        {
+            res = SSH_ERROR;
+            break;
+        }
+        if (nbytes > 0)
+        {
+            continue;
+        }
+
+        bool exited;
+        {
+            lock_guard<mutex> session(_client._sessionMutex);
+            exited = ssh_channel_is_eof(_channel) || ssh_channel_is_closed(_channel);
+        }
+        if (exited)
+        {
+            SSH_LOG(Error, "Remote shell exited during a batch");
+            res = SSH_ERROR;
+            break;
+        }
+
+        _client._WaitSession();
+    }
+
+    // A shell that failed is in an unknown state, the next batch gets a new one
+    if (res != SSH_OK)
+    {
+        _client._CloseChannel(_channel);
+        _channel = NULL;
+    }
+
+    return res;
+}
+
+int SshShell::ExecuteScript(SshClient& client, const vector<string>& commands,
+                            vector<SshCommandResult>& results)
+{
+    string token = newToken();
+    string script = buildScript(commands, token);
+    ScriptSource source(script);
+    BatchParser parser(token, commands.size(), results);
+    int exitStatus = -1;
+    int res;
+
+    res = client.Execute("sh", source, parser, &exitStatus);
+    if (res == SSH_OK && parser.Done() == false)
+    {
+        SSH_LOG(Error, "Remote shell exited during a batch");
+        res = SSH_ERROR;
+    }
+
+    return res;
+}
@@ -0,0 +1,36 @@
+#ifndef __SSH_SHELL_H__
+#define __SSH_SHELL_H__
+
+#include "SshClient.h"
+
+// Remote sh kept open on one channel, which runs a batch of commands written
+// back to back as a single script. Each command runs in a subshell with its
+// input from /dev/null, and is followed by a marker on stdout and stderr that
+// carries its exit status, so a batch costs one round trip instead of a
+// channel open and exec per command. Batches on one shell take turns.
+class SshShell
+{
+public:
+    SshShell(SshClient& client): _client(client){};
+    ~SshShell();
+    SshShell(const SshShell&) = delete;
+    SshShell& operator=(const SshShell&) = delete;
+
+    int Open();
+    bool IsOpen();
+    // Fails when the shell went away, results then only hold the commands
+    // that completed
+    int ExecuteBatch(const vector<string>& commands, vector<SshCommandResult>& results);
+    void Close();
+
+    // Runs the same script once through Execute, on a channel of its own
+    static int ExecuteScript(SshClient& client, const vector<string>& commands,
+                             vector<SshCommandResult>& results);
+
+private:
+    SshClient& _client;
+    mutex _mutex;
+    ssh_channel _channel{NULL};
+};
+
+#endif // __SSH_SHELL_H__
@@ -0,0 +1,730 @@
+#include "SshSync.h"
+#include "SshHash.h"
+#include "SshTarTransfer.h"
+
+#include <filesystem>
+#include <unordered_map>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+// Changed files that share less than this part of their blocks with the old
+// copy are sent whole
+static constexpr uint64_t minMatchedFraction = 10;
+// Bits of the weak checksum used by the filter checked before the block index
+static constexpr int filterBits = 20;
+
+// POSIX cksum (CRC-32 with polynomial 0x04C11DB7 and the length appended) of
+// a fixed size window sliding one byte at a time, the same value the remote
+// `cksum` prints for each block
+class RollingCksum
+{
+public:
+    RollingCksum(size_t window): _window(window)
+    {
+        // The CRC is linear, so the contribution of the byte leaving the
+        // window is the CRC of that byte followed by `window` zero bytes
+        uint32_t bits[8];
+
+        for (int bit = 0; bit < 8; bit++)
+        {
+            uint32_t crc = _Update(0, 1 << bit);
+            for (size_t i = 0; i < window; i++)
+            {
+                crc = _Update(crc, 0);
+            }
+            bits[bit] = crc;
+        }
+        for (int byte = 0; byte < 256; byte++)
+        {
+            _outgoing[byte] = 0;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                if (byte & (1 << bit))
+                {
+                    _outgoing[byte] ^= bits[bit];
+                }
+            }
+        }
+    };
+
+    void Reset(const uint8_t *data)
+    {
+        _crc = 0;
+        for (size_t i = 0; i < _window; i++)
+        {
+            _crc = _Update(_crc, data[i]);
+        }
+    };
+
+    void Roll(uint8_t outgoing, uint8_t incoming)
+    {
+        _crc = _Update(_crc, incoming) ^ _outgoing[outgoing];
+    };
+
+    uint32_t Value() const
+    {
+        uint32_t crc = _crc;
+
+        for (uint64_t length = _window; length > 0; length >>= 8)
+        {
+            crc = _Update(crc, length & 0xff);
+        }
+
+        return ~crc;
+    };
+
+private:
+    static uint32_t _Update(uint32_t crc, uint8_t byte)
+    {
+        static const vector<uint32_t> table = []()
+        {
+            vector<uint32_t> table(256);
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i << 24;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+                }
+                table[i] = crc;
+            }
+            return table;
+        }();
+
+        return (crc << 8) ^ table[(crc >> 24) ^ byte];
+    };
+
+private:
+    size_t _window;
+    uint32_t _crc{0};
+    uint32_t _outgoing[256];
+};
+
+// One step of a remote rebuild: copy `length` blocks of the old file starting
+// at block `start`, or send `length` bytes of the new file from offset `start`
+struct DeltaOp
+{
+    bool copy;
+    uint64_t start;
+    uint64_t length;
+};
+
+// Feeds the rebuild loop: a header line per step, literal bytes right after
+// their header, and a final end marker
+class DeltaSource : public SshInputSource
+{
+public:
+    DeltaSource(const vector<DeltaOp>& ops, const uint8_t *data): _ops(ops), _data(data){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        size_t filled = 0;
+
+        while (filled < size)
+        {
+            if (_headerOffset < _header.size())
+            {
+                size_t count = min(size - filled, _header.size() - _headerOffset);
+                memcpy(buffer + filled, _header.data() + _headerOffset, count);
+                _headerOffset += count;
+                filled += count;
+            }
+            else if (_literalLength > 0)
+            {
+                size_t count = min<uint64_t>(size - filled, _literalLength);
+                memcpy(buffer + filled, _data + _literalOffset, count);
+                _literalOffset += count;
+                _literalLength -= count;
+                filled += count;
+            }
+            else if (_next < _ops.size())
+            {
+                const DeltaOp& op = _ops[_next++];
+
+                _header = (op.copy ? "C " + to_string(op.start) + " " : "L ") +
+                          to_string(op.length) + "\n";
+                _headerOffset = 0;
+                if (op.copy == false)
+                {
+                    _literalOffset = op.start;
+                    _literalLength = op.length;
+                }
+            }
+            else if (_ended == false)
+            {
+                _header = "E\n";
+                _headerOffset = 0;
+                _ended = true;
+            }
+            else
+            {
+                break;
+            }
+        }
+        _sent += filled;
+
+        return filled;
+    };
+
+    uint64_t Sent() const { return _sent; };
+
+private:
+    const vector<DeltaOp>& _ops;
+    const uint8_t *_data;
+    size_t _next{0};
+    string _header;
+    size_t _headerOffset{0};
+    uint64_t _literalOffset{0};
+    uint64_t _literalLength{0};
+    bool _ended{false};
+    uint64_t _sent{0};
+};
+
+class ScriptSource : public SshInputSource
+{
+public:
+    ScriptSource(const string& script): _script(script){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        size_t count = min(size, _script.size() - _offset);
+
+        memcpy(buffer, _script.data() + _offset, count);
+        _offset += count;
+
+        return count;
+    };
+
+private:
+    const string& _script;
+    size_t _offset{0};
+};
+
+// Around the square root of the size, like rsync, so the signature and the
+// matching granularity grow together
+static size_t blockSizeFor(uint64_t size)
+{
+    size_t block = (size_t) sqrt((double) size);
+
+    block = (block + 1023) / 1024 * 1024;
+
+    return min<size_t>(max<size_t>(block, 8 * 1024), 1024 * 1024);
+}
+
+static string octal(int mode)
+{
+    char text[8];
+
+    snprintf(text, sizeof(text), "%04o", mode);
+
+    return text;
+}
+
+int SshSync::Sync(const string& source, const string& destination,
+                  const SshTransferOptions& options, SshSyncReport& report)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    chrono::duration<double> sending{0};
+    vector<SshManifestEntry> local;
+    map<string, SshManifestEntry> remote;
+    vector<pair<SshManifestEntry*, const SshManifestEntry*>> deltas;
+    vector<string> copies;
+    string metadata;
+    int res = SSH_OK;
+
+    report = SshSyncReport();
+
+    if (_BuildLocalManifest(source, local) != SSH_OK ||
+        _BuildRemoteManifest(destination, remote) != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    for (SshManifestEntry& entry : local)
+    {
+        map<string, SshManifestEntry>::iterator found = remote.find(entry.path);
+        const SshManifestEntry* existing = found == remote.end() ? NULL : &found->second;
+        string quoted = SshShellQuote(entry.path);
+
+        if (entry.directory)
+        {
+            if (existing == NULL)
+            {
+                copies.push_back(entry.path);
+            }
+            else if (existing->mode != entry.mode)
+            {
+                metadata += "chmod " + octal(entry.mode) + " -- " + quoted + "\n";
+            }
+            continue;
+        }
+
+        report.files++;
+        report.bytesTotal += entry.size;
+
+        if (existing && existing->directory == false && existing->size == entry.size)
+        {
+            bool same = false;
+
+            // Same size and time is taken as unchanged unless asked to
+            // compare content, the hash settles any other case
+            if (options.syncChecksum == false && existing->mtime == entry.mtime)
+            {
+                same = true;
+            }
+            else if (existing->hash.empty() == false)
+            {
+                entry.hash = SshSha256File((fs::path(source) / entry.path).string());
+                same = entry.hash == existing->hash;
+            }
+
+            if (same)
+            {
+                report.filesUnchanged++;
+                if (existing->mode != entry.mode)
+                {
+                    metadata += "chmod " + octal(entry.mode) + " -- " + quoted + "\n";
+                }
+                if (existing->mtime != entry.mtime)
+                {
+                    metadata += "touch -m -d @" + to_string(entry.mtime) + " -- " + quoted + "\n";
+                }
+                continue;
+            }
+        }
+
+        if (existing && existing->directory == false &&
+            existing->size >= options.syncDeltaMinSize &&
+            entry.size >= options.syncDeltaMinSize)
+        {
+            deltas.push_back({&entry, existing});
+        }
+        else
+        {
+            copies.push_back(entry.path);
+            report.filesCopied++;
+        }
+    }
+
+    chrono::steady_clock::time_point sendStart = chrono::steady_clock::now();
+
+    for (pair<SshManifestEntry*, const SshManifestEntry*>& delta : deltas)
+    {
+        uint64_t sent = 0;
+
+        res = _SendDelta((fs::path(source) / delta.first->path).string(),
+                         destination + "/" + delta.first->path,
+                         *delta.first, *delta.second, options, sent);
+        report.bytesSent += sent;
+
+        if (res == SSH_OK)
+        {
+            report.filesDelta++;
+        }
+        else
+        {
+            copies.push_back(delta.first->path);
+            report.filesCopied++;
+        }
+    }
+
+    res = SSH_OK;
+    if (copies.empty() == false)
+    {
+        SshTarTransfer tar(_client);
+        SshTransferStats stats;
+
+        res = tar.PushFiles(source, destination, copies, options, stats);
+        report.bytesSent += stats.bytes;
+    }
+
+    sending = chrono::steady_clock::now() - sendStart;
+
+    if (metadata.empty() == false && _ApplyMetadata(destination, metadata) != SSH_OK)
+    {
+        res = SSH_ERROR;
+    }
+
+    report.elapsed = chrono::steady_clock::now() - start;
+    if (report.bytesSent > 0 && sending.count() > 0)
+    {
+        report.timeSaved = sending * ((double) report.BytesSaved() / report.bytesSent);
+    }
+
+    return res;
+}
+
+int SshSync::_BuildLocalManifest(const string& source, vector<SshManifestEntry>& manifest)
+{
+    error_code ec;
+
+    if (fs::is_directory(source, ec) == false)
+    {
+        SSH_LOG(Error, "Not a local directory: %s", source.c_str());
+        return SSH_ERROR;
+    }
+
+    for (fs::recursive_directory_iterator entry(source, ec), end; entry != end && !ec;
+         entry.increment(ec))
+    {
+        SshManifestEntry item;
+        struct stat status;
+
+        // Symbolic links and special files are left out
+        if (lstat(entry->path().c_str(), &status) != 0 ||
+            (S_ISDIR(status.st_mode) == false && S_ISREG(status.st_mode) == false))
+        {
+            continue;
+        }
+
+        item.path = entry->path().lexically_relative(source).string();
+        item.mode = status.st_mode & 07777;
+        item.directory = S_ISDIR(status.st_mode);
+        item.size = item.directory ? 0 : status.st_size;
+        item.mtime = status.st_mtime;
+        manifest.push_back(item);
+    }
+
+    if (ec)
+    {
+        SSH_LOG(Error, "Error reading directory %s: %s", source.c_str(),
+                ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshSync::_BuildRemoteManifest(const string& destination,
+                                  map<string, SshManifestEntry>& manifest)
+{
+    SshCaptureSink sink;
+    int exitStatus = -1;
+    size_t begin = 0;
+    int res;
+
+    // A missing destination is an empty manifest. Unreadable files get no
+    // hash and are sent again.
+    res = _client.Execute("cd " + SshShellQuote(destination) + " 2>/dev/null || exit 0; "
+                          "find . -mindepth 1"
+                          " \\( -type d -printf 'd %m %s %T@ %P\\0' \\) -o"
+                          " \\( -type f -printf 'f %m %s %T@ %P\\0' \\) || exit 1; "
+                          "find . -type f -print0 | xargs -0 -r sha256sum -z 2>/dev/null; "
+                          "exit 0",
+                          sink, &exitStatus);
+    if (res != SSH_OK || exitStatus != 0)
+    {
+        SSH_LOG(Error, "Can't list remote directory %s: %s", destination.c_str(),
+                sink.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    while (begin < sink.output.size())
+    {
+        size_t end = sink.output.find('\0', begin);
+        if (end == string::npos)
+        {
+            end = sink.output.size();
+        }
+
+        string record = sink.output.substr(begin, end - begin);
+        begin = end + 1;
+
+        // Hash records are the digest, two spaces and the path as find
+        // printed it
+        if (record.size() > 68 && record[1] != ' ' && record.compare(64, 4, "  ./") == 0)
+        {
+            map<string, SshManifestEntry>::iterator found = manifest.find(record.substr(68));
+            if (found != manifest.end())
+            {
+                found->second.hash = record.substr(0, 64);
+            }
+            continue;
+        }
+
+        size_t modeEnd = record.find(' ', 2);
+        size_t sizeEnd = modeEnd == string::npos ? string::npos : record.find(' ', modeEnd + 1);
+        size_t timeEnd = sizeEnd == string::npos ? string::npos : record.find(' ', sizeEnd + 1);
+        if (record.size() < 2 || record[1] != ' ' || timeEnd == string::npos)
+        {
+            continue;
+        }
+
+        SshManifestEntry item;
+        item.directory = record[0] == 'd';
+        item.mode = stoi(record.substr(2, modeEnd - 2), nullptr, 8);
+        item.size = stoull(record.substr(modeEnd + 1, sizeEnd - modeEnd - 1));
+        item.mtime = stoll(record.substr(sizeEnd + 1, timeEnd - sizeEnd - 1));
+        item.path = record.substr(timeEnd + 1);
+        manifest[item.path] = item;
+    }
+
+    return SSH_OK;
+}
+
+int SshSync::_ReadBlocks(const string& remotePath, size_t blockSize,
+                         vector<_Block>& blocks)
+{
+    SshCaptureSink sink;
+    string size = to_string(blockSize);
+    int exitStatus = -1;
+    size_t begin = 0;
+    size_t strong = 0;
+    bool weakDone = false;
+    int res;
+
+    // Weak sums of every block first, then their SHA-256, in the same order
+    res = _client.Execute("f=" + SshShellQuote(remotePath) + "; " +
+                          "split -b " + size + " --filter=cksum -- \"$f\" && echo && " +
+                          "split -b " + size + " --filter=sha256sum -- \"$f\"",
+                          sink, &exitStatus);
+    if (res != SSH_OK || exitStatus != 0)
+    {
+        SSH_LOG(Error, "Can't read blocks of %s: %s", remotePath.c_str(),
+                sink.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    while (begin < sink.output.size())
+    {
+        size_t end = sink.output.find('\n', begin);
+        if (end == string::npos)
+        {
+            end = sink.output.size();
+        }
+
+        string line = sink.output.substr(begin, end - begin);
+        begin = end + 1;
+
+        if (weakDone == false)
+        {
+            size_t space = line.find(' ');
+            if (line.empty())
+            {
+                weakDone = true;
+            }
+            else if (space != string::npos)
+            {
+                blocks.push_back({(uint32_t) stoul(line.substr(0, space)),
+                                  (uint32_t) stoul(line.substr(space + 1)), ""});
+            }
+        }
+        else if (line.size() >= 64 && strong < blocks.size())
+        {
+            blocks[strong++].strong = line.substr(0, 64);
+        }
+    }
+
+    if (strong != blocks.size())
+    {
+        SSH_LOG(Error, "Incomplete block list for %s", remotePath.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshSync::_SendDelta(const string& path, const string& remotePath,
+                        const SshManifestEntry& local, const SshManifestEntry& remote,
+                        const SshTransferOptions& options, uint64_t& sent)
+{
+    size_t blockSize = options.syncBlockSize ? options.syncBlockSize : blockSizeFor(remote.size);
+    unordered_map<uint32_t, vector<uint32_t>> index;
+    vector<uint64_t> filter((size_t(1) << filterBits) / 64, 0);
+    vector<_Block> blocks;
+    vector<DeltaOp> ops;
+    uint64_t matched = 0;
+    string hash = local.hash;
+    struct stat status;
+    uint8_t *data;
+    int fd;
+
+    if (_ReadBlocks(remotePath, blockSize, blocks) != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    // Only whole blocks can match a window of the new file
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i].size == blockSize)
+        {
+            uint32_t bit = blocks[i].weak & ((1 << filterBits) - 1);
+
+            index[blocks[i].weak].push_back(i);
+            filter[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &status) != 0 || (uint64_t) status.st_size != local.size)
+    {
+        SSH_LOG(Error, "Can't read %s", path.c_str());
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return SSH_ERROR;
+    }
+
+    data = (uint8_t *) mmap(NULL, local.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        SSH_LOG(Error, "Can't map %s: %s", path.c_str(), strerror(errno));
+        return SSH_ERROR;
+    }
+    madvise(data, local.size, MADV_SEQUENTIAL);
+
+    RollingCksum rolling(blockSize);
+    uint64_t position = 0;
+    uint64_t literalStart = 0;
+    bool primed = false;
+
+    while (position + blockSize <= local.size)
+    {
+        if (primed == false)
+        {
+            rolling.Reset(data + position);
+            primed = true;
+        }
+
+        uint32_t weak = rolling.Value();
+        uint32_t bit = weak & ((1 << filterBits) - 1);
+        int64_t match = -1;
+
+        if (filter[bit / 64] & (uint64_t(1) << (bit % 64)))
+        {
+            unordered_map<uint32_t, vector<uint32_t>>::iterator found = index.find(weak);
+
+            if (found != index.end())
+            {
+                SshSha256 window;
+                string strong;
+
+                window.Update(data + position, blockSize);
+                strong = window.HexDigest();
+
+                for (uint32_t candidate : found->second)
+                {
+                    if (blocks[candidate].strong != strong)
+                    {
+                        continue;
+                    }
+                    match = candidate;
+                    // Among identical blocks prefer the one that extends the
+                    // current copy
+                    if (ops.empty() == false && ops.back().copy &&
+                        ops.back().start + ops.back().length == candidate)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (match >= 0)
+        {
+            if (position > literalStart)
+            {
+                ops.push_back({false, literalStart, position - literalStart});
+            }
+            if (ops.empty() == false && ops.back().copy &&
+                ops.back().start + ops.back().length == (uint64_t) match)
+            {
+                ops.back().length++;
+            }
+            else
+            {
+                ops.push_back({true, (uint64_t) match, 1});
+            }
+
+            matched += blockSize;
+            position += blockSize;
+            literalStart = position;
+            primed = false;
+            continue;
+        }
+
+        if (position + blockSize >= local.size)
+        {
+            break;
+        }
+        rolling.Roll(data[position], data[position + blockSize]);
+        position++;
+    }
+
+    if (local.size > literalStart)
+    {
+        ops.push_back({false, literalStart, local.size - literalStart});
+    }
+
+    if (matched < local.size / minMatchedFraction)
+    {
+        SSH_LOG(Debug, "%s shares too little with the remote copy, sending it whole",
+                path.c_str());
+        munmap(data, local.size);
+        return SSH_ERROR;
+    }
+
+    if (hash.empty())
+    {
+        SshSha256 whole;
+
+        whole.Update(data, local.size);
+        hash = whole.HexDigest();
+    }
+
+    // The new file is assembled next to the old one, checked against the
+    // local hash and only then moved over it
+    string script =
+        "f=" + SshShellQuote(remotePath) + "; " +
+        "t=$(mktemp \"$f.XXXXXX\") || exit 1; trap 'rm -f \"$t\"' EXIT; " +
+        "while read op a b; do case $op in " +
+        "C) dd if=\"$f\" bs=" + to_string(blockSize) + " skip=$a count=$b 2>/dev/null || exit 1;; " +
+        "L) dd bs=65536 count=$a iflag=fullblock,count_bytes 2>/dev/null || exit 1;; " +
+        "*) break;; esac; done > \"$t\" || exit 1; " +
+        "[ \"$(sha256sum < \"$t\")\" = " + SshShellQuote(hash + "  -") + " ] || " +
+        "{ echo 'rebuilt file does not match' >&2; exit 1; }; " +
+        "chmod " + octal(local.mode) + " \"$t\" && " +
+        "touch -m -d @" + to_string(local.mtime) + " \"$t\" && mv -f \"$t\" \"$f\"";
+
+    DeltaSource input(ops, data);
+    SshCaptureSink output;
+    int exitStatus = -1;
+    int res;
+
+    res = _client.Execute(script, input, output, &exitStatus);
+    sent = input.Sent();
+    munmap(data, local.size);
+
+    if (res != SSH_OK || exitStatus != 0)
+    {
+        SSH_LOG(Error, "Error updating %s in place: %s", remotePath.c_str(),
+                output.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int SshSync::_ApplyMetadata(const string& destination, const string& script)
+{
+    ScriptSource input(script);
+    SshCaptureSink output;
+    int exitStatus = -1;
+
+    if (_client.Execute("cd " + SshShellQuote(destination) + " && exec sh -s",
+                        input, output, &exitStatus) != SSH_OK || exitStatus != 0)
+    {
+        SSH_LOG(Error, "Can't update modes and times in %s: %s",
+                destination.c_str(), output.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
@@ -0,0 +1,43 @@
+#ifndef __SSH_SYNC_H__
+#define __SSH_SYNC_H__
+
+#include "SshClient.h"
+#include "SshDirectoryTransfer.h"
+
+#include <map>
+
+// Brings a remote directory up to date with a local one. The remote tree is
+// listed with sizes, modification times and hashes in one round trip, files
+// that already match are skipped, large changed files are rebuilt remotely
+// from the blocks they still share with the old copy, and everything else is
+// sent whole in a single tar stream. Remote files missing locally are kept.
+class SshSync
+{
+public:
+    SshSync(SshClient& client): _client(client){};
+
+    int Sync(const string& source, const string& destination,
+             const SshTransferOptions& options, SshSyncReport& report);
+
+private:
+    struct _Block
+    {
+        uint32_t weak;
+        uint32_t size;
+        string strong;
+    };
+
+    int _BuildLocalManifest(const string& source, vector<SshManifestEntry>& manifest);
+    int _BuildRemoteManifest(const string& destination,
+                             map<string, SshManifestEntry>& manifest);
+    int _SendDelta(const string& path, const string& remotePath,
+                   const SshManifestEntry& local, const SshManifestEntry& remote,
+                   const SshTransferOptions& options, uint64_t& sent);
+    int _ReadBlocks(const string& remotePath, size_t blockSize, vector<_Block>& blocks);
+    int _ApplyMetadata(const string& destination, const string& script);
+
+private:
+    SshClient& _client;
+};
+
+#endif // __SSH_SYNC_H__
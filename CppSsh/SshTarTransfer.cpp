@@ -0,0 +1,284 @@
+#include "SshTarTransfer.h"
+
+#include <filesystem>
+#include <pthread.h>
+#include <signal.h>
+
+namespace fs = std::filesystem;
+
+// Standard input of the remote tar, read from the local one
+class TarSource : public SshInputSource
+{
+public:
+    TarSource(FILE *archive, const string& host, SshTransferPriority priority,
+              SshTransferStats& stats):
+              _archive(archive), _host(host), _priority(priority), _stats(stats){};
+
+    ssize_t Read(char *buffer, size_t size) override
+    {
+        size_t nbytes = fread(buffer, 1, size, _archive);
+        if (nbytes == 0 && ferror(_archive))
+        {
+            return -1;
+        }
+        SshTransferScheduler::Shared().Acquire(_host, _priority, nbytes);
+        _stats.bytes += nbytes;
+
+        return nbytes;
+    };
+
+private:
+    FILE *_archive;
+    const string& _host;
+    SshTransferPriority _priority;
+    SshTransferStats& _stats;
+};
+
+// Output of the remote tar, written into the local one
+class TarSink : public SshOutputSink
+{
+public:
+    TarSink(FILE *archive, const string& host, SshTransferPriority priority,
+            SshTransferStats& stats):
+            _fd(fileno(archive)), _host(host), _priority(priority), _stats(stats){};
+
+    void OnStdout(string_view data) override
+    {
+        // Charged once it arrived, which holds back the reads that follow
+        SshTransferScheduler::Shared().Acquire(_host, _priority, data.size());
+        // Once the local tar is gone the rest of the stream is dropped, the
+        // failure shows in its exit status
+        if (_failed == false &&
+            SshWriteAll(_fd, data.data(), data.size()) != SSH_OK)
+        {
+            _failed = true;
+        }
+        _stats.bytes += data.size();
+    };
+
+    void OnStderr(string_view data) override { errors.append(data); };
+
+    string errors;
+
+private:
+    int _fd;
+    const string& _host;
+    SshTransferPriority _priority;
+    bool _failed{false};
+    SshTransferStats& _stats;
+};
+
+// Blocks SIGPIPE for the calling thread so a local tar exiting early shows up
+// as a failed write instead of terminating the process
+class SigpipeGuard
+{
+public:
+    SigpipeGuard()
+    {
+        sigemptyset(&_pipe);
+        sigaddset(&_pipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &_pipe, &_previous);
+    };
+
+    ~SigpipeGuard()
+    {
+        struct timespec now = {0, 0};
+
+        // Discard the signal raised while blocked before restoring the mask
+        while (sigtimedwait(&_pipe, NULL, &now) > 0)
+        {
+        }
+        pthread_sigmask(SIG_SETMASK, &_previous, NULL);
+    };
+
+private:
+    sigset_t _pipe;
+    sigset_t _previous;
+};
+
+static int tarStatus(FILE *archive)
+{
+    int status = pclose(archive);
+
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+// Name of the last component of a path, ignoring trailing separators
+static string baseName(const string& path)
+{
+    fs::path normal = fs::path(path).lexically_normal();
+
+    if (normal.has_filename() == false)
+    {
+        normal = normal.parent_path();
+    }
+
+    return normal.filename().string();
+}
+
+string SshTarTransfer::_TarFlags(const SshTransferOptions& options)
+{
+    switch (options.compression)
+    {
+    case SshCompression::Gzip:
+        return " -z";
+    case SshCompression::Zstd:
+        return " --zstd";
+    default:
+        return "";
+    }
+}
+
+int SshTarTransfer::Push(const string& source, const string& destination,
+                         const SshTransferOptions& options, SshTransferStats& stats)
+{
+    error_code ec;
+    string name;
+
+    if (fs::is_directory(source, ec) == false)
+    {
+        SSH_LOG(Error, "Error: %s is not a directory", source.c_str());
+        return SSH_ERROR;
+    }
+
+    // Same placement as the other protocols: inside destination when it is
+    // an existing directory, under that name otherwise
+    name = baseName(fs::absolute(source, ec).string());
+
+    return _Send("exec tar -C " + SshShellQuote(source) + _TarFlags(options) + " -cf - .",
+                 destination,
+                 "d=" + SshShellQuote(destination) + "; " +
+                 "if [ -d \"$d\" ]; then d=\"$d\"/" + SshShellQuote(name) + "; fi; " +
+                 "mkdir -p \"$d\" && exec tar -C \"$d\"" + _TarFlags(options) + " -xpf -",
+                 options, stats);
+}
+
+int SshTarTransfer::PushFiles(const string& source, const string& destination,
+                              const vector<string>& paths,
+                              const SshTransferOptions& options, SshTransferStats& stats)
+{
+    char list[] = "/tmp/cppssh-tar-XXXXXX";
+    string names;
+    int fd;
+    int res;
+
+    // The names go through a file so their number isn't bound by the
+    // command line length
+    for (const string& path : paths)
+    {
+        names += path;
+        names += '\0';
+    }
+
+    fd = mkstemp(list);
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Error creating file list: %s", strerror(errno));
+        return SSH_ERROR;
+    }
+    res = SshWriteAll(fd, names.data(), names.size());
+    close(fd);
+
+    if (res == SSH_OK)
+    {
+        res = _Send("exec tar -C " + SshShellQuote(source) + " --no-recursion --null -T " +
+                    SshShellQuote(list) + _TarFlags(options) + " -cf -",
+                    destination,
+                    "mkdir -p " + SshShellQuote(destination) + " && exec tar -C " +
+                    SshShellQuote(destination) + _TarFlags(options) + " -xpf -",
+                    options, stats);
+    }
+
+    unlink(list);
+
+    return res;
+}
+
+int SshTarTransfer::_Send(const string& archiveCommand, const string& destination,
+                          const string& unpackCommand, const SshTransferOptions& options,
+                          SshTransferStats& stats)
+{
+    int exitStatus = -1;
+    int res;
+
+    FILE *archive = popen(archiveCommand.c_str(), "re");
+    if (archive == NULL)
+    {
+        SSH_LOG(Error, "Error starting local tar: %s", strerror(errno));
+        return SSH_ERROR;
+    }
+
+    TarSource input(archive, _client._ip, options.priority, stats);
+    SshCaptureSink output;
+
+    res = _client.Execute(unpackCommand, input, output, &exitStatus);
+
+    if (tarStatus(archive) != SSH_OK)
+    {
+        SSH_LOG(Error, "Error packing files for %s", destination.c_str());
+        res = SSH_ERROR;
+    }
+
+    if (res == SSH_OK && exitStatus != 0)
+    {
+        SSH_LOG(Error, "Error unpacking into %s: %s", destination.c_str(),
+                output.errors.c_str());
+        res = SSH_ERROR;
+    }
+
+    return res;
+}
+
+int SshTarTransfer::Pull(const string& source, const string& destination,
+                         const SshTransferOptions& options, SshTransferStats& stats)
+{
+    fs::path target(destination);
+    error_code ec;
+    string command;
+    int exitStatus = -1;
+    int res;
+
+    if (fs::is_directory(target, ec))
+    {
+        target /= baseName(source);
+    }
+
+    command = "[ -d " + SshShellQuote(source) + " ] || " +
+              "{ echo " + SshShellQuote(source + " is not a directory") + " >&2; exit 1; }; " +
+              "exec tar -C " + SshShellQuote(source) + _TarFlags(options) + " -cf - .";
+
+    SigpipeGuard guard;
+
+    FILE *archive = popen(("mkdir -p " + SshShellQuote(target.string()) +
+                           " && exec tar -C " + SshShellQuote(target.string()) +
+                           _TarFlags(options) + " -xpf -").c_str(), "we");
+    if (archive == NULL)
+    {
+        SSH_LOG(Error, "Error starting local tar: %s", strerror(errno));
+        return SSH_ERROR;
+    }
+
+    TarSink output(archive, _client._ip, options.priority, stats);
+
+    res = _client.Execute(command, output, &exitStatus);
+
+    if (res == SSH_OK && exitStatus != 0)
+    {
+        SSH_LOG(Error, "Error packing %s: %s", source.c_str(),
+                output.errors.c_str());
+        res = SSH_ERROR;
+    }
+
+    if (tarStatus(archive) != SSH_OK)
+    {
+        SSH_LOG(Error, "Error unpacking into %s", target.c_str());
+        res = SSH_ERROR;
+    }
+
+    return res;
+}
@@ -0,0 +1,35 @@
+#ifndef __SSH_TAR_TRANSFER_H__
+#define __SSH_TAR_TRANSFER_H__
+
+#include "SshClient.h"
+
+// Copies a directory tree as a single tar stream: a local tar process packs
+// it and a remote one unpacks it from the standard input of an exec channel,
+// or the other way around for Pull. Trees of many small files then cost one
+// channel instead of a request and acknowledgement per file and directory.
+class SshTarTransfer
+{
+public:
+    SshTarTransfer(SshClient& client): _client(client){};
+
+    int Push(const string& source, const string& destination,
+             const SshTransferOptions& options, SshTransferStats& stats);
+    int Pull(const string& source, const string& destination,
+             const SshTransferOptions& options, SshTransferStats& stats);
+    // Sends only the listed entries, relative to source, into the directory
+    // destination. Directories in the list are created without their content.
+    int PushFiles(const string& source, const string& destination,
+                  const vector<string>& paths, const SshTransferOptions& options,
+                  SshTransferStats& stats);
+
+private:
+    static string _TarFlags(const SshTransferOptions& options);
+    int _Send(const string& archiveCommand, const string& destination,
+              const string& unpackCommand, const SshTransferOptions& options,
+              SshTransferStats& stats);
+
+private:
+    SshClient& _client;
+};
+
+#endif // __SSH_TAR_TRANSFER_H__
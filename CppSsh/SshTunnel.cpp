@@ -0,0 +1,771 @@
+#include "SshTunnel.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// Per direction and connection, one SSH channel packet holds at most 32 KiB
+static constexpr size_t relayBufferSize = 64 * 1024;
+// How long the relay sleeps when nothing happens, channel data that arrives
+// meanwhile also wakes it through the session socket
+static constexpr int relayPollTimeoutMs = 100;
+
+static int listenOn(const string& address, int port, int* boundPort)
+{
+    struct addrinfo hints = {};
+    struct addrinfo *addresses = NULL;
+    struct sockaddr_storage bound = {};
+    socklen_t length = sizeof(bound);
+    int fd = -1;
+    int one = 1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(address.empty() ? NULL : address.c_str(), to_string(port).c_str(),
+                    &hints, &addresses) != 0)
+    {
+        SSH_LOG(Error, "Can't resolve %s", address.c_str());
+        return -1;
+    }
+
+    for (struct addrinfo *ai = addresses; ai != NULL && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Can't listen on %s:%d: %s", address.c_str(), port, strerror(errno));
+        return -1;
+    }
+
+    if (boundPort && getsockname(fd, (struct sockaddr *) &bound, &length) == 0)
+    {
+        *boundPort = ntohs(bound.ss_family == AF_INET6
+                           ? ((struct sockaddr_in6 *) &bound)->sin6_port
+                           : ((struct sockaddr_in *) &bound)->sin_port);
+    }
+
+    return fd;
+}
+
+static int connectTo(const string& host, int port)
+{
+    struct addrinfo hints = {};
+    struct addrinfo *addresses = NULL;
+    int fd = -1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0)
+    {
+        SSH_LOG(Error, "Can't resolve %s", host.c_str());
+        return -1;
+    }
+
+    for (struct addrinfo *ai = addresses; ai != NULL && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (fd < 0)
+    {
+        SSH_LOG(Error, "Can't connect to %s:%d: %s", host.c_str(), port, strerror(errno));
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+static void setNoDelay(int fd)
+{
+    int one = 1;
+
+    // Fails harmlessly on anything but TCP
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+SshTunnel::~SshTunnel()
+{
+    Stop();
+}
+
+int SshTunnel::ForwardLocal(const string& localAddress, int localPort,
+                            const string& remoteHost, int remotePort, int* boundPort)
+{
+    int fd = listenOn(localAddress, localPort, boundPort);
+
+    if (fd < 0)
+    {
+        return SSH_ERROR;
+    }
+
+    lock_guard<mutex> lock(_mutex);
+
+    _newListeners.push_back(_Listener{fd, remoteHost, remotePort});
+    if (_wakeFd >= 0)
+    {
+        uint64_t one = 1;
+        SshWriteAll(_wakeFd, (const char *) &one, sizeof(one));
+    }
+
+    return SSH_OK;
+}
+
+int SshTunnel::ForwardRemote(const string& remoteAddress, int remotePort,
+                             const string& localHost, int localPort, int* boundPort)
+{
+    int bound = 0;
+    int res;
+
+    if (_client._controlled)
+    {
+        SSH_LOG(Error, "Forwarding needs a direct session, not a control master");
+        return SSH_ERROR;
+    }
+
+    {
+        lock_guard<mutex> lock(_client._sessionMutex);
+
+        if (_client._session == NULL)
+        {
+            return SSH_ERROR;
+        }
+
+        res = ssh_channel_listen_forward(_client._session,
+                                         remoteAddress.empty() ? NULL : remoteAddress.c_str(),
+                                         remotePort, &bound);
+        if (res != SSH_OK)
+        {
+            SSH_LOG(Error, "Server refused to listen on %s:%d: %s", remoteAddress.c_str(),
+                    remotePort, ssh_get_error(_client._session));
+            return SSH_ERROR;
+        }
+    }
+
+    // The server only reports the port when it picked one
+    if (remotePort != 0)
+    {
+        bound = remotePort;
+    }
+    if (boundPort)
+    {
+        *boundPort = bound;
+    }
+
+    lock_guard<mutex> lock(_mutex);
+    _remoteForwards[bound] = _LocalTarget{localHost, localPort, remoteAddress, bound};
+
+    return SSH_OK;
+}
+
+int SshTunnel::Start()
+{
+    struct epoll_event event = {};
+
+    if (_client._controlled)
+    {
+        SSH_LOG(Error, "Forwarding needs a direct session, not a control master");
+        return SSH_ERROR;
+    }
+
+    if (_relay.joinable())
+    {
+        SSH_LOG(Error, "Tunnel is already running");
+        return SSH_ERROR;
+    }
+
+    {
+        lock_guard<mutex> lock(_client._sessionMutex);
+
+        if (_client._session == NULL)
+        {
+            return SSH_ERROR;
+        }
+        _sessionFd = ssh_get_fd(_client._session);
+    }
+
+    _epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (_epollFd < 0)
+    {
+        SSH_LOG(Error, "Can't create an epoll instance: %s", strerror(errno));
+        return SSH_ERROR;
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        _wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_wakeFd < 0)
+        {
+            SSH_LOG(Error, "Can't create an eventfd: %s", strerror(errno));
+            close(_epollFd);
+            _epollFd = -1;
+            return SSH_ERROR;
+        }
+    }
+
+    event.events = EPOLLIN;
+    event.data.fd = _wakeFd;
+    epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &event);
+    if (_sessionFd >= 0)
+    {
+        event.data.fd = _sessionFd;
+        epoll_ctl(_epollFd, EPOLL_CTL_ADD, _sessionFd, &event);
+    }
+
+    // A tunnel started again after Stop begins with a running relay
+    _stopping = false;
+    _relay = thread(&SshTunnel::_Run, this);
+
+    return SSH_OK;
+}
+
+void SshTunnel::Stop()
+{
+    map<int, _LocalTarget> remoteForwards;
+
+    if (_relay.joinable())
+    {
+        uint64_t one = 1;
+
+        _stopping = true;
+        SshWriteAll(_wakeFd, (const char *) &one, sizeof(one));
+        _relay.join();
+    }
+
+    while (_connections.empty() == false)
+    {
+        _CloseConnection(_connections.begin()->first);
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        for (const _Listener& listener : _newListeners)
+        {
+            close(listener.fd);
+        }
+        _newListeners.clear();
+        remoteForwards.swap(_remoteForwards);
+
+        if (_wakeFd >= 0)
+        {
+            close(_wakeFd);
+            _wakeFd = -1;
+        }
+    }
+
+    for (const pair<const int, _Listener>& listener : _listeners)
+    {
+        close(listener.first);
+    }
+    _listeners.clear();
+
+    if (remoteForwards.empty() == false)
+    {
+        lock_guard<mutex> lock(_client._sessionMutex);
+
+        for (const pair<const int, _LocalTarget>& forward : remoteForwards)
+        {
+            if (_client._session)
+            {
+                const string& address = forward.second.remoteAddress;
+
+                ssh_channel_cancel_forward(_client._session,
+                                           address.empty() ? NULL : address.c_str(),
+                                           forward.first);
+            }
+        }
+    }
+
+    if (_epollFd >= 0)
+    {
+        close(_epollFd);
+        _epollFd = -1;
+    }
+}
+
+SshTunnelStats SshTunnel::GetStats()
+{
+    SshTunnelStats stats;
+
+    stats.connections = _connectionCount.load(memory_order_relaxed);
+    stats.failures = _failures.load(memory_order_relaxed);
+    stats.active = _active.load(memory_order_relaxed);
+    stats.bytesToRemote = _bytesToRemote.load(memory_order_relaxed);
+    stats.bytesToLocal = _bytesToLocal.load(memory_order_relaxed);
+
+    return stats;
+}
+
+void SshTunnel::_Run()
+{
+    struct epoll_event events[64];
+    vector<pair<ssh_channel, int>> accepted;
+    vector<int> finished;
+    bool busy = false;
+
+    while (_stopping == false)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+
+            for (const _Listener& listener : _newListeners)
+            {
+                struct epoll_event event = {};
+
+                event.events = EPOLLIN;
+                event.data.fd = listener.fd;
+                epoll_ctl(_epollFd, EPOLL_CTL_ADD, listener.fd, &event);
+                _listeners[listener.fd] = listener;
+            }
+            _newListeners.clear();
+        }
+
+        // Channels that filled a whole buffer may have more queued in libssh
+        int count = epoll_wait(_epollFd, events, 64, busy ? 0 : relayPollTimeoutMs);
+
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if (fd == _wakeFd)
+            {
+                uint64_t value;
+                ssize_t ignored = read(_wakeFd, &value, sizeof(value));
+                (void) ignored;
+                continue;
+            }
+            if (fd == _sessionFd)
+            {
+                continue;
+            }
+
+            map<int, _Listener>::iterator listener = _listeners.find(fd);
+            if (listener != _listeners.end())
+            {
+                _Accept(listener->second);
+                continue;
+            }
+
+            map<int, unique_ptr<_Connection>>::iterator connection = _connections.find(fd);
+            if (connection != _connections.end())
+            {
+                // A hangup is reported with whatever is watched, it only
+                // counts for the side that is waiting on the socket
+                uint32_t watched = connection->second->events;
+
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && (watched & EPOLLIN))
+                {
+                    _ReadLocal(*connection->second);
+                }
+                if ((events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && (watched & EPOLLOUT))
+                {
+                    _WriteLocal(*connection->second);
+                }
+            }
+        }
+
+        accepted.clear();
+        busy = _Pump(accepted);
+
+        for (const pair<ssh_channel, int>& channel : accepted)
+        {
+            _ConnectRemote(channel.first, channel.second);
+        }
+
+        finished.clear();
+        for (const pair<const int, unique_ptr<_Connection>>& entry : _connections)
+        {
+            _Connection& connection = *entry.second;
+
+            if (connection.failed || (connection.eofSent && connection.shutdownSent))
+            {
+                finished.push_back(entry.first);
+            }
+            else
+            {
+                _UpdateEvents(connection);
+            }
+        }
+        for (int fd : finished)
+        {
+            _CloseConnection(fd);
+        }
+    }
+}
+
+void SshTunnel::_Accept(const _Listener& listener)
+{
+    while (true)
+    {
+        struct sockaddr_storage peer = {};
+        socklen_t length = sizeof(peer);
+        char host[NI_MAXHOST] = "127.0.0.1";
+        char port[NI_MAXSERV] = "0";
+        ssh_channel channel;
+        int fd;
+
+        fd = accept4(listener.fd, (struct sockaddr *) &peer, &length,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+        setNoDelay(fd);
+        getnameinfo((struct sockaddr *) &peer, length, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+
+        {
+            lock_guard<mutex> lock(_client._sessionMutex);
+            channel = _client._session ? ssh_channel_new(_client._session) : NULL;
+        }
+
+        if (channel == NULL)
+        {
+            _failures++;
+            close(fd);
+            continue;
+        }
+
+        // _Pump opens the channel along with the relaying
+        _Connection& connection = _AddConnection(fd, channel, true);
+
+        connection.remoteHost = listener.remoteHost;
+        connection.remotePort = listener.remotePort;
+        connection.originHost = host;
+        connection.originPort = atoi(port);
+    }
+}
+
+void SshTunnel::_ConnectRemote(ssh_channel channel, int port)
+{
+    _LocalTarget target;
+    int fd = -1;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        map<int, _LocalTarget>::iterator it = _remoteForwards.find(port);
+
+        if (it != _remoteForwards.end())
+        {
+            target = it->second;
+            fd = connectTo(target.host, target.port);
+        }
+    }
+
+    if (fd < 0)
+    {
+        lock_guard<mutex> lock(_client._sessionMutex);
+
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        _failures++;
+        return;
+    }
+
+    setNoDelay(fd);
+    _AddConnection(fd, channel, false);
+}
+
+SshTunnel::_Connection& SshTunnel::_AddConnection(int fd, ssh_channel channel, bool opening)
+{
+    unique_ptr<_Connection> connection = make_unique<_Connection>();
+    _Connection& added = *connection;
+
+    connection->fd = fd;
+    connection->channel = channel;
+    connection->opening = opening;
+    connection->toRemote.data = SshBufferPool::Shared().Acquire(relayBufferSize);
+    connection->toLocal.data = SshBufferPool::Shared().Acquire(relayBufferSize);
+    _UpdateEvents(added);
+
+    _connections[fd] = move(connection);
+    if (opening == false)
+    {
+        _connectionCount++;
+    }
+    _active++;
+
+    return added;
+}
+
+void SshTunnel::_ReadLocal(_Connection& connection)
+{
+    _Buffer& buffer = connection.toRemote;
+    ssize_t nbytes;
+
+    // Nothing more is read until the channel took what is pending
+    if (connection.localEof || buffer.Pending() > 0)
+    {
+        return;
+    }
+
+    nbytes = read(connection.fd, buffer.data.Data(), relayBufferSize);
+    if (nbytes > 0)
+    {
+        buffer.start = 0;
+        buffer.end = nbytes;
+    }
+    else if (nbytes == 0)
+    {
+        connection.localEof = true;
+    }
+    else if (errno != EAGAIN && errno != EINTR)
+    {
+        connection.failed = true;
+    }
+}
+
+void SshTunnel::_WriteLocal(_Connection& connection)
+{
+    _Buffer& buffer = connection.toLocal;
+    ssize_t nbytes;
+
+    if (buffer.Pending() == 0)
+    {
+        return;
+    }
+
+    nbytes = send(connection.fd, buffer.data.Data() + buffer.start, buffer.Pending(),
+                  MSG_NOSIGNAL);
+    if (nbytes > 0)
+    {
+        buffer.start += nbytes;
+        _bytesToLocal += nbytes;
+    }
+    else if (nbytes < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        connection.failed = true;
+    }
+}
+
+bool SshTunnel::_Pump(vector<pair<ssh_channel, int>>& accepted)
+{
+    bool remoteForwards;
+    bool busy = false;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        remoteForwards = _remoteForwards.empty() == false;
+    }
+
+    lock_guard<mutex> lock(_client._sessionMutex);
+
+    if (_client._session == NULL)
+    {
+        return false;
+    }
+
+    while (remoteForwards)
+    {
+        int port = 0;
+        ssh_channel channel = ssh_channel_accept_forward(_client._session, 0, &port);
+
+        if (channel == NULL)
+        {
+            break;
+        }
+        accepted.push_back(make_pair(channel, port));
+    }
+
+    for (const pair<const int, unique_ptr<_Connection>>& entry : _connections)
+    {
+        _Connection& connection = *entry.second;
+        ssh_channel channel = connection.channel;
+
+        if (connection.failed)
+        {
+            continue;
+        }
+
+        if (connection.opening)
+        {
+            int res;
+
+            ssh_set_blocking(_client._session, 0);
+            res = ssh_channel_open_forward(channel, connection.remoteHost.c_str(),
+                                           connection.remotePort,
+                                           connection.originHost.c_str(),
+                                           connection.originPort);
+            ssh_set_blocking(_client._session, 1);
+
+            if (res == SSH_AGAIN)
+            {
+                continue;
+            }
+            if (res != SSH_OK)
+            {
+                SSH_LOG(Error, "Can't forward to %s:%d: %s", connection.remoteHost.c_str(),
+                        connection.remotePort, ssh_get_error(_client._session));
+                connection.failed = true;
+                _failures++;
+                continue;
+            }
+            connection.opening = false;
+            _connectionCount++;
+        }
+
+        // Socket to channel, as far as the remote window goes
+        if (connection.toRemote.Pending() > 0)
+        {
+            _Buffer& buffer = connection.toRemote;
+            uint32_t window = ssh_channel_window_size(channel);
+
+            if (window > 0)
+            {
+                int nbytes = ssh_channel_write(channel, buffer.data.Data() + buffer.start,
+                                               min<size_t>(window, buffer.Pending()));
+                if (nbytes < 0)
+                {
+                    connection.failed = true;
+                    continue;
+                }
+                buffer.start += nbytes;
+                _bytesToRemote += nbytes;
+            }
+        }
+        if (connection.localEof && connection.toRemote.Pending() == 0 && !connection.eofSent)
+        {
+            ssh_channel_send_eof(channel);
+            connection.eofSent = true;
+        }
+
+        // Channel to socket, written out right away
+        if (connection.remoteEof == false && connection.toLocal.Pending() == 0)
+        {
+            _Buffer& buffer = connection.toLocal;
+            int nbytes = ssh_channel_read_nonblocking(channel, buffer.data.Data(),
+                                                      relayBufferSize, 0);
+
+            if (nbytes > 0)
+            {
+                buffer.start = 0;
+                buffer.end = nbytes;
+                _WriteLocal(connection);
+                busy = busy || (size_t) nbytes == relayBufferSize;
+            }
+            else if (nbytes == SSH_EOF || (nbytes == 0 && ssh_channel_is_eof(channel)))
+            {
+                connection.remoteEof = true;
+            }
+            else if (nbytes < 0)
+            {
+                connection.failed = true;
+                continue;
+            }
+        }
+
+        if (ssh_channel_is_closed(channel))
+        {
+            // Nothing can go out on it anymore
+            connection.remoteEof = true;
+            connection.eofSent = true;
+        }
+        if (connection.remoteEof && connection.toLocal.Pending() == 0 && !connection.shutdownSent)
+        {
+            shutdown(connection.fd, SHUT_WR);
+            connection.shutdownSent = true;
+        }
+    }
+
+    return busy;
+}
+
+void SshTunnel::_UpdateEvents(_Connection& connection)
+{
+    uint32_t events = 0;
+    struct epoll_event event = {};
+    int operation;
+
+    if (connection.opening == false && connection.localEof == false &&
+        connection.toRemote.Pending() == 0)
+    {
+        events |= EPOLLIN;
+    }
+    if (connection.toLocal.Pending() > 0)
+    {
+        events |= EPOLLOUT;
+    }
+
+    if (events == connection.events)
+    {
+        return;
+    }
+
+    // Hangups are reported whatever the mask is, so a socket with nothing to
+    // wait for leaves the epoll set instead of waking the relay over and over
+    if (connection.events == 0)
+    {
+        operation = EPOLL_CTL_ADD;
+    }
+    else if (events == 0)
+    {
+        operation = EPOLL_CTL_DEL;
+    }
+    else
+    {
+        operation = EPOLL_CTL_MOD;
+    }
+
+    event.events = events;
+    event.data.fd = connection.fd;
+    epoll_ctl(_epollFd, operation, connection.fd, &event);
+    connection.events = events;
+}
+
+void SshTunnel::_CloseConnection(int fd)
+{
+    map<int, unique_ptr<_Connection>>::iterator it = _connections.find(fd);
+    unique_ptr<_Connection> connection = move(it->second);
+
+    _connections.erase(it);
+
+    {
+        lock_guard<mutex> lock(_client._sessionMutex);
+
+        if (_client._session)
+        {
+            // A channel still opening has nothing to close
+            if (connection->opening == false && ssh_channel_is_closed(connection->channel) == 0)
+            {
+                ssh_channel_close(connection->channel);
+            }
+            ssh_channel_free(connection->channel);
+        }
+    }
+
+    if (connection->events != 0)
+    {
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    close(fd);
+    _active--;
+}
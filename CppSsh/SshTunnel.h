@@ -0,0 +1,128 @@
+#ifndef __SSH_TUNNEL_H__
+#define __SSH_TUNNEL_H__
+
+#include "SshClient.h"
+
+#include <map>
+#include <thread>
+
+struct SshTunnelStats
+{
+    uint64_t connections{0};
+    uint64_t failures{0};
+    uint64_t active{0};
+    // Payload relayed in each direction, SSH framing not included
+    uint64_t bytesToRemote{0};
+    uint64_t bytesToLocal{0};
+};
+
+// Port forwarding on the session of a connected client. Local forwards listen
+// here and open a direct-tcpip channel per connection, remote forwards have
+// the server listen and connect the forwarded-tcpip channels it opens to a
+// local address. One epoll driven thread relays every connection, reading
+// socket data straight into per connection buffers taken from the shared
+// SshBufferPool and writing channel data straight to the socket. It opens
+// channels without blocking, so new connections don't hold up the others.
+// Stop the tunnel, or destroy it, before closing the client.
+class SshTunnel
+{
+public:
+    SshTunnel(SshClient& client): _client(client){};
+    ~SshTunnel();
+    SshTunnel(const SshTunnel&) = delete;
+    SshTunnel& operator=(const SshTunnel&) = delete;
+
+    // Like ssh -L. Port 0 picks a free port, returned in boundPort.
+    int ForwardLocal(const string& localAddress, int localPort, const string& remoteHost,
+                     int remotePort, int* boundPort);
+    // Like ssh -R. Port 0 lets the server pick, returned in boundPort.
+    int ForwardRemote(const string& remoteAddress, int remotePort, const string& localHost,
+                      int localPort, int* boundPort);
+    int Start();
+    void Stop();
+    SshTunnelStats GetStats();
+
+private:
+    struct _Buffer
+    {
+        SshPooledBuffer data;
+        size_t start{0};
+        size_t end{0};
+
+        size_t Pending() const { return end - start; };
+    };
+
+    struct _Connection
+    {
+        int fd{-1};
+        ssh_channel channel{NULL};
+        // Read from the socket, waiting for room in the channel window
+        _Buffer toRemote;
+        // Read from the channel, waiting for room in the socket
+        _Buffer toLocal;
+        bool localEof{false};
+        bool remoteEof{false};
+        bool eofSent{false};
+        bool shutdownSent{false};
+        bool failed{false};
+        // Watched on the socket, 0 while it is out of the epoll set
+        uint32_t events{0};
+        // A local forward whose direct-tcpip channel the server hasn't
+        // confirmed yet, the socket isn't read meanwhile
+        bool opening{false};
+        string remoteHost;
+        int remotePort{0};
+        string originHost;
+        int originPort{0};
+    };
+
+    struct _Listener
+    {
+        int fd;
+        string remoteHost;
+        int remotePort;
+    };
+
+    struct _LocalTarget
+    {
+        string host;
+        int port;
+        string remoteAddress;
+        int remotePort;
+    };
+
+    void _Run();
+    void _Accept(const _Listener& listener);
+    _Connection& _AddConnection(int fd, ssh_channel channel, bool opening);
+    void _ReadLocal(_Connection& connection);
+    void _WriteLocal(_Connection& connection);
+    bool _Pump(vector<pair<ssh_channel, int>>& accepted);
+    void _ConnectRemote(ssh_channel channel, int port);
+    void _UpdateEvents(_Connection& connection);
+    void _CloseConnection(int fd);
+
+private:
+    SshClient& _client;
+    thread _relay;
+    int _epollFd{-1};
+    int _wakeFd{-1};
+    int _sessionFd{-1};
+    atomic<bool> _stopping{false};
+
+    // Shared with the callers of ForwardLocal and ForwardRemote
+    mutex _mutex;
+    vector<_Listener> _newListeners;
+    map<int, _LocalTarget> _remoteForwards;
+
+    // Relay thread only
+    map<int, _Listener> _listeners;
+    map<int, unique_ptr<_Connection>> _connections;
+
+    atomic<uint64_t> _connectionCount{0};
+    atomic<uint64_t> _failures{0};
+    atomic<uint64_t> _active{0};
+    atomic<uint64_t> _bytesToRemote{0};
+    atomic<uint64_t> _bytesToLocal{0};
+};
+
+#endif // __SSH_TUNNEL_H__
@@ -0,0 +1,150 @@
+#include "SshVerify.h"
+#include "SshClient.h"
+
+#include <sstream>
+
+// Longest quoted path list of one remote command, it appears twice in it
+static constexpr size_t maxBatchLength = 32 * 1024;
+
+static const char crcScript[] =
+    "import sys, zlib\n"
+    "for path in sys.argv[1:]:\n"
+    "    crc = 0\n"
+    "    try:\n"
+    "        with open(path, 'rb') as f:\n"
+    "            for block in iter(lambda: f.read(1 << 20), b''):\n"
+    "                crc = zlib.crc32(block, crc)\n"
+    "        print(crc & 0xffffffff)\n"
+    "    except OSError:\n"
+    "        print(-1)\n";
+
+void SshTransferVerifier::Add(const string& remotePath, const string& localPath, uint32_t crc)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    _files.push_back(_File{remotePath, localPath, crc});
+}
+
+void SshTransferVerifier::Clear()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    _files.clear();
+}
+
+size_t SshTransferVerifier::Files()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    return _files.size();
+}
+
+int SshTransferVerifier::Check(SshClient& client)
+{
+    vector<_File> files;
+    vector<_File> batch;
+    size_t length = 0;
+    int res = SSH_OK;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        files.swap(_files);
+    }
+
+    for (_File& file : files)
+    {
+        size_t quoted = SshShellQuote(file.remotePath).size() + 1;
+
+        if (batch.empty() == false && length + quoted > maxBatchLength)
+        {
+            if (_CheckBatch(client, batch) != SSH_OK)
+            {
+                res = SSH_ERROR;
+            }
+            batch.clear();
+            length = 0;
+        }
+        batch.push_back(move(file));
+        length += quoted;
+    }
+
+    if (batch.empty() == false && _CheckBatch(client, batch) != SSH_OK)
+    {
+        res = SSH_ERROR;
+    }
+
+    if (res == SSH_OK)
+    {
+        SSH_LOG(Info, "Verified %zu files", files.size());
+    }
+
+    return res;
+}
+
+int SshTransferVerifier::_CheckBatch(SshClient& client, const vector<_File>& files)
+{
+    string paths;
+    SshCaptureSink sink;
+    int exitStatus = -1;
+    int res = SSH_OK;
+
+    for (const _File& file : files)
+    {
+        paths += " " + SshShellQuote(file.remotePath);
+    }
+
+    // Python prints everything or nothing, so a failure halfway doesn't mix
+    // its lines with those of the fallback
+    string command = "out=$(python3 -c " + SshShellQuote(crcScript) + paths +
+                     " 2>/dev/null) && printf '%s\\n' \"$out\" || for f in" + paths +
+                     "; do if [ -r \"$f\" ]; then gzip -1c < \"$f\" | tail -c8 | od -An -tu1 -N4 |"
+                     " awk '{ printf \"%.0f\\n\", $1 + 256 * $2 + 65536 * $3 + 16777216 * $4 }';"
+                     " else echo -1; fi; done";
+
+    if (client.Execute(command, sink, &exitStatus) != SSH_OK)
+    {
+        SSH_LOG(Error, "Can't hash the remote copies");
+        return SSH_ERROR;
+    }
+
+    istringstream lines(sink.output);
+    string line;
+    size_t index = 0;
+
+    while (getline(lines, line))
+    {
+        if (line.find_first_not_of(" \t") == string::npos)
+        {
+            continue;
+        }
+        if (index == files.size())
+        {
+            index++;
+            break;
+        }
+
+        const _File& file = files[index++];
+        long long remote = strtoll(line.c_str(), NULL, 10);
+
+        if (remote < 0)
+        {
+            SSH_LOG(Error, "Can't read remote file %s to verify it", file.remotePath.c_str());
+            res = SSH_ERROR;
+        }
+        else if ((uint32_t) remote != file.crc)
+        {
+            SSH_LOG(Error, "Verification failed for %s: CRC-32 %08x locally, %08x on the "
+                    "remote host", file.localPath.c_str(), file.crc, (uint32_t) remote);
+            res = SSH_ERROR;
+        }
+    }
+
+    if (index != files.size())
+    {
+        SSH_LOG(Error, "Can't hash the remote copies, exit status %d: %s", exitStatus,
+                sink.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    return res;
+}
@@ -0,0 +1,41 @@
+#ifndef __SSH_VERIFY_H__
+#define __SSH_VERIFY_H__
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class SshClient;
+
+// Collects the CRC-32 of every file a transfer streamed, then has the remote
+// host hash its copies and compares them. The remote side uses Python's
+// zlib.crc32, or the trailer of gzip -1 where there is no python3, with one
+// command for many files.
+class SshTransferVerifier
+{
+public:
+    void Add(const string& remotePath, const string& localPath, uint32_t crc);
+    // Fails if a remote copy differs, can't be read or couldn't be hashed
+    int Check(SshClient& client);
+    void Clear();
+    size_t Files();
+
+private:
+    struct _File
+    {
+        string remotePath;
+        string localPath;
+        uint32_t crc;
+    };
+
+    int _CheckBatch(SshClient& client, const vector<_File>& files);
+
+private:
+    mutex _mutex;
+    vector<_File> _files;
+};
+
+#endif // __SSH_VERIFY_H__
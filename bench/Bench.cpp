@@ -0,0 +1,1958 @@
+#include "LocalSshd.h"
+#include "SshAsyncEngine.h"
+#include "SshCaptureBuffer.h"
+#include "SshClient.h"
+#include "SshControlMaster.h"
+#include "SshDirectoryTransfer.h"
+#include "SshHash.h"
+#include "SshTunnel.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <thread>
+#include <tuple>
+
+namespace fs = std::filesystem;
+
+// Every operator new in the process, so the allocations benchmark can show
+// what one operation costs on the C++ side of the library
+static atomic<uint64_t> allocationCount{0};
+
+void* operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+
+    void *data = malloc(size > 0 ? size : 1);
+    if (data == NULL)
+    {
+        throw bad_alloc();
+    }
+
+    return data;
+}
+
+void operator delete(void *data) noexcept
+{
+    free(data);
+}
+
+void operator delete(void *data, size_t) noexcept
+{
+    free(data);
+}
+
+// Builds one line of JSON output: a flat object of strings and numbers
+class JsonLine
+{
+public:
+    JsonLine(const string& benchmark) { Add("benchmark", benchmark); };
+
+    JsonLine& Add(const string& key, const string& value)
+    {
+        _Key(key);
+        _body += '"';
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                _body += '\\';
+                _body += c;
+            }
+            else if ((unsigned char) c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                _body += escaped;
+            }
+            else
+            {
+                _body += c;
+            }
+        }
+        _body += '"';
+
+        return *this;
+    };
+
+    JsonLine& Add(const string& key, const char *value) { return Add(key, string(value)); };
+
+    JsonLine& Add(const string& key, double value)
+    {
+        char number[32];
+
+        snprintf(number, sizeof(number), "%.15g", value);
+        _Key(key);
+        _body += number;
+
+        return *this;
+    };
+
+    string Text() const { return "{" + _body + "}"; };
+
+private:
+    void _Key(const string& key)
+    {
+        if (_body.empty() == false)
+        {
+            _body += ",";
+        }
+        _body += "\"" + key + "\":";
+    };
+
+private:
+    string _body;
+};
+
+class Samples
+{
+public:
+    void Add(double value) { _values.push_back(value); };
+    size_t Count() const { return _values.size(); };
+
+    double Percentile(double fraction)
+    {
+        if (_values.empty())
+        {
+            return 0;
+        }
+        sort(_values.begin(), _values.end());
+
+        size_t rank = (size_t) (fraction * _values.size() + 0.999999);
+        return _values[min(max<size_t>(rank, 1), _values.size()) - 1];
+    };
+
+    double Mean() const
+    {
+        double sum = 0;
+
+        for (double value : _values)
+        {
+            sum += value;
+        }
+
+        return _values.empty() ? 0 : sum / _values.size();
+    };
+
+private:
+    vector<double> _values;
+};
+
+struct Bench
+{
+    string host{"127.0.0.1"};
+    string user;
+    string password;
+    SshConnectOptions connect;
+    string local;
+    string remote;
+    string only;
+    uint64_t maxSize{4ull << 30};
+    int iterations{200};
+    int connectIterations{20};
+    size_t treeFiles{50000};
+    FILE *out{NULL};
+    // With --check, benchmarks with bounds count the ones they exceed
+    bool check{false};
+    int regressions{0};
+
+    bool Enabled(const string& name) const
+    {
+        return only.empty() || name.find(only) != string::npos;
+    };
+
+    void Emit(const JsonLine& line)
+    {
+        fprintf(out, "%s\n", line.Text().c_str());
+        fflush(out);
+    };
+
+    unique_ptr<SshClient> Client()
+    {
+        unique_ptr<SshClient> client = make_unique<SshClient>(host, user, password);
+
+        client->SetConnectOptions(connect);
+        if (client->Connect() != SSH_OK)
+        {
+            return nullptr;
+        }
+
+        return client;
+    };
+};
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static int run(SshClient& client, const string& command)
+{
+    SshCaptureSink sink;
+    int exitStatus = -1;
+
+    if (client.Execute(command, sink, &exitStatus) != SSH_OK || exitStatus != 0)
+    {
+        fprintf(stderr, "Remote command failed: %s\n%s", command.c_str(), sink.errors.c_str());
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+// Incompressible content, so compression anywhere on the path can't flatter
+// the numbers
+static int makeFile(const string& path, uint64_t size, uint64_t seed)
+{
+    vector<uint64_t> buffer(128 * 1024);
+    uint64_t state = seed * 0x9e3779b97f4a7c15ull + 1;
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (file == NULL)
+    {
+        return SSH_ERROR;
+    }
+
+    while (size > 0)
+    {
+        size_t count = min<uint64_t>(size, buffer.size() * sizeof(uint64_t));
+
+        for (uint64_t& word : buffer)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            word = state;
+        }
+        if (fwrite(buffer.data(), 1, count, file) != count)
+        {
+            fclose(file);
+            return SSH_ERROR;
+        }
+        size -= count;
+    }
+
+    return fclose(file) == 0 ? SSH_OK : SSH_ERROR;
+}
+
+static bool enoughSpace(const string& path, uint64_t bytes)
+{
+    struct statvfs fs;
+
+    return statvfs(path.c_str(), &fs) != 0 || (uint64_t) fs.f_bavail * fs.f_frsize > bytes;
+}
+
+static void benchConnect(Bench& bench)
+{
+    Samples latency;
+    int failures = 0;
+
+    for (int i = 0; i < bench.connectIterations; i++)
+    {
+        SshClient client(bench.host, bench.user, bench.password);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        client.SetConnectOptions(bench.connect);
+        if (client.Connect() != SSH_OK)
+        {
+            failures++;
+            continue;
+        }
+        latency.Add(secondsSince(start) * 1000);
+        client.Close();
+    }
+
+    bench.Emit(JsonLine("connect")
+               .Add("iterations", (double) latency.Count())
+               .Add("failures", failures)
+               .Add("p50_ms", latency.Percentile(0.5))
+               .Add("p99_ms", latency.Percentile(0.99))
+               .Add("mean_ms", latency.Mean()));
+}
+
+// Connect and a first command for a client that finds its session already
+// open in a control master, as a short-lived process would
+static void benchControlConnect(Bench& bench)
+{
+    SshControlMaster master(bench.local + "/control.sock", chrono::seconds(600));
+    Samples latency;
+    int failures = 0;
+
+    if (master.Start() != SSH_OK)
+    {
+        return;
+    }
+
+    // The first client opens the session the others reuse
+    for (int i = 0; i <= bench.connectIterations; i++)
+    {
+        SshClient client(bench.host, bench.user, bench.password);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        client.SetConnectOptions(bench.connect);
+        client.SetControlPath(bench.local + "/control.sock");
+        if (client.Connect() != SSH_OK || run(client, "true") != SSH_OK)
+        {
+            failures++;
+            continue;
+        }
+        if (i > 0)
+        {
+            latency.Add(secondsSince(start) * 1000);
+        }
+        client.Close();
+    }
+
+    bench.Emit(JsonLine("connect_control")
+               .Add("iterations", (double) latency.Count())
+               .Add("failures", failures)
+               .Add("p50_ms", latency.Percentile(0.5))
+               .Add("p99_ms", latency.Percentile(0.99))
+               .Add("mean_ms", latency.Mean()));
+}
+
+static void benchExecute(Bench& bench)
+{
+    unique_ptr<SshClient> client = bench.Client();
+    Samples latency;
+
+    if (client == nullptr)
+    {
+        return;
+    }
+
+    for (int i = 0; i < bench.iterations + 5; i++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        SshCaptureSink sink;
+        int exitStatus;
+
+        client->Execute("true", sink, &exitStatus);
+        // The first few warm up the channel path
+        if (i >= 5)
+        {
+            latency.Add(secondsSince(start) * 1000);
+        }
+    }
+
+    bench.Emit(JsonLine("execute")
+               .Add("iterations", (double) latency.Count())
+               .Add("p50_ms", latency.Percentile(0.5))
+               .Add("p99_ms", latency.Percentile(0.99))
+               .Add("mean_ms", latency.Mean()));
+}
+
+// A health check sized batch of tiny commands, one Execute each against one
+// ExecuteBatch on the persistent shell
+static void benchExecuteBatch(Bench& bench)
+{
+    unique_ptr<SshClient> client = bench.Client();
+    vector<string> commands(30, "true");
+    vector<SshCommandResult> results;
+    Samples sequential, batched;
+    int rounds = max(bench.iterations / 10, 5);
+
+    if (client == nullptr || client->ExecuteBatch(commands, &results) != SSH_OK)
+    {
+        return;
+    }
+
+    for (int i = 0; i < rounds; i++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (const string& command : commands)
+        {
+            SshCaptureSink sink;
+            int exitStatus;
+
+            client->Execute(command, sink, &exitStatus);
+        }
+        sequential.Add(secondsSince(start) * 1000);
+
+        start = chrono::steady_clock::now();
+        client->ExecuteBatch(commands, &results);
+        batched.Add(secondsSince(start) * 1000);
+    }
+
+    for (pair<const char *, Samples*> mode : {make_pair("sequential", &sequential),
+                                              make_pair("batch", &batched)})
+    {
+        bench.Emit(JsonLine("execute_batch")
+                   .Add("mode", mode.first)
+                   .Add("commands", (double) commands.size())
+                   .Add("iterations", (double) mode.second->Count())
+                   .Add("p50_ms", mode.second->Percentile(0.5))
+                   .Add("p99_ms", mode.second->Percentile(0.99)));
+    }
+}
+
+// The same commands spread over more and more sessions, once with a thread
+// per blocking client and once on the async engine. session_scale holds the
+// sessions open without running anything.
+static void benchConcurrentExecute(Bench& bench)
+{
+    const size_t counts[] = {8, 32, 128};
+    const size_t total = 1024;
+
+    for (size_t sessions : counts)
+    {
+        const size_t commands = total / sessions;
+
+        {
+            vector<unique_ptr<SshClient>> clients;
+            vector<thread> workers;
+
+            for (size_t i = 0; i < sessions; i++)
+            {
+                clients.push_back(bench.Client());
+                if (clients.back() == nullptr)
+                {
+                    return;
+                }
+            }
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (size_t i = 0; i < sessions; i++)
+            {
+                workers.emplace_back([&clients, i, commands]()
+                {
+                    for (size_t j = 0; j < commands; j++)
+                    {
+                        run(*clients[i], "true");
+                    }
+                });
+            }
+            for (thread& worker : workers)
+            {
+                worker.join();
+            }
+            double seconds = secondsSince(start);
+
+            bench.Emit(JsonLine("execute_concurrent")
+                       .Add("mode", "threads")
+                       .Add("sessions", (double) sessions)
+                       .Add("commands", (double) (sessions * commands))
+                       .Add("seconds", seconds)
+                       .Add("commands_per_second", sessions * commands / seconds));
+        }
+
+        {
+            SshAsyncEngine engine(2);
+            vector<shared_ptr<SshAsyncSession>> handles;
+            vector<future<SshExecResult>> results;
+
+            engine.SetConnectOptions(bench.connect);
+            for (size_t i = 0; i < sessions; i++)
+            {
+                handles.push_back(engine.CreateSession(bench.host, bench.user, bench.password));
+                if (handles.back()->ConnectAsync().get() != SSH_OK)
+                {
+                    return;
+                }
+            }
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (size_t j = 0; j < commands; j++)
+            {
+                for (shared_ptr<SshAsyncSession>& handle : handles)
+                {
+                    results.push_back(handle->ExecuteAsync("true"));
+                }
+            }
+            for (future<SshExecResult>& result : results)
+            {
+                result.get();
+            }
+            double seconds = secondsSince(start);
+
+            bench.Emit(JsonLine("execute_concurrent")
+                       .Add("mode", "async")
+                       .Add("sessions", (double) sessions)
+                       .Add("commands", (double) (sessions * commands))
+                       .Add("seconds", seconds)
+                       .Add("commands_per_second", sessions * commands / seconds));
+
+            for (shared_ptr<SshAsyncSession>& handle : handles)
+            {
+                handle->CloseAsync().get();
+            }
+        }
+    }
+}
+
+static uint64_t residentBytes()
+{
+    unsigned long long size = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm != NULL)
+    {
+        if (fscanf(statm, "%llu %llu", &size, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Many sessions held open at once, each on a thread of its own and all of
+// them on the async engine. Reports how fast they connect and the resident
+// memory each one takes while connected.
+static void benchSessionScale(Bench& bench)
+{
+    const size_t counts[] = {16, 64, 128};
+
+    for (size_t sessions : counts)
+    {
+        vector<unique_ptr<SshClient>> clients(sessions);
+        vector<thread> workers;
+        mutex lock;
+        condition_variable changed;
+        size_t connected = 0;
+        bool release = false;
+        uint64_t resident = residentBytes();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (size_t i = 0; i < sessions; i++)
+        {
+            workers.emplace_back([&, i]()
+            {
+                clients[i] = bench.Client();
+
+                unique_lock<mutex> guard(lock);
+                connected++;
+                changed.notify_all();
+                changed.wait(guard, [&release]() { return release; });
+            });
+        }
+
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]() { return connected == sessions; });
+        double seconds = secondsSince(start);
+        uint64_t growth = max(residentBytes(), resident) - resident;
+        size_t failures = count(clients.begin(), clients.end(), nullptr);
+        release = true;
+        changed.notify_all();
+        guard.unlock();
+
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+        for (unique_ptr<SshClient>& client : clients)
+        {
+            if (client != nullptr)
+            {
+                client->Close();
+            }
+        }
+
+        bench.Emit(JsonLine("session_scale")
+                   .Add("mode", "threads")
+                   .Add("sessions", (double) sessions)
+                   .Add("failures", (double) failures)
+                   .Add("seconds", seconds)
+                   .Add("sessions_per_second", sessions / seconds)
+                   .Add("resident_bytes_per_session", (double) growth / sessions));
+    }
+
+    for (size_t sessions : counts)
+    {
+        SshAsyncEngine engine(2);
+        vector<shared_ptr<SshAsyncSession>> handles;
+        vector<future<int>> connects;
+        size_t failures = 0;
+        uint64_t resident = residentBytes();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        engine.SetConnectOptions(bench.connect);
+        for (size_t i = 0; i < sessions; i++)
+        {
+            handles.push_back(engine.CreateSession(bench.host, bench.user, bench.password));
+            connects.push_back(handles.back()->ConnectAsync());
+        }
+        for (future<int>& connect : connects)
+        {
+            if (connect.get() != SSH_OK)
+            {
+                failures++;
+            }
+        }
+        double seconds = secondsSince(start);
+        uint64_t growth = max(residentBytes(), resident) - resident;
+
+        for (shared_ptr<SshAsyncSession>& handle : handles)
+        {
+            handle->CloseAsync().get();
+        }
+
+        bench.Emit(JsonLine("session_scale")
+                   .Add("mode", "async")
+                   .Add("sessions", (double) sessions)
+                   .Add("failures", (double) failures)
+                   .Add("seconds", seconds)
+                   .Add("sessions_per_second", sessions / seconds)
+                   .Add("resident_bytes_per_session", (double) growth / sessions));
+    }
+}
+
+static void benchFiles(Bench& bench)
+{
+    const uint64_t sizes[] = {1ull << 10, 16ull << 10, 256ull << 10, 4ull << 20,
+                              64ull << 20, 1ull << 30, 4ull << 30};
+    const pair<const char *, SshTransferProtocol> protocols[] =
+    {
+        {"scp", SshTransferProtocol::Scp},
+        {"sftp", SshTransferProtocol::Sftp}
+    };
+    unique_ptr<SshClient> client = bench.Client();
+
+    if (client == nullptr)
+    {
+        return;
+    }
+
+    for (uint64_t size : sizes)
+    {
+        string source = bench.local + "/file";
+        string pulled = bench.local + "/pulled";
+        string remote = bench.remote + "/file";
+        // Small files are repeated so each measurement covers some time
+        int repeats = (int) min<uint64_t>(max<uint64_t>((64ull << 20) / size, 1), 20);
+
+        if (size > bench.maxSize)
+        {
+            break;
+        }
+        if (enoughSpace(bench.local, 3 * size) == false)
+        {
+            bench.Emit(JsonLine("file").Add("size", (double) size).Add("skipped", "disk space"));
+            continue;
+        }
+        if (makeFile(source, size, size) != SSH_OK)
+        {
+            fprintf(stderr, "Can't create %s\n", source.c_str());
+            return;
+        }
+
+        for (const pair<const char *, SshTransferProtocol>& protocol : protocols)
+        {
+            Samples push, pull;
+
+            for (int i = 0; i < repeats; i++)
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                if (client->Push(source, remote, protocol.second) == SSH_OK)
+                {
+                    push.Add(secondsSince(start));
+                }
+
+                error_code ec;
+                fs::remove(pulled, ec);
+                start = chrono::steady_clock::now();
+                if (client->Pull(remote, pulled, protocol.second) == SSH_OK)
+                {
+                    pull.Add(secondsSince(start));
+                }
+            }
+
+            for (pair<const char *, Samples*> direction :
+                 {make_pair("file_push", &push), make_pair("file_pull", &pull)})
+            {
+                double seconds = direction.second->Percentile(0.5);
+
+                bench.Emit(JsonLine(direction.first)
+                           .Add("protocol", protocol.first)
+                           .Add("size", (double) size)
+                           .Add("repeats", (double) direction.second->Count())
+                           .Add("seconds", seconds)
+                           .Add("bytes_per_second", seconds > 0 ? size / seconds : 0));
+            }
+        }
+
+        error_code ec;
+        fs::remove(source, ec);
+        fs::remove(pulled, ec);
+        run(*client, "rm -f " + SshShellQuote(remote));
+    }
+}
+
+struct TreeShape
+{
+    string name;
+    uint64_t files{0};
+    uint64_t bytes{0};
+};
+
+static int makeTree(const string& root, const string& shape, size_t treeFiles,
+                    TreeShape& tree)
+{
+    error_code ec;
+    uint64_t seed = 1;
+
+    tree.name = shape;
+    fs::create_directories(root, ec);
+
+    function<int(const string&, uint64_t)> add = [&](const string& path, uint64_t size)
+    {
+        fs::create_directories(fs::path(path).parent_path(), ec);
+        tree.files++;
+        tree.bytes += size;
+        return makeFile(path, size, seed++);
+    };
+
+    if (shape == "small-files")
+    {
+        // Many 1 KiB files, a hundred per directory
+        for (size_t i = 0; i < treeFiles; i++)
+        {
+            if (add(root + "/d" + to_string(i / 100) + "/f" + to_string(i % 100), 1024) != SSH_OK)
+            {
+                return SSH_ERROR;
+            }
+        }
+    }
+    else if (shape == "deep")
+    {
+        // A chain of 64 nested directories holding four 16 KiB files each
+        string directory = root;
+        for (int level = 0; level < 64; level++)
+        {
+            directory += "/level" + to_string(level);
+            for (int i = 0; i < 4; i++)
+            {
+                if (add(directory + "/f" + to_string(i), 16 * 1024) != SSH_OK)
+                {
+                    return SSH_ERROR;
+                }
+            }
+        }
+    }
+    else
+    {
+        // Sizes spread from 1 KiB to 1 MiB
+        for (int i = 0; i < 500; i++)
+        {
+            if (add(root + "/m" + to_string(i % 10) + "/f" + to_string(i),
+                    1024ull << (i % 11)) != SSH_OK)
+            {
+                return SSH_ERROR;
+            }
+        }
+    }
+
+    return SSH_OK;
+}
+
+// Forwards loopback connections to the server, holding every chunk back for
+// half the round trip time in each direction, like a link with that latency
+// and no bandwidth limit
+class DelayProxy
+{
+public:
+    DelayProxy(const string& host, int port, chrono::microseconds roundTrip):
+               _host(host), _port(port), _delay(roundTrip / 2){};
+
+    ~DelayProxy()
+    {
+        if (_fd >= 0)
+        {
+            shutdown(_fd, SHUT_RDWR);
+            close(_fd);
+        }
+        if (_acceptor.joinable())
+        {
+            _acceptor.join();
+        }
+    };
+
+    int Start()
+    {
+        struct sockaddr_in address = {};
+        socklen_t length = sizeof(address);
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (_fd < 0 || bind(_fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+            listen(_fd, SOMAXCONN) < 0 ||
+            getsockname(_fd, (struct sockaddr *) &address, &length) < 0)
+        {
+            fprintf(stderr, "Can't start the delay proxy: %s\n", strerror(errno));
+            return SSH_ERROR;
+        }
+        _listenPort = ntohs(address.sin_port);
+        _acceptor = thread(&DelayProxy::_Accept, this);
+
+        return SSH_OK;
+    };
+
+    int Port() const { return _listenPort; };
+
+private:
+    struct _Chunk
+    {
+        chrono::steady_clock::time_point due;
+        string data;
+    };
+
+    // One direction of a connection, filled by a reader thread and drained
+    // by a writer thread once each chunk is due
+    struct _Link
+    {
+        mutex lock;
+        condition_variable changed;
+        deque<_Chunk> chunks;
+        bool closed{false};
+    };
+
+    struct _Connection
+    {
+        int client{-1};
+        int server{-1};
+        _Link up;
+        _Link down;
+
+        ~_Connection()
+        {
+            close(client);
+            close(server);
+        };
+    };
+
+    int _Connect()
+    {
+        struct addrinfo hints = {};
+        struct addrinfo *addresses;
+        string port = to_string(_port);
+        int fd = -1;
+
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(_host.c_str(), port.c_str(), &hints, &addresses) != 0)
+        {
+            return -1;
+        }
+        for (struct addrinfo *address = addresses; address != NULL && fd < 0;
+             address = address->ai_next)
+        {
+            fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+
+        return fd;
+    };
+
+    void _Accept()
+    {
+        int fd;
+
+        while ((fd = accept4(_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+        {
+            shared_ptr<_Connection> connection = make_shared<_Connection>();
+
+            connection->client = fd;
+            connection->server = _Connect();
+            if (connection->server < 0)
+            {
+                continue;
+            }
+            int one = 1;
+
+            setsockopt(connection->client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(connection->server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            _Pump(connection, connection->client, connection->server, connection->up);
+            _Pump(connection, connection->server, connection->client, connection->down);
+        }
+    };
+
+    void _Pump(const shared_ptr<_Connection>& connection, int from, int to, _Link& link)
+    {
+        chrono::microseconds delay = _delay;
+
+        thread([connection, from, &link, delay]()
+        {
+            char buffer[64 * 1024];
+            ssize_t nbytes;
+
+            while ((nbytes = read(from, buffer, sizeof(buffer))) > 0)
+            {
+                lock_guard<mutex> lock(link.lock);
+
+                link.chunks.push_back({chrono::steady_clock::now() + delay,
+                                       string(buffer, nbytes)});
+                link.changed.notify_one();
+            }
+
+            lock_guard<mutex> lock(link.lock);
+            link.closed = true;
+            link.changed.notify_one();
+        }).detach();
+
+        thread([connection, to, &link]()
+        {
+            unique_lock<mutex> lock(link.lock);
+
+            while (true)
+            {
+                link.changed.wait(lock, [&link]() { return link.closed || link.chunks.empty() == false; });
+                if (link.chunks.empty())
+                {
+                    break;
+                }
+
+                _Chunk chunk = move(link.chunks.front());
+                link.chunks.pop_front();
+                lock.unlock();
+                this_thread::sleep_until(chunk.due);
+                if (SshWriteAll(to, chunk.data.data(), chunk.data.size()) != SSH_OK)
+                {
+                    lock.lock();
+                    break;
+                }
+                lock.lock();
+            }
+            shutdown(to, SHUT_WR);
+        }).detach();
+    };
+
+private:
+    string _host;
+    int _port;
+    chrono::microseconds _delay;
+    int _fd{-1};
+    int _listenPort{0};
+    thread _acceptor;
+};
+
+// Push and Pull over scp and SFTP through links of growing latency. scp
+// waits for an acknowledgement per file while SFTP keeps sftpQueueDepth
+// requests in flight, which is what the round trip time shows.
+static void benchLatencyFiles(Bench& bench)
+{
+    const int roundTripsMs[] = {2, 20, 100};
+    const pair<const char *, SshTransferProtocol> protocols[] =
+    {
+        {"scp", SshTransferProtocol::Scp},
+        {"sftp", SshTransferProtocol::Sftp}
+    };
+    const uint64_t size = min<uint64_t>(bench.maxSize, 64ull << 20);
+    string source = bench.local + "/latency";
+    string pulled = bench.local + "/latency-pulled";
+    string remote = bench.remote + "/latency";
+
+    if (enoughSpace(bench.local, 3 * size) == false || makeFile(source, size, 7) != SSH_OK)
+    {
+        return;
+    }
+
+    for (int roundTripMs : roundTripsMs)
+    {
+        DelayProxy proxy(bench.host, bench.connect.port, chrono::milliseconds(roundTripMs));
+        SshConnectOptions connect = bench.connect;
+
+        if (proxy.Start() != SSH_OK)
+        {
+            break;
+        }
+        connect.port = proxy.Port();
+
+        SshClient client("127.0.0.1", bench.user, bench.password);
+        client.SetConnectOptions(connect);
+        if (client.Connect() != SSH_OK)
+        {
+            fprintf(stderr, "Can't connect through the delay proxy\n");
+            break;
+        }
+
+        for (const pair<const char *, SshTransferProtocol>& protocol : protocols)
+        {
+            error_code ec;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            int pushed = client.Push(source, remote, protocol.second);
+            double pushSeconds = secondsSince(start);
+
+            fs::remove(pulled, ec);
+            start = chrono::steady_clock::now();
+            int pulledRes = client.Pull(remote, pulled, protocol.second);
+            double pullSeconds = secondsSince(start);
+
+            for (auto [direction, res, seconds] :
+                 {make_tuple("push", pushed, pushSeconds), make_tuple("pull", pulledRes, pullSeconds)})
+            {
+                bench.Emit(JsonLine("file_latency")
+                           .Add("protocol", protocol.first)
+                           .Add("direction", direction)
+                           .Add("rtt_ms", roundTripMs)
+                           .Add("size", (double) size)
+                           .Add("failures", res == SSH_OK ? 0 : 1)
+                           .Add("seconds", seconds)
+                           .Add("bytes_per_second", size / seconds));
+            }
+        }
+
+        run(client, "rm -f " + SshShellQuote(remote));
+        client.Close();
+    }
+
+    error_code ec;
+    fs::remove(source, ec);
+    fs::remove(pulled, ec);
+}
+
+static void benchTrees(Bench& bench)
+{
+    const char *shapes[] = {"small-files", "deep", "mixed"};
+    const char *methods[] = {"scp", "sftp", "tar", "parallel-4"};
+    unique_ptr<SshClient> client = bench.Client();
+
+    if (client == nullptr)
+    {
+        return;
+    }
+
+    for (const char *shape : shapes)
+    {
+        string source = bench.local + "/tree";
+        string pulled = bench.local + "/pulled-tree";
+        string remote = bench.remote + "/tree";
+        TreeShape tree;
+        error_code ec;
+
+        if (makeTree(source, shape, bench.treeFiles, tree) != SSH_OK)
+        {
+            fprintf(stderr, "Can't create the %s tree\n", shape);
+            return;
+        }
+
+        for (const char *method : methods)
+        {
+            string name = method;
+            int pushed = SSH_ERROR, fetched = SSH_ERROR;
+            double pushSeconds = 0, pullSeconds = 0;
+
+            run(*client, "rm -rf " + SshShellQuote(remote));
+            fs::remove_all(pulled, ec);
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            if (name == "parallel-4")
+            {
+                SshDirectoryTransfer transfer(bench.host, bench.user, bench.password, 4);
+
+                transfer.SetConnectOptions(bench.connect);
+                pushed = transfer.Push(source, remote);
+                pushSeconds = secondsSince(start);
+                start = chrono::steady_clock::now();
+                fetched = transfer.Pull(remote, pulled);
+                pullSeconds = secondsSince(start);
+            }
+            else
+            {
+                SshTransferProtocol protocol = name == "scp" ? SshTransferProtocol::Scp :
+                                               name == "sftp" ? SshTransferProtocol::Sftp :
+                                               SshTransferProtocol::Tar;
+
+                pushed = client->Push(source, remote, protocol);
+                pushSeconds = secondsSince(start);
+                start = chrono::steady_clock::now();
+                fetched = client->Pull(remote, pulled, protocol);
+                pullSeconds = secondsSince(start);
+            }
+
+            for (auto direction : {make_tuple("tree_push", pushed, pushSeconds),
+                                   make_tuple("tree_pull", fetched, pullSeconds)})
+            {
+                double seconds = get<2>(direction);
+
+                bench.Emit(JsonLine(get<0>(direction))
+                           .Add("shape", shape)
+                           .Add("method", method)
+                           .Add("files", (double) tree.files)
+                           .Add("bytes", (double) tree.bytes)
+                           .Add("ok", get<1>(direction) == SSH_OK ? "true" : "false")
+                           .Add("seconds", seconds)
+                           .Add("files_per_second", seconds > 0 ? tree.files / seconds : 0)
+                           .Add("bytes_per_second", seconds > 0 ? tree.bytes / seconds : 0));
+            }
+        }
+
+        run(*client, "rm -rf " + SshShellQuote(remote));
+        fs::remove_all(pulled, ec);
+        fs::remove_all(source, ec);
+    }
+}
+
+// A first sync, one with nothing changed, and one after a small edit in the
+// middle of a large file
+static void benchSync(Bench& bench)
+{
+    unique_ptr<SshClient> client = bench.Client();
+    string source = bench.local + "/sync";
+    string remote = bench.remote + "/sync";
+    TreeShape tree;
+    error_code ec;
+
+    if (client == nullptr || makeTree(source, "mixed", 0, tree) != SSH_OK ||
+        makeFile(source + "/large", 64ull << 20, 7) != SSH_OK)
+    {
+        return;
+    }
+    tree.files++;
+    tree.bytes += 64ull << 20;
+
+    for (const char *pass : {"initial", "unchanged", "edited"})
+    {
+        if (string(pass) == "edited")
+        {
+            FILE *file = fopen((source + "/large").c_str(), "r+b");
+            if (file)
+            {
+                fseek(file, 32 << 20, SEEK_SET);
+                fputs("edited in the middle", file);
+                fclose(file);
+            }
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int res = client->Sync(source, remote);
+        double seconds = secondsSince(start);
+        SshSyncReport report = client->GetLastSyncReport();
+
+        bench.Emit(JsonLine("sync")
+                   .Add("pass", pass)
+                   .Add("ok", res == SSH_OK ? "true" : "false")
+                   .Add("files", (double) tree.files)
+                   .Add("bytes", (double) report.bytesTotal)
+                   .Add("bytes_sent", (double) report.bytesSent)
+                   .Add("files_patched", (double) report.filesDelta)
+                   .Add("files_copied", (double) report.filesCopied)
+                   .Add("seconds", seconds));
+    }
+
+    run(*client, "rm -rf " + SshShellQuote(remote));
+    fs::remove_all(source, ec);
+}
+
+// Throughput of each cipher over one channel, and the order picked for
+// this CPU without measuring
+static void benchCiphers(Bench& bench)
+{
+    SshConnectOptions options = bench.connect;
+    vector<SshCipherResult> results;
+    int res = SshCalibrateCiphers(bench.host, bench.user, bench.password, options, &results,
+                                  min<uint64_t>(bench.maxSize, 256ull << 20));
+
+    for (const SshCipherResult& result : results)
+    {
+        bench.Emit(JsonLine("cipher")
+                   .Add("cipher", result.cipher)
+                   .Add("bytes_per_second", result.bytesPerSecond));
+    }
+
+    bench.Emit(JsonLine("cipher_order")
+               .Add("ok", res == SSH_OK ? "true" : "false")
+               .Add("hardware_aes", SshHardwareAes() ? "true" : "false")
+               .Add("hardware", SshHardwareCiphers())
+               .Add("calibrated", options.crypto.ciphers));
+}
+
+// Local server behind the tunnel. Each connection is read to its end and
+// answered with the number of bytes that came in.
+class CountingServer
+{
+public:
+    ~CountingServer()
+    {
+        if (_fd >= 0)
+        {
+            shutdown(_fd, SHUT_RDWR);
+            close(_fd);
+        }
+        if (_acceptor.joinable())
+        {
+            _acceptor.join();
+        }
+    };
+
+    int Start()
+    {
+        struct sockaddr_in address = {};
+        socklen_t length = sizeof(address);
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (_fd < 0 || bind(_fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+            listen(_fd, SOMAXCONN) < 0 ||
+            getsockname(_fd, (struct sockaddr *) &address, &length) < 0)
+        {
+            fprintf(stderr, "Can't start the tunnel server: %s\n", strerror(errno));
+            return SSH_ERROR;
+        }
+        _port = ntohs(address.sin_port);
+        _acceptor = thread(&CountingServer::_Accept, this);
+
+        return SSH_OK;
+    };
+
+    int Port() const { return _port; };
+
+private:
+    void _Accept()
+    {
+        int fd;
+
+        while ((fd = accept4(_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+        {
+            thread([fd]()
+            {
+                vector<char> buffer(256 * 1024);
+                uint64_t received = 0;
+                ssize_t nbytes;
+
+                while ((nbytes = read(fd, buffer.data(), buffer.size())) > 0)
+                {
+                    received += nbytes;
+                }
+                SshWriteAll(fd, (const char *) &received, sizeof(received));
+                close(fd);
+            }).detach();
+        }
+    };
+
+private:
+    int _fd{-1};
+    int _port{0};
+    thread _acceptor;
+};
+
+// Sends size bytes to port and waits for the server's count
+static bool tunnelRoundTrip(int port, uint64_t size)
+{
+    struct sockaddr_in address = {};
+    vector<char> buffer(min<uint64_t>(size, 256 * 1024), 'x');
+    uint64_t remaining = size;
+    uint64_t received = 0;
+    bool ok = false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0)
+    {
+        while (remaining > 0 && SshWriteAll(fd, buffer.data(),
+                                            min<uint64_t>(remaining, buffer.size())) == SSH_OK)
+        {
+            remaining -= min<uint64_t>(remaining, buffer.size());
+        }
+        shutdown(fd, SHUT_WR);
+        ok = remaining == 0 &&
+             read(fd, &received, sizeof(received)) == sizeof(received) && received == size;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return ok;
+}
+
+// Bulk throughput through a local forward, and how many short connections
+// it carries per second
+static void benchTunnel(Bench& bench)
+{
+    unique_ptr<SshClient> client = bench.Client();
+    CountingServer server;
+    int port = 0;
+
+    if (client == nullptr || server.Start() != SSH_OK)
+    {
+        return;
+    }
+
+    SshTunnel tunnel(*client);
+
+    // The server side connects back to the loopback server on the same host
+    if (tunnel.ForwardLocal("127.0.0.1", 0, "127.0.0.1", server.Port(), &port) != SSH_OK ||
+        tunnel.Start() != SSH_OK)
+    {
+        return;
+    }
+
+    uint64_t size = min<uint64_t>(bench.maxSize, 1ull << 30);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool ok = tunnelRoundTrip(port, size);
+    double seconds = secondsSince(start);
+
+    bench.Emit(JsonLine("tunnel")
+               .Add("mode", "throughput")
+               .Add("ok", ok ? "true" : "false")
+               .Add("bytes", (double) size)
+               .Add("seconds", seconds)
+               .Add("bytes_per_second", size / seconds));
+
+    Samples latency;
+    int failures = 0;
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < bench.iterations; i++)
+    {
+        chrono::steady_clock::time_point connection = chrono::steady_clock::now();
+
+        if (tunnelRoundTrip(port, 1) == false)
+        {
+            failures++;
+            continue;
+        }
+        latency.Add(secondsSince(connection) * 1000);
+    }
+    seconds = secondsSince(start);
+
+    bench.Emit(JsonLine("tunnel")
+               .Add("mode", "connections")
+               .Add("iterations", (double) latency.Count())
+               .Add("failures", failures)
+               .Add("connections_per_second", latency.Count() / seconds)
+               .Add("p50_ms", latency.Percentile(0.5))
+               .Add("p99_ms", latency.Percentile(0.99)));
+
+    tunnel.Stop();
+}
+
+// Small pushes next to two bulk uploads under a global rate limit, once in
+// the same class as the bulk ones and once as interactive
+static void benchScheduler(Bench& bench)
+{
+    SshTransferScheduler& scheduler = SshTransferScheduler::Shared();
+    const uint64_t rate = 64ull << 20;
+    const uint64_t bulkSize = min<uint64_t>(bench.maxSize, 64ull << 20);
+    string bulkSource = bench.local + "/bulk";
+    string smallSource = bench.local + "/small";
+    unique_ptr<SshClient> client = bench.Client();
+
+    if (client == nullptr || makeFile(bulkSource, bulkSize, 1) != SSH_OK ||
+        makeFile(smallSource, 16 * 1024, 2) != SSH_OK)
+    {
+        return;
+    }
+
+    scheduler.SetGlobalRate(rate);
+
+    for (SshTransferPriority priority : {SshTransferPriority::Bulk,
+                                        SshTransferPriority::Interactive})
+    {
+        atomic<bool> stop{false};
+        vector<thread> bulk;
+        SshTransferOptions options;
+        Samples latency;
+
+        scheduler.ResetStats();
+        for (int i = 0; i < 2; i++)
+        {
+            bulk.emplace_back([&, i]()
+            {
+                unique_ptr<SshClient> uploader = bench.Client();
+                SshTransferOptions bulkOptions;
+                string remote = bench.remote + "/bulk" + to_string(i);
+
+                if (uploader == nullptr)
+                {
+                    return;
+                }
+                bulkOptions.priority = SshTransferPriority::Bulk;
+                uploader->SetTransferOptions(bulkOptions);
+                while (stop == false)
+                {
+                    uploader->Push(bulkSource, remote, SshTransferProtocol::Sftp);
+                }
+            });
+        }
+
+        // Lets the bulk uploads fill the limit first
+        this_thread::sleep_for(chrono::milliseconds(500));
+
+        options.priority = priority;
+        client->SetTransferOptions(options);
+        for (int i = 0; i < 20; i++)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+            if (client->Push(smallSource, bench.remote + "/small", SshTransferProtocol::Sftp) ==
+                SSH_OK)
+            {
+                latency.Add(secondsSince(start) * 1000);
+            }
+        }
+
+        stop = true;
+        for (thread& uploader : bulk)
+        {
+            uploader.join();
+        }
+
+        SshSchedulerStats stats = scheduler.GetStats();
+
+        bench.Emit(JsonLine("scheduler")
+                   .Add("small_priority", priority == SshTransferPriority::Bulk
+                                          ? "bulk" : "interactive")
+                   .Add("limit_bytes_per_second", (double) rate)
+                   .Add("pushes", (double) latency.Count())
+                   .Add("p50_ms", latency.Percentile(0.5))
+                   .Add("p99_ms", latency.Percentile(0.99))
+                   .Add("interactive_bytes_per_second",
+                        stats.classes[(size_t) SshTransferPriority::Interactive].BytesPerSecond())
+                   .Add("bulk_bytes_per_second",
+                        stats.classes[(size_t) SshTransferPriority::Bulk].BytesPerSecond()));
+    }
+
+    scheduler.SetGlobalRate(0);
+    client->SetTransferOptions(SshTransferOptions());
+
+    error_code ec;
+    fs::remove(bulkSource, ec);
+    fs::remove(smallSource, ec);
+    run(*client, "rm -f " + SshShellQuote(bench.remote) + "/bulk* " +
+                 SshShellQuote(bench.remote + "/small"));
+}
+
+// Heap allocations and buffer pool misses per operation once warmed up
+static void benchAllocations(Bench& bench)
+{
+    unique_ptr<SshClient> client = bench.Client();
+    string source = bench.local + "/allocations";
+    string pulled = bench.local + "/allocations-pulled";
+    string remote = bench.remote + "/allocations";
+    const int rounds = 20;
+
+    if (client == nullptr || makeFile(source, 4 << 20, 3) != SSH_OK)
+    {
+        if (bench.check)
+        {
+            bench.regressions++;
+        }
+        return;
+    }
+
+    struct Operation
+    {
+        const char *name;
+        // Most heap allocations one operation may take with --check. Far
+        // below one per chunk of the 4 MiB file, well above the handful of
+        // strings an operation needs.
+        double maxHeap;
+        function<int()> run;
+    };
+
+    const Operation operations[] =
+    {
+        {"execute", 128, [&]()
+        {
+            SshCaptureSink sink;
+            int exitStatus;
+
+            return client->Execute("true", sink, &exitStatus);
+        }},
+        {"push_scp", 256, [&]() { return client->Push(source, remote, SshTransferProtocol::Scp); }},
+        {"pull_scp", 256, [&]() { return client->Pull(remote, pulled, SshTransferProtocol::Scp); }},
+        {"push_sftp", 256, [&]() { return client->Push(source, remote, SshTransferProtocol::Sftp); }},
+        {"pull_sftp", 256, [&]() { return client->Pull(remote, pulled, SshTransferProtocol::Sftp); }},
+    };
+
+    for (const Operation& operation : operations)
+    {
+        int failures = 0;
+
+        for (int i = 0; i < 3; i++)
+        {
+            operation.run();
+        }
+
+        uint64_t allocations = allocationCount.load();
+        SshBufferPoolStats pool = SshBufferPool::Shared().GetStats();
+
+        for (int i = 0; i < rounds; i++)
+        {
+            if (operation.run() != SSH_OK)
+            {
+                failures++;
+            }
+        }
+
+        allocations = allocationCount.load() - allocations;
+        uint64_t misses = SshBufferPool::Shared().GetStats().allocations - pool.allocations;
+        double heap = (double) allocations / rounds;
+
+        bench.Emit(JsonLine("allocations")
+                   .Add("operation", operation.name)
+                   .Add("size", strncmp(operation.name, "execute", 7) ? 4 << 20 : 0)
+                   .Add("failures", failures)
+                   .Add("heap_per_operation", heap)
+                   .Add("pool_misses_per_operation", (double) misses / rounds));
+
+        // After the warm-up every buffer comes back from the pool
+        if (bench.check && (failures > 0 || heap > operation.maxHeap || misses > 0))
+        {
+            fprintf(stderr, "%s: %d failures, %.1f heap allocations (at most %.0f), "
+                    "%llu pool misses (none)\n", operation.name, failures, heap,
+                    operation.maxHeap, (unsigned long long) misses);
+            bench.regressions++;
+        }
+    }
+
+    error_code ec;
+    fs::remove(source, ec);
+    fs::remove(pulled, ec);
+    run(*client, "rm -f " + SshShellQuote(remote));
+}
+
+// File throughput with the local I/O inline and overlapped with the channel.
+// The source is evicted from the page cache before every push and pulled
+// data is flushed as it goes, so both sides wait for the disk.
+static void benchPipeline(Bench& bench)
+{
+    const uint64_t size = min<uint64_t>(bench.maxSize, 256ull << 20);
+    const size_t depths[] = {0, 1, 4, 8};
+    const pair<const char *, SshTransferProtocol> protocols[] =
+    {
+        {"scp", SshTransferProtocol::Scp},
+        {"sftp", SshTransferProtocol::Sftp}
+    };
+    unique_ptr<SshClient> client = bench.Client();
+    string source = bench.local + "/pipeline";
+    string pulled = bench.local + "/pipeline-pulled";
+    string remote = bench.remote + "/pipeline";
+
+    if (client == nullptr || enoughSpace(bench.local, 3 * size) == false ||
+        makeFile(source, size, 4) != SSH_OK)
+    {
+        return;
+    }
+
+    for (const pair<const char *, SshTransferProtocol>& protocol : protocols)
+    {
+        for (size_t depth : depths)
+        {
+            SshTransferOptions options;
+            Samples push, pull;
+
+            options.pipelineDepth = depth;
+            options.dropPageCache = true;
+            client->SetTransferOptions(options);
+
+            for (int i = 0; i < 3; i++)
+            {
+                int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd >= 0)
+                {
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                    close(fd);
+                }
+
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                if (client->Push(source, remote, protocol.second) == SSH_OK)
+                {
+                    push.Add(secondsSince(start));
+                }
+
+                error_code ec;
+                fs::remove(pulled, ec);
+                start = chrono::steady_clock::now();
+                if (client->Pull(remote, pulled, protocol.second) == SSH_OK)
+                {
+                    pull.Add(secondsSince(start));
+                }
+            }
+
+            for (pair<const char *, Samples*> direction :
+                 {make_pair("push", &push), make_pair("pull", &pull)})
+            {
+                double seconds = direction.second->Percentile(0.5);
+
+                bench.Emit(JsonLine("pipeline")
+                           .Add("protocol", protocol.first)
+                           .Add("direction", direction.first)
+                           .Add("depth", (double) depth)
+                           .Add("size", (double) size)
+                           .Add("seconds", seconds)
+                           .Add("bytes_per_second", seconds > 0 ? size / seconds : 0));
+            }
+        }
+    }
+
+    client->SetTransferOptions(SshTransferOptions());
+
+    error_code ec;
+    fs::remove(source, ec);
+    fs::remove(pulled, ec);
+    run(*client, "rm -f " + SshShellQuote(remote));
+}
+
+// Throughput of each CRC-32 kernel the CPU supports, then the cost of verify
+// mode on whole transfers, the remote hashing included
+static void benchVerify(Bench& bench)
+{
+    const SshCrc32Kernel kernels[] = {SshCrc32Kernel::Pclmul, SshCrc32Kernel::Arm,
+                                      SshCrc32Kernel::Table};
+    const size_t blockSizes[] = {4 * 1024, 256 * 1024, 16 * 1024 * 1024};
+    const pair<const char *, SshTransferProtocol> protocols[] =
+    {
+        {"scp", SshTransferProtocol::Scp},
+        {"sftp", SshTransferProtocol::Sftp}
+    };
+    SshPooledBuffer buffer = SshBufferPool::Shared().Acquire(16 * 1024 * 1024);
+
+    for (size_t i = 0; i < buffer.Size(); i++)
+    {
+        buffer.Data()[i] = (char) (i * 2654435761u >> 13);
+    }
+
+    for (SshCrc32Kernel kernel : kernels)
+    {
+        if (SshCrc32Supported(kernel) == false)
+        {
+            continue;
+        }
+
+        for (size_t blockSize : blockSizes)
+        {
+            // About 4 GiB per measurement
+            uint64_t rounds = max<uint64_t>((4ull << 30) / blockSize, 1);
+            uint32_t crc = 0;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+            for (uint64_t round = 0; round < rounds; round++)
+            {
+                crc = SshCrc32(kernel, buffer.Data(), blockSize, crc);
+            }
+
+            double seconds = secondsSince(start);
+
+            bench.Emit(JsonLine("crc32")
+                       .Add("kernel", SshCrc32KernelName(kernel))
+                       .Add("block_size", (double) blockSize)
+                       .Add("bytes_per_second", rounds * blockSize / seconds)
+                       .Add("crc", (double) crc));
+        }
+    }
+
+    const uint64_t size = min<uint64_t>(bench.maxSize, 256ull << 20);
+    unique_ptr<SshClient> client = bench.Client();
+    string source = bench.local + "/verify";
+    string pulled = bench.local + "/verify-pulled";
+    string remote = bench.remote + "/verify";
+
+    if (client == nullptr || enoughSpace(bench.local, 3 * size) == false ||
+        makeFile(source, size, 5) != SSH_OK)
+    {
+        return;
+    }
+
+    for (const pair<const char *, SshTransferProtocol>& protocol : protocols)
+    {
+        for (bool verify : {false, true})
+        {
+            SshTransferOptions options;
+            Samples push, pull;
+
+            options.verify = verify;
+            client->SetTransferOptions(options);
+
+            for (int i = 0; i < 3; i++)
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                if (client->Push(source, remote, protocol.second) == SSH_OK)
+                {
+                    push.Add(secondsSince(start));
+                }
+
+                error_code ec;
+                fs::remove(pulled, ec);
+                start = chrono::steady_clock::now();
+                if (client->Pull(remote, pulled, protocol.second) == SSH_OK)
+                {
+                    pull.Add(secondsSince(start));
+                }
+            }
+
+            for (pair<const char *, Samples*> direction :
+                 {make_pair("push", &push), make_pair("pull", &pull)})
+            {
+                double seconds = direction.second->Percentile(0.5);
+
+                bench.Emit(JsonLine("verify")
+                           .Add("protocol", protocol.first)
+                           .Add("direction", direction.first)
+                           .Add("verify", verify ? "on" : "off")
+                           .Add("size", (double) size)
+                           .Add("repeats", (double) direction.second->Count())
+                           .Add("seconds", seconds)
+                           .Add("bytes_per_second", seconds > 0 ? size / seconds : 0));
+            }
+        }
+    }
+
+    client->SetTransferOptions(SshTransferOptions());
+
+    error_code ec;
+    fs::remove(source, ec);
+    fs::remove(pulled, ec);
+    run(*client, "rm -f " + SshShellQuote(remote));
+}
+
+// Resident memory of the process in bytes
+// Large command output captured in a string, in a buffer that spills past
+// its memory limit, and in one that only keeps the tail. The resident growth
+// is taken with the result still held, before its view is read, as the
+// mapped file would count towards it afterwards.
+static void benchCapture(Bench& bench)
+{
+    const uint64_t size = min<uint64_t>(bench.maxSize, 1ull << 30);
+    const string command = "head -c " + to_string(size) + " /dev/zero";
+    unique_ptr<SshClient> client = bench.Client();
+    SshCaptureOptions limited;
+    SshCaptureOptions tail;
+
+    if (client == nullptr)
+    {
+        return;
+    }
+    tail.tail = 1 << 20;
+
+    const pair<const char *, const SshCaptureOptions*> modes[] =
+    {
+        {"string", nullptr},
+        {"spill", &limited},
+        {"tail", &tail},
+    };
+
+    for (const pair<const char *, const SshCaptureOptions*>& mode : modes)
+    {
+        uint64_t resident = residentBytes();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        unique_ptr<SshCaptureBuffer> buffer;
+        string received;
+        string_view view;
+        int res;
+
+        if (mode.second == nullptr)
+        {
+            res = client->Execute(command, &received);
+            view = received;
+        }
+        else
+        {
+            buffer = make_unique<SshCaptureBuffer>(*mode.second);
+            res = client->Execute(command, buffer.get());
+            view = buffer->View();
+        }
+
+        double seconds = secondsSince(start);
+        uint64_t grown = residentBytes();
+        uint64_t zeros = count(view.begin(), view.end(), '\0');
+
+        bench.Emit(JsonLine("capture")
+                   .Add("mode", mode.first)
+                   .Add("size", (double) size)
+                   .Add("failures", res == SSH_OK && zeros == view.size() ? 0 : 1)
+                   .Add("kept", (double) view.size())
+                   .Add("spilled", buffer && buffer->Spilled() ? 1 : 0)
+                   .Add("bytes_per_second", size / seconds)
+                   .Add("resident_growth", (double) (grown > resident ? grown - resident : 0)));
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Without --host a throwaway sshd is started on the loopback interface.\n"
+            "  --host HOST          benchmark an existing server instead\n"
+            "  --port PORT          port of --host (22)\n"
+            "  --user USER          user on --host (current user)\n"
+            "  --password PASSWORD  password on --host\n"
+            "  --identity FILE      private key for --host\n"
+            "  --sshd PATH          sshd binary for the local server (/usr/sbin/sshd)\n"
+            "  --only NAME          run the benchmarks whose name contains NAME\n"
+            "  --max-size BYTES     largest single file (4294967296)\n"
+            "  --tree-files COUNT   files in the small-files tree (50000)\n"
+            "  --iterations COUNT   Execute round trips (200)\n"
+            "  --output FILE        write the JSON lines there instead of stdout\n"
+            "  --check              exit with 1 when a result is out of its bounds\n",
+            program);
+}
+
+int main(int argc, char *argv[])
+{
+    Bench bench;
+    string sshdPath = "/usr/sbin/sshd";
+    string output;
+    bool loopback = true;
+    int res = 0;
+
+    const char *login = getenv("USER");
+    bench.user = login ? login : "";
+
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+
+        if (option == "--check")
+        {
+            bench.check = true;
+            continue;
+        }
+        if (option == "--help" || value.empty())
+        {
+            usage(argv[0]);
+            return option == "--help" ? 0 : 1;
+        }
+        i++;
+
+        if (option == "--host") { bench.host = value; loopback = false; }
+        else if (option == "--port") { bench.connect.port = stoi(value); }
+        else if (option == "--user") { bench.user = value; }
+        else if (option == "--password") { bench.password = value; }
+        else if (option == "--identity") { bench.connect.identityFile = value; }
+        else if (option == "--sshd") { sshdPath = value; }
+        else if (option == "--only") { bench.only = value; }
+        else if (option == "--max-size") { bench.maxSize = stoull(value); }
+        else if (option == "--tree-files") { bench.treeFiles = stoull(value); }
+        else if (option == "--iterations") { bench.iterations = stoi(value); }
+        else if (option == "--output") { output = value; }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // The library reports progress on stdout, the results keep it for
+    // themselves and everything else goes to stderr
+    bench.out = output.empty() ? fdopen(dup(STDOUT_FILENO), "w") : fopen(output.c_str(), "w");
+    if (bench.out == NULL)
+    {
+        fprintf(stderr, "Can't open the output: %s\n", strerror(errno));
+        return 1;
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    LocalSshd sshd(sshdPath);
+    char scratch[] = "/tmp/cppssh-bench-data-XXXXXX";
+
+    if (mkdtemp(scratch) == NULL)
+    {
+        fprintf(stderr, "Can't create a scratch directory: %s\n", strerror(errno));
+        return 1;
+    }
+    bench.local = string(scratch) + "/local";
+    fs::create_directories(bench.local);
+
+    if (loopback)
+    {
+        if (sshd.Start() != SSH_OK)
+        {
+            fs::remove_all(scratch);
+            return 1;
+        }
+        bench.connect.port = sshd.Port();
+        bench.connect.identityFile = sshd.IdentityFile();
+        bench.connect.knownHostsFile = sshd.KnownHostsFile();
+        // Same host, so the remote side gets its own part of the scratch area
+        bench.remote = string(scratch) + "/remote";
+        fs::create_directories(bench.remote);
+    }
+    else
+    {
+        unique_ptr<SshClient> client = bench.Client();
+        SshCaptureSink sink;
+        int exitStatus = -1;
+
+        if (client == nullptr ||
+            client->Execute("mktemp -d /tmp/cppssh-bench-XXXXXX", sink, &exitStatus) != SSH_OK ||
+            exitStatus != 0)
+        {
+            fprintf(stderr, "Can't prepare %s\n", bench.host.c_str());
+            fs::remove_all(scratch);
+            return 1;
+        }
+        bench.remote = sink.output.substr(0, sink.output.find('\n'));
+    }
+
+    bench.Emit(JsonLine("meta")
+               .Add("target", loopback ? "loopback" : bench.host)
+               .Add("libssh", ssh_version(0))
+               .Add("timestamp", (double) chrono::duration_cast<chrono::seconds>(
+                    chrono::system_clock::now().time_since_epoch()).count()));
+
+    const pair<const char *, void (*)(Bench&)> benchmarks[] =
+    {
+        {"connect", benchConnect},
+        {"connect_control", benchControlConnect},
+        {"execute", benchExecute},
+        {"execute_batch", benchExecuteBatch},
+        {"execute_concurrent", benchConcurrentExecute},
+        {"session_scale", benchSessionScale},
+        {"file", benchFiles},
+        {"file_latency", benchLatencyFiles},
+        {"tree", benchTrees},
+        {"sync", benchSync},
+        {"cipher", benchCiphers},
+        {"tunnel", benchTunnel},
+        {"scheduler", benchScheduler},
+        {"allocations", benchAllocations},
+        {"pipeline", benchPipeline},
+        {"verify", benchVerify},
+        {"capture", benchCapture},
+    };
+
+    for (const pair<const char *, void (*)(Bench&)>& benchmark : benchmarks)
+    {
+        if (bench.Enabled(benchmark.first))
+        {
+            benchmark.second(bench);
+        }
+    }
+
+    if (loopback == false)
+    {
+        unique_ptr<SshClient> client = bench.Client();
+        if (client == nullptr || run(*client, "rm -rf " + SshShellQuote(bench.remote)) != SSH_OK)
+        {
+            res = 1;
+        }
+    }
+
+    fs::remove_all(scratch);
+    fclose(bench.out);
+
+    if (bench.regressions > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", bench.regressions);
+        res = 1;
+    }
+
+    return res;
+}
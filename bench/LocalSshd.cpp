@@ -0,0 +1,188 @@
+#include "LocalSshd.h"
+#include "SshClient.h"
+
+#include <filesystem>
+#include <fstream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace fs = std::filesystem;
+
+// How long the server gets to start accepting connections
+static constexpr int startTimeoutMs = 10000;
+
+static int freePort()
+{
+    struct sockaddr_in address = {};
+    socklen_t length = sizeof(address);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int port = -1;
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // The kernel picks an unused port, released again for sshd to bind
+    if (fd >= 0 && bind(fd, (struct sockaddr *) &address, sizeof(address)) == 0 &&
+        getsockname(fd, (struct sockaddr *) &address, &length) == 0)
+    {
+        port = ntohs(address.sin_port);
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return port;
+}
+
+LocalSshd::~LocalSshd()
+{
+    Stop();
+}
+
+int LocalSshd::Start()
+{
+    char directory[] = "/tmp/cppssh-bench-XXXXXX";
+
+    if (_sshdPath.empty() || _sshdPath[0] != '/' || access(_sshdPath.c_str(), X_OK) != 0)
+    {
+        fprintf(stderr, "sshd must be given by absolute path, %s isn't usable\n",
+                _sshdPath.c_str());
+        return SSH_ERROR;
+    }
+
+    if (mkdtemp(directory) == NULL)
+    {
+        fprintf(stderr, "Can't create a temporary directory: %s\n", strerror(errno));
+        return SSH_ERROR;
+    }
+    _directory = directory;
+
+    string keygen = "ssh-keygen -q -t ed25519 -N '' -f ";
+    if (system((keygen + SshShellQuote(_directory + "/host_key")).c_str()) != 0 ||
+        system((keygen + SshShellQuote(IdentityFile())).c_str()) != 0)
+    {
+        fprintf(stderr, "ssh-keygen failed\n");
+        return SSH_ERROR;
+    }
+
+    error_code ec;
+    fs::copy_file(IdentityFile() + ".pub", _directory + "/authorized_keys", ec);
+    if (ec)
+    {
+        fprintf(stderr, "Can't install the client key: %s\n", ec.message().c_str());
+        return SSH_ERROR;
+    }
+
+    _port = freePort();
+    if (_port < 0 || _WriteConfig() != SSH_OK)
+    {
+        return SSH_ERROR;
+    }
+
+    _pid = fork();
+    if (_pid < 0)
+    {
+        fprintf(stderr, "Can't start sshd: %s\n", strerror(errno));
+        return SSH_ERROR;
+    }
+    if (_pid == 0)
+    {
+        string config = _directory + "/sshd_config";
+
+        execl(_sshdPath.c_str(), _sshdPath.c_str(), "-D", "-e", "-f", config.c_str(),
+              (char *) NULL);
+        _exit(127);
+    }
+
+    return _WaitReady();
+}
+
+void LocalSshd::Stop()
+{
+    if (_pid > 0)
+    {
+        kill(_pid, SIGTERM);
+        waitpid(_pid, NULL, 0);
+        _pid = -1;
+    }
+
+    if (_directory.empty() == false)
+    {
+        error_code ec;
+
+        fs::remove_all(_directory, ec);
+        _directory.clear();
+    }
+}
+
+int LocalSshd::_WriteConfig()
+{
+    ofstream config(_directory + "/sshd_config");
+
+    config << "ListenAddress 127.0.0.1\n"
+           << "Port " << _port << "\n"
+           << "HostKey " << _directory << "/host_key\n"
+           << "PidFile " << _directory << "/sshd.pid\n"
+           << "AuthorizedKeysFile " << _directory << "/authorized_keys\n"
+           << "PubkeyAuthentication yes\n"
+           << "PasswordAuthentication no\n"
+           << "KbdInteractiveAuthentication no\n"
+           << "StrictModes no\n"
+           << "UsePAM no\n"
+           << "MaxSessions 128\n"
+           << "MaxStartups 128\n"
+           << "LogLevel ERROR\n"
+           << "Subsystem sftp internal-sftp\n";
+
+    if (!config)
+    {
+        fprintf(stderr, "Can't write the sshd configuration\n");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int LocalSshd::_WaitReady()
+{
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now() + chrono::milliseconds(startTimeoutMs);
+
+    while (chrono::steady_clock::now() < deadline)
+    {
+        struct sockaddr_in address = {};
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int res;
+
+        address.sin_family = AF_INET;
+        address.sin_port = htons(_port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        res = fd < 0 ? -1 : connect(fd, (struct sockaddr *) &address, sizeof(address));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (res == 0)
+        {
+            return SSH_OK;
+        }
+
+        if (waitpid(_pid, NULL, WNOHANG) == _pid)
+        {
+            fprintf(stderr, "sshd exited during startup\n");
+            _pid = -1;
+            return SSH_ERROR;
+        }
+
+        usleep(20 * 1000);
+    }
+
+    fprintf(stderr, "sshd didn't start listening on port %d\n", _port);
+
+    return SSH_ERROR;
+}
@@ -0,0 +1,38 @@
+#ifndef __LOCAL_SSHD_H__
+#define __LOCAL_SSHD_H__
+
+#include <string>
+#include <sys/types.h>
+
+using namespace std;
+
+// Throwaway OpenSSH server on the loopback interface, running as the current
+// user with fresh host and client keys in a temporary directory. Everything
+// is removed when the object is destroyed.
+class LocalSshd
+{
+public:
+    LocalSshd(const string& sshdPath): _sshdPath(sshdPath){};
+    ~LocalSshd();
+    LocalSshd(const LocalSshd&) = delete;
+    LocalSshd& operator=(const LocalSshd&) = delete;
+
+    int Start();
+    void Stop();
+    int Port() const { return _port; };
+    string Directory() const { return _directory; };
+    string IdentityFile() const { return _directory + "/id_ed25519"; };
+    string KnownHostsFile() const { return _directory + "/known_hosts"; };
+
+private:
+    int _WriteConfig();
+    int _WaitReady();
+
+private:
+    string _sshdPath;
+    string _directory;
+    int _port{0};
+    pid_t _pid{-1};
+};
+
+#endif // __LOCAL_SSHD_H__
@@ -0,0 +1,70 @@
+#include "SshControlMaster.h"
+
+#include <signal.h>
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Keeps SSH sessions open for SshClient instances of other processes.\n"
+            "  --socket PATH        control socket (%s)\n"
+            "  --idle SECONDS       close sessions unused for this long (600)\n"
+            "  --verbose            log every transferred file\n",
+            program, SshDefaultControlPath().c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    string path = SshDefaultControlPath();
+    chrono::seconds idle(600);
+    sigset_t signals;
+    int signal;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+
+        if (option == "--verbose")
+        {
+            SshSetLogLevel(SshLogLevel::Debug);
+            continue;
+        }
+
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (option == "--help" || value.empty())
+        {
+            usage(argv[0]);
+            return option == "--help" ? 0 : 1;
+        }
+        i++;
+
+        if (option == "--socket") { path = value; }
+        else if (option == "--idle") { idle = chrono::seconds(stoll(value)); }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Blocked before any thread starts, so only sigwait sees them
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    ::signal(SIGPIPE, SIG_IGN);
+
+    SshControlMaster master(path, idle);
+    if (master.Start() != SSH_OK)
+    {
+        return 1;
+    }
+    SSH_LOG(Info, "Control master listening on %s", path.c_str());
+
+    sigwait(&signals, &signal);
+    SSH_LOG(Info, "Stopping on signal %d", signal);
+    master.Stop();
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include "SshFanOut.h"
+
+#include <fstream>
+#include <pwd.h>
+#include <signal.h>
+#include <unistd.h>
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options] --hosts FILE COMMAND\n"
+            "       %s [options] --hosts FILE --push SOURCE DESTINATION\n"
+            "       %s [options] --hosts FILE --pull SOURCE DIRECTORY\n"
+            "Runs a command or a transfer on many hosts at once.\n"
+            "  --hosts FILE         one [user@]host[:port] per line, - for stdin\n"
+            "  --user NAME          user of the hosts that don't name one ($USER)\n"
+            "  --password TEXT      password, $CPPSSH_PASSWORD by default\n"
+            "  --identity FILE      private key tried before the password\n"
+            "  --parallel COUNT     hosts worked on at once (32)\n"
+            "  --timeout SECONDS    limit for each host, 0 for none (0)\n"
+            "  --slowest COUNT      slowest hosts listed at the end (5)\n"
+            "  --quiet              don't print the output of the commands\n"
+            "  --verbose            log what the sessions do\n",
+            program, program, program);
+}
+
+// [user@]host[:port], with IPv6 addresses in brackets when a port follows
+static bool parseHost(string line, const string& user, SshFanOutHost& host)
+{
+    size_t at = line.find('@');
+
+    host.user = user;
+    if (at != string::npos)
+    {
+        host.user = line.substr(0, at);
+        line.erase(0, at + 1);
+    }
+
+    size_t colon = line.rfind(':');
+    if (line[0] == '[')
+    {
+        size_t close = line.find(']');
+        if (close == string::npos)
+        {
+            return false;
+        }
+        if (close + 1 < line.size() && line[close + 1] == ':')
+        {
+            host.port = atoi(line.c_str() + close + 2);
+        }
+        line = line.substr(1, close - 1);
+    }
+    else if (colon != string::npos && line.find(':') == colon)
+    {
+        host.port = atoi(line.c_str() + colon + 1);
+        line.erase(colon);
+    }
+    host.ip = line;
+
+    return host.ip.empty() == false && host.user.empty() == false;
+}
+
+static int readHosts(const string& path, const string& user, const string& password,
+                     vector<SshFanOutHost>& hosts)
+{
+    ifstream file;
+    istream *input = &cin;
+    string line;
+
+    if (path != "-")
+    {
+        file.open(path);
+        if (file.is_open() == false)
+        {
+            SSH_LOG(Error, "Can't read %s", path.c_str());
+            return SSH_ERROR;
+        }
+        input = &file;
+    }
+
+    while (getline(*input, line))
+    {
+        size_t start = line.find_first_not_of(" \t");
+        SshFanOutHost host;
+
+        if (start == string::npos || line[start] == '#')
+        {
+            continue;
+        }
+        line = line.substr(start, line.find_last_not_of(" \t\r") + 1 - start);
+
+        host.password = password;
+        if (parseHost(line, user, host) == false)
+        {
+            SSH_LOG(Error, "Can't parse host %s", line.c_str());
+            return SSH_ERROR;
+        }
+        hosts.push_back(host);
+    }
+
+    return SSH_OK;
+}
+
+// Prints every line of text prefixed with the host
+static void printLines(FILE *out, const string& ip, const char *separator, const string& text)
+{
+    size_t start = 0;
+
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+        fprintf(out, "%s%s %.*s\n", ip.c_str(), separator, (int) (end - start),
+                text.c_str() + start);
+        start = end + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *environment;
+    string hostsPath, user, password;
+    string command, source, destination;
+    bool push = false, pull = false, quiet = false;
+    size_t slowest = 5;
+    SshFanOutOptions options;
+    vector<SshFanOutHost> hosts;
+
+    environment = getenv("USER");
+    if (environment == NULL)
+    {
+        struct passwd *entry = getpwuid(getuid());
+
+        environment = entry ? entry->pw_name : NULL;
+    }
+    user = environment ? environment : "";
+    environment = getenv("CPPSSH_PASSWORD");
+    password = environment ? environment : "";
+
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+
+        if (option == "--quiet")
+        {
+            quiet = true;
+            continue;
+        }
+        if (option == "--verbose")
+        {
+            SshSetLogLevel(SshLogLevel::Debug);
+            continue;
+        }
+        if (option.compare(0, 2, "--") != 0)
+        {
+            // The rest is the command, as ssh takes it
+            for (; i < argc; i++)
+            {
+                command += (command.empty() ? "" : " ") + string(argv[i]);
+            }
+            break;
+        }
+
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (option == "--help" || value.empty())
+        {
+            usage(argv[0]);
+            return option == "--help" ? 0 : 1;
+        }
+        i++;
+
+        if (option == "--hosts") { hostsPath = value; }
+        else if (option == "--user") { user = value; }
+        else if (option == "--password") { password = value; }
+        else if (option == "--identity") { options.connect.identityFile = value; }
+        else if (option == "--parallel") { options.concurrency = stoul(value); }
+        else if (option == "--timeout")
+        {
+            options.timeout = chrono::milliseconds((long long) (stod(value) * 1000));
+        }
+        else if (option == "--slowest") { slowest = stoul(value); }
+        else if ((option == "--push" || option == "--pull") && i + 1 < argc)
+        {
+            push = option == "--push";
+            pull = option == "--pull";
+            source = value;
+            destination = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (hostsPath.empty() || (command.empty() == (push == false && pull == false)))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (readHosts(hostsPath, user, password, hosts) != SSH_OK)
+    {
+        return 1;
+    }
+
+    ::signal(SIGPIPE, SIG_IGN);
+
+    SshFanOut fanOut(hosts);
+    size_t finished = 0;
+    int res;
+
+    fanOut.SetOptions(options);
+    fanOut.SetResultCallback([&](const SshFanOutHost& host, const SshFanOutResult& result)
+    {
+        finished++;
+        printf("[%zu/%zu] %s %s %.2fs", finished, hosts.size(),
+               result.Succeeded() ? "OK" : "FAILED", host.ip.c_str(),
+               result.elapsed.count());
+        if (result.status == SSH_OK && result.exitStatus != 0)
+        {
+            printf(" exit %d", result.exitStatus);
+        }
+        if (result.timedOut)
+        {
+            printf(" (timed out)");
+        }
+        printf("\n");
+        if (quiet == false)
+        {
+            printLines(stdout, host.ip, ":", result.output);
+            printLines(stdout, host.ip, "!", result.errors);
+        }
+        fflush(stdout);
+    });
+
+    if (push)
+    {
+        res = fanOut.Push(source, destination);
+    }
+    else if (pull)
+    {
+        res = fanOut.Pull(source, destination);
+    }
+    else
+    {
+        res = fanOut.Execute(command);
+    }
+
+    SshFanOutSummary summary = fanOut.GetSummary(slowest);
+
+    printf("%zu hosts in %.2fs: %zu succeeded, %zu failed", summary.hosts,
+           summary.elapsed.count(), summary.succeeded, summary.failed);
+    if (summary.timedOut > 0)
+    {
+        printf(" (%zu timed out)", summary.timedOut);
+    }
+    printf("\nlatency p50 %.2fs p90 %.2fs p99 %.2fs max %.2fs\n", summary.p50.count(),
+           summary.p90.count(), summary.p99.count(), summary.max.count());
+    if (summary.slowest.empty() == false)
+    {
+        printf("slowest:");
+        for (size_t i = 0; i < summary.slowest.size(); i++)
+        {
+            const SshFanOutResult& result = fanOut.GetResults()[summary.slowest[i]];
+
+            printf("%s %s %.2fs", i == 0 ? "" : ",", hosts[result.host].ip.c_str(),
+                   result.elapsed.count());
+        }
+        printf("\n");
+    }
+
+    return res == SSH_OK ? 0 : 1;
+}